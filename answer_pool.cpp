@@ -0,0 +1,227 @@
+#include "answer_pool.h"
+
+#include <algorithm>
+#include <exception>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// From <numaif.h>; spelled out so that we do not need libnuma to build.
+static const int MPOL_BIND_MODE = 2;
+static const unsigned MPOL_MF_MOVE_FLAG = 1 << 1;
+static const int MAX_NUMA_NODES = 1024;
+
+// Parses a sysfs CPU list such as "0-15,32-47".
+static std::vector<int> ParseCpuList(const std::string& s) {
+    std::vector<int> out;
+    std::stringstream ss(s);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (item.empty()) {
+            continue;
+        }
+        size_t dash = item.find('-');
+        int lo = std::stoi(item.substr(0, dash));
+        int hi = (dash == std::string::npos) ? lo : std::stoi(item.substr(dash + 1));
+        for (int c = lo; c <= hi; c++) {
+            out.push_back(c);
+        }
+    }
+    return out;
+}
+
+// Groups CPUs by NUMA node so that consecutive workers (and hence
+// consecutive DB rows) share a node. Falls back to a single node when
+// sysfs has no NUMA information.
+void DiscoverTopology(std::vector<int>& cpus, std::vector<int>& nodes) {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    bool have_mask = (sched_getaffinity(0, sizeof(allowed), &allowed) == 0);
+
+    std::vector<int> node_ids;
+    if (DIR* dir = opendir("/sys/devices/system/node")) {
+        while (struct dirent* ent = readdir(dir)) {
+            std::string name = ent->d_name;
+            if (name.size() > 4 && name.compare(0, 4, "node") == 0 &&
+                std::all_of(name.begin() + 4, name.end(), ::isdigit)) {
+                node_ids.push_back(std::stoi(name.substr(4)));
+            }
+        }
+        closedir(dir);
+    }
+    std::sort(node_ids.begin(), node_ids.end());
+
+    for (int node : node_ids) {
+        std::ifstream f("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        std::string line;
+        if (!f || !std::getline(f, line)) {
+            continue;
+        }
+        for (int cpu : ParseCpuList(line)) {
+            if (!have_mask || CPU_ISSET(cpu, &allowed)) {
+                cpus.push_back(cpu);
+                nodes.push_back(node);
+            }
+        }
+    }
+
+    if (cpus.empty()) {
+        unsigned n = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned cpu = 0; cpu < n; cpu++) {
+            if (!have_mask || CPU_ISSET(cpu, &allowed)) {
+                cpus.push_back(cpu);
+                nodes.push_back(0);
+            }
+        }
+    }
+}
+
+// Best effort: moves the whole pages in [addr, addr + len) to node.
+static void MigrateToNode(void* addr, size_t len, int node) {
+    if (node < 0 || node >= MAX_NUMA_NODES) {
+        return;
+    }
+    uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+    uintptr_t lo = (reinterpret_cast<uintptr_t>(addr) + page - 1) & ~(page - 1);
+    uintptr_t hi = (reinterpret_cast<uintptr_t>(addr) + len) & ~(page - 1);
+    if (hi <= lo) {
+        return;
+    }
+    unsigned long mask[MAX_NUMA_NODES / (8 * sizeof(unsigned long))] = {0};
+    mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+    syscall(SYS_mbind, lo, hi - lo, MPOL_BIND_MODE, mask, MAX_NUMA_NODES + 1, MPOL_MF_MOVE_FLAG);
+}
+
+AnswerPool::AnswerPool(uint64_t num_workers)
+    : bound_data(nullptr), bound_rows(0), job(nullptr), generation(0), pending(0), stopping(false) {
+    DiscoverTopology(cpus, nodes);
+    if (num_workers == 0) {
+        num_workers = cpus.size();
+    }
+    uint64_t online = cpus.size();
+    for (uint64_t w = online; w < num_workers; w++) {
+        cpus.push_back(cpus[w % online]);
+        nodes.push_back(nodes[w % online]);
+    }
+    cpus.resize(num_workers);
+    nodes.resize(num_workers);
+    ranges.assign(num_workers, RowRange{0, 0});
+
+    for (uint64_t w = 0; w < num_workers; w++) {
+        workers.emplace_back(&AnswerPool::Loop, this, w);
+    }
+}
+
+AnswerPool::~AnswerPool() {
+    {
+        std::lock_guard<std::mutex> lock(mu);
+        stopping = true;
+    }
+    start.notify_all();
+    for (auto& t : workers) {
+        t.join();
+    }
+}
+
+uint64_t AnswerPool::NumWorkers() const {
+    return workers.size();
+}
+
+void AnswerPool::Bind(const MatrixView& db) {
+    uint64_t n = workers.size();
+    bool numa = std::any_of(nodes.begin(), nodes.end(), [&](int node) { return node != nodes[0]; });
+
+    // Migration only moves pages, so it runs unlocked: answers that are
+    // reading db (or another matrix) meanwhile stay correct.
+    std::vector<RowRange> split(n);
+    for (uint64_t w = 0; w < n; w++) {
+        split[w] = Rows(w, db.Rows);
+        if (numa && split[w].End > split[w].Start) {
+            MigrateToNode(db.Row(split[w].Start),
+                          (split[w].End - split[w].Start) * db.Stride * sizeof(db.Data[0]), nodes[w]);
+        }
+    }
+    std::lock_guard<std::mutex> lock(bind_mu);
+    ranges = split;
+    bound_data = db.Data;
+    bound_rows = db.Rows;
+}
+
+bool AnswerPool::IsBound(const MatrixView& db) const {
+    std::lock_guard<std::mutex> lock(bind_mu);
+    return bound_data == db.Data && bound_rows == db.Rows;
+}
+
+RowRange AnswerPool::Rows(uint64_t w) const {
+    std::lock_guard<std::mutex> lock(bind_mu);
+    return ranges[w];
+}
+
+RowRange AnswerPool::Rows(uint64_t w, uint64_t rows) const {
+    uint64_t n = workers.size();
+    uint64_t rows_per = (rows + n - 1) / n;
+    uint64_t s = std::min(w * rows_per, rows);
+    return RowRange{s, std::min(s + rows_per, rows)};
+}
+
+void AnswerPool::Run(const std::function<void(uint64_t)>& fn) {
+    std::lock_guard<std::mutex> serial(run_mu);
+    std::unique_lock<std::mutex> lock(mu);
+    job = &fn;
+    pending = workers.size();
+    error = nullptr;
+    generation++;
+    start.notify_all();
+    done.wait(lock, [&] { return pending == 0; });
+    job = nullptr;
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void AnswerPool::Loop(uint64_t w) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpus[w], &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+    uint64_t seen = 0;
+    for (;;) {
+        const std::function<void(uint64_t)>* fn;
+        {
+            std::unique_lock<std::mutex> lock(mu);
+            start.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping) {
+                return;
+            }
+            seen = generation;
+            fn = job;
+        }
+
+        std::exception_ptr err;
+        try {
+            (*fn)(w);
+        } catch (...) {
+            err = std::current_exception();
+        }
+
+        std::lock_guard<std::mutex> lock(mu);
+        if (err && !error) {
+            error = err;
+        }
+        if (--pending == 0) {
+            done.notify_one();
+        }
+    }
+}
+
+AnswerPool& DefaultAnswerPool() {
+    static AnswerPool pool;
+    return pool;
+}
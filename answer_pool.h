@@ -0,0 +1,88 @@
+#ifndef ANSWER_POOL_H
+#define ANSWER_POOL_H
+
+#include <cstdint>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+
+#include "matrix.h"
+
+struct RowRange {
+    uint64_t Start;
+    uint64_t End;
+};
+
+// Persistent pool of worker threads for the online phase. Each worker is
+// pinned to one CPU, and workers are ordered by NUMA node, so that after
+// Bind() every worker owns a contiguous range of DB rows whose pages live
+// on its own node. Answer passes then read the DB only from local memory,
+// and each worker writes a disjoint slice of the answer.
+class AnswerPool {
+public:
+    // num_workers == 0 starts one worker per online CPU. Past that many,
+    // workers share the CPUs round-robin.
+    explicit AnswerPool(uint64_t num_workers = 0);
+    ~AnswerPool();
+
+    AnswerPool(const AnswerPool&) = delete;
+    AnswerPool& operator=(const AnswerPool&) = delete;
+
+    uint64_t NumWorkers() const;
+
+    // Splits db's rows into one contiguous range per worker and, on NUMA
+    // machines, migrates the pages of each range to its worker's node.
+    // Should be called again whenever db is reallocated (e.g. after
+    // Squish); until then answers stay correct but read remote memory.
+    // Safe to call while Run is answering from another matrix.
+    void Bind(const MatrixView& db);
+
+    // Whether db is the matrix the current row ranges were computed for.
+    bool IsBound(const MatrixView& db) const;
+
+    // Rows of the bound matrix owned by worker w.
+    RowRange Rows(uint64_t w) const;
+
+    // Rows owned by worker w in any matrix with the given height; equals
+    // Rows(w) for the bound matrix. Answers use this so they do not
+    // depend on which matrix is bound.
+    RowRange Rows(uint64_t w, uint64_t rows) const;
+
+    // Runs fn(w) on every worker w and waits until all of them return.
+    // Concurrent calls are serialized. If any fn throws, the first
+    // exception is rethrown here once every worker has finished.
+    void Run(const std::function<void(uint64_t)>& fn);
+
+private:
+    void Loop(uint64_t w);
+
+    std::vector<std::thread> workers;
+    std::vector<int> cpus;
+    std::vector<int> nodes;
+    std::vector<RowRange> ranges;
+    const uint32_t* bound_data;
+    uint64_t bound_rows;
+
+    mutable std::mutex bind_mu;
+    std::mutex run_mu;
+    std::mutex mu;
+    std::condition_variable start;
+    std::condition_variable done;
+    const std::function<void(uint64_t)>* job;
+    std::exception_ptr error;
+    uint64_t generation;
+    uint64_t pending;
+    bool stopping;
+};
+
+// Lists the CPUs this process may run on and the NUMA node of each, in
+// the order AnswerPool assigns them to workers.
+void DiscoverTopology(std::vector<int>& cpus, std::vector<int>& nodes);
+
+// Process-wide pool used by SimplePIR::Answer.
+AnswerPool& DefaultAnswerPool();
+
+#endif // ANSWER_POOL_H
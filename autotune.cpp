@@ -0,0 +1,289 @@
+#include "autotune.h"
+#include "pir.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char* TUNE_FILE_MAGIC = "SPIRTUNE";
+static const int TUNE_FILE_VERSION = 1;
+
+// The shape every measurement runs on; the hard-coded one, which the
+// widest DBs use.
+static const size_t TUNE_BASIS = 10;
+static const size_t TUNE_COMPRESSION = 3;
+
+// Size of the squished matrices the variant and aspect timings scan:
+// larger than the caches of most hosts, so they measure streaming.
+static const uint64_t TUNE_SCAN_WORDS = uint64_t(1) << 22;
+
+// Each candidate is run until it has taken this long, at least
+// TUNE_MIN_REPS times, and its fastest run counts.
+static const double TUNE_MIN_SECONDS = 0.1;
+static const int TUNE_MIN_REPS = 3;
+
+static const int TUNE_ASPECTS_LOG2[] = {-8, -6, -4, -2, 0, 2, 4, 6, 8};
+static const int TUNE_TRANSPOSED_RATIOS_LOG2[] = {-4, -2, 0, 2, 4};
+
+static std::mutex applied_mu;
+static bool applied = false;
+static TuneResult current;
+
+double TuneResult::BestAspect() const {
+    if (AspectCost.empty()) {
+        return 1.0;
+    }
+    size_t best = std::min_element(AspectCost.begin(), AspectCost.end()) - AspectCost.begin();
+    return std::exp2(AspectLog2[best]);
+}
+
+std::string CpuModel() {
+    std::ifstream in("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.compare(0, 10, "model name") == 0) {
+            size_t colon = line.find(':');
+            if (colon != std::string::npos) {
+                size_t start = line.find_first_not_of(" \t", colon + 1);
+                return (start == std::string::npos) ? "unknown" : line.substr(start);
+            }
+        }
+    }
+    return "unknown";
+}
+
+// Fastest of repeated runs of fn, in seconds.
+static double TimeBest(const std::function<void()>& fn) {
+    double best = INFINITY;
+    double total = 0;
+    for (int rep = 0; rep < TUNE_MIN_REPS || total < TUNE_MIN_SECONDS; rep++) {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        best = std::min(best, t);
+        total += t;
+    }
+    return best;
+}
+
+// Seconds per word for one matMulVecPacked pass over a rows-by-cols
+// squished matrix.
+static double TimeScan(uint64_t rows, uint64_t cols) {
+    const PackedKernels* k = packedKernels(TUNE_BASIS, TUNE_COMPRESSION);
+    std::vector<Elem> a(rows * cols);
+    for (uint64_t i = 0; i < a.size(); i++) {
+        a[i] = static_cast<Elem>(i * 2654435761u);
+    }
+    std::vector<Elem> b(cols * TUNE_COMPRESSION, 1);
+    std::vector<Elem> out(rows);
+    double t = TimeBest([&] { k->matMulVecPacked(out.data(), a.data(), b.data(), rows, cols, cols); });
+    return t / static_cast<double>(rows * cols);
+}
+
+// Seconds for one matMulTransposedPacked under the current crossover.
+static double TimeTransposed(uint64_t aRows, uint64_t aCols, uint64_t bRows) {
+    const PackedKernels* k = packedKernels(TUNE_BASIS, TUNE_COMPRESSION);
+    std::vector<Elem> a(aRows * aCols, 0x12345678u);
+    std::vector<Elem> b(bRows * aCols * TUNE_COMPRESSION, 3);
+    std::vector<Elem> out(aRows * bRows);
+    return TimeBest([&] {
+        k->matMulTransposedPacked(out.data(), a.data(), b.data(), aRows, aCols, bRows, aCols * TUNE_COMPRESSION);
+    });
+}
+
+TuneResult Autotune() {
+    TuneResult r;
+    r.Cpu = CpuModel();
+    std::string old_variant = matMulVecPackedVariant();
+    size_t old_crossover = matMulTransposedPackedCrossover();
+
+    // A square-ish scan picks the variant; the aspects are then timed
+    // with the winner, since that is what Answer will run.
+    uint64_t side = static_cast<uint64_t>(std::sqrt(static_cast<double>(TUNE_SCAN_WORDS)));
+    const char* names[8];
+    size_t num_variants = std::min<size_t>(packedKernelVariants(names, 8), 8);
+    double best_time = INFINITY;
+    for (size_t v = 0; v < num_variants; v++) {
+        selectPackedKernelVariant(names[v]);
+        double t = TimeScan(side, side);
+        if (t < best_time) {
+            best_time = t;
+            r.Variant = names[v];
+        }
+    }
+    selectPackedKernelVariant(r.Variant.c_str());
+
+    // Aspect m / l of the DB in Z_p elements; each squished word holds
+    // TUNE_COMPRESSION of them.
+    for (int a : TUNE_ASPECTS_LOG2) {
+        double elems = static_cast<double>(TUNE_SCAN_WORDS * TUNE_COMPRESSION);
+        uint64_t rows = static_cast<uint64_t>(std::sqrt(elems / std::exp2(a))) / 8 * 8;
+        rows = std::max<uint64_t>(rows, 8);
+        uint64_t cols = std::max<uint64_t>(TUNE_SCAN_WORDS / rows, 1);
+        r.AspectLog2.push_back(a);
+        r.AspectCost.push_back(TimeScan(rows, cols));
+    }
+    double fastest = *std::min_element(r.AspectCost.begin(), r.AspectCost.end());
+    for (double& c : r.AspectCost) {
+        c /= fastest;
+    }
+
+    // Crossover: halfway (in log scale) between the smallest aRows / aCols
+    // at which the long-row loop wins and the ratio tried before it.
+    const uint64_t transposed_words = uint64_t(1) << 16;
+    const uint64_t b_rows = 64;
+    const size_t num_ratios = sizeof(TUNE_TRANSPOSED_RATIOS_LOG2) / sizeof(TUNE_TRANSPOSED_RATIOS_LOG2[0]);
+    double crossover_log2 = TUNE_TRANSPOSED_RATIOS_LOG2[num_ratios - 1] + 1;
+    for (size_t i = 0; i < num_ratios; i++) {
+        int ratio = TUNE_TRANSPOSED_RATIOS_LOG2[i];
+        uint64_t a_rows = static_cast<uint64_t>(std::sqrt(transposed_words * std::exp2(ratio)));
+        uint64_t a_cols = transposed_words / a_rows;
+        setMatMulTransposedPackedCrossover(0);
+        double long_rows = TimeTransposed(a_rows, a_cols, b_rows);
+        setMatMulTransposedPackedCrossover(size_t(1) << 30);
+        double short_rows = TimeTransposed(a_rows, a_cols, b_rows);
+        if (long_rows < short_rows) {
+            crossover_log2 = ratio - 1;
+            break;
+        }
+    }
+    r.TransposedCrossover = static_cast<uint64_t>(std::llround(100 * std::exp2(crossover_log2)));
+
+    selectPackedKernelVariant(old_variant.c_str());
+    setMatMulTransposedPackedCrossover(old_crossover);
+    return r;
+}
+
+void ApplyTuning(const TuneResult& r) {
+    if (selectPackedKernelVariant(r.Variant.c_str()) != 0) {
+        throw std::runtime_error("Tuned kernel variant not supported here: " + r.Variant);
+    }
+    setMatMulTransposedPackedCrossover(r.TransposedCrossover);
+    std::lock_guard<std::mutex> lock(applied_mu);
+    current = r;
+    applied = true;
+}
+
+// 64-bit FNV-1a, to turn a CPU model into a file name.
+static uint64_t Fnv1a(const std::string& s) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (unsigned char c : s) {
+        h = (h ^ c) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static bool LoadTuning(const std::string& file, const std::string& cpu, TuneResult& r) {
+    std::ifstream in(file);
+    std::string magic;
+    int version = 0;
+    if (!(in >> magic >> version) || magic != TUNE_FILE_MAGIC || version != TUNE_FILE_VERSION) {
+        return false;
+    }
+    in >> std::ws;
+    std::string line;
+    r = TuneResult();
+    r.TransposedCrossover = 0;
+    while (std::getline(in, line)) {
+        std::istringstream ls(line);
+        std::string key;
+        ls >> key;
+        if (key == "cpu") {
+            std::getline(ls >> std::ws, r.Cpu);
+        } else if (key == "variant") {
+            ls >> r.Variant;
+        } else if (key == "crossover") {
+            ls >> r.TransposedCrossover;
+        } else if (key == "aspect") {
+            double a, c;
+            if (ls >> a >> c) {
+                r.AspectLog2.push_back(a);
+                r.AspectCost.push_back(c);
+            }
+        }
+    }
+    const char* names[8];
+    size_t n = std::min<size_t>(packedKernelVariants(names, 8), 8);
+    bool supported = std::any_of(names, names + n, [&](const char* v) { return r.Variant == v; });
+    return r.Cpu == cpu && supported && r.TransposedCrossover > 0 && !r.AspectCost.empty();
+}
+
+static void StoreTuning(const std::string& file, const TuneResult& r) {
+    std::string tmp = file + "." + std::to_string(getpid()) + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::trunc);
+        out << TUNE_FILE_MAGIC << " " << TUNE_FILE_VERSION << "\n";
+        out << "cpu " << r.Cpu << "\n";
+        out << "variant " << r.Variant << "\n";
+        out << "crossover " << r.TransposedCrossover << "\n";
+        for (size_t k = 0; k < r.AspectLog2.size(); k++) {
+            out << "aspect " << r.AspectLog2[k] << " " << r.AspectCost[k] << "\n";
+        }
+        if (!out.good()) {
+            throw std::runtime_error("Error writing tuning file");
+        }
+    }
+    if (rename(tmp.c_str(), file.c_str()) != 0) {
+        throw std::runtime_error("Error renaming tuning file");
+    }
+}
+
+TuneResult LoadOrAutotune(const std::string& dir) {
+    if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+        throw std::runtime_error("Error creating tuning directory");
+    }
+    std::string cpu = CpuModel();
+    char name[32];
+    snprintf(name, sizeof(name), "tune-%016llx", static_cast<unsigned long long>(Fnv1a(cpu)));
+    std::string file = dir + "/" + name;
+
+    TuneResult r;
+    if (LoadTuning(file, cpu, r)) {
+        std::cout << "Loaded tuning for " << cpu << ": " << r.Variant << " kernels, m/l ~ " << r.BestAspect()
+                  << std::endl;
+    } else {
+        std::cout << "Tuning for " << cpu << "..." << std::endl;
+        r = Autotune();
+        StoreTuning(file, r);
+        std::cout << "\t" << r.Variant << " kernels, m/l ~ " << r.BestAspect() << ", transposed crossover "
+                  << r.TransposedCrossover << "%" << std::endl;
+    }
+    ApplyTuning(r);
+    return r;
+}
+
+double ScanCostFactor(double aspect) {
+    std::lock_guard<std::mutex> lock(applied_mu);
+    if (!applied || current.AspectCost.empty()) {
+        return 1.0;
+    }
+    const std::vector<double>& x = current.AspectLog2;
+    const std::vector<double>& y = current.AspectCost;
+    double a = std::log2(aspect);
+    if (a <= x.front()) {
+        return y.front();
+    }
+    if (a >= x.back()) {
+        return y.back();
+    }
+    size_t k = std::upper_bound(x.begin(), x.end(), a) - x.begin();
+    double f = (a - x[k - 1]) / (x[k] - x[k - 1]);
+    return y[k - 1] + f * (y[k] - y[k - 1]);
+}
+
+double TunedAspect() {
+    std::lock_guard<std::mutex> lock(applied_mu);
+    return applied ? current.BestAspect() : 1.0;
+}
@@ -0,0 +1,58 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Decisions that depend on the host rather than on the params: which
+// packed-kernel variant answers fastest, how the DB's aspect ratio affects
+// scan speed, and where matMulTransposedPacked should switch from its
+// short-row to its long-row loop. The right answers differ between CPU
+// generations (wider SIMD can be slower once it lowers clocks; caches
+// decide how long a row can get before the query no longer fits), so they
+// are measured on the host itself.
+struct TuneResult {
+    // CPU model the measurements were taken on.
+    std::string Cpu;
+    // Packed-kernel variant for Answer (see packedKernelVariants).
+    std::string Variant;
+    // Scan time per word of a squished DB with m / l = 2^AspectLog2[k],
+    // relative to the fastest aspect measured. Between measured points it
+    // is interpolated in log2(aspect).
+    std::vector<double> AspectLog2;
+    std::vector<double> AspectCost;
+    // For setMatMulTransposedPackedCrossover.
+    uint64_t TransposedCrossover;
+
+    // The measured aspect with the lowest cost.
+    double BestAspect() const;
+};
+
+// "model name" from /proc/cpuinfo, or "unknown".
+std::string CpuModel();
+
+// Times every candidate on this host; takes a few seconds. Leaves the
+// kernel dispatch as it found it.
+TuneResult Autotune();
+
+// Makes r the tuning in effect: selects its kernel variant and transposed
+// crossover, and feeds its aspect costs to ScanCostFactor and TunedAspect.
+// Call before serving; switching kernels under running answers is unsafe.
+void ApplyTuning(const TuneResult& r);
+
+// Applies the result stored in dir for this CPU model, or runs Autotune,
+// stores its result in dir (created if needed) and applies it. Stored
+// results for another model, or naming a variant the host lacks, are
+// measured again.
+TuneResult LoadOrAutotune(const std::string& dir);
+
+// Scan cost of a DB with m / l = aspect relative to the fastest aspect,
+// under the tuning in effect; 1 when nothing has been applied.
+double ScanCostFactor(double aspect);
+
+// The fastest aspect under the tuning in effect; 1 (square) when nothing
+// has been applied.
+double TunedAspect();
+
+#endif // AUTOTUNE_H
@@ -0,0 +1,152 @@
+#include "batch_pir.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_map>
+
+// Evictions per inserted index before cuckoo insertion gives up on it.
+static const int MAX_EVICTIONS = 500;
+
+static uint64_t SplitMix64(uint64_t& state) {
+    uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+CuckooBatch::CuckooBatch(uint64_t num_records, uint64_t max_batch, uint64_t seed)
+    : num_records(num_records), max_batch(max_batch) {
+    if (num_records == 0 || max_batch == 0) {
+        throw std::runtime_error("Empty cuckoo batch");
+    }
+    num_buckets = (3 * max_batch + 1) / 2 + EXTRA_BUCKETS;
+    section_records = (num_records + num_buckets - 1) / num_buckets;
+    domain_bits = 1;
+    while ((uint64_t(1) << domain_bits) < num_records) {
+        domain_bits++;
+    }
+    uint64_t state = seed;
+    for (int h = 0; h < NUM_HASHES; h++) {
+        for (uint64_t& k : keys[h]) {
+            k = SplitMix64(state);
+        }
+    }
+}
+
+// Four rounds of add-key, multiply by an odd constant and xor-shift, each
+// a bijection on domain_bits-bit values. Values that land outside
+// [0, N) are permuted again until they do not (cycle walking); since
+// N > 2^(domain_bits - 1), that takes under two rounds on average.
+uint64_t CuckooBatch::permute(uint64_t i, int h) const {
+    const uint64_t mask = (domain_bits == 64) ? ~uint64_t(0) : (uint64_t(1) << domain_bits) - 1;
+    const unsigned shift = (domain_bits + 1) / 2;
+    uint64_t x = i;
+    do {
+        for (uint64_t k : keys[h]) {
+            x = (x + k) & mask;
+            x = (x * 0x9e3779b97f4a7c15ULL) & mask;
+            x ^= x >> shift;
+        }
+    } while (x >= num_records);
+    return x;
+}
+
+uint64_t CuckooBatch::Bucket(uint64_t i, int h) const {
+    return permute(i, h) % num_buckets;
+}
+
+uint64_t CuckooBatch::Slot(uint64_t i, int h) const {
+    return h * section_records + permute(i, h) / num_buckets;
+}
+
+std::vector<uint64_t> CuckooBatch::Replicate(const std::vector<uint64_t>& vals, uint64_t stride) const {
+    if (vals.size() != num_records) {
+        throw std::runtime_error("Bad input DB");
+    }
+    if (stride < BucketRecords()) {
+        throw std::runtime_error("Bucket stride smaller than a bucket");
+    }
+    std::vector<uint64_t> out(num_buckets * stride, 0);
+    for (uint64_t i = 0; i < num_records; i++) {
+        for (int h = 0; h < NUM_HASHES; h++) {
+            uint64_t x = permute(i, h);
+            out[(x % num_buckets) * stride + h * section_records + x / num_buckets] = vals[i];
+        }
+    }
+    return out;
+}
+
+CuckooBatch::Assignment CuckooBatch::Assign(const std::vector<uint64_t>& indices, std::mt19937_64& rng) const {
+    Assignment a;
+    a.ForBucket.assign(num_buckets, NONE);
+    a.Slot.assign(num_buckets, 0);
+    a.BucketOf.assign(indices.size(), NONE);
+
+    // Hash choice each bucket's current occupant sits in it by.
+    std::vector<int> choice(num_buckets, 0);
+    std::unordered_map<uint64_t, uint64_t> first;
+    uint64_t distinct = 0;
+    for (uint64_t pos = 0; pos < indices.size(); pos++) {
+        if (indices[pos] >= num_records) {
+            throw std::runtime_error("Index out of range");
+        }
+        if (!first.emplace(indices[pos], pos).second) {
+            continue;
+        }
+        if (++distinct > max_batch) {
+            throw std::runtime_error("Too many indices for this batch");
+        }
+
+        uint64_t cur = pos;
+        int last_h = -1;
+        for (int step = 0; step <= MAX_EVICTIONS && cur != NONE; step++) {
+            uint64_t i = indices[cur];
+            int h_free = -1;
+            for (int h = 0; h < NUM_HASHES && h_free < 0; h++) {
+                if (a.ForBucket[Bucket(i, h)] == NONE) {
+                    h_free = h;
+                }
+            }
+            if (h_free >= 0) {
+                uint64_t b = Bucket(i, h_free);
+                a.ForBucket[b] = cur;
+                choice[b] = h_free;
+                cur = NONE;
+                break;
+            }
+            // Evict the occupant of a random candidate, other than the
+            // bucket cur was just evicted from.
+            int h;
+            do {
+                h = static_cast<int>(rng() % NUM_HASHES);
+            } while (h == last_h && NUM_HASHES > 1);
+            uint64_t b = Bucket(i, h);
+            uint64_t evicted = a.ForBucket[b];
+            a.ForBucket[b] = cur;
+            choice[b] = h;
+            cur = evicted;
+            // The evictee must not go straight back to b.
+            last_h = -1;
+            for (int g = 0; g < NUM_HASHES; g++) {
+                if (Bucket(indices[cur], g) == b) {
+                    last_h = g;
+                }
+            }
+        }
+        // cur is now whichever index was left homeless, if any.
+    }
+
+    for (uint64_t b = 0; b < num_buckets; b++) {
+        uint64_t pos = a.ForBucket[b];
+        if (pos != NONE) {
+            a.Slot[b] = Slot(indices[pos], choice[b]);
+            a.BucketOf[pos] = b;
+        } else {
+            a.Slot[b] = rng() % BucketRecords();
+        }
+    }
+    for (uint64_t pos = 0; pos < indices.size(); pos++) {
+        a.BucketOf[pos] = a.BucketOf[first[indices[pos]]];
+    }
+    return a;
+}
@@ -0,0 +1,87 @@
+#ifndef BATCH_PIR_H
+#define BATCH_PIR_H
+
+#include <cstdint>
+#include <random>
+#include <vector>
+
+// Batch PIR by cuckoo hashing. Splitting the DB evenly over the queries
+// of a batch only retrieves records that happen to fall in distinct
+// slices; with k random indices about k / e of the slices come up empty.
+// Instead, every record is replicated into NUM_HASHES of NumBuckets()
+// buckets, chosen by keyed hash functions, and the client cuckoo-hashes
+// its k indices so that each bucket serves at most one of them. One query
+// per bucket then retrieves all k in a single pass, over NUM_HASHES
+// copies of the DB rather than k.
+//
+// Hash h is a keyed permutation pi_h of [0, NumRecords()): record i goes
+// to bucket pi_h(i) % NumBuckets(), at slot pi_h(i) / NumBuckets() of the
+// bucket's section h. Every bucket therefore holds NUM_HASHES sections of
+// the same size, and the client finds a record's slot from the seed alone,
+// without a copy of the layout.
+class CuckooBatch {
+public:
+    static constexpr int NUM_HASHES = 3;
+    static constexpr uint64_t EXTRA_BUCKETS = 4;
+
+    // Value of Assignment::BucketOf for indices that did not fit, and of
+    // Assignment::ForBucket for buckets left over.
+    static constexpr uint64_t NONE = ~uint64_t(0);
+
+    // Buckets for batches of up to max_batch indices: 1.5 per index, at
+    // which cuckoo insertion with three choices almost never fails for
+    // large batches, plus EXTRA_BUCKETS, which small ones need. The scan
+    // costs NUM_HASHES passes over the DB whatever the number of buckets.
+    // seed keys the hash functions; server and clients must use the same
+    // one.
+    CuckooBatch(uint64_t num_records, uint64_t max_batch, uint64_t seed);
+
+    uint64_t NumRecords() const { return num_records; }
+    uint64_t NumBuckets() const { return num_buckets; }
+    uint64_t MaxBatch() const { return max_batch; }
+
+    // Records per bucket, NUM_HASHES sections of SectionRecords() each;
+    // slots no record maps to are empty.
+    uint64_t BucketRecords() const { return NUM_HASHES * section_records; }
+    uint64_t SectionRecords() const { return section_records; }
+
+    // Bucket and slot of copy h of record i.
+    uint64_t Bucket(uint64_t i, int h) const;
+    uint64_t Slot(uint64_t i, int h) const;
+
+    // The replicated DB: bucket b is records [b * stride, b * stride +
+    // BucketRecords()) of the result, and empty slots and the padding up to
+    // stride are zero. stride lets the caller align buckets to whole row
+    // blocks of the PIR matrix.
+    std::vector<uint64_t> Replicate(const std::vector<uint64_t>& vals, uint64_t stride) const;
+
+    struct Assignment {
+        // Position in the index list of the record each bucket fetches, or
+        // NONE for buckets that carry a dummy query.
+        std::vector<uint64_t> ForBucket;
+        // Slot each bucket queries: the record's copy, or a random slot.
+        std::vector<uint64_t> Slot;
+        // Bucket serving each position of the index list, or NONE if
+        // insertion gave up on it; repeated indices share a bucket.
+        std::vector<uint64_t> BucketOf;
+    };
+
+    // Places indices (at most MaxBatch() distinct ones) into distinct
+    // buckets by cuckoo insertion with random-walk eviction. Indices left
+    // without a bucket, which is rare, are marked NONE and have to go into
+    // a later batch.
+    Assignment Assign(const std::vector<uint64_t>& indices, std::mt19937_64& rng) const;
+
+private:
+    uint64_t num_records;
+    uint64_t max_batch;
+    uint64_t num_buckets;
+    uint64_t section_records;
+    // pi_h works on [0, 2^domain_bits) and walks cycles into [0, N).
+    unsigned domain_bits;
+    uint64_t keys[NUM_HASHES][4];
+
+    uint64_t permute(uint64_t i, int h) const;
+};
+
+#endif // BATCH_PIR_H
@@ -0,0 +1,159 @@
+#include "coalescer.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+void Histogram::Add(uint64_t v) {
+    size_t b = 0;
+    while (b < 64 && (uint64_t(1) << b) <= v) {
+        b++;
+    }
+    if (Buckets.size() <= b) {
+        Buckets.resize(b + 1, 0);
+    }
+    Buckets[b]++;
+}
+
+uint64_t Histogram::Count() const {
+    uint64_t n = 0;
+    for (uint64_t c : Buckets) {
+        n += c;
+    }
+    return n;
+}
+
+uint64_t Histogram::Quantile(double q) const {
+    uint64_t n = Count();
+    if (n == 0) {
+        return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(q * static_cast<double>(n));
+    rank = std::min(std::max<uint64_t>(rank, 1), n);
+    uint64_t seen = 0;
+    for (size_t b = 0; b < Buckets.size(); b++) {
+        seen += Buckets[b];
+        if (seen >= rank) {
+            return (b == 0) ? 0 : (uint64_t(1) << b) - 1;
+        }
+    }
+    return ~uint64_t(0);
+}
+
+void Histogram::Print(std::ostream& out, const char* unit) const {
+    uint64_t n = Count();
+    for (size_t b = 0; b < Buckets.size(); b++) {
+        if (Buckets[b] == 0) {
+            continue;
+        }
+        uint64_t lo = (b == 0) ? 0 : uint64_t(1) << (b - 1);
+        uint64_t hi = (b == 0) ? 0 : (uint64_t(1) << b) - 1;
+        out << "\t\t[" << lo << ", " << hi << "] " << unit << ": " << Buckets[b] << " ("
+            << 100.0 * static_cast<double>(Buckets[b]) / static_cast<double>(n) << "%)\n";
+    }
+}
+
+QueryCoalescer::QueryCoalescer(BatchAnswerFn answer, uint64_t max_batch, std::chrono::microseconds max_delay)
+    : answer(std::move(answer)), max_batch(max_batch), max_delay(max_delay), stopping(false) {
+    if (max_batch == 0) {
+        throw std::runtime_error("Coalescer batches must hold a query");
+    }
+    flusher = std::thread([this] { Run(); });
+}
+
+QueryCoalescer::~QueryCoalescer() {
+    {
+        std::lock_guard<std::mutex> lock(mu);
+        stopping = true;
+    }
+    cv.notify_all();
+    flusher.join();
+}
+
+std::future<Msg> QueryCoalescer::Submit(const Msg& query) {
+    Pending p;
+    p.Query = query;
+    p.Arrived = std::chrono::steady_clock::now();
+    std::future<Msg> result = p.Answer.get_future();
+    bool wake;
+    {
+        std::lock_guard<std::mutex> lock(mu);
+        if (stopping) {
+            throw std::runtime_error("Coalescer is shutting down");
+        }
+        queue.push_back(std::move(p));
+        // The flusher needs to hear of the first query (to start its
+        // deadline) and of a full batch; it ignores the rest.
+        wake = queue.size() == 1 || queue.size() == max_batch;
+    }
+    if (wake) {
+        cv.notify_one();
+    }
+    return result;
+}
+
+CoalescerStats QueryCoalescer::Stats() const {
+    std::lock_guard<std::mutex> lock(mu);
+    return stats;
+}
+
+void QueryCoalescer::ResetStats() {
+    std::lock_guard<std::mutex> lock(mu);
+    stats = CoalescerStats();
+}
+
+void QueryCoalescer::Run() {
+    std::unique_lock<std::mutex> lock(mu);
+    for (;;) {
+        cv.wait(lock, [this] { return stopping || !queue.empty(); });
+        if (queue.empty()) {
+            return; // Stopping, and nothing left to answer.
+        }
+        auto deadline = queue.front().Arrived + max_delay;
+        cv.wait_until(lock, deadline, [this] { return stopping || queue.size() >= max_batch; });
+
+        uint64_t n = std::min<uint64_t>(queue.size(), max_batch);
+        std::vector<Pending> batch;
+        batch.reserve(n);
+        for (uint64_t k = 0; k < n; k++) {
+            batch.push_back(std::move(queue.front()));
+            queue.pop_front();
+        }
+        auto now = std::chrono::steady_clock::now();
+        for (const Pending& p : batch) {
+            auto waited = std::chrono::duration_cast<std::chrono::microseconds>(now - p.Arrived);
+            stats.QueueDelayUs.Add(static_cast<uint64_t>(waited.count()));
+        }
+        stats.BatchSize.Add(n);
+        stats.Queries += n;
+        stats.Passes++;
+        if (n == max_batch) {
+            stats.FullPasses++;
+        } else {
+            stats.DeadlinePasses++;
+        }
+
+        lock.unlock();
+        std::vector<Msg> queries;
+        queries.reserve(n);
+        for (const Pending& p : batch) {
+            queries.push_back(p.Query);
+        }
+        // If set_value throws part way, the promises before it already
+        // hold their answers, so only the rest get the exception.
+        uint64_t fulfilled = 0;
+        try {
+            std::vector<Msg> answers = answer(queries);
+            if (answers.size() != n) {
+                throw std::runtime_error("Batch answer has the wrong number of answers");
+            }
+            for (; fulfilled < n; fulfilled++) {
+                batch[fulfilled].Answer.set_value(answers[fulfilled]);
+            }
+        } catch (...) {
+            for (uint64_t k = fulfilled; k < n; k++) {
+                batch[k].Answer.set_exception(std::current_exception());
+            }
+        }
+        lock.lock();
+    }
+}
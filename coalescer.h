@@ -0,0 +1,96 @@
+#ifndef COALESCER_H
+#define COALESCER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+#include "utils.h"
+
+// Counts of values in power-of-two buckets: bucket 0 holds 0, bucket b
+// holds [2^(b-1), 2^b).
+class Histogram {
+public:
+    void Add(uint64_t v);
+    uint64_t Count() const;
+    // Upper bound of the bucket holding the q-quantile (0 < q <= 1), or 0
+    // when empty.
+    uint64_t Quantile(double q) const;
+    // One line per non-empty bucket: its range, count and share.
+    void Print(std::ostream& out, const char* unit) const;
+
+    std::vector<uint64_t> Buckets;
+};
+
+struct CoalescerStats {
+    // Microseconds from Submit to the pass that answers the query.
+    Histogram QueueDelayUs;
+    // Queries per pass.
+    Histogram BatchSize;
+    uint64_t Queries = 0;
+    uint64_t Passes = 0;
+    // Passes started because the batch was full, and because the oldest
+    // query's deadline came first.
+    uint64_t FullPasses = 0;
+    uint64_t DeadlinePasses = 0;
+};
+
+// Coalesces single-index queries from independent clients into
+// multi-query DB passes. An Answer costs a full scan of the DB whichever
+// way it is done, and one pass of the multi-query kernel answers many
+// queries for little more memory traffic than one, so queries that arrive
+// close together are queued and answered together. A pass starts as soon
+// as max_batch queries are waiting, or when the oldest has waited
+// max_delay, so no query waits longer than max_delay plus the pass in
+// progress when it arrived. One pass runs at a time; queries arriving
+// during it form the next batch.
+class QueryCoalescer {
+public:
+    // Answers queries[k] in element k of the result, in one pass; e.g.
+    // SimplePIR::AnswerMany bound to a DB and its state.
+    typedef std::function<std::vector<Msg>(const std::vector<Msg>&)> BatchAnswerFn;
+
+    QueryCoalescer(BatchAnswerFn answer, uint64_t max_batch, std::chrono::microseconds max_delay);
+    // Answers whatever is still queued, then stops.
+    ~QueryCoalescer();
+
+    QueryCoalescer(const QueryCoalescer&) = delete;
+    QueryCoalescer& operator=(const QueryCoalescer&) = delete;
+
+    // Queues query, whose matrices the caller keeps alive until the future
+    // is ready. The future yields the answer, or the exception the pass
+    // threw. Safe to call from any thread.
+    std::future<Msg> Submit(const Msg& query);
+
+    CoalescerStats Stats() const;
+    void ResetStats();
+
+private:
+    struct Pending {
+        Msg Query;
+        std::promise<Msg> Answer;
+        std::chrono::steady_clock::time_point Arrived;
+    };
+
+    void Run();
+
+    BatchAnswerFn answer;
+    const uint64_t max_batch;
+    const std::chrono::microseconds max_delay;
+
+    mutable std::mutex mu;
+    std::condition_variable cv;
+    std::deque<Pending> queue;
+    bool stopping;
+    CoalescerStats stats;
+    std::thread flusher;
+};
+
+#endif // COALESCER_H
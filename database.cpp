@@ -3,6 +3,18 @@
 #include <cmath>
 #include <tuple>
 #include <stdexcept>
+#include <memory>
+#include <algorithm>
+#include <mutex>
+#include <shared_mutex>
+#include "database.h"
+#include "answer_pool.h"
+#include "matrix.h"
+#include "params.h"
+#include "utils.h"
+#include "packing.h"
+#include "pir.h"
+#include "db_file.h"
 
 // CONVERT MATRIX.GO INTO CPP and CREATE HEADER FILE AND IMPORT INTO THIS FILE
 // SIMILARLY DO FOR UTILS.Go
@@ -26,101 +38,272 @@ uint64_t ReconstructElem(const std::vector<uint64_t>& vals, uint64_t index, cons
     return val;
 }
 
-class DBinfo {
-public:
-    uint64_t Num;        // Number of DB entries.
-    uint64_t Row_length; // Number of bits per DB entry.
+DBinfo::DBinfo(uint64_t num, uint64_t row_length, uint64_t packing,
+               uint64_t ne, uint64_t x, uint64_t p, uint64_t logq,
+               uint64_t basis, uint64_t squishing, uint64_t cols)
+    : Num(num), Row_length(row_length), Packing(packing), Ne(ne),
+      X(x), P(p), Logq(logq), Basis(basis), Squishing(squishing), Cols(cols) {}
+
+// Picks the tightest packing for this DB: the fewest bits per digit that
+// still hold a Z_p element, and as many digits per log(q)-bit word as fit.
+// Only shapes with specialized kernels (PACKED_SHAPES) are eligible, so we
+// widen the digit until one matches; the hard-coded 10-bit/3-digit shape
+// always does for p <= 1024.
+void PickSquishing(DBinfo& info) {
+    uint64_t basis = static_cast<uint64_t>(std::ceil(std::log2(static_cast<double>(info.P))));
+    for (; basis <= info.Logq; basis++) {
+        uint64_t squishing = info.Logq / basis;
+        if (packedShapeSupported(basis, squishing)) {
+            info.Basis = basis;
+            info.Squishing = squishing;
+            return;
+        }
+    }
+    throw std::runtime_error("No packed kernel for these params");
+}
 
-    uint64_t Packing;    // Number of DB entries per Z_p elem, if log(p) > DB entry size.
-    uint64_t Ne;         // Number of Z_p elems per DB entry, if DB entry size > log(p).
+Database::Database() : Data(nullptr), Squished(false) {}
 
-    uint64_t X;          // Tunable parameter that governs communication,
-                         // must be in range [1, Ne] and must be a divisor of Ne;
-                         // represents the number of times the scheme is repeated.
-    uint64_t P;          // Plaintext modulus.
-    uint64_t Logq;       // (Logarithm of) ciphertext modulus.
+Database::~Database() {
+    delete Data;
+    Data = nullptr;
+}
 
-    // For in-memory DB compression
-    uint64_t Basis;
-    uint64_t Squishing;
-    uint64_t Cols;
+void Database::Squish() {
+    if (Mapped) {
+        throw std::runtime_error("Mapped DB is already squished");
+    }
+    // std::cout << "Original DB dims: ";
+    // Data->Dim(); // Assuming Dim is a method that prints dimensions
 
-    // Constructor (optional)
-    DBinfo(uint64_t num = 0, uint64_t row_length = 0, uint64_t packing = 0,
-           uint64_t ne = 0, uint64_t x = 0, uint64_t p = 0, uint64_t logq = 0,
-           uint64_t basis = 0, uint64_t squishing = 0, uint64_t cols = 0)
-        : Num(num), Row_length(row_length), Packing(packing), Ne(ne),
-          X(x), P(p), Logq(logq), Basis(basis), Squishing(squishing), Cols(cols) {}
-};
+    PickSquishing(Info);
+    Info.Cols = Data->Cols;
 
+    Data->Squish(Info.Basis, Info.Squishing);
 
+    // std::cout << "After squishing, with compression factor " << Info.Squishing << ": ";
+    // Data->Dim(); // Assuming Dim is again called to print dimensions after squishing
 
-class Database {
-public:
-    DBinfo Info;
-    Matrix* Data; // Pointer to Matrix
+    // Check that params allow for this compression
+    if (Info.P > (1ULL << Info.Basis) || Info.Logq < Info.Basis * Info.Squishing) {
+        throw std::runtime_error("Bad params");
+    }
+    Squished = true;
+}
 
-    // Constructor
-    Database() : Data(nullptr) {} // Initializes Data pointer to nullptr
+void Database::Unsquish() {
+    if (Mapped) {
+        throw std::runtime_error("Mapped DB is read-only");
+    }
+    if (Data != nullptr) {
+        Data->Unsquish(Info.Basis, Info.Squishing, Info.Cols);
+    }
+    Squished = false;
+}
 
-    // Destructor to handle cleanup
-    ~Database() {
-        delete Data; // Ensure proper deletion of the Matrix object
-        Data = nullptr; // Avoid dangling pointer
+// Reads through View and current, so it works on squished, mapped and
+// shared-memory DBs as well as on a plain matrix, and sees staged writes
+// before they are compacted.
+uint64_t Database::GetElem(uint64_t i) {
+    if (i >= Info.Num) {
+        throw std::out_of_range("Index out of range");
     }
+    std::shared_lock<std::shared_mutex> guard(lock);
+    uint64_t cols = Squished ? Info.Cols : View().Cols;
 
-    // Copy constructor and copy assignment operator should be
-    // defined if deep copy is required. For simplicity, they are
-    // not included here. Be cautious of shallow copies.
+    uint64_t col = i % cols;
+    uint64_t row = i / cols;
 
-    // Optionally, more constructors, member functions, or friend functions can be defined here.
-    void Squish() {
-        // std::cout << "Original DB dims: ";
-        // Data->Dim(); // Assuming Dim is a method that prints dimensions
+    if (Info.Packing > 0) {
+        uint64_t new_i = i / Info.Packing;
+        col = new_i % cols;
+        row = new_i / cols;
+    }
 
-        Info.Basis = 10;
-        Info.Squishing = 3;
-        Info.Cols = Data->Cols(); // Assuming Cols() method exists in Matrix that returns column count
+    // ReconstructElem takes the entries centered, as an unsquished
+    // matrix stores them.
+    std::vector<uint64_t> vals;
+    for (uint64_t j = row * Info.Ne; j < (row + 1) * Info.Ne; ++j) {
+        vals.push_back(current(j, col) - Info.P / 2);
+    }
+
+    return ReconstructElem(vals, i, Info);
+}
 
-        Data->Squish(Info.Basis, Info.Squishing);
+std::vector<DBEntryDelta> Database::Update(uint64_t i, uint64_t val) {
+    if (Mapped) {
+        throw std::runtime_error("Mapped DB is read-only");
+    }
+    std::unique_lock<std::shared_mutex> guard(lock);
+    compactLocked(Overlay.size());
+    return rewrite(i, val, false);
+}
 
-        // std::cout << "After squishing, with compression factor " << Info.Squishing << ": ";
-        // Data->Dim(); // Assuming Dim is again called to print dimensions after squishing
+std::vector<DBEntryDelta> Database::Stage(uint64_t i, uint64_t val) {
+    std::unique_lock<std::shared_mutex> guard(lock);
+    return rewrite(i, val, true);
+}
 
-        // Check that params allow for this compression
-        if (Info.P > (1ULL << Info.Basis) || Info.Logq < Info.Basis * Info.Squishing) {
-            throw std::runtime_error("Bad params");
+void Database::Compact() {
+    if (Mapped) {
+        throw std::runtime_error("Mapped DB is read-only");
+    }
+    // Fold a bounded number of entries per lock hold so that Answer
+    // calls can run in between.
+    const size_t step = 4096;
+    for (;;) {
+        std::unique_lock<std::shared_mutex> guard(lock);
+        if (Overlay.empty()) {
+            return;
         }
+        compactLocked(step);
     }
+}
+
+std::shared_lock<std::shared_mutex> Database::ReadLock() {
+    return std::shared_lock<std::shared_mutex>(lock);
+}
 
-    void Unsquish() {
-        if (Data != nullptr) {
-            Data->Unsquish(Info.Basis, Info.Squishing, Info.Cols);
+std::vector<DBEntryDelta> Database::Append(const std::vector<uint64_t>& vals) {
+    if (Mapped) {
+        throw std::runtime_error("Mapped DB is read-only");
+    }
+    for (uint64_t val : vals) {
+        if (Info.Row_length < 64 && (val >> Info.Row_length) != 0) {
+            throw std::runtime_error("Value does not fit in a DB entry");
         }
     }
+    std::unique_lock<std::shared_mutex> guard(lock);
+    compactLocked(Overlay.size());
+    uint64_t cols = Squished ? Info.Cols : Data->Cols;
+    uint64_t perBlock = (Info.Packing > 0) ? cols * Info.Packing : cols;
+    uint64_t blockRows = (Info.Packing > 0) ? 1 : Info.Ne;
+    uint64_t blocks = (Info.Num + vals.size() + perBlock - 1) / perBlock;
+    uint64_t oldRows = Data->Rows;
+    if (blocks * blockRows > oldRows) {
+        // New entries hold digit 0, which unsquished DBs store as -p/2.
+        uint32_t zero = Squished ? 0 : static_cast<uint32_t>(0 - Info.P / 2);
+        Data->Rows = blocks * blockRows;
+        Data->Data.resize(Data->Rows * Data->Cols, zero);
+    }
 
-    uint64_t GetElem(uint64_t i) {
-        if (i >= Info.Num) {
-            throw std::out_of_range("Index out of range");
+    std::vector<DBEntryDelta> changes;
+    uint64_t first = Info.Num;
+    Info.Num += vals.size();
+    for (uint64_t k = 0; k < vals.size(); k++) {
+        for (const DBEntryDelta& c : rewrite(first + k, vals[k], false)) {
+            if (c.Row < oldRows) {
+                changes.push_back(c);
+            }
         }
+    }
+    return changes;
+}
 
-        uint64_t col = i % Data->Cols(); // Assuming Cols() returns number of columns
-        uint64_t row = i / Data->Cols();
+MatrixView Database::View() {
+    if (Mapped) {
+        return Mapped->View();
+    }
+    return Data->View();
+}
 
-        if (Info.Packing > 0) {
-            uint64_t new_i = i / Info.Packing;
-            col = new_i % Data->Cols();
-            row = new_i / Data->Cols();
-        }
+// Sets record i to val, either in the matrix or, if staged, in the
+// overlay, and returns the entries whose value changed.
+std::vector<DBEntryDelta> Database::rewrite(uint64_t i, uint64_t val, bool staged) {
+    if (i >= Info.Num) {
+        throw std::out_of_range("Index out of range");
+    }
+    if (Info.Row_length < 64 && (val >> Info.Row_length) != 0) {
+        throw std::runtime_error("Value does not fit in a DB entry");
+    }
 
-        std::vector<uint64_t> vals;
-        for (uint64_t j = row * Info.Ne; j < (row + 1) * Info.Ne; ++j) {
-            vals.push_back(Data->Get(j, col)); // Assuming Get method exists and is public
+    uint64_t cols = Squished ? Info.Cols : View().Cols;
+    std::vector<DBEntryDelta> changes;
+    auto put = [&](uint64_t row, uint64_t col, uint64_t cur) {
+        uint64_t old = current(row, col);
+        if (cur == old) {
+            return;
         }
+        changes.push_back({row, col, cur - old});
+        std::vector<DBEntryDelta>::iterator pending = overlayAt(row, col);
+        if (!staged) {
+            setEntry(row, col, cur);
+        } else if (pending != Overlay.end() && pending->Row == row && pending->Col == col) {
+            pending->Delta += cur - old;
+            if (pending->Delta == 0) {
+                Overlay.erase(pending);
+            }
+        } else {
+            Overlay.insert(pending, {row, col, cur - old});
+        }
+    };
+
+    if (Info.Packing > 0) {
+        // Replace this record's bits in the Z_p element it shares with
+        // its Packing - 1 neighbours.
+        uint64_t at = i / Info.Packing;
+        uint64_t shift = Info.Row_length * (i % Info.Packing);
+        uint64_t mask = ((1ULL << Info.Row_length) - 1) << shift;
+        uint64_t row = at / cols;
+        uint64_t col = at % cols;
+        put(row, col, (current(row, col) & ~mask) | (val << shift));
+    } else {
+        uint64_t col = i % cols;
+        for (uint64_t j = 0; j < Info.Ne; j++) {
+            put((i / cols) * Info.Ne + j, col, Base_p(Info.P, val, j));
+        }
+    }
+    return changes;
+}
+
+// First overlay entry at or after (row, col).
+std::vector<DBEntryDelta>::iterator Database::overlayAt(uint64_t row, uint64_t col) {
+    return std::lower_bound(Overlay.begin(), Overlay.end(), DBEntryDelta{row, col, 0},
+                            [](const DBEntryDelta& a, const DBEntryDelta& b) {
+                                return a.Row < b.Row || (a.Row == b.Row && a.Col < b.Col);
+                            });
+}
+
+// Entry (row, col) with any staged write applied.
+uint64_t Database::current(uint64_t row, uint64_t col) {
+    std::vector<DBEntryDelta>::iterator pending = overlayAt(row, col);
+    if (pending != Overlay.end() && pending->Row == row && pending->Col == col) {
+        return entry(row, col) + pending->Delta;
+    }
+    return entry(row, col);
+}
+
+// Folds the last n overlay entries into the matrix.
+void Database::compactLocked(size_t n) {
+    n = std::min(n, Overlay.size());
+    for (size_t k = Overlay.size() - n; k < Overlay.size(); k++) {
+        const DBEntryDelta& d = Overlay[k];
+        setEntry(d.Row, d.Col, entry(d.Row, d.Col) + d.Delta);
+    }
+    Overlay.resize(Overlay.size() - n);
+}
 
-        return ReconstructElem(vals, i, Info);
+// Entry (row, col) of the DB as a value in [0, p): squished DBs store
+// it as a Basis-bit field, unsquished ones shifted down by p/2.
+uint64_t Database::entry(uint64_t row, uint64_t col) {
+    MatrixView m = View();
+    if (Squished) {
+        uint64_t word = m.Row(row)[col / Info.Squishing];
+        return (word >> (Info.Basis * (col % Info.Squishing))) & ((1ULL << Info.Basis) - 1);
     }
-};
+    return static_cast<uint32_t>(m.Get(row, col) + Info.P / 2);
+}
+
+void Database::setEntry(uint64_t row, uint64_t col, uint64_t val) {
+    if (Squished) {
+        uint32_t& word = Data->Data[row * Data->Cols + col / Info.Squishing];
+        uint64_t shift = Info.Basis * (col % Info.Squishing);
+        uint32_t mask = static_cast<uint32_t>(((1ULL << Info.Basis) - 1) << shift);
+        word = (word & ~mask) | static_cast<uint32_t>(val << shift);
+        return;
+    }
+    Data->Set(val - Info.P / 2, row, col);
+}
 
 // Definition for the Matrix class should be provided elsewhere.
 
@@ -162,31 +345,53 @@ std::tuple<uint64_t, uint64_t> ApproxDatabaseDims(uint64_t N, uint64_t row_lengt
 }
 
 
+std::tuple<uint64_t, uint64_t> ApproxDatabaseDimsWithAspect(uint64_t N, uint64_t row_length, uint64_t p, double aspect) {
+    auto [db_elems, elems_per_entry, _] = Num_DB_entries(N, row_length, p);
+    uint64_t l = static_cast<uint64_t>(std::floor(std::sqrt(static_cast<double>(db_elems) / aspect)));
+    l = std::max<uint64_t>(std::min<uint64_t>(l, db_elems), 1);
 
-
-Database* SetupDB(uint64_t Num, uint64_t row_length, const Params* p) {
-    if (Num == 0 || row_length == 0) {
-        throw std::runtime_error("Empty database!");
+    uint64_t rem = l % elems_per_entry;
+    if (rem != 0) {
+        l += elems_per_entry - rem;
     }
 
-    auto* D = new Database();
+    uint64_t m = static_cast<uint64_t>(std::ceil(static_cast<double>(db_elems) / static_cast<double>(l)));
+
+    return std::make_tuple(l, m);
+}
 
-    D->Info.Num = Num;
-    D->Info.Row_length = row_length;
-    D->Info.P = p->P;
-    D->Info.Logq = p->Logq;
+
+
+
+DBinfo DBLayout(uint64_t Num, uint64_t row_length, const Params* p) {
+    DBinfo info;
+    info.Num = Num;
+    info.Row_length = row_length;
+    info.P = p->P;
+    info.Logq = p->Logq;
 
     auto [db_elems, elems_per_entry, entries_per_elem] = Num_DB_entries(Num, row_length, p->P);
-    D->Info.Ne = elems_per_entry;
-    D->Info.X = D->Info.Ne;
-    D->Info.Packing = entries_per_elem;
+    info.Ne = elems_per_entry;
+    info.X = info.Ne;
+    info.Packing = entries_per_elem;
+
+    while (info.Ne % info.X != 0) {
+        info.X += 1;
+    }
 
-    while (D->Info.Ne % D->Info.X != 0) {
-        D->Info.X += 1;
+    info.Basis = 0;
+    info.Squishing = 0;
+    return info;
+}
+
+Database* SetupDB(uint64_t Num, uint64_t row_length, const Params* p) {
+    if (Num == 0 || row_length == 0) {
+        throw std::runtime_error("Empty database!");
     }
 
-    D->Info.Basis = 0;
-    D->Info.Squishing = 0;
+    auto* D = new Database();
+    D->Info = DBLayout(Num, row_length, p);
+    uint64_t db_elems = std::get<0>(Num_DB_entries(Num, row_length, p->P));
 
     double dbSizeMB = (static_cast<double>(p->L) * p->M) * std::log2(static_cast<double>(p->P)) / (1024.0 * 1024.0 * 8.0);
     std::cout << "Total packed DB size is ~" << dbSizeMB << " MB\n";
@@ -207,7 +412,7 @@ Database* SetupDB(uint64_t Num, uint64_t row_length, const Params* p) {
 
 Database* MakeRandomDB(uint64_t Num, uint64_t row_length, const Params* p) {
     Database* D = SetupDB(Num, row_length, p);
-    D->Data = MatrixRand(p->L, p->M, 0, p->P); // Generate a random matrix
+    D->Data = new Matrix(MatrixRand(p->L, p->M, 0, p->P)); // Generate a random matrix
 
     // Map DB elems to [-p/2; p/2]
     D->Data->Sub(p->P / 2);
@@ -217,7 +422,7 @@ Database* MakeRandomDB(uint64_t Num, uint64_t row_length, const Params* p) {
 
 Database* MakeDB(uint64_t Num, uint64_t row_length, const Params* p, const std::vector<uint64_t>& vals) {
     Database* D = SetupDB(Num, row_length, p);
-    D->Data = MatrixZeros(p->L, p->M);
+    D->Data = new Matrix(p->L, p->M);
 
     if (vals.size() != Num) {
         delete D; // Cleanup before throwing
@@ -250,4 +455,40 @@ Database* MakeDB(uint64_t Num, uint64_t row_length, const Params* p, const std::
     D->Data->Sub(p->P / 2);
 
     return D;
-}
\ No newline at end of file
+}
+
+Matrix HintRows(Database* DB, Matrix& A, uint64_t first, uint64_t num, AnswerPool& pool) {
+    const uint64_t step = 64;
+    MatrixView db = DB->View().SelectRows(first, num);
+    uint64_t cols = DB->Squished ? DB->Info.Cols : db.Cols;
+    if (cols != A.Rows) {
+        std::cout << num << "-by-" << cols << " vs. " << A.Rows << "-by-" << A.Cols << std::endl;
+        throw std::runtime_error("Dimension mismatch");
+    }
+    Matrix H(num, A.Cols);
+
+    // Each worker unpacks and multiplies its own rows, step rows at a
+    // time, with the single-threaded blocked kernel.
+    pool.Run([&](uint64_t w) {
+        RowRange mine = pool.Rows(w, num);
+        for (uint64_t r = mine.Start; r < mine.End; r += step) {
+            uint64_t n = std::min(step, mine.End - r);
+            Matrix block(db.SelectRows(r, n));
+            if (DB->Squished) {
+                block.Unsquish(DB->Info.Basis, DB->Info.Squishing, DB->Info.Cols);
+                block.Sub(DB->Info.P / 2);
+            }
+            ::matMul(&H.Data[r * H.Cols], block.Data.data(), A.Data.data(), n, cols, A.Cols);
+        }
+    });
+    for (const DBEntryDelta& d : DB->Overlay) {
+        if (d.Row >= first && d.Row < first + num) {
+            uint32_t* h = &H.Data[(d.Row - first) * H.Cols];
+            const uint32_t* a = &A.Data[d.Col * A.Cols];
+            for (uint64_t j = 0; j < A.Cols; j++) {
+                h[j] += static_cast<uint32_t>(d.Delta) * a[j];
+            }
+        }
+    }
+    return H;
+}
@@ -5,11 +5,24 @@
 #include <vector>
 #include <tuple>
 #include <stdexcept>
+#include <memory>
+#include <shared_mutex>
+
+#include "matrix.h"
 
 // Forward declarations
-class Matrix; // Assuming the Matrix class is defined in a separate file or later in the source file.
+class AnswerPool;
+class MappedDB;
 class Params; // Assuming the Params class is defined in a separate file or later in the source file.
 
+// A change to one entry of the (unsquished) DB matrix made by
+// Database::Update: entry (Row, Col) grew by Delta, mod 2^Logq.
+struct DBEntryDelta {
+    uint64_t Row;
+    uint64_t Col;
+    uint64_t Delta;
+};
+
 class DBinfo {
 public:
     // Public member variables
@@ -25,6 +38,15 @@ class Database {
 public:
     DBinfo Info;
     Matrix* Data;
+    // Set instead of Data when the squished DB is mapped from a file
+    // written by SaveSquishedDB (see db_file.h).
+    std::shared_ptr<MappedDB> Mapped;
+    // Whether the matrix is in packed form (after Squish, or when built
+    // by LoadSquishedDB or IngestDB).
+    bool Squished;
+    // Writes staged by Stage and not yet folded into the matrix, sorted
+    // by (Row, Col). Read it under ReadLock.
+    std::vector<DBEntryDelta> Overlay;
 
     // Constructor and Destructor
     Database();
@@ -34,20 +56,75 @@ public:
     void Squish();
     void Unsquish();
     uint64_t GetElem(uint64_t i);
+
+    // Sets record i to val, rewriting its digits in place whether or not
+    // the DB is squished. Returns the entries that changed, from which
+    // SimplePIR::UpdateHint builds the matching patch to the hint.
+    std::vector<DBEntryDelta> Update(uint64_t i, uint64_t val);
+
+    // Like Update, but records the change in Overlay instead of the
+    // matrix, so the DB never has to be unsquished and stays readable by
+    // Answer, which adds Overlay's contribution to every answer. Works on
+    // mapped DBs too.
+    std::vector<DBEntryDelta> Stage(uint64_t i, uint64_t val);
+
+    // Folds Overlay into the matrix, a bounded batch at a time, so it can
+    // run on a background thread while queries are being answered.
+    void Compact();
+
+    // Held by Answer while it reads the matrix and Overlay; Update, Stage,
+    // Compact and Append take the same lock exclusively.
+    std::shared_lock<std::shared_mutex> ReadLock();
+
+    // Appends vals as records Num, Num + 1, ..., adding zeroed row blocks
+    // to the matrix when they no longer fit. Rows that existed before are
+    // only ever changed where the last block was partly empty; those
+    // changes are returned, as for Update. SimplePIR::Append rebinds
+    // Answer's pool to the grown matrix.
+    std::vector<DBEntryDelta> Append(const std::vector<uint64_t>& vals);
+
+    // The DB matrix, whether it lives in Data or in a mapped file.
+    MatrixView View();
+
+private:
+    std::shared_mutex lock;
+
+    std::vector<DBEntryDelta> rewrite(uint64_t i, uint64_t val, bool staged);
+    std::vector<DBEntryDelta>::iterator overlayAt(uint64_t row, uint64_t col);
+    uint64_t current(uint64_t row, uint64_t col);
+    void compactLocked(size_t n);
+    uint64_t entry(uint64_t row, uint64_t col);
+    void setEntry(uint64_t row, uint64_t col, uint64_t val);
 };
 
 // Function declarations
+void PickSquishing(DBinfo& info);
+
 uint64_t ReconstructElem(const std::vector<uint64_t>& vals, uint64_t index, const DBinfo& info);
 
 std::tuple<uint64_t, uint64_t> ApproxSquareDatabaseDims(uint64_t N, uint64_t row_length, uint64_t p);
 
 std::tuple<uint64_t, uint64_t> ApproxDatabaseDims(uint64_t N, uint64_t row_length, uint64_t p, uint64_t lower_bound_m);
 
+// Like ApproxSquareDatabaseDims, but aims for m / l close to aspect
+// instead of 1 (e.g. the ratio the autotuner found fastest on this host).
+std::tuple<uint64_t, uint64_t> ApproxDatabaseDimsWithAspect(uint64_t N, uint64_t row_length, uint64_t p, double aspect);
+
+// The DBinfo SetupDB gives a DB of Num records of row_length bits under
+// p, before squishing: Ne, X and Packing as Num_DB_entries lays them out.
+DBinfo DBLayout(uint64_t Num, uint64_t row_length, const Params* p);
+
 Database* SetupDB(uint64_t Num, uint64_t row_length, const Params* p);
 
 Database* MakeRandomDB(uint64_t Num, uint64_t row_length, const Params* p);
 
 Database* MakeDB(uint64_t Num, uint64_t row_length, const Params* p, const std::vector<uint64_t>& vals);
 
+// Rows [first, first + num) of DB * A, counting staged writes: the hint of
+// SimplePIR, and H1 of DoublePIR. A squished DB is unpacked a few rows at a
+// time and Setup's p/2 shift undone, so the unsquished DB never exists in
+// full. The rows are split over pool's workers as Answer splits them.
+Matrix HintRows(Database* DB, Matrix& A, uint64_t first, uint64_t num, AnswerPool& pool);
+
 
-#endif // PIR_H
+#endif // DATABASE_H
@@ -0,0 +1,305 @@
+#include "db_file.h"
+#include "database.h"
+
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char DB_FILE_MAGIC[8] = {'S', 'P', 'I', 'R', 'D', 'B', 0, 0};
+static const uint32_t DB_FILE_BOM = 0x01020304;
+static const uint64_t DB_FILE_DATA_OFFSET = 4096;
+
+struct DBFileHeader {
+    char Magic[8];
+    uint32_t Version;
+    uint32_t ByteOrder;
+    uint64_t Info[10];
+    uint64_t Rows;
+    uint64_t Cols;
+    uint64_t DataOffset;
+};
+
+static_assert(sizeof(DBFileHeader) == 120, "DB file header layout changed");
+
+MappedDB::MappedDB(void* base, size_t len, uint32_t* data, uint64_t rows, uint64_t cols,
+                   std::function<void()> release)
+    : base(base), len(len), data(data), rows(rows), cols(cols), release(release) {}
+
+MappedDB::~MappedDB() {
+    munmap(base, len);
+    if (release) {
+        release();
+    }
+}
+
+MatrixView MappedDB::View() const {
+    return MatrixView(data, rows, cols, cols);
+}
+
+static DBFileHeader MakeHeader(const DBinfo& in, const MatrixView& m) {
+    DBFileHeader h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.Magic, DB_FILE_MAGIC, sizeof(h.Magic));
+    h.Version = DB_FILE_VERSION;
+    h.ByteOrder = DB_FILE_BOM;
+    uint64_t info[10] = {in.Num, in.Row_length, in.Packing, in.Ne, in.X,
+                         in.P, in.Logq, in.Basis, in.Squishing, in.Cols};
+    std::memcpy(h.Info, info, sizeof(info));
+    h.Rows = m.Rows;
+    h.Cols = m.Cols;
+    h.DataOffset = DB_FILE_DATA_OFFSET;
+    return h;
+}
+
+// Throws unless h describes a DB image that fits in size bytes.
+static void CheckHeader(const DBFileHeader& h, uint64_t size) {
+    if (std::memcmp(h.Magic, DB_FILE_MAGIC, sizeof(h.Magic)) != 0) {
+        throw std::runtime_error("Not a DB file");
+    }
+    if (h.Version != DB_FILE_VERSION || h.ByteOrder != DB_FILE_BOM) {
+        throw std::runtime_error("Unsupported DB file version or byte order");
+    }
+    uint64_t bytes = h.Rows * h.Cols * sizeof(uint32_t);
+    if (h.DataOffset % sysconf(_SC_PAGESIZE) != 0 || size < h.DataOffset + bytes) {
+        throw std::runtime_error("Truncated DB file");
+    }
+}
+
+// A squished Database answering from data, which mapped keeps alive.
+static Database* MappedDatabase(const DBFileHeader& h, std::shared_ptr<MappedDB> mapped) {
+    Database* D = new Database();
+    D->Info = DBinfo(h.Info[0], h.Info[1], h.Info[2], h.Info[3], h.Info[4],
+                     h.Info[5], h.Info[6], h.Info[7], h.Info[8], h.Info[9]);
+    D->Mapped = mapped;
+    D->Squished = true;
+    return D;
+}
+
+void SaveSquishedDB(Database* DB, const std::string& path) {
+    if (!DB->Squished) {
+        throw std::runtime_error("DB must be squished before saving");
+    }
+    auto guard = DB->ReadLock();
+    if (!DB->Overlay.empty()) {
+        throw std::runtime_error("DB has staged writes; Compact it before saving");
+    }
+    MatrixView m = DB->View();
+    DBFileHeader h = MakeHeader(DB->Info, m);
+
+    // Write to a temporary name and rename, so readers never see a
+    // half-written file.
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+        if (!f.is_open()) {
+            throw std::runtime_error("Error creating DB file");
+        }
+        std::vector<char> header(DB_FILE_DATA_OFFSET, 0);
+        std::memcpy(header.data(), &h, sizeof(h));
+        f.write(header.data(), header.size());
+        for (uint64_t i = 0; i < m.Rows; i++) {
+            f.write(reinterpret_cast<const char*>(m.Row(i)), m.Cols * sizeof(uint32_t));
+        }
+        if (!f.good()) {
+            throw std::runtime_error("Error writing DB file");
+        }
+    }
+    if (rename(tmp.c_str(), path.c_str()) != 0) {
+        throw std::runtime_error("Error renaming DB file");
+    }
+}
+
+Database* LoadSquishedDB(const std::string& path, bool huge_pages) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Error opening DB file");
+    }
+    struct stat st;
+    DBFileHeader h;
+    if (fstat(fd, &st) != 0 || pread(fd, &h, sizeof(h), 0) != static_cast<ssize_t>(sizeof(h))) {
+        close(fd);
+        throw std::runtime_error("Error reading DB file header");
+    }
+    try {
+        CheckHeader(h, st.st_size);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+
+    size_t len = h.DataOffset + h.Rows * h.Cols * sizeof(uint32_t);
+    void* base = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        throw std::runtime_error("Error mapping DB file");
+    }
+    if (huge_pages) {
+        madvise(base, len, MADV_HUGEPAGE);
+    }
+    // Answer streams the whole matrix on every pass; start faulting it in.
+    madvise(base, len, MADV_WILLNEED);
+
+    uint32_t* data = reinterpret_cast<uint32_t*>(static_cast<char*>(base) + h.DataOffset);
+    return MappedDatabase(h, std::make_shared<MappedDB>(base, len, data, h.Rows, h.Cols));
+}
+
+// Shared-memory segments hold a control page followed by a DB image laid
+// out exactly like a DB file and then the hint, page-aligned. Only the
+// control page is ever mapped writable after creation.
+static const char SHARED_DB_MAGIC[8] = {'S', 'P', 'I', 'R', 'S', 'H', 'M', 0};
+static const uint64_t SHARED_DB_IMAGE_OFFSET = 4096;
+
+struct SharedDBControl {
+    char Magic[8];
+    std::atomic<uint64_t> Ready;
+    std::atomic<uint64_t> Refs;
+    uint64_t Size;
+    uint64_t HintOffset;
+    uint64_t HintRows;
+    uint64_t HintCols;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "Shared DB refcount must be lock-free to live in shared memory");
+
+static uint64_t PageAlign(uint64_t n) {
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    return (n + page - 1) / page * page;
+}
+
+// Maps segment name, taking a reference on it unless the caller already
+// owns one (the creator). The returned Database drops the reference when
+// destroyed, and whoever drops the last one removes the segment.
+static Database* AttachSegment(const std::string& name, MatrixView* hint, bool take_ref) {
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0) {
+        throw std::runtime_error("Error opening shared DB");
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < SHARED_DB_IMAGE_OFFSET) {
+        close(fd);
+        throw std::runtime_error("Not a shared DB");
+    }
+    void* ctl_base = mmap(nullptr, SHARED_DB_IMAGE_OFFSET, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ctl_base == MAP_FAILED) {
+        close(fd);
+        throw std::runtime_error("Error mapping shared DB");
+    }
+    SharedDBControl* ctl = static_cast<SharedDBControl*>(ctl_base);
+    auto fail = [&](const char* msg) {
+        munmap(ctl_base, SHARED_DB_IMAGE_OFFSET);
+        close(fd);
+        throw std::runtime_error(msg);
+    };
+    if (std::memcmp(ctl->Magic, SHARED_DB_MAGIC, sizeof(ctl->Magic)) != 0 ||
+        ctl->Ready.load(std::memory_order_acquire) == 0) {
+        fail("Shared DB is not ready");
+    }
+    if (take_ref) {
+        // A count of zero means the last user is removing the segment.
+        uint64_t refs = ctl->Refs.load();
+        do {
+            if (refs == 0) {
+                fail("Shared DB is being removed");
+            }
+        } while (!ctl->Refs.compare_exchange_weak(refs, refs + 1));
+    }
+
+    auto release = [ctl, name] {
+        if (ctl->Refs.fetch_sub(1) == 1) {
+            shm_unlink(name.c_str());
+        }
+        munmap(ctl, SHARED_DB_IMAGE_OFFSET);
+    };
+    uint64_t len = ctl->Size - SHARED_DB_IMAGE_OFFSET;
+    void* base = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, SHARED_DB_IMAGE_OFFSET);
+    close(fd);
+    if (base == MAP_FAILED) {
+        release();
+        throw std::runtime_error("Error mapping shared DB");
+    }
+
+    // Until MappedDB owns base, failures must unmap it and drop the
+    // reference themselves.
+    std::shared_ptr<MappedDB> mapped;
+    const DBFileHeader& h = *static_cast<const DBFileHeader*>(base);
+    try {
+        CheckHeader(h, len);
+        uint32_t* data = reinterpret_cast<uint32_t*>(static_cast<char*>(base) + h.DataOffset);
+        mapped = std::make_shared<MappedDB>(base, len, data, h.Rows, h.Cols, release);
+    } catch (...) {
+        munmap(base, len);
+        release();
+        throw;
+    }
+    if (hint != nullptr) {
+        char* image = static_cast<char*>(base);
+        uint32_t* hdata = reinterpret_cast<uint32_t*>(image + ctl->HintOffset - SHARED_DB_IMAGE_OFFSET);
+        *hint = MatrixView(hdata, ctl->HintRows, ctl->HintCols, ctl->HintCols);
+    }
+    return MappedDatabase(h, mapped);
+}
+
+Database* CreateSharedDB(Database* DB, Matrix& hint, const std::string& name, MatrixView* shared_hint) {
+    if (!DB->Squished) {
+        throw std::runtime_error("DB must be squished before sharing");
+    }
+    auto guard = DB->ReadLock();
+    if (!DB->Overlay.empty()) {
+        throw std::runtime_error("DB has staged writes; Compact it before sharing");
+    }
+    MatrixView m = DB->View();
+    DBFileHeader h = MakeHeader(DB->Info, m);
+    uint64_t hint_offset = PageAlign(SHARED_DB_IMAGE_OFFSET + h.DataOffset + m.Rows * m.Cols * sizeof(uint32_t));
+    uint64_t size = hint_offset + hint.Rows * hint.Cols * sizeof(uint32_t);
+
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+        throw std::runtime_error("Error creating shared DB");
+    }
+    void* base = MAP_FAILED;
+    if (ftruncate(fd, size) == 0) {
+        base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (base == MAP_FAILED) {
+        shm_unlink(name.c_str());
+        throw std::runtime_error("Error sizing shared DB");
+    }
+
+    char* seg = static_cast<char*>(base);
+    char* image = seg + SHARED_DB_IMAGE_OFFSET;
+    std::memcpy(image, &h, sizeof(h));
+    for (uint64_t i = 0; i < m.Rows; i++) {
+        std::memcpy(image + h.DataOffset + i * m.Cols * sizeof(uint32_t), m.Row(i), m.Cols * sizeof(uint32_t));
+    }
+    std::memcpy(seg + hint_offset, hint.Data.data(), hint.Data.size() * sizeof(uint32_t));
+
+    SharedDBControl* ctl = new (seg) SharedDBControl;
+    std::memcpy(ctl->Magic, SHARED_DB_MAGIC, sizeof(ctl->Magic));
+    ctl->Size = size;
+    ctl->HintOffset = hint_offset;
+    ctl->HintRows = hint.Rows;
+    ctl->HintCols = hint.Cols;
+    ctl->Refs.store(1);
+    ctl->Ready.store(1, std::memory_order_release);
+    munmap(base, size);
+
+    try {
+        return AttachSegment(name, shared_hint, false);
+    } catch (...) {
+        shm_unlink(name.c_str());
+        throw;
+    }
+}
+
+Database* AttachSharedDB(const std::string& name, MatrixView* hint) {
+    return AttachSegment(name, hint, true);
+}
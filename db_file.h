@@ -0,0 +1,79 @@
+#ifndef DB_FILE_H
+#define DB_FILE_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include "matrix.h"
+
+class Database;
+
+// On-disk format for a squished database, i.e. the state Setup leaves the
+// DB in (entries shifted by p/2 and packed Info.Squishing per word). The
+// file is a fixed header followed, at a page-aligned offset, by the packed
+// matrix as little-endian 32-bit words in row-major order:
+//
+//   offset  size  field
+//        0     8  magic "SPIRDB\0\0"
+//        8     4  format version (DB_FILE_VERSION)
+//       12     4  byte-order mark 0x01020304
+//       16    80  DBinfo: Num, Row_length, Packing, Ne, X, P, Logq,
+//                 Basis, Squishing, Cols (uint64 each)
+//       96     8  rows of the packed matrix
+//      104     8  columns of the packed matrix
+//      112     8  byte offset of the matrix data
+//
+// Readers reject files with another version, so the layout may change as
+// long as DB_FILE_VERSION is bumped.
+const uint32_t DB_FILE_VERSION = 1;
+
+// Read-only mapping of a DB file's matrix. Unmapped on destruction, after
+// which release, if set, is called.
+class MappedDB {
+public:
+    MappedDB(void* base, size_t len, uint32_t* data, uint64_t rows, uint64_t cols,
+             std::function<void()> release = nullptr);
+    ~MappedDB();
+
+    MappedDB(const MappedDB&) = delete;
+    MappedDB& operator=(const MappedDB&) = delete;
+
+    MatrixView View() const;
+
+private:
+    void* base;
+    size_t len;
+    uint32_t* data;
+    uint64_t rows;
+    uint64_t cols;
+    std::function<void()> release;
+};
+
+// Writes DB, which must already be squished, to path.
+void SaveSquishedDB(Database* DB, const std::string& path);
+
+// Maps a file written by SaveSquishedDB read-only and returns a Database
+// that answers queries straight from the mapping; nothing is copied, and
+// processes serving the same file share its page cache. With huge_pages,
+// the mapping is advised to use transparent huge pages (effective on
+// hugetlbfs, tmpfs, or kernels with read-only THP for file mappings).
+Database* LoadSquishedDB(const std::string& path, bool huge_pages = false);
+
+// Copies DB, which must be squished, and its hint into a new POSIX
+// shared-memory segment called name (e.g. "/spir-db"), so that server
+// processes on the host can all answer from one copy of it. Returns a
+// Database answering from the segment; if shared_hint is set, it is
+// pointed at the segment's read-only copy of the hint. The segment is
+// reference counted: it starts with one reference, held by the returned
+// Database, and is removed when the last Database using it is deleted.
+// References held by processes that die without deleting theirs are
+// never dropped; remove such segments with shm_unlink.
+Database* CreateSharedDB(Database* DB, Matrix& hint, const std::string& name,
+                         MatrixView* shared_hint = nullptr);
+
+// Maps the segment created by CreateSharedDB read-only and takes a
+// reference on it, dropped when the returned Database is deleted.
+Database* AttachSharedDB(const std::string& name, MatrixView* hint = nullptr);
+
+#endif // DB_FILE_H
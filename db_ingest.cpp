@@ -0,0 +1,214 @@
+#include "db_ingest.h"
+#include "database.h"
+#include "params.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+// Records buffered per chunk; the reader fills one chunk of this size
+// while the workers split the other.
+static const uint64_t INGEST_CHUNK_RECORDS = 1ULL << 23;
+
+FileRecordReader::FileRecordReader(const std::string& path) {
+    f = fopen(path.c_str(), "rb");
+    if (f == nullptr) {
+        throw std::runtime_error("Error opening record file");
+    }
+    // Reads already come in multi-megabyte chunks; stdio buffering would
+    // only add a copy.
+    setvbuf(f, nullptr, _IONBF, 0);
+}
+
+FileRecordReader::~FileRecordReader() {
+    fclose(f);
+}
+
+uint64_t FileRecordReader::Read(uint64_t* out, uint64_t max) {
+    uint64_t n = fread(out, sizeof(uint64_t), max, f);
+    if (n < max && ferror(f)) {
+        throw std::runtime_error("Error reading record file");
+    }
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    for (uint64_t i = 0; i < n; i++) {
+        out[i] = __builtin_bswap64(out[i]);
+    }
+#endif
+    return n;
+}
+
+VectorRecordReader::VectorRecordReader(const std::vector<uint64_t>& vals)
+    : vals(vals), pos(0) {}
+
+uint64_t VectorRecordReader::Read(uint64_t* out, uint64_t max) {
+    uint64_t n = std::min(max, static_cast<uint64_t>(vals.size()) - pos);
+    std::copy(vals.begin() + pos, vals.begin() + pos + n, out);
+    pos += n;
+    return n;
+}
+
+// Layout of the squished matrix being filled. A "group" is the set of
+// records that lands in one block of Ne DB rows (or one DB row, when
+// several records are packed per Z_p element), so groups map to disjoint
+// rows and can be filled by different threads without locking.
+struct IngestLayout {
+    uint64_t M;           // DB width, in Z_p elements
+    uint64_t Ne;          // DB rows per group
+    uint64_t Packing;     // records per Z_p element, or 0
+    uint64_t RowLength;
+    uint64_t Basis;
+    uint64_t Squishing;
+    uint64_t SqCols;      // words per squished row
+    uint64_t P;
+    uint64_t PInv;        // floor((2^64 - 1) / P)
+    uint32_t* Out;
+
+    uint64_t RecordsPerGroup() const {
+        return M * std::max<uint64_t>(Packing, 1);
+    }
+
+    void Put(uint64_t row, uint64_t col, uint32_t val) const {
+        Out[row * SqCols + col / Squishing] |= val << (Basis * (col % Squishing));
+    }
+};
+
+// Splits recs (n records, starting at group g) into base-P digits, one
+// digit of every record per pass so that each pass writes a single DB row
+// front to back. Division by P is a multiply by its reciprocal and at most
+// one correction, which the compiler cannot do for a runtime P on its own.
+// This stays scalar: x86 has no packed 64x64->128-bit multiply, so a vector
+// version needs a multi-limb division per digit, and one thread already
+// converts ~200 MB/s of 32-bit records, ahead of storage once the chunk is
+// split over ingestChunk's workers.
+static void ingestDigits(const IngestLayout& l, uint64_t g, uint64_t* recs, uint64_t n) {
+    for (uint64_t start = 0; start < n; start += l.M, g++) {
+        uint64_t cols = std::min(l.M, n - start);
+        uint64_t* v = recs + start;
+        for (uint64_t j = 0; j < l.Ne; j++) {
+            uint64_t row = g * l.Ne + j;
+            for (uint64_t c = 0; c < cols; c++) {
+                uint64_t q = static_cast<uint64_t>((static_cast<unsigned __int128>(v[c]) * l.PInv) >> 64);
+                uint64_t d = v[c] - q * l.P;
+                if (d >= l.P) {
+                    d -= l.P;
+                    q++;
+                }
+                v[c] = q;
+                l.Put(row, c, static_cast<uint32_t>(d));
+            }
+        }
+    }
+}
+
+// Packs l.Packing consecutive records per Z_p element, low record first,
+// as MakeDB does. A trailing partial element keeps its missing records 0.
+static void ingestPacked(const IngestLayout& l, uint64_t g, const uint64_t* recs, uint64_t n) {
+    uint64_t at = 0;
+    for (uint64_t i = 0; i < n; at++) {
+        uint64_t cur = 0;
+        for (uint64_t t = 0; t < l.Packing && i < n; t++, i++) {
+            cur += recs[i] << (l.RowLength * t);
+        }
+        l.Put(g + at / l.M, at % l.M, static_cast<uint32_t>(cur));
+    }
+}
+
+// Hands each of nThreads workers a contiguous run of whole groups from a
+// chunk of n records starting at group g.
+static void ingestChunk(const IngestLayout& l, uint64_t g, uint64_t* recs, uint64_t n,
+                        uint64_t nThreads, std::vector<std::thread>& workers) {
+    uint64_t per = l.RecordsPerGroup();
+    uint64_t groups = (n + per - 1) / per;
+    uint64_t step = (groups + nThreads - 1) / nThreads;
+    for (uint64_t first = 0; first < groups; first += step) {
+        uint64_t begin = first * per;
+        uint64_t len = std::min(step * per, n - begin);
+        workers.emplace_back([&l, g, first, recs, begin, len] {
+            if (l.Packing > 0) {
+                ingestPacked(l, g + first, recs + begin, len);
+            } else {
+                ingestDigits(l, g + first, recs + begin, len);
+            }
+        });
+    }
+}
+
+Database* IngestDB(RecordReader& in, uint64_t Num, uint64_t row_length, const Params* p,
+                   uint64_t nThreads) {
+    Database* D = SetupDB(Num, row_length, p);
+    PickSquishing(D->Info);
+    D->Info.Cols = p->M;
+    if (D->Info.P > (1ULL << D->Info.Basis) || D->Info.Logq < D->Info.Basis * D->Info.Squishing) {
+        delete D;
+        throw std::runtime_error("Bad params");
+    }
+
+    IngestLayout l;
+    l.M = p->M;
+    l.Ne = D->Info.Ne;
+    l.Packing = D->Info.Packing;
+    l.RowLength = row_length;
+    l.Basis = D->Info.Basis;
+    l.Squishing = D->Info.Squishing;
+    l.SqCols = (p->M + l.Squishing - 1) / l.Squishing;
+    l.P = D->Info.P;
+    l.PInv = UINT64_MAX / l.P;
+    D->Data = new Matrix(p->L, l.SqCols);
+    l.Out = D->Data->Data.data();
+
+    if (nThreads == 0) {
+        nThreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    uint64_t per = l.RecordsPerGroup();
+    uint64_t chunk = std::max<uint64_t>(1, INGEST_CHUNK_RECORDS / per) * per;
+    std::vector<uint64_t> bufs[2] = {std::vector<uint64_t>(chunk), std::vector<uint64_t>(chunk)};
+    std::vector<std::thread> workers;
+
+    uint64_t read = 0;
+    uint64_t group = 0;
+    int cur = 0;
+    try {
+        while (read < Num) {
+            // Fill a whole chunk (the reader may return short counts), so
+            // every chunk but the last starts on a group boundary.
+            uint64_t want = std::min(chunk, Num - read);
+            uint64_t n = 0;
+            while (n < want) {
+                uint64_t got = in.Read(bufs[cur].data() + n, want - n);
+                if (got == 0) {
+                    break;
+                }
+                n += got;
+            }
+            for (auto& w : workers) {
+                w.join();
+            }
+            workers.clear();
+            if (n < want) {
+                throw std::runtime_error("Bad input DB");
+            }
+            ingestChunk(l, group, bufs[cur].data(), n, nThreads, workers);
+            read += n;
+            group += n / per;
+            cur ^= 1;
+        }
+        for (auto& w : workers) {
+            w.join();
+        }
+        workers.clear();
+        uint64_t extra;
+        if (in.Read(&extra, 1) != 0) {
+            throw std::runtime_error("Bad input DB");
+        }
+    } catch (...) {
+        for (auto& w : workers) {
+            w.join();
+        }
+        delete D;
+        throw;
+    }
+
+    D->Squished = true;
+    return D;
+}
@@ -0,0 +1,54 @@
+#ifndef DB_INGEST_H
+#define DB_INGEST_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+class Database;
+class Params;
+
+// A stream of DB records, consumed in chunks.
+class RecordReader {
+public:
+    virtual ~RecordReader() {}
+
+    // Copies up to max records into out; returns how many, 0 at the end.
+    virtual uint64_t Read(uint64_t* out, uint64_t max) = 0;
+};
+
+// Records stored as consecutive little-endian uint64 values.
+class FileRecordReader : public RecordReader {
+public:
+    explicit FileRecordReader(const std::string& path);
+    ~FileRecordReader();
+
+    uint64_t Read(uint64_t* out, uint64_t max) override;
+
+private:
+    FILE* f;
+};
+
+// Records already in memory, e.g. to ingest the vals that MakeDB takes.
+class VectorRecordReader : public RecordReader {
+public:
+    explicit VectorRecordReader(const std::vector<uint64_t>& vals);
+
+    uint64_t Read(uint64_t* out, uint64_t max) override;
+
+private:
+    const std::vector<uint64_t>& vals;
+    uint64_t pos;
+};
+
+// Builds the same DB as MakeDB, but from a record stream and directly in
+// the squished layout that Setup would leave it in, so neither the full
+// vals vector nor the unsquished matrix is ever held in memory. Chunks of
+// whole DB rows are read on the calling thread while the previous chunk
+// is split into base-p digits and packed by nThreads workers (0 = one
+// per core). Setup recognizes the result as already squished.
+Database* IngestDB(RecordReader& in, uint64_t Num, uint64_t row_length, const Params* p,
+                   uint64_t nThreads = 0);
+
+#endif // DB_INGEST_H
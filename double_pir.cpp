@@ -0,0 +1,426 @@
+#include "double_pir.h"
+#include "pir.h"
+#include "params.h"
+#include "database.h"
+#include "answer_pool.h"
+#include "autotune.h"
+#include "packing.h"
+#include "utils.h"
+#include <iostream>
+#include <string>
+#include <cstdint>
+#include <vector>
+#include <stdexcept>
+#include <utility>
+#include <algorithm>
+#include <memory>
+#include <tuple>
+
+std::string DoublePIR::Name() const {
+    return "DoublePIR";
+}
+
+Params DoublePIR::PickParams(uint64_t N, uint64_t d, uint64_t n, uint64_t logq) {
+    std::shared_ptr<const ParamsTable> table = LWEParamsTable();
+    Params best;
+    ParamsCost best_cost{};
+    bool found = false;
+
+    for (const LWEParamsEntry* row : table->Rows(n, logq)) {
+        uint64_t max_samples = uint64_t(1) << row->LogM;
+        for (uint64_t mod_p : CandidateModuli(row->PDouble)) {
+            auto [l, m] = ApproxSquareDatabaseDims(N, d, mod_p);
+            uint64_t samples = std::max(l, m);
+            if (samples > max_samples) {
+                continue;
+            }
+            const LWEParamsEntry* used = table->Find(n, logq, samples);
+            Params p(n, used->Sigma, l, m, logq, mod_p);
+            ParamsCost c = Cost(p, N, d);
+            if (!found || std::make_tuple(c.ScanBytes, c.HintBytes) <
+                              std::make_tuple(best_cost.ScanBytes, best_cost.HintBytes)) {
+                best = p;
+                best_cost = c;
+                found = true;
+            }
+        }
+    }
+
+    if (!found) {
+        std::cerr << "Searched for " << n << ", " << N << " records of " << d << " bits, " << logq << ",\n";
+        throw std::runtime_error("No suitable params known!");
+    }
+    best.PrintParams();
+    return best;
+}
+
+ParamsCost DoublePIR::Cost(const Params& p, uint64_t N, uint64_t d) {
+    DBinfo info = DBLayout(N, d, &p);
+    PickSquishing(info);
+    uint64_t x = info.X;
+    uint64_t per = info.Ne / info.X;
+    uint64_t c = info.Squishing;
+    double delta = static_cast<double>(p.delta());
+
+    double elem_bytes = static_cast<double>(p.Logq) / 8.0;
+    double words = static_cast<double>(p.L) * static_cast<double>((p.M + c - 1) / c);
+    words *= ScanCostFactor(static_cast<double>(p.M) / static_cast<double>(p.L));
+    words += per * static_cast<double>(p.N) * delta * x * static_cast<double>((p.L / x + c - 1) / c);
+    double hint = static_cast<double>(p.N) * delta * x * static_cast<double>(p.N);
+    double upload = static_cast<double>(p.M + p.L / x * per);
+    double download = delta * x * static_cast<double>(p.N) + (static_cast<double>(p.N) + 1) * delta * x * per;
+    return ParamsCost{words * elem_bytes, hint * elem_bytes, upload * elem_bytes, download * elem_bytes};
+}
+
+Params DoublePIR::PickParamsGivenDimensions(uint64_t l, uint64_t m, uint64_t n, uint64_t logq) {
+    Params p;
+    p.N = n;
+    p.Logq = logq;
+    p.L = l;
+    p.M = m;
+    p.PickParams(true, {m, l});
+    return p;
+}
+
+void DoublePIR::GetBW(const DBinfo& info, const Params& p) {
+    uint64_t per = info.Ne / info.X;
+
+    double offlineDownload = static_cast<double>(p.N * p.delta() * info.X * p.N * p.Logq) / (8.0 * 1024.0);
+    std::cout << "\t\tOffline download: " << static_cast<uint64_t>(offlineDownload) << " KB\n";
+
+    double onlineUpload = static_cast<double>((p.M + p.L / info.X * per) * p.Logq) / (8.0 * 1024.0);
+    std::cout << "\t\tOnline upload: " << static_cast<uint64_t>(onlineUpload) << " KB\n";
+
+    uint64_t down = p.delta() * info.X * p.N + (p.N * p.delta() * info.X + p.delta() * info.X) * per;
+    double onlineDownload = static_cast<double>(down * p.Logq) / (8.0 * 1024.0);
+    std::cout << "\t\tOnline download: " << static_cast<uint64_t>(onlineDownload) << " KB\n";
+}
+
+State DoublePIR::Init(const DBinfo& info, const Params& p) {
+    Matrix* A1 = new Matrix(MatrixRand(p.M, p.N, p.Logq, 0));
+    Matrix* A2 = new Matrix(MatrixRand(p.L / info.X, p.N, p.Logq, 0));
+    return MakeState({A1, A2});
+}
+
+std::pair<State, CompressedState> DoublePIR::InitCompressed(const DBinfo& info, const Params& p) {
+    PRGKey* seed = new PRGKey(RandomPRGKey());
+    return InitCompressedSeeded(info, p, seed);
+}
+
+std::pair<State, CompressedState> DoublePIR::InitCompressedSeeded(const DBinfo& info, const Params& p, PRGKey* seed) {
+    return {ExpandSeed(info, p, seed->data()), MakeCompressedState(seed)};
+}
+
+State DoublePIR::DecompressState(const DBinfo& info, const Params& p, const CompressedState& comp) {
+    return ExpandSeed(info, p, comp.seed->data());
+}
+
+std::pair<State, Msg> DoublePIR::Setup(Database* DB, const State& shared, const Params& p) {
+    Matrix& A1 = *shared.data[0];
+    Matrix& A2 = *shared.data[1];
+    if (!DB->Overlay.empty()) {
+        throw std::runtime_error("DoublePIR does not serve staged writes; Compact first");
+    }
+
+    Matrix H1 = DB->Squished ? HintRows(DB, A1, 0, DB->View().Rows, DefaultAnswerPool()) : Matrix::MatrixMul(*DB->Data, A1);
+    if (!DB->Squished) {
+        DB->Data->Add(p.P / 2);
+        DB->Squish();
+    }
+    DefaultAnswerPool().Bind(DB->View());
+
+    // H2 is computed over centered digits, like H1 over the centered DB;
+    // the squished copy keeps them in [0, p).
+    H1.Transpose();
+    H1.Expand(p.P, p.delta());
+    H1.ConcatCols(DB->Info.X);
+    H1.Sub(p.P / 2);
+    Matrix* H2 = new Matrix(Matrix::MatrixMul(H1, A2));
+    H1.Add(p.P / 2);
+    H1.Squish(DB->Info.Basis, DB->Info.Squishing);
+
+    Matrix* H1sq = new Matrix(std::move(H1));
+    Matrix* A2T = new Matrix(PaddedTranspose(A2, DB->Info.Squishing));
+    return {MakeState({H1sq, A2T}), MakeMsg({H2})};
+}
+
+std::pair<State, double> DoublePIR::FakeSetup(Database* DB, const Params& p) {
+    const DBinfo& info = DB->Info;
+    double offlineDownload = static_cast<double>(p.N * p.delta() * info.X * p.N * p.Logq) / (8.0 * 1024.0);
+    std::cout << "\t\tOffline download: " << static_cast<uint64_t>(offlineDownload) << " KB\n";
+
+    if (!DB->Squished) {
+        DB->Data->Add(p.P / 2);
+        DB->Squish();
+    }
+    DefaultAnswerPool().Bind(DB->View());
+
+    Matrix* H1sq = new Matrix(MatrixRand(p.N * p.delta() * info.X, p.L / info.X, 0, p.P));
+    H1sq->Squish(info.Basis, info.Squishing);
+    Matrix A2 = MatrixRand(p.L / info.X, p.N, p.Logq, 0);
+    Matrix* A2T = new Matrix(PaddedTranspose(A2, info.Squishing));
+    return {MakeState({H1sq, A2T}), offlineDownload};
+}
+
+std::pair<State, Msg> DoublePIR::Query(uint64_t i, const State& shared, const Params& p, const DBinfo& info) {
+    MatrixPool& pool = MatrixPool::Local();
+    Matrix& A1 = *shared.data[0];
+    Matrix& A2 = *shared.data[1];
+    uint64_t per = info.Ne / info.X;
+    uint64_t e = i / std::max<uint64_t>(info.Packing, 1);
+
+    Matrix* s1 = new Matrix(pool.Get(p.N, 1));
+    Matrix* q1 = Encrypt(A1, *s1, e % p.M, p, info.Squishing);
+    State client = MakeState({s1});
+    Msg query = MakeMsg({q1});
+
+    for (uint64_t j = 0; j < per; j++) {
+        Matrix* s2 = new Matrix(pool.Get(p.N, 1));
+        Matrix* q2 = Encrypt(A2, *s2, (e / p.M) * per + j, p, info.Squishing);
+        client.data.push_back(s2);
+        query.data.push_back(q2);
+    }
+    return {client, query};
+}
+
+std::pair<State, Msg> DoublePIR::QueryCompressed(uint64_t i, const CompressedState& comp, const Params& p,
+                                                 const DBinfo& info) {
+    MatrixPool& pool = MatrixPool::Local();
+    const uint8_t* seed = comp.seed->data();
+    uint64_t per = info.Ne / info.X;
+    uint64_t e = i / std::max<uint64_t>(info.Packing, 1);
+
+    Matrix* s1 = new Matrix(pool.Get(p.N, 1));
+    Matrix* q1 = EncryptSeeded(seed, 0, p.M, *s1, e % p.M, p, info.Squishing);
+    State client = MakeState({s1});
+    Msg query = MakeMsg({q1});
+
+    for (uint64_t j = 0; j < per; j++) {
+        Matrix* s2 = new Matrix(pool.Get(p.N, 1));
+        Matrix* q2 = EncryptSeeded(seed, p.M, p.L / info.X, *s2, (e / p.M) * per + j, p, info.Squishing);
+        client.data.push_back(s2);
+        query.data.push_back(q2);
+    }
+    return {client, query};
+}
+
+void DoublePIR::ReleaseQuery(State& client, Msg& query) {
+    MatrixPool& pool = MatrixPool::Local();
+    for (Matrix* m : client.data) {
+        pool.Put(*m);
+        delete m;
+    }
+    for (Matrix* m : query.data) {
+        pool.Put(*m);
+        delete m;
+    }
+    client.data.clear();
+    query.data.clear();
+}
+
+Msg DoublePIR::Answer(Database* DB, const std::vector<Msg>& query, const State& server, const State&, const Params& p) {
+    auto guard = DB->ReadLock();
+    if (!DB->Overlay.empty()) {
+        throw std::runtime_error("DoublePIR does not serve staged writes; Compact first");
+    }
+    Matrix& H1 = *server.data[0];
+    Matrix& A2T = *server.data[1];
+    MatrixView db = DB->View();
+    const DBinfo& info = DB->Info;
+    uint64_t num_queries = query.size();
+    uint64_t batch_sz = db.Rows / num_queries;
+    AnswerPool& pool = DefaultAnswerPool();
+
+    Matrix a1(db.Rows, 1);
+    pool.Run([&](uint64_t w) {
+        RowRange mine = pool.Rows(w, db.Rows);
+        uint64_t last = 0;
+        for (size_t batch = 0; batch < num_queries; ++batch) {
+            uint64_t sz = (batch == num_queries - 1) ? db.Rows - last : batch_sz;
+            uint64_t start = std::max(last, mine.Start);
+            uint64_t end = std::min(last + sz, mine.End);
+            if (start < end) {
+                MatrixMulVecPackedInto(a1.SelectRows(start, end - start),
+                                       db.SelectRows(start, end - start),
+                                       *query[batch].data[0],
+                                       info.Basis,
+                                       info.Squishing);
+            }
+            last += sz;
+        }
+    });
+
+    a1.Transpose();
+    a1.Expand(p.P, p.delta());
+    a1.ConcatCols(info.X);
+    a1.Squish(info.Basis, info.Squishing);
+
+    Msg ans = MakeMsg({new Matrix(MatrixMulTransposedPacked(a1, A2T, info.Basis, info.Squishing))});
+    for (size_t batch = 0; batch < num_queries; ++batch) {
+        for (size_t j = 1; j < query[batch].data.size(); j++) {
+            Matrix& q2 = *query[batch].data[j];
+            Matrix* a2 = new Matrix(H1.Rows, 1);
+            pool.Run([&](uint64_t w) {
+                RowRange mine = pool.Rows(w, H1.Rows);
+                if (mine.Start < mine.End) {
+                    MatrixMulVecPackedInto(a2->SelectRows(mine.Start, mine.End - mine.Start),
+                                           H1.SelectRows(mine.Start, mine.End - mine.Start),
+                                           q2,
+                                           info.Basis,
+                                           info.Squishing);
+                }
+            });
+            ans.data.push_back(a2);
+            ans.data.push_back(new Matrix(MatrixMulVecPacked(a1, q2, info.Basis, info.Squishing)));
+        }
+    }
+    return ans;
+}
+
+uint64_t DoublePIR::Recover(uint64_t i, uint64_t batch_index, const Msg& offline, const Msg& query, const Msg& answer,
+                            const State& shared, const State& client, const Params& p, const DBinfo& info) {
+    Matrix& s1 = *client.data[0];
+    Matrix& H2 = *offline.data[0];
+    Matrix& A2 = *shared.data[1];
+    Matrix& h1 = *answer.data[0];
+    uint64_t per = info.Ne / info.X;
+    uint64_t delta = p.delta();
+    uint32_t ratio = static_cast<uint32_t>(p.P / 2);
+
+    // Storing digits + p/2 in squished form adds p/2 times the sum of
+    // the query to every answer entry: ratio * sum(q1) at the first
+    // level, ratio * sum(q2) at the second, and ratio times the column
+    // sums of A2 in h1.
+    uint32_t offset1 = ratio * ColumnSum(*query.data[0], p.M)[0];
+    std::vector<uint32_t> offsetA = ColumnSum(A2, A2.Rows);
+    for (uint32_t& o : offsetA) {
+        o *= ratio;
+    }
+
+    MatrixPool& pool = MatrixPool::Local();
+    Matrix interm = pool.Get(H2.Rows, 1);
+    std::vector<uint32_t> row(p.N);
+    std::vector<uint64_t> vals;
+    vals.reserve(info.Ne);
+    for (uint64_t j = 0; j < per; j++) {
+        Matrix& s2 = *client.data[1 + j];
+        Matrix& a2 = *answer.data[1 + 2 * (batch_index * per + j)];
+        Matrix& h2 = *answer.data[2 + 2 * (batch_index * per + j)];
+        uint32_t offset2 = ratio * ColumnSum(*query.data[1 + j], p.L / info.X)[0];
+        Matrix::MatrixMulInto(interm, H2, s2);
+
+        for (uint64_t x = 0; x < info.X; x++) {
+            // Row i1 of H1, digit by digit, and with it H1[i1] * s1.
+            uint32_t hs = 0;
+            for (uint64_t n = 0; n < p.N; n++) {
+                uint64_t r = (x * p.N + n) * delta;
+                uint32_t v = 0;
+                uint32_t place = 1;
+                for (uint64_t f = 0; f < delta; f++) {
+                    v += place * Digit(a2.Data[r + f] - offset2 - interm.Data[r + f], p);
+                    place *= static_cast<uint32_t>(p.P);
+                }
+                hs += v * s1.Data[n];
+            }
+
+            // Entry i1 of a1.
+            uint32_t a = 0;
+            uint32_t place = 1;
+            for (uint64_t f = 0; f < delta; f++) {
+                uint64_t r = x * delta + f;
+                uint32_t hr = 0;
+                for (uint64_t n = 0; n < p.N; n++) {
+                    hr += (h1.Data[r * h1.Cols + n] - offsetA[n]) * s2.Data[n];
+                }
+                a += place * Digit(h2.Data[r] - offset2 - hr, p);
+                place *= static_cast<uint32_t>(p.P);
+            }
+
+            uint32_t noised = a - offset1 - hs;
+            vals.push_back(p.Round(noised));
+        }
+    }
+    pool.Put(interm);
+
+    return ReconstructElem(vals, i, info);
+}
+
+void DoublePIR::Reset(Database* DB, const Params& p) {
+    if (DB->Mapped) {
+        return; // Mapped DBs are read-only and stay squished.
+    }
+    DB->Unsquish();
+    DB->Data->Sub(p.P / 2);
+}
+
+State DoublePIR::ExpandSeed(const DBinfo& info, const Params& p, const uint8_t* seed) {
+    Matrix A = MatrixFromSeed(seed, p.M + p.L / info.X, p.N, p.Logq);
+    Matrix* A1 = new Matrix(A.SelectRows(0, p.M));
+    Matrix* A2 = new Matrix(A.SelectRows(p.M, p.L / info.X));
+    return MakeState({A1, A2});
+}
+
+Matrix* DoublePIR::Encrypt(Matrix& A, Matrix& secret, uint64_t index, const Params& p, uint64_t squishing) {
+    if (index >= A.Rows) {
+        throw std::runtime_error("Index out of dimensions");
+    }
+    MatrixPool& pool = MatrixPool::Local();
+    uint64_t pad = (A.Rows % squishing != 0) ? squishing - (A.Rows % squishing) : 0;
+    MatrixRandInto(secret, p.Logq, 0);
+    Matrix err = pool.Get(A.Rows, 1);
+    MatrixGaussianInto(err);
+    Matrix* q = new Matrix(pool.Get(A.Rows, 1, A.Rows + pad));
+    Matrix::MatrixMulInto(*q, A, secret);
+    q->MatrixAdd(err);
+    pool.Put(err);
+    q->Data[index] += p.Delta();
+    if (pad != 0) {
+        q->AppendZeros(pad);
+    }
+    return q;
+}
+
+Matrix* DoublePIR::EncryptSeeded(const uint8_t* seed, uint64_t first, uint64_t rows, Matrix& secret,
+                                 uint64_t index, const Params& p, uint64_t squishing) {
+    if (index >= rows) {
+        throw std::runtime_error("Index out of dimensions");
+    }
+    MatrixPool& pool = MatrixPool::Local();
+    uint64_t pad = (rows % squishing != 0) ? squishing - (rows % squishing) : 0;
+    MatrixRandInto(secret, p.Logq, 0);
+    Matrix err = pool.Get(rows, 1);
+    MatrixGaussianInto(err);
+    Matrix* q = new Matrix(pool.Get(rows, 1, rows + pad));
+    MatrixMulVecSeededInto(*q, seed, p.N, p.Logq, secret, &err, first);
+    pool.Put(err);
+    q->Data[index] += p.Delta();
+    if (pad != 0) {
+        q->AppendZeros(pad);
+    }
+    return q;
+}
+
+Matrix DoublePIR::PaddedTranspose(const Matrix& A, uint64_t squishing) {
+    Matrix T = A;
+    uint64_t pad = (A.Rows % squishing != 0) ? squishing - (A.Rows % squishing) : 0;
+    if (pad != 0) {
+        Matrix zeros(pad, A.Cols);
+        T.Concat(zeros);
+    }
+    T.Transpose();
+    return T;
+}
+
+std::vector<uint32_t> DoublePIR::ColumnSum(const Matrix& m, uint64_t rows) {
+    std::vector<uint32_t> sum(m.Cols, 0);
+    for (uint64_t r = 0; r < rows; r++) {
+        for (uint64_t c = 0; c < m.Cols; c++) {
+            sum[c] += m.Data[r * m.Cols + c];
+        }
+    }
+    return sum;
+}
+
+uint32_t DoublePIR::Digit(uint32_t noised, const Params& p) {
+    return static_cast<uint32_t>((p.Round(noised) + p.P / 2) % p.P);
+}
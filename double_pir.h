@@ -0,0 +1,124 @@
+#ifndef DOUBLE_PIR_H
+#define DOUBLE_PIR_H
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "database.h"
+#include "matrix.h"
+#include "params.h"
+#include "pir_scheme.h"
+#include "utils.h"
+
+// SimplePIR with its hint compressed by a second round of PIR. The server
+// keeps the SimplePIR hint H1 = DB * A1 to itself and, instead of sending
+// it, treats its transpose, expanded into base-p digits, as a second
+// database: the client downloads only H2 = H1' * A2, which is
+// (N * delta * X)-by-N no matter how large the DB is. An answer is the
+// SimplePIR answer a1 = DB * q1, decomposed the same way, answered over
+// with a second query q2 together with the matching row of H1. Both levels
+// scan squished matrices with the packed kernels.
+//
+// Record i lives in DB element e = i / Packing (e = i for unpacked DBs),
+// in column e % M of rows (e / M) * Ne ... + Ne - 1. Those rows are
+// spread over X second-level blocks (X divides Ne; SetupDB makes X = Ne),
+// so the client sends Ne / X second-level queries, one per group of X
+// digits. Staged writes (Database::Overlay) are not supported: H1 is
+// computed once at Setup, so Compact before setting up.
+class DoublePIR : public PIR {
+public:
+    std::string Name() const override;
+
+    // Like SimplePIR::PickParams, scores a candidate for each row of the
+    // params table: its DoublePIR modulus and the largest p of every packed
+    // shape below that, each with square dimensions. Both levels draw LWE
+    // samples from the same row, so it has to allow max(l, m) of them. The
+    // cheapest candidate scans the fewest bytes over both levels, then has
+    // the smallest hint.
+    Params PickParams(uint64_t N, uint64_t d, uint64_t n, uint64_t logq) override;
+
+    // Per-query costs of p for N records of d bits: the server scans the
+    // squished DB (weighted as in SimplePIR::Cost) and then the squished
+    // (N * delta * X)-by-(L / X) H1, once per second-level query; the
+    // client downloads H2 once, uploads q1 and the Ne / X queries q2, and
+    // downloads h1 plus an (a2, h2) pair per q2.
+    static ParamsCost Cost(const Params& p, uint64_t N, uint64_t d);
+
+    Params PickParamsGivenDimensions(uint64_t l, uint64_t m, uint64_t n, uint64_t logq) override;
+
+    void GetBW(const DBinfo& info, const Params& p) override;
+
+    // Shared state: A1 (M-by-N), for the first level, and A2 ((L / X)-by-N),
+    // for the second.
+    State Init(const DBinfo& info, const Params& p) override;
+
+    std::pair<State, CompressedState> InitCompressed(const DBinfo& info, const Params& p) override;
+
+    // A1 and A2 are rows [0, M) and [M, M + L / X) of the matrix the seed
+    // expands to (see prg.h).
+    std::pair<State, CompressedState> InitCompressedSeeded(const DBinfo& info, const Params& p, PRGKey* seed) override;
+
+    State DecompressState(const DBinfo& info, const Params& p, const CompressedState& comp) override;
+
+    // The hint H2 goes to the client; the server keeps the squished H1'
+    // digits and A2', padded to a whole number of squished words, for
+    // Answer.
+    std::pair<State, Msg> Setup(Database* DB, const State& shared, const Params& p) override;
+
+    // As Setup, but with a random H1 and A2: enough to time answers and
+    // count bandwidth, not to recover them.
+    std::pair<State, double> FakeSetup(Database* DB, const Params& p) override;
+
+    // The client state is one secret per level: s1, then one s2 for each
+    // of the Ne / X second-level queries, which follow q1 in the message.
+    // Buffers come from this thread's MatrixPool, as in SimplePIR::Query.
+    std::pair<State, Msg> Query(uint64_t i, const State& shared, const Params& p, const DBinfo& info) override;
+
+    // Query for clients that hold only the seed: q1 and every q2 are
+    // computed with A1 and A2 expanded from it a few rows at a time, as in
+    // SimplePIR::QueryCompressed.
+    std::pair<State, Msg> QueryCompressed(uint64_t i, const CompressedState& comp, const Params& p,
+                                          const DBinfo& info) override;
+
+    // Hands the buffers of a finished query back to this thread's pool.
+    void ReleaseQuery(State& client, Msg& query);
+
+    // h1 = a1' * A2, then for every q2 of every batch, a2 = H1' * q2 and
+    // h2 = a1' * q2, in that order. The DB and H1 passes are split over
+    // the AnswerPool's workers.
+    Msg Answer(Database* DB, const std::vector<Msg>& query, const State& server, const State&, const Params& p) override;
+
+    // Undoes the second level to get back row i1 of H1 and entry i1 of a1,
+    // one group of X DB rows per q2, and decrypts the first level from
+    // those as SimplePIR::Recover does with the full hint.
+    uint64_t Recover(uint64_t i, uint64_t batch_index, const Msg& offline, const Msg& query, const Msg& answer,
+                     const State& shared, const State& client, const Params& p, const DBinfo& info) override;
+
+    void Reset(Database* DB, const Params& p) override;
+
+private:
+    static State ExpandSeed(const DBinfo& info, const Params& p, const uint8_t* seed);
+
+    // A * secret + err, with Delta added at position index, padded with
+    // zeros to a multiple of squishing entries. secret is filled in.
+    static Matrix* Encrypt(Matrix& A, Matrix& secret, uint64_t index, const Params& p, uint64_t squishing);
+
+    // As Encrypt, with A being rows [first, first + rows) of the matrix the
+    // seed expands to.
+    static Matrix* EncryptSeeded(const uint8_t* seed, uint64_t first, uint64_t rows, Matrix& secret,
+                                 uint64_t index, const Params& p, uint64_t squishing);
+
+    // A', with zero columns appended so that its width is a whole number
+    // of squished words; MatrixMulTransposedPacked needs that.
+    static Matrix PaddedTranspose(const Matrix& A, uint64_t squishing);
+
+    // Sums of the columns of the first rows rows of m.
+    static std::vector<uint32_t> ColumnSum(const Matrix& m, uint64_t rows);
+
+    // The digit in [0, p) whose centered value noised encrypts.
+    static uint32_t Digit(uint32_t noised, const Params& p);
+};
+
+#endif // DOUBLE_PIR_H
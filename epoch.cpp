@@ -0,0 +1,63 @@
+#include "epoch.h"
+#include "answer_pool.h"
+#include "database.h"
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Nice value for rebuild threads; answers run at the default of 0.
+static const int REBUILD_NICE = 10;
+
+Epoch::Epoch(uint64_t id, Database* db, Msg hint) : Id(id), DB(db), Hint(hint) {}
+
+Epoch::~Epoch() {
+    for (Matrix* m : Hint.data) {
+        delete m;
+    }
+    delete DB;
+}
+
+EpochManager::EpochManager() : last_id(0) {}
+
+EpochManager::~EpochManager() {
+    std::lock_guard<std::mutex> lock(rebuild_mu);
+    if (rebuilder.joinable()) {
+        rebuilder.join();
+    }
+}
+
+std::shared_ptr<const Epoch> EpochManager::Current() const {
+    return std::atomic_load(&current);
+}
+
+uint64_t EpochManager::Publish(Database* DB, Msg hint) {
+    std::lock_guard<std::mutex> lock(publish_mu);
+    // Place the new DB's pages before it takes traffic; answers still in
+    // flight on the old epoch are unaffected. Bound under the lock, so
+    // the pool ends up bound to whichever DB is published last.
+    DefaultAnswerPool().Bind(DB->View());
+
+    auto next = std::make_shared<const Epoch>(last_id + 1, DB, hint);
+    last_id++;
+    std::atomic_store(&current, next);
+    return next->Id;
+}
+
+std::future<uint64_t> EpochManager::Rebuild(std::function<std::pair<Database*, Msg>()> build) {
+    // Held while joining, so concurrent callers queue up behind the
+    // rebuild in progress; the rebuild itself only takes publish_mu.
+    std::lock_guard<std::mutex> lock(rebuild_mu);
+    if (rebuilder.joinable()) {
+        rebuilder.join();
+    }
+    auto task = std::make_shared<std::packaged_task<uint64_t()>>([this, build] {
+        // On Linux, nice applies to the calling thread only.
+        setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), REBUILD_NICE);
+        std::pair<Database*, Msg> next = build();
+        return Publish(next.first, next.second);
+    });
+    std::future<uint64_t> result = task->get_future();
+    rebuilder = std::thread([task] { (*task)(); });
+    return result;
+}
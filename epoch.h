@@ -0,0 +1,69 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include "utils.h"
+
+class Database;
+
+// One published version of the DB together with the hint clients need
+// for it. Owns both; they are freed when the last reader lets go.
+class Epoch {
+public:
+    Epoch(uint64_t id, Database* db, Msg hint);
+    ~Epoch();
+
+    Epoch(const Epoch&) = delete;
+    Epoch& operator=(const Epoch&) = delete;
+
+    const uint64_t Id;
+    Database* const DB;
+    const Msg Hint;
+};
+
+// Serves one epoch while the next is prepared elsewhere. Readers take the
+// current epoch with Current() and hold the pointer for the whole call,
+// so a swap never frees a DB that an in-flight Answer is reading; the old
+// epoch goes away when its last reader drops it.
+class EpochManager {
+public:
+    EpochManager();
+    ~EpochManager();
+
+    EpochManager(const EpochManager&) = delete;
+    EpochManager& operator=(const EpochManager&) = delete;
+
+    // The epoch being served, or nullptr before the first Publish.
+    std::shared_ptr<const Epoch> Current() const;
+
+    // Makes DB, which must already be set up (squished), and its hint the
+    // served epoch, and returns the new epoch's id. Ids increase by one
+    // per Publish, starting at 1.
+    uint64_t Publish(Database* DB, Msg hint);
+
+    // Runs build (typically MakeDB or IngestDB followed by Setup) on a
+    // background thread at lowered CPU priority, so that answers keep
+    // their latency, and publishes what it returns. The future yields
+    // the new epoch id, or the exception build threw. Waits for the
+    // previous rebuild first, so at most one runs at a time; safe to call
+    // from several threads.
+    std::future<uint64_t> Rebuild(std::function<std::pair<Database*, Msg>()> build);
+
+private:
+    std::shared_ptr<const Epoch> current;
+    std::mutex publish_mu;
+    uint64_t last_id;
+    // Guards rebuilder.
+    std::mutex rebuild_mu;
+    std::thread rebuilder;
+};
+
+#endif // EPOCH_H
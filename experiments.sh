@@ -2,5 +2,8 @@
 
 go test -bench PirVaryingDB -timeout 0 -run=^$ | tee results/our_pir_varying_db.txt
 LOG_N=33 D=1 go test -bench PirSingle -timeout 0 -run=^$ | tee results/our_pir_same_db_tput.txt
+LOG_N=33 D=1 go test -bench PirAllocPolicy -timeout 0 -run=^$ | tee results/our_pir_alloc_policy.txt
 go test -bench PirBatchLarge -timeout 0 -run=^$ | tee results/our_pir_batch.txt
+go test -bench PirCuckooBatch -timeout 0 -run=^$ | tee results/our_pir_cuckoo_batch.txt
+go test -bench PirCoalesced -timeout 0 -run=^$ | tee results/our_pir_coalesced.txt
 LOG_N=36 D=1 go test -bench PirSingle -timeout 0 -run=^$ | tee results/our_pir_ct_app.txt
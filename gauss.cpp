@@ -27,8 +27,9 @@ const std::vector<double> cdf_table = {
 
 // Gaussian Sample function
 int64_t GaussSample() {
-    std::random_device rd;
-    std::mt19937 mrand(rd());
+    // Seeded once per thread: a query draws M samples, and opening the
+    // random device for each of them dominated Query.
+    thread_local std::mt19937 mrand(std::random_device{}());
     std::uniform_real_distribution<double> dist(0.0, 1.0);
 
     int64_t x;
@@ -0,0 +1,241 @@
+#include "hint_cache.h"
+#include "database.h"
+#include "params.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char HINT_FILE_MAGIC[8] = {'S', 'P', 'I', 'R', 'H', 'I', 'N', 'T'};
+static const uint32_t HINT_FILE_VERSION = 1;
+
+// Hint files: this header, then Count pairs of uint64 (rows, cols), then
+// the matrices' entries as little-endian 32-bit words, in order.
+struct HintFileHeader {
+    char Magic[8];
+    uint32_t Version;
+    uint32_t Count;
+    uint64_t Key[2];
+};
+
+// Two independent multiply-mix lanes over 64-bit words. Runs at memory
+// speed, which matters because it reads the whole DB on every startup.
+class DigestBuilder {
+public:
+    DigestBuilder() : a(0x243F6A8885A308D3ULL), b(0x13198A2E03707344ULL), len(0) {}
+
+    void Add(uint64_t w) {
+        a = (a ^ w) * 0x9E3779B97F4A7C15ULL;
+        a ^= a >> 32;
+        b = (b + w) * 0xC2B2AE3D27D4EB4FULL;
+        b = (b << 31) | (b >> 33);
+        len++;
+    }
+
+    void Add(const uint32_t* words, uint64_t n) {
+        uint64_t i = 0;
+        for (; i + 2 <= n; i += 2) {
+            Add(static_cast<uint64_t>(words[i]) | (static_cast<uint64_t>(words[i + 1]) << 32));
+        }
+        if (i < n) {
+            Add(words[i]);
+        }
+    }
+
+    void Add(const std::string& s) {
+        Add(s.size());
+        for (size_t i = 0; i < s.size(); i++) {
+            Add(static_cast<uint8_t>(s[i]));
+        }
+    }
+
+    HintDigest Finish() {
+        Add(len);
+        return HintDigest{{Mix(a ^ (b >> 1)), Mix(b ^ (a << 1))}};
+    }
+
+private:
+    static uint64_t Mix(uint64_t x) {
+        x ^= x >> 33;
+        x *= 0xFF51AFD7ED558CCDULL;
+        x ^= x >> 33;
+        x *= 0xC4CEB9FE1A85EC53ULL;
+        x ^= x >> 33;
+        return x;
+    }
+
+    uint64_t a;
+    uint64_t b;
+    uint64_t len;
+};
+
+std::string HintDigest::Hex() const {
+    char buf[33];
+    snprintf(buf, sizeof(buf), "%016llx%016llx", static_cast<unsigned long long>(Words[0]),
+             static_cast<unsigned long long>(Words[1]));
+    return buf;
+}
+
+HintDigest DigestHintInputs(Database* DB, const uint8_t seed[PRG_SEED_BYTES], const Params& p,
+                            const std::string& scheme) {
+    DigestBuilder d;
+    d.Add(scheme);
+    const DBinfo& in = DB->Info;
+    for (uint64_t v : {in.Num, in.Row_length, in.Packing, in.Ne, in.X, in.P, in.Logq, in.Basis,
+                       in.Squishing, in.Cols}) {
+        d.Add(v);
+    }
+    for (uint64_t v : {p.N, p.L, p.M, p.Logq, p.P}) {
+        d.Add(v);
+    }
+    for (size_t i = 0; i < PRG_SEED_BYTES; i++) {
+        d.Add(seed[i]);
+    }
+
+    auto guard = DB->ReadLock();
+    MatrixView m = DB->View();
+    d.Add(DB->Squished ? 1 : 0);
+    d.Add(m.Rows);
+    d.Add(m.Cols);
+    for (uint64_t i = 0; i < m.Rows; i++) {
+        d.Add(m.Row(i), m.Cols);
+    }
+    for (const DBEntryDelta& e : DB->Overlay) {
+        d.Add(e.Row);
+        d.Add(e.Col);
+        d.Add(e.Delta);
+    }
+    return d.Finish();
+}
+
+HintCache::HintCache(const std::string& dir) : dir(dir) {
+    if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+        throw std::runtime_error("Error creating hint cache directory");
+    }
+}
+
+std::string HintCache::path(const std::string& file) const {
+    return dir + "/" + file;
+}
+
+void HintCache::Seed(uint8_t seed[PRG_SEED_BYTES]) const {
+    std::string file = path("seed");
+    std::ifstream in(file, std::ios::binary);
+    if (in.read(reinterpret_cast<char*>(seed), PRG_SEED_BYTES)) {
+        return;
+    }
+
+    std::random_device rd;
+    for (size_t i = 0; i < PRG_SEED_BYTES; i++) {
+        seed[i] = static_cast<uint8_t>(rd());
+    }
+    std::string tmp = file + "." + std::to_string(getpid()) + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(seed), PRG_SEED_BYTES);
+        if (!out.good()) {
+            unlink(tmp.c_str());
+            throw std::runtime_error("Error writing hint cache seed");
+        }
+    }
+    // If another process created the seed first, use theirs.
+    if (link(tmp.c_str(), file.c_str()) != 0) {
+        unlink(tmp.c_str());
+        std::ifstream again(file, std::ios::binary);
+        if (!again.read(reinterpret_cast<char*>(seed), PRG_SEED_BYTES)) {
+            throw std::runtime_error("Error reading hint cache seed");
+        }
+        return;
+    }
+    unlink(tmp.c_str());
+}
+
+bool HintCache::Load(const HintDigest& key, Msg& hint) const {
+    std::ifstream in(path(key.Hex() + ".hint"), std::ios::binary);
+    if (!in.is_open()) {
+        return false;
+    }
+    HintFileHeader h;
+    if (!in.read(reinterpret_cast<char*>(&h), sizeof(h)) ||
+        std::memcmp(h.Magic, HINT_FILE_MAGIC, sizeof(h.Magic)) != 0 ||
+        h.Version != HINT_FILE_VERSION || h.Key[0] != key.Words[0] || h.Key[1] != key.Words[1]) {
+        return false;
+    }
+    // Bound the header's counts by what the file holds before allocating,
+    // so a corrupt entry is a miss rather than a huge allocation.
+    std::streamoff start = in.tellg();
+    in.seekg(0, std::ios::end);
+    uint64_t left = static_cast<uint64_t>(in.tellg() - start);
+    in.seekg(start);
+    if (h.Count > left / (2 * sizeof(uint64_t))) {
+        return false;
+    }
+    std::vector<uint64_t> dims(2 * h.Count);
+    if (!in.read(reinterpret_cast<char*>(dims.data()), dims.size() * sizeof(uint64_t))) {
+        return false;
+    }
+    left -= dims.size() * sizeof(uint64_t);
+    for (uint32_t k = 0; k < h.Count; k++) {
+        uint64_t rows = dims[2 * k], cols = dims[2 * k + 1];
+        if (rows != 0 && cols > left / sizeof(uint32_t) / rows) {
+            return false;
+        }
+        left -= rows * cols * sizeof(uint32_t);
+    }
+
+    std::vector<Matrix*> mats;
+    for (uint32_t k = 0; k < h.Count; k++) {
+        Matrix* m = new Matrix(dims[2 * k], dims[2 * k + 1]);
+        mats.push_back(m);
+        if (!in.read(reinterpret_cast<char*>(m->Data.data()), m->Data.size() * sizeof(uint32_t))) {
+            for (Matrix* done : mats) {
+                delete done;
+            }
+            return false;
+        }
+    }
+    hint = MakeMsg(mats);
+    return true;
+}
+
+void HintCache::Store(const HintDigest& key, const Msg& hint) const {
+    HintFileHeader h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.Magic, HINT_FILE_MAGIC, sizeof(h.Magic));
+    h.Version = HINT_FILE_VERSION;
+    h.Count = hint.data.size();
+    h.Key[0] = key.Words[0];
+    h.Key[1] = key.Words[1];
+
+    std::string file = path(key.Hex() + ".hint");
+    std::string tmp = file + "." + std::to_string(getpid()) + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        if (!out.is_open()) {
+            throw std::runtime_error("Error creating hint cache entry");
+        }
+        out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+        for (const Matrix* m : hint.data) {
+            uint64_t dims[2] = {m->Rows, m->Cols};
+            out.write(reinterpret_cast<const char*>(dims), sizeof(dims));
+        }
+        for (const Matrix* m : hint.data) {
+            out.write(reinterpret_cast<const char*>(m->Data.data()), m->Data.size() * sizeof(uint32_t));
+        }
+        if (!out.good()) {
+            unlink(tmp.c_str());
+            throw std::runtime_error("Error writing hint cache entry");
+        }
+    }
+    if (rename(tmp.c_str(), file.c_str()) != 0) {
+        unlink(tmp.c_str());
+        throw std::runtime_error("Error renaming hint cache entry");
+    }
+}
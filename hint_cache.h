@@ -0,0 +1,51 @@
+#ifndef HINT_CACHE_H
+#define HINT_CACHE_H
+
+#include <cstdint>
+#include <string>
+
+#include "prg.h"
+#include "utils.h"
+
+class Database;
+class Params;
+
+// Identifies everything a hint depends on: the DB's contents and layout,
+// the seed of A, the params and the scheme. Not collision resistant
+// against someone choosing DBs on purpose; the cache directory belongs to
+// the operator, who also controls the DBs.
+struct HintDigest {
+    uint64_t Words[2];
+
+    std::string Hex() const;
+};
+
+HintDigest DigestHintInputs(Database* DB, const uint8_t seed[PRG_SEED_BYTES], const Params& p,
+                            const std::string& scheme);
+
+// Directory of hints computed by Setup, one file per HintDigest, so that
+// runs over an unchanged DB load the hint instead of recomputing DB * A.
+class HintCache {
+public:
+    // Creates dir if it does not exist yet.
+    explicit HintCache(const std::string& dir);
+
+    // Writes the seed of A that runs using this cache should expand A
+    // from. It is drawn once and then kept in the directory: hints can
+    // only be reused while A stays the same. A is public, so reusing it
+    // across runs reveals nothing.
+    void Seed(uint8_t seed[PRG_SEED_BYTES]) const;
+
+    // Reads the hint stored under key into hint; false if there is none.
+    bool Load(const HintDigest& key, Msg& hint) const;
+
+    // Stores hint under key, replacing any older entry atomically.
+    void Store(const HintDigest& key, const Msg& hint) const;
+
+private:
+    std::string path(const std::string& file) const;
+
+    std::string dir;
+};
+
+#endif // HINT_CACHE_H
@@ -1,14 +1,10 @@
-#include<bits/stdc++.h>
-using namespace std;
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
 
-
-struct Params {
-    int N;
-    int L;
-    int M;
-    int Logq;
-    int P;
-};
+#include "logging.h"
+#include "pir.h"
 
 std::chrono::duration<double> printTime(std::chrono::steady_clock::time_point start) {
     auto elapsed = std::chrono::steady_clock::now() - start;
@@ -16,10 +12,10 @@ std::chrono::duration<double> printTime(std::chrono::steady_clock::time_point st
     return elapsed;
 }
 
-double printRate(Params p, std::chrono::duration<double> elapsed, int batch_sz) {
+double printRate(const Params& p, std::chrono::duration<double> elapsed, int batch_sz) {
     double rate = std::log2(static_cast<double>(p.P)) * static_cast<double>(p.L * p.M) * static_cast<double>(batch_sz) /
         (8 * 1024 * 1024 * elapsed.count());
-    std::cout << "\tRate: " << rate << " MB/s\n";
+    std::cout << "\tRate: " << rate << " MB/s (" << matMulVecPackedVariant() << " kernel)\n";
     return rate;
 }
 
@@ -31,7 +27,7 @@ void clearFile(std::string filename) {
     file << "log(n) log(l) log(m) log(q) rate(MB/s) BW(KB)\n";
 }
 
-void writeToFile(Params p, double rate, double bw, std::string filename) {
+void writeToFile(const Params& p, double rate, double bw, std::string filename) {
     std::ofstream file(filename, std::ios::app);
     if (!file) {
         throw std::runtime_error("Failed to open file");
@@ -43,8 +39,3 @@ void writeToFile(Params p, double rate, double bw, std::string filename) {
          << rate << ","
          << bw << "\n";
 }
-
-int main() {
-    return 0;
-}
-
@@ -0,0 +1,20 @@
+#ifndef LOGGING_H
+#define LOGGING_H
+
+#include <chrono>
+#include <string>
+
+#include "params.h"
+
+// Prints and returns the time since start.
+std::chrono::duration<double> printTime(std::chrono::steady_clock::time_point start);
+
+// Prints and returns the rate at which batch_sz queries scanned the DB of
+// p in elapsed, in MB/s, with the packed kernel that did the scanning.
+double printRate(const Params& p, std::chrono::duration<double> elapsed, int batch_sz);
+
+void clearFile(std::string filename);
+
+void writeToFile(const Params& p, double rate, double bw, std::string filename);
+
+#endif // LOGGING_H
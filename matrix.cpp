@@ -1,191 +1,356 @@
 #include<bits/stdc++.h>
+#include "matrix.h"
+#include "packing.h"
+#include "pir.h"
 using namespace std;
 
-struct Elem {
-    uint64_t val;
-};
+int64_t GaussSample(); // gauss.cpp
 
-class Matrix {
-public:
-    uint64_t Rows;
-    uint64_t Cols;
-    std::vector<Elem> Data;
+// Matrix and the C kernels must agree on the element layout.
+static_assert(sizeof(Elem) == sizeof(uint32_t), "pir.h Elem must be 32 bits");
 
-    Matrix(uint64_t rows, uint64_t cols) {
-        Rows = rows;
-        Cols = cols;
-        // Initialize Data with appropriate size
-        Data.resize(rows * cols);
+template <typename T>
+MatrixOf<T>::MatrixOf(uint64_t rows, uint64_t cols) {
+    Rows = rows;
+    Cols = cols;
+    // Initialize Data with appropriate size
+    Data.resize(rows * cols);
+}
+
+template <typename T>
+MatrixOf<T>::MatrixOf(uint64_t rows, uint64_t cols, MatrixStorage<T> data) {
+    Rows = rows;
+    Cols = cols;
+    Data = std::move(data);
+}
+
+// Materializes a view into a new, contiguous matrix.
+template <typename T>
+MatrixOf<T>::MatrixOf(const MatrixViewOf<T>& v) : MatrixOf(0, 0) {
+    Concat(v);
+}
+
+template <typename T>
+uint64_t MatrixOf<T>::Size() {
+    return Rows * Cols;
+}
+
+template <typename T>
+MatrixOf<T> MatrixOf<T>::MatrixZeros(uint64_t rows, uint64_t cols) {
+    MatrixOf out(rows, cols);
+    std::fill(out.Data.begin(), out.Data.end(), 0);
+    return out;
+}
+
+template <typename T>
+MatrixViewOf<T> MatrixOf<T>::View() {
+    return MatrixViewOf<T>(Data.data(), Rows, Cols, Cols);
+}
+
+// Returns a view of rows [offset, offset + num); nothing is copied.
+template <typename T>
+MatrixViewOf<T> MatrixOf<T>::SelectRows(uint64_t offset, uint64_t num) {
+    return View().SelectRows(offset, num);
+}
+
+template <typename T>
+void MatrixOf<T>::Concat(MatrixOf& b) {
+    Concat(b.View());
+}
+
+template <typename T>
+void MatrixOf<T>::Concat(const MatrixViewOf<T>& b) {
+    if (Cols == 0 && Rows == 0) {
+        Cols = b.Cols;
+    } else if (Cols != b.Cols) {
+        cout << Rows << "-by-" << Cols << " vs. " << b.Rows << "-by-" << b.Cols << endl;
+        throw runtime_error("Dimension mismatch");
     }
+    Data.reserve(Data.size() + b.Rows * b.Cols);
+    if (b.Contiguous()) {
+        Data.insert(Data.end(), b.Data, b.Data + b.Rows * b.Cols);
+    } else {
+        for (uint64_t i = 0; i < b.Rows; i++) {
+            Data.insert(Data.end(), b.Row(i), b.Row(i) + b.Cols);
+        }
+    }
+    Rows += b.Rows;
+}
 
-    Matrix(uint64_t rows, uint64_t cols, std::vector<Elem> data) {
-        Rows = rows;
-        Cols = cols;
-        Data = data;
+// Appends n zero rows to a column vector, in place; buffers sized with
+// spare capacity (see MatrixPool::Get) do not reallocate.
+template <typename T>
+void MatrixOf<T>::AppendZeros(uint64_t n) {
+    if (Cols != 1 && !(Cols == 0 && Rows == 0)) {
+        cout << Rows << "-by-" << Cols << " vs. " << n << "-by-1" << endl;
+        throw runtime_error("Dimension mismatch");
     }
+    Cols = 1;
+    Data.resize(Data.size() + n, 0);
+    Rows += n;
+}
 
-    uint64_t Size() {
-        return Rows * Cols;
+template <typename T>
+void MatrixOf<T>::ReduceMod(uint64_t p) {
+    for (auto& elem : Data) {
+        elem = elem % p;
     }
+}
 
-    Matrix MatrixZeros(uint64_t rows, uint64_t cols) {
-        Matrix out(rows, cols);
-        for (auto& elem : out.Data) {
-            elem.val = 0;
-        }
-        return out;
+template <typename T>
+uint64_t MatrixOf<T>::Get(uint64_t i, uint64_t j) {
+    if (i >= Rows) {
+        throw std::runtime_error("Too many rows!");
     }
+    if (j >= Cols) {
+        throw std::runtime_error("Too many cols!");
+    }
+    return Data[i * Cols + j];
+}
 
-    void Concat(Matrix& b) {
-        if (Cols == 0 && Rows == 0) {
-            Cols = b.Cols;
-            Rows = b.Rows;
-            Data = b.Data;
-            return;
-        }
-        if (Cols != b.Cols) {
-            cout << Rows << "-by-" << Cols << " vs. " << b.Rows << "-by-" << b.Cols << endl;
-            throw runtime_error("Dimension mismatch");
-        }
-        Rows += b.Rows;
-        Data.insert(Data.end(), b.Data.begin(), b.Data.end());
+template <typename T>
+void MatrixOf<T>::Set(uint64_t val, uint64_t i, uint64_t j) {
+    if (i >= Rows) {
+        throw std::runtime_error("Too many rows!");
     }
-    
-    void AppendZeros(uint64_t n) {
-        Matrix zeros = MatrixZeros(n, 1);
-        Concat(zeros);
+    if (j >= Cols) {
+        throw std::runtime_error("Too many cols!");
     }
+    Data[i * Cols + j] = static_cast<T>(val);
+}
 
-    void ReduceMod(uint64_t p) {
-        Elem mod = {p};
-        for (auto& elem : Data) {
-            elem.val = elem.val % mod.val;
-        }
+template <typename T>
+void MatrixOf<T>::MatrixAdd(MatrixOf& b) {
+    if ((Cols != b.Cols) || (Rows != b.Rows)) {
+        std::cout << Rows << "-by-" << Cols << " vs. " << b.Rows << "-by-" << b.Cols << std::endl;
+        throw std::runtime_error("Dimension mismatch");
+    }
+    for (uint64_t i = 0; i < Cols * Rows; i++) {
+        Data[i] += b.Data[i];
     }
+}
 
-    uint64_t Get(uint64_t i, uint64_t j) {
-        if (i >= Rows) {
-            throw std::runtime_error("Too many rows!");
-        }
-        if (j >= Cols) {
-            throw std::runtime_error("Too many cols!");
-        }
-        return Data[i * Cols + j].val;
+template <typename T>
+void MatrixOf<T>::Add(uint64_t val) {
+    T v = static_cast<T>(val);
+    for (auto& elem : Data) {
+        elem += v;
     }
+}
 
-    void Set(uint64_t val, uint64_t i, uint64_t j) {
-        if (i >= Rows) {
-            throw std::runtime_error("Too many rows!");
-        }
-        if (j >= Cols) {
-            throw std::runtime_error("Too many cols!");
-        }
-        Data[i * Cols + j].val = val;
+template <typename T>
+void MatrixOf<T>::Sub(uint64_t val) {
+    T v = static_cast<T>(val);
+    for (auto& elem : Data) {
+        elem -= v;
     }
+}
 
-    void MatrixAdd(Matrix& b) {
-        if ((Cols != b.Cols) || (Rows != b.Rows)) {
-            std::cout << Rows << "-by-" << Cols << " vs. " << b.Rows << "-by-" << b.Cols << std::endl;
-            throw std::runtime_error("Dimension mismatch");
-        }
-        for (uint64_t i = 0; i < Cols * Rows; i++) {
-            Data[i].val += b.Data[i].val;
-        }
+template <typename T>
+void MatrixOf<T>::AddAt(uint64_t val, uint64_t i, uint64_t j) {
+    if ((i >= Rows) || (j >= Cols)) {
+        throw std::runtime_error("Out of bounds");
     }
+    Set(Get(i, j) + val, i, j);
+}
 
-    void Add(uint64_t val) {
-        Elem v = {val};
-        for (auto& elem : Data) {
-            elem.val += v.val;
-        }
+template <typename T>
+void MatrixOf<T>::MatrixSub(MatrixOf& b) {
+    if ((Cols != b.Cols) || (Rows != b.Rows)) {
+        std::cout << Rows << "-by-" << Cols << " vs. " << b.Rows << "-by-" << b.Cols << std::endl;
+        throw std::runtime_error("Dimension mismatch");
     }
+    for (uint64_t i = 0; i < Cols * Rows; i++) {
+        Data[i] -= b.Data[i];
+    }
+}
 
-    void AddAt(uint64_t val, uint64_t i, uint64_t j) {
-        if ((i >= Rows) || (j >= Cols)) {
-            throw std::runtime_error("Out of bounds");
+template <typename T>
+MatrixOf<T> MatrixOf<T>::MatrixMul(MatrixOf& a, MatrixOf& b) {
+    MatrixOf out(a.Rows, b.Cols);
+    MatrixMulInto(out, a, b);
+    return out;
+}
+
+template <typename T>
+MatrixOf<T> MatrixOf<T>::MatrixMulVec(MatrixOf& a, MatrixOf& b) {
+    MatrixOf out(a.Rows, 1);
+    MatrixMulVecInto(out, a, b);
+    return out;
+}
+
+// out = a * b, computed in out's existing a.Rows-by-b.Cols buffer, so that
+// callers can reuse storage (e.g. from a MatrixPool) across products.
+template <typename T>
+void MatrixOf<T>::MatrixMulInto(MatrixOf& out, MatrixOf& a, MatrixOf& b) {
+    if (b.Cols == 1) {
+        MatrixMulVecInto(out, a, b);
+        return;
+    }
+    if (a.Cols != b.Rows) {
+        std::cout << a.Rows << "-by-" << a.Cols << " vs. " << b.Rows << "-by-" << b.Cols << std::endl;
+        throw std::runtime_error("Dimension mismatch");
+    }
+    if (out.Rows != a.Rows || out.Cols != b.Cols) {
+        throw std::runtime_error("Output dimension mismatch");
+    }
+    std::fill(out.Data.begin(), out.Data.end(), 0);
+    if constexpr (std::is_same<T, uint32_t>::value) {
+        // Blocked and split over every core; see pir.c.
+        ::matMulParallel(out.Data.data(), a.Data.data(), b.Data.data(), a.Rows, a.Cols, b.Cols, 0);
+        return;
+    }
+    for (uint64_t i = 0; i < a.Rows; i++) {
+        for (uint64_t k = 0; k < a.Cols; k++) {
+            T av = a.Data[i * a.Cols + k];
+            for (uint64_t j = 0; j < b.Cols; j++) {
+                out.Data[i * b.Cols + j] += av * b.Data[k * b.Cols + j];
+            }
         }
-        Set(Get(i, j) + val, i, j);
     }
+}
 
-    void MatrixSub(Matrix& b) {
-        if ((Cols != b.Cols) || (Rows != b.Rows)) {
-            std::cout << Rows << "-by-" << Cols << " vs. " << b.Rows << "-by-" << b.Cols << std::endl;
-            throw std::runtime_error("Dimension mismatch");
-        }
-        for (uint64_t i = 0; i < Cols * Rows; i++) {
-            Data[i].val -= b.Data[i].val;
+template <typename T>
+void MatrixOf<T>::MatrixMulVecInto(MatrixOf& out, MatrixOf& a, MatrixOf& b) {
+    if ((a.Cols != b.Rows) && (a.Cols + 1 != b.Rows) && (a.Cols + 2 != b.Rows)) {
+        std::cout << a.Rows << "-by-" << a.Cols << " vs. " << b.Rows << "-by-" << b.Cols << std::endl;
+        throw std::runtime_error("Dimension mismatch");
+    }
+    if (b.Cols != 1) {
+        throw std::runtime_error("Second argument is not a vector");
+    }
+    if (out.Rows != a.Rows || out.Cols != 1) {
+        throw std::runtime_error("Output dimension mismatch");
+    }
+    if constexpr (std::is_same<T, uint32_t>::value) {
+        ::matMulVec(out.Data.data(), a.Data.data(), b.Data.data(), a.Rows, a.Cols);
+        return;
+    }
+    std::fill(out.Data.begin(), out.Data.end(), 0);
+    for (uint64_t i = 0; i < a.Rows; i++) {
+        for (uint64_t j = 0; j < a.Cols; j++) {
+            out.Data[i] += a.Data[i * a.Cols + j] * b.Data[j];
         }
     }
+}
 
-    static Matrix MatrixMul(Matrix& a, Matrix& b) {
-        if (b.Cols == 1) {
-            return MatrixMulVec(a, b);
-        }
-        if (a.Cols != b.Rows) {
-            std::cout << a.Rows << "-by-" << a.Cols << " vs. " << b.Rows << "-by-" << b.Cols << std::endl;
-            throw std::runtime_error("Dimension mismatch");
+template <typename T>
+void MatrixOf<T>::Transpose() {
+    if (Cols == 1) {
+        Cols = Rows;
+        Rows = 1;
+        return;
+    }
+    if (Rows == 1) {
+        Rows = Cols;
+        Cols = 1;
+        return;
+    }
+    if constexpr (std::is_same<T, uint32_t>::value) {
+        // Blocked and in place, so transposing A or a hint does not need a
+        // second matrix-sized buffer.
+        if (::transposeInPlace(Data.data(), Rows, Cols) != 0) {
+            throw std::runtime_error("Out of memory transposing matrix");
         }
-        Matrix out(a.Rows, b.Cols);
-        for (uint64_t i = 0; i < a.Rows; i++) {
-            for (uint64_t j = 0; j < b.Cols; j++) {
-                for (uint64_t k = 0; k < a.Cols; k++) {
-                    out.Data[i * b.Cols + j].val += a.Data[i * a.Cols + k].val * b.Data[k * b.Cols + j].val;
-                }
+    } else {
+        MatrixOf out(Cols, Rows);
+        for (uint64_t i = 0; i < Rows; i++) {
+            for (uint64_t j = 0; j < Cols; j++) {
+                out.Data[j * Rows + i] = Data[i * Cols + j];
             }
         }
-        return out;
+        Data = std::move(out.Data);
     }
+    std::swap(Rows, Cols);
+}
 
-    static Matrix MatrixMulVec(Matrix& a, Matrix& b) {
-        if ((a.Cols != b.Rows) && (a.Cols + 1 != b.Rows) && (a.Cols + 2 != b.Rows)) {
-            std::cout << a.Rows << "-by-" << a.Cols << " vs. " << b.Rows << "-by-" << b.Cols << std::endl;
-            throw std::runtime_error("Dimension mismatch");
-        }
-        if (b.Cols != 1) {
-            throw std::runtime_error("Second argument is not a vector");
-        }
-        Matrix out(a.Rows, 1);
-        for (uint64_t i = 0; i < a.Rows; i++) {
-            for (uint64_t j = 0; j < a.Cols; j++) {
-                out.Data[i].val += a.Data[i * a.Cols + j].val * b.Data[j].val;
+// Replaces every entry by its delta base-mod digits, least significant
+// first, in consecutive rows: entry (i, j) becomes entries (i * delta + f, j).
+template <typename T>
+void MatrixOf<T>::Expand(uint64_t mod, uint64_t delta) {
+    MatrixOf out(Rows * delta, Cols);
+    for (uint64_t i = 0; i < Rows; i++) {
+        for (uint64_t j = 0; j < Cols; j++) {
+            uint64_t val = Data[i * Cols + j];
+            for (uint64_t f = 0; f < delta; f++) {
+                out.Data[(i * delta + f) * Cols + j] = static_cast<T>(val % mod);
+                val /= mod;
             }
         }
-        return out;
     }
+    Rows = out.Rows;
+    Data = std::move(out.Data);
+}
 
-    void Transpose() {
-        if (Cols == 1) {
-            Cols = Rows;
-            Rows = 1;
-            return;
-        }
-        if (Rows == 1) {
-            Rows = Cols;
-            Cols = 1;
-            return;
+// Deals the columns out to n blocks stacked vertically: column j moves to
+// block j % n, at column j / n. Cols must be a multiple of n.
+template <typename T>
+void MatrixOf<T>::ConcatCols(uint64_t n) {
+    if (n == 1) {
+        return;
+    }
+    if (n == 0 || Cols % n != 0) {
+        throw std::runtime_error("Column count is not a multiple of n");
+    }
+    MatrixOf out(Rows * n, Cols / n);
+    for (uint64_t i = 0; i < Rows; i++) {
+        for (uint64_t j = 0; j < Cols; j++) {
+            out.Data[(i + Rows * (j % n)) * out.Cols + j / n] = Data[i * Cols + j];
         }
-        Matrix out(Cols, Rows);
-        for (uint64_t i = 0; i < Rows; i++) {
-            for (uint64_t j = 0; j < Cols; j++) {
-                out.Data[j * Rows + i].val = Data[i * Cols + j].val;
+    }
+    Rows = out.Rows;
+    Cols = out.Cols;
+    Data = std::move(out.Data);
+}
+
+// Packs delta consecutive entries of each row, basis bits apiece, into a
+// single element. Entries must already lie in [0, 2^basis).
+template <typename T>
+void MatrixOf<T>::Squish(uint64_t basis, uint64_t delta) {
+    if (basis * delta > 8 * sizeof(T)) {
+        throw std::runtime_error("Squished digits do not fit in a limb");
+    }
+    MatrixOf out(Rows, (Cols + delta - 1) / delta);
+    for (uint64_t i = 0; i < out.Rows; i++) {
+        for (uint64_t j = 0; j < out.Cols; j++) {
+            for (uint64_t k = 0; k < delta; k++) {
+                if (delta * j + k < Cols) {
+                    T val = Data[i * Cols + delta * j + k];
+                    out.Data[i * out.Cols + j] += val << (k * basis);
+                }
             }
         }
-        Cols = out.Cols;
-        Rows = out.Rows;
-        Data = out.Data;
     }
+    Cols = out.Cols;
+    Data = std::move(out.Data);
+}
 
+template <typename T>
+void MatrixOf<T>::Unsquish(uint64_t basis, uint64_t delta, uint64_t cols) {
+    MatrixOf out(Rows, cols);
+    T mask = static_cast<T>((1ULL << basis) - 1);
+    for (uint64_t i = 0; i < out.Rows; i++) {
+        for (uint64_t j = 0; j < out.Cols; j++) {
+            out.Data[i * out.Cols + j] = (Data[i * Cols + j / delta] >> (basis * (j % delta))) & mask;
+        }
+    }
+    Cols = out.Cols;
+    Data = std::move(out.Data);
+}
 
-    void Print() {
-        std::cout << Rows << "-by-" << Cols << " matrix:" << std::endl;
-        for (uint64_t i = 0; i < Rows; i++) {
-            for (uint64_t j = 0; j < Cols; j++) {
-                std::cout << Data[i * Cols + j].val << " ";
-            }
-            std::cout << std::endl;
+template <typename T>
+void MatrixOf<T>::Print() {
+    std::cout << Rows << "-by-" << Cols << " matrix:" << std::endl;
+    for (uint64_t i = 0; i < Rows; i++) {
+        for (uint64_t j = 0; j < Cols; j++) {
+            std::cout << Data[i * Cols + j] << " ";
         }
+        std::cout << std::endl;
     }
-};
+}
+
+template class MatrixOf<uint32_t>;
+template class MatrixOf<uint64_t>;
 
 Matrix MatrixNew(uint64_t rows, uint64_t cols) {
     Matrix out(rows, cols);
@@ -194,46 +359,168 @@ Matrix MatrixNew(uint64_t rows, uint64_t cols) {
 
 Matrix MatrixRand(uint64_t rows, uint64_t cols, uint64_t logmod, uint64_t mod) {
     Matrix out(rows, cols);
+    MatrixRandInto(out, logmod, mod);
+    return out;
+}
+
+// Refills every entry of out with a fresh uniform sample mod m, reusing its
+// buffer. The generator is per thread and has full 32-bit output, so every
+// residue mod 2^32 is reachable and concurrent clients do not contend on
+// rand()'s lock.
+void MatrixRandInto(Matrix& out, uint64_t logmod, uint64_t mod) {
+    if (mod == 0 && logmod > MATRIX_LOGQ) {
+        throw std::runtime_error("Logq too large for 32-bit matrix limbs");
+    }
+    if (mod > (uint64_t(1) << MATRIX_LOGQ)) {
+        throw std::runtime_error("Modulus too large for 32-bit matrix limbs");
+    }
     uint64_t m = mod;
     if (mod == 0) {
-        m = pow(2, logmod);
+        m = uint64_t(1) << logmod;
     }
+    thread_local std::mt19937 mrand(std::random_device{}());
+    std::uniform_int_distribution<uint32_t> dist(0, static_cast<uint32_t>(m - 1));
     for (auto& elem : out.Data) {
-        elem.val = rand() % m;
+        elem = dist(mrand);
     }
-    return out;
 }
 
 Matrix MatrixGaussian(uint64_t rows, uint64_t cols) {
     Matrix out(rows, cols);
+    MatrixGaussianInto(out);
+    return out;
+}
+
+// Negative samples wrap around to q - |x|, as the scheme expects.
+void MatrixGaussianInto(Matrix& out) {
     for (auto& elem : out.Data) {
-        elem.val = rand();
+        elem = static_cast<uint32_t>(GaussSample());
+    }
+}
+
+Matrix MatrixFromSeed(const uint8_t* seed, uint64_t rows, uint64_t cols, uint64_t logmod) {
+    if (logmod > MATRIX_LOGQ) {
+        throw std::runtime_error("Logq too large for 32-bit matrix limbs");
+    }
+    PrgKey key;
+    prgInit(&key, seed);
+    Matrix out(rows, cols);
+    for (uint64_t i = 0; i < rows; i++) {
+        prgMatrixRow(&key, i, cols, logmod, out.Data.data() + i * cols);
     }
     return out;
 }
 
+// out = A * b + e, where A is rows [firstRow, firstRow + out.Rows) of the
+// matrix with aCols columns that MatrixFromSeed would expand. A is expanded
+// a few rows at a time and never stored.
+void MatrixMulVecSeededInto(Matrix& out, const uint8_t* seed, uint64_t aCols, uint64_t logmod,
+                            Matrix& b, Matrix* e, uint64_t firstRow) {
+    if (logmod > MATRIX_LOGQ) {
+        throw std::runtime_error("Logq too large for 32-bit matrix limbs");
+    }
+    if (b.Rows != aCols || b.Cols != 1) {
+        std::cout << out.Rows << "-by-" << aCols << " vs. " << b.Rows << "-by-" << b.Cols << std::endl;
+        throw std::runtime_error("Dimension mismatch");
+    }
+    if (out.Cols != 1 || (e != nullptr && (e->Rows != out.Rows || e->Cols != 1))) {
+        throw std::runtime_error("Output dimension mismatch");
+    }
+    PrgKey key;
+    prgInit(&key, seed);
+    if (matMulVecSeeded(out.Data.data(), &key, logmod, b.Data.data(),
+                        e == nullptr ? nullptr : e->Data.data(), firstRow, out.Rows, aCols) != 0) {
+        throw std::runtime_error("Out of memory expanding seeded matrix");
+    }
+}
+
+// Capacity class c holds buffers of exactly 2^c entries, so any buffer in
+// class ceil(log2(n)) fits n entries and Put never has to search.
+static unsigned CapacityClass(uint64_t n) {
+    unsigned c = 0;
+    while ((uint64_t(1) << c) < n) {
+        c++;
+    }
+    return c;
+}
+
+MatrixPool& MatrixPool::Local() {
+    static thread_local MatrixPool pool;
+    return pool;
+}
+
+Matrix MatrixPool::Get(uint64_t rows, uint64_t cols, uint64_t reserve) {
+    uint64_t n = rows * cols;
+    unsigned c = CapacityClass(std::max(std::max(n, reserve), uint64_t(1)));
+    if (c >= NUM_CLASSES) {
+        throw std::runtime_error("Matrix too large for pool");
+    }
+    MatrixStorage<uint32_t> buf;
+    if (!buffers[c].empty()) {
+        buf = std::move(buffers[c].back());
+        buffers[c].pop_back();
+        cached -= buf.capacity() * sizeof(uint32_t);
+    } else {
+        buf.reserve(uint64_t(1) << c);
+    }
+    buf.assign(n, 0);
+    return Matrix(rows, cols, std::move(buf));
+}
+
+void MatrixPool::Put(Matrix& m) {
+    uint64_t cap = m.Data.capacity();
+    m.Rows = 0;
+    m.Cols = 0;
+    if (cap == 0 || (cap & (cap - 1)) != 0) {
+        // Not one of ours; let it be freed normally.
+        MatrixStorage<uint32_t>().swap(m.Data);
+        return;
+    }
+    unsigned c = CapacityClass(cap);
+    if (c >= NUM_CLASSES || buffers[c].size() >= MAX_PER_CLASS) {
+        MatrixStorage<uint32_t>().swap(m.Data);
+        return;
+    }
+    m.Data.clear();
+    cached += cap * sizeof(uint32_t);
+    buffers[c].push_back(std::move(m.Data));
+    m.Data = MatrixStorage<uint32_t>();
+}
+
+uint64_t MatrixPool::CachedBytes() const {
+    return cached;
+}
+
+// Packed products against a squished DB: every element of a holds
+// compression digits of basis bits each, and digit f of a(i, k) multiplies
+// column k * compression + f of the other operand. Both go through the
+// packed-kernel dispatch table for the requested shape.
 Matrix MatrixMulTransposedPacked(Matrix& a, Matrix& b, uint64_t basis, uint64_t compression) {
-    std::cout << a.Rows << "-by-" << a.Cols << " vs. " << b.Cols << "-by-" << b.Rows << std::endl;
-    if (compression != 3 && basis != 10) {
-        throw std::runtime_error("Must use hard-coded values!");
+    const PackedKernels* k = packedKernels(basis, compression);
+    if (k == nullptr) {
+        throw std::runtime_error("Unsupported packing shape!");
     }
-    Matrix out(a.Rows, b.Rows);
-    for (uint64_t j = 0; j < b.Rows; j++) {
-        for (uint64_t i = 0; i < a.Cols; i++) {
-            uint64_t val = a.Data[i + j * a.Cols].val;
-            for (uint64_t f = 0; f < compression; f++) {
-                uint64_t new_val = val % mod;
-                uint64_t r = (i * compression + f) + a.Cols * compression * (j % concat);
-                uint64_t c = j / concat;
-                out.Data[r * out.Cols + c / d].val += new_val << (basis * (c % d));
-                val /= mod;
-            }
-        }
+    if (a.Cols * compression != b.Cols) {
+        throw std::runtime_error("Dimension mismatch");
     }
+    Matrix out(a.Rows, b.Rows);
+    k->matMulTransposedPacked(out.Data.data(), a.Data.data(), b.Data.data(), a.Rows, a.Cols, b.Rows, b.Cols);
     return out;
 }
 
 Matrix MatrixMulVecPacked(Matrix& a, Matrix& b, uint64_t basis, uint64_t compression) {
+    return MatrixMulVecPacked(a.View(), b, basis, compression);
+}
+
+Matrix MatrixMulVecPacked(const MatrixView& a, Matrix& b, uint64_t basis, uint64_t compression) {
+    Matrix out(a.Rows, 1);
+    MatrixMulVecPackedInto(out.View(), a, b, basis, compression);
+    return out;
+}
+
+// Accumulates a * b into out, which must be a column vector with a.Rows
+// entries, e.g. a slice of a larger preallocated answer.
+void MatrixMulVecPackedInto(const MatrixView& out, const MatrixView& a, Matrix& b, uint64_t basis, uint64_t compression) {
     if (a.Cols * compression != b.Rows) {
         std::cout << a.Rows << "-by-" << a.Cols << " vs. " << b.Rows << "-by-" << b.Cols << std::endl;
         throw std::runtime_error("Dimension mismatch");
@@ -241,50 +528,52 @@ Matrix MatrixMulVecPacked(Matrix& a, Matrix& b, uint64_t basis, uint64_t compres
     if (b.Cols != 1) {
         throw std::runtime_error("Second argument is not a vector");
     }
-    if (compression != 3 && basis != 10) {
-        throw std::runtime_error("Must use hard-coded values!");
+    if (out.Rows != a.Rows || out.Cols != 1 || out.Stride != 1) {
+        throw std::runtime_error("Output is not a matching vector");
     }
-    Matrix out(a.Rows + 8, 1);
-    for (uint64_t i = 0; i < a.Rows; i++) {
-        for (uint64_t j = 0; j < a.Cols; j++) {
-            uint64_t val = a.Data[i * a.Cols + j].val;
-            for (uint64_t f = 0; f < compression; f++) {
-                uint64_t new_val = val % mod;
-                uint64_t r = (i * compression + f) + a.Cols * compression * (j % concat);
-                uint64_t c = j / concat;
-                out.Data[r * out.Cols + c / d].val += new_val << (basis * (c % d));
-                val /= mod;
-            }
-        }
+    const PackedKernels* k = packedKernels(basis, compression);
+    if (k == nullptr) {
+        throw std::runtime_error("Unsupported packing shape!");
     }
-    out.DropLastRows(8);
+    k->matMulVecPacked(out.Data, a.Data, b.Data.data(), a.Rows, a.Cols, a.Stride);
+}
+
+Matrix MatrixMulMatPacked(const MatrixView& a, Matrix& b, uint64_t basis, uint64_t compression) {
+    Matrix out(a.Rows, b.Cols);
+    MatrixMulMatPackedInto(out.View(), a, b, basis, compression);
     return out;
 }
 
-void transpose(Matrix& out, Matrix& m) {
-    for (uint64_t i = 0; i < m.Rows; i++) {
-        for (uint64_t j = 0; j < m.Cols; j++) {
-            out.Data[j * m.Rows + i].val = m.Data[i * m.Cols + j].val;
-        }
+// Accumulates a * b into out, where each column of b is a separate query;
+// all b.Cols queries are answered in a single pass over a. out must be a
+// contiguous a.Rows-by-b.Cols block, e.g. a row slice of a larger answer.
+void MatrixMulMatPackedInto(const MatrixView& out, const MatrixView& a, Matrix& b, uint64_t basis, uint64_t compression) {
+    if (a.Cols * compression != b.Rows) {
+        std::cout << a.Rows << "-by-" << a.Cols << " vs. " << b.Rows << "-by-" << b.Cols << std::endl;
+        throw std::runtime_error("Dimension mismatch");
     }
+    if (out.Rows != a.Rows || out.Cols != b.Cols || !out.Contiguous()) {
+        throw std::runtime_error("Output is not a matching matrix");
+    }
+    const PackedKernels* k = packedKernels(basis, compression);
+    if (k == nullptr) {
+        throw std::runtime_error("Unsupported packing shape!");
+    }
+    if (b.Cols == 1) {
+        k->matMulVecPacked(out.Data, a.Data, b.Data.data(), a.Rows, a.Cols, a.Stride);
+        return;
+    }
+    k->matMulMatPacked(out.Data, a.Data, b.Data.data(), a.Rows, a.Cols, a.Stride, b.Cols);
+}
+
+void transpose(Matrix& out, Matrix& m) {
+    ::transpose(out.Data.data(), m.Data.data(), m.Rows, m.Cols);
 }
 
 void matMul(Matrix& out, Matrix& a, Matrix& b) {
-    for (uint64_t i = 0; i < a.Rows; i++) {
-        for (uint64_t j = 0; j < b.Cols; j++) {
-            for (uint64_t k = 0; k < a.Cols; k++) {
-                out.Data[i * b.Cols + j].val += a.Data[i * a.Cols + k].val * b.Data[k * b.Cols + j].val;
-            }
-        }
-    }
+    ::matMulParallel(out.Data.data(), a.Data.data(), b.Data.data(), a.Rows, a.Cols, b.Cols, 0);
 }
 
 void matMulVec(Matrix& out, Matrix& a, Matrix& b) {
-    for (uint64_t i = 0; i < a.Rows; i++) {
-        for (uint64_t j = 0; j < a.Cols; j++) {
-            out.Data[i].val += a.Data[i * a.Cols + j].val * b.Data[j].val;
-        }
-    }
+    ::matMulVec(out.Data.data(), a.Data.data(), b.Data.data(), a.Rows, a.Cols);
 }
-
-
@@ -6,40 +6,147 @@
 #include <cstdint>
 #include <stdexcept>
 
-struct Elem {
-    uint64_t val;
+#include "matrix_alloc.h"
+
+// Non-owning view of a Rows-by-Cols block of some matrix whose consecutive
+// rows sit Stride elements apart. Views never allocate and are cheap to pass
+// by value; the matrix they point into must outlive them and must not be
+// resized while they are in use.
+template <typename T>
+struct MatrixViewOf {
+    T* Data;
+    uint64_t Rows;
+    uint64_t Cols;
+    uint64_t Stride;
+
+    MatrixViewOf(T* data, uint64_t rows, uint64_t cols, uint64_t stride)
+        : Data(data), Rows(rows), Cols(cols), Stride(stride) {}
+
+    T* Row(uint64_t i) const {
+        return Data + i * Stride;
+    }
+
+    bool Contiguous() const {
+        return Stride == Cols;
+    }
+
+    uint64_t Get(uint64_t i, uint64_t j) const {
+        if (i >= Rows) {
+            throw std::runtime_error("Too many rows!");
+        }
+        if (j >= Cols) {
+            throw std::runtime_error("Too many cols!");
+        }
+        return Data[i * Stride + j];
+    }
+
+    MatrixViewOf SelectRows(uint64_t offset, uint64_t num) const {
+        if (offset + num > Rows) {
+            throw std::runtime_error("Too many rows!");
+        }
+        return MatrixViewOf(Data + offset * Stride, num, Cols, Stride);
+    }
+
+    MatrixViewOf SelectCols(uint64_t offset, uint64_t num) const {
+        if (offset + num > Cols) {
+            throw std::runtime_error("Too many cols!");
+        }
+        return MatrixViewOf(Data + offset, Rows, num, Stride);
+    }
 };
 
-class Matrix {
+// Matrix entries are stored as native T limbs and all arithmetic wraps
+// around mod 2^(8*sizeof(T)), so no explicit reduction is needed as long
+// as q = 2^(8*sizeof(T)). Every parameter set in params.csv has Logq = 32,
+// so the scheme runs on Matrix (uint32_t limbs), which is also the layout
+// the C kernels in pir.h operate on. Matrix64 is there for Logq up to 64.
+// Storage comes from MatrixAllocator, so large matrices follow the
+// huge-page and NUMA policy set with SetMatrixAllocPolicy.
+template <typename T>
+class MatrixOf {
 public:
     uint64_t Rows;
     uint64_t Cols;
-    std::vector<Elem> Data;
+    MatrixStorage<T> Data;
 
-    Matrix(uint64_t rows, uint64_t cols);
-    Matrix(uint64_t rows, uint64_t cols, std::vector<Elem> data);
+    MatrixOf(uint64_t rows, uint64_t cols);
+    MatrixOf(uint64_t rows, uint64_t cols, MatrixStorage<T> data);
+    explicit MatrixOf(const MatrixViewOf<T>& v);
     uint64_t Size();
-    Matrix MatrixZeros(uint64_t rows, uint64_t cols);
-    void Concat(Matrix& b);
+    MatrixOf MatrixZeros(uint64_t rows, uint64_t cols);
+    MatrixViewOf<T> View();
+    MatrixViewOf<T> SelectRows(uint64_t offset, uint64_t num);
+    void Concat(MatrixOf& b);
+    void Concat(const MatrixViewOf<T>& b);
     void AppendZeros(uint64_t n);
     void ReduceMod(uint64_t p);
     uint64_t Get(uint64_t i, uint64_t j);
     void Set(uint64_t val, uint64_t i, uint64_t j);
-    void MatrixAdd(Matrix& b);
+    void MatrixAdd(MatrixOf& b);
     void Add(uint64_t val);
+    void Sub(uint64_t val);
     void AddAt(uint64_t val, uint64_t i, uint64_t j);
-    void MatrixSub(Matrix& b);
-    static Matrix MatrixMul(Matrix& a, Matrix& b);
-    static Matrix MatrixMulVec(Matrix& a, Matrix& b);
+    void MatrixSub(MatrixOf& b);
+    static MatrixOf MatrixMul(MatrixOf& a, MatrixOf& b);
+    static MatrixOf MatrixMulVec(MatrixOf& a, MatrixOf& b);
+    static void MatrixMulInto(MatrixOf& out, MatrixOf& a, MatrixOf& b);
+    static void MatrixMulVecInto(MatrixOf& out, MatrixOf& a, MatrixOf& b);
     void Transpose();
+    void Expand(uint64_t mod, uint64_t delta);
+    void ConcatCols(uint64_t n);
+    void Squish(uint64_t basis, uint64_t delta);
+    void Unsquish(uint64_t basis, uint64_t delta, uint64_t cols);
     void Print();
 };
 
+typedef MatrixOf<uint32_t> Matrix;
+typedef MatrixOf<uint64_t> Matrix64;
+typedef MatrixViewOf<uint32_t> MatrixView;
+
+// Largest log(q) that Matrix can hold with wraparound arithmetic.
+const uint64_t MATRIX_LOGQ = 32;
+
+// Per-thread free lists of Matrix buffers, one per power-of-two capacity.
+// Query and Recover take their temporaries from here and give them back
+// when done, so in steady state they do no heap allocation. Pools are
+// thread-local, so Get and Put need no locking; a buffer may be Put on a
+// different thread than the one it came from.
+class MatrixPool {
+public:
+    static MatrixPool& Local();
+
+    // A zeroed rows-by-cols matrix whose buffer can grow to reserve entries
+    // (e.g. through AppendZeros) without reallocating.
+    Matrix Get(uint64_t rows, uint64_t cols, uint64_t reserve = 0);
+
+    // Takes back m's buffer and leaves m empty. At most MAX_PER_CLASS
+    // buffers are kept per capacity; the rest are freed.
+    void Put(Matrix& m);
+
+    uint64_t CachedBytes() const;
+
+private:
+    static const unsigned NUM_CLASSES = 48;
+    static const size_t MAX_PER_CLASS = 4;
+
+    std::vector<MatrixStorage<uint32_t>> buffers[NUM_CLASSES];
+    uint64_t cached = 0;
+};
+
 Matrix MatrixNew(uint64_t rows, uint64_t cols);
 Matrix MatrixRand(uint64_t rows, uint64_t cols, uint64_t logmod, uint64_t mod);
 Matrix MatrixGaussian(uint64_t rows, uint64_t cols);
+void MatrixRandInto(Matrix& out, uint64_t logmod, uint64_t mod);
+void MatrixGaussianInto(Matrix& out);
+Matrix MatrixFromSeed(const uint8_t* seed, uint64_t rows, uint64_t cols, uint64_t logmod);
+void MatrixMulVecSeededInto(Matrix& out, const uint8_t* seed, uint64_t aCols, uint64_t logmod,
+                            Matrix& b, Matrix* e, uint64_t firstRow = 0);
 Matrix MatrixMulTransposedPacked(Matrix& a, Matrix& b, uint64_t basis, uint64_t compression);
 Matrix MatrixMulVecPacked(Matrix& a, Matrix& b, uint64_t basis, uint64_t compression);
+Matrix MatrixMulVecPacked(const MatrixView& a, Matrix& b, uint64_t basis, uint64_t compression);
+void MatrixMulVecPackedInto(const MatrixView& out, const MatrixView& a, Matrix& b, uint64_t basis, uint64_t compression);
+Matrix MatrixMulMatPacked(const MatrixView& a, Matrix& b, uint64_t basis, uint64_t compression);
+void MatrixMulMatPackedInto(const MatrixView& out, const MatrixView& a, Matrix& b, uint64_t basis, uint64_t compression);
 void transpose(Matrix& out, Matrix& m);
 void matMul(Matrix& out, Matrix& a, Matrix& b);
 void matMulVec(Matrix& out, Matrix& a, Matrix& b);
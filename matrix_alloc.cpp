@@ -0,0 +1,254 @@
+#include "matrix_alloc.h"
+#include "answer_pool.h"
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+// From <numaif.h>; spelled out so that we do not need libnuma to build.
+static const int MPOL_BIND_MODE = 2;
+static const int MPOL_INTERLEAVE_MODE = 3;
+static const int MAX_NUMA_NODES = 1024;
+
+static const size_t PAGE_2M = size_t(1) << 21;
+static const size_t PAGE_1G = size_t(1) << 30;
+
+static std::mutex policy_mu;
+static MatrixAllocPolicy policy;
+
+// Mappings handed out by MatrixAllocate, by start address, with their
+// length. Only large allocations that did not go to operator new are here.
+static std::mutex mappings_mu;
+static std::unordered_map<uintptr_t, size_t> mappings;
+
+void SetMatrixAllocPolicy(const MatrixAllocPolicy& p) {
+    std::lock_guard<std::mutex> lock(policy_mu);
+    policy = p;
+}
+
+MatrixAllocPolicy GetMatrixAllocPolicy() {
+    std::lock_guard<std::mutex> lock(policy_mu);
+    return policy;
+}
+
+static const char* PAGE_NAMES[] = {"default", "thp", "2m", "1g"};
+static const char* PLACEMENT_NAMES[] = {"first-touch", "parallel", "interleave", "bind"};
+
+MatrixAllocPolicy ParseMatrixAllocPolicy(const std::string& spec) {
+    std::vector<std::string> parts;
+    std::stringstream ss(spec);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        parts.push_back(item);
+    }
+    if (parts.empty() || parts.size() > 3) {
+        throw std::runtime_error("Bad matrix allocation policy: " + spec);
+    }
+
+    MatrixAllocPolicy p;
+    const char** page = std::find(std::begin(PAGE_NAMES), std::end(PAGE_NAMES), parts[0]);
+    if (page == std::end(PAGE_NAMES)) {
+        throw std::runtime_error("Bad matrix page size: " + parts[0]);
+    }
+    p.Pages = static_cast<MatrixPages>(page - std::begin(PAGE_NAMES));
+    if (parts.size() > 1) {
+        const char** place = std::find(std::begin(PLACEMENT_NAMES), std::end(PLACEMENT_NAMES), parts[1]);
+        if (place == std::end(PLACEMENT_NAMES)) {
+            throw std::runtime_error("Bad matrix placement: " + parts[1]);
+        }
+        p.Placement = static_cast<MatrixPlacement>(place - std::begin(PLACEMENT_NAMES));
+    }
+    if (parts.size() > 2) {
+        p.Node = std::stoi(parts[2]);
+        if (p.Node < 0 || p.Node >= MAX_NUMA_NODES) {
+            throw std::runtime_error("Bad NUMA node: " + parts[2]);
+        }
+    }
+    return p;
+}
+
+std::string MatrixAllocPolicyName(const MatrixAllocPolicy& p) {
+    std::string name = std::string(PAGE_NAMES[static_cast<int>(p.Pages)]) + "," +
+                       PLACEMENT_NAMES[static_cast<int>(p.Placement)];
+    if (p.Placement == MatrixPlacement::Bind) {
+        name += "," + std::to_string(p.Node);
+    }
+    return name;
+}
+
+static size_t RoundUp(size_t n, size_t page) {
+    return (n + page - 1) / page * page;
+}
+
+// Maps len bytes (a multiple of 2 MB) at a 2 MB boundary, so that the
+// kernel can back all of it with transparent huge pages.
+static void* MapTransparent(size_t len) {
+    void* raw = mmap(nullptr, len + PAGE_2M, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return nullptr;
+    }
+    uintptr_t start = reinterpret_cast<uintptr_t>(raw);
+    uintptr_t aligned = RoundUp(start, PAGE_2M);
+    if (aligned > start) {
+        munmap(raw, aligned - start);
+    }
+    uintptr_t end = start + len + PAGE_2M;
+    if (end > aligned + len) {
+        munmap(reinterpret_cast<void*>(aligned + len), end - aligned - len);
+    }
+    madvise(reinterpret_cast<void*>(aligned), len, MADV_HUGEPAGE);
+    return reinterpret_cast<void*>(aligned);
+}
+
+static void* MapHugetlb(size_t len, size_t page) {
+    int shift = (page == PAGE_1G) ? 30 : 21;
+    void* p = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (shift << MAP_HUGE_SHIFT), -1, 0);
+    return (p == MAP_FAILED) ? nullptr : p;
+}
+
+struct Topology {
+    std::vector<int> Cpus;
+    std::vector<int> Nodes;
+};
+
+static const Topology& MachineTopology() {
+    static Topology t;
+    static std::once_flag once;
+    std::call_once(once, [] { DiscoverTopology(t.Cpus, t.Nodes); });
+    return t;
+}
+
+// Sets the NUMA policy of a fresh mapping before anything touches it.
+// Best effort, like AnswerPool's migration: on a single node, or without
+// permission, the pages simply stay where first touch puts them.
+static void PlaceMapping(void* addr, size_t len, const MatrixAllocPolicy& p) {
+    unsigned long mask[MAX_NUMA_NODES / (8 * sizeof(unsigned long))] = {0};
+    const size_t bits = 8 * sizeof(unsigned long);
+    int mode;
+    if (p.Placement == MatrixPlacement::Interleave) {
+        for (int node : MachineTopology().Nodes) {
+            if (node >= 0 && node < MAX_NUMA_NODES) {
+                mask[node / bits] |= 1UL << (node % bits);
+            }
+        }
+        mode = MPOL_INTERLEAVE_MODE;
+    } else if (p.Placement == MatrixPlacement::Bind) {
+        mask[p.Node / bits] |= 1UL << (p.Node % bits);
+        mode = MPOL_BIND_MODE;
+    } else {
+        return;
+    }
+    syscall(SYS_mbind, addr, len, mode, mask, MAX_NUMA_NODES + 1, 0);
+}
+
+// Faults in [addr, addr + len) from one thread per CPU, each taking the
+// slice of the mapping that the AnswerPool worker on that CPU will own.
+// Slices are whole pages of the given size, so no page is split between
+// nodes.
+static void TouchInParallel(void* addr, size_t len, size_t page) {
+    const std::vector<int>& cpus = MachineTopology().Cpus;
+    uint64_t n = cpus.size();
+    if (n <= 1) {
+        return;
+    }
+    size_t per = RoundUp((len + n - 1) / n, page);
+    std::vector<std::thread> touchers;
+    for (uint64_t w = 0; w < n && w * per < len; w++) {
+        char* start = static_cast<char*>(addr) + w * per;
+        size_t num = std::min(per, len - w * per);
+        int cpu = cpus[w];
+        touchers.emplace_back([start, num, cpu] {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            std::memset(start, 0, num);
+        });
+    }
+    for (auto& t : touchers) {
+        t.join();
+    }
+}
+
+void* MatrixAllocate(size_t bytes) {
+    if (bytes < MATRIX_LARGE_BYTES) {
+        return ::operator new(bytes);
+    }
+    MatrixAllocPolicy p = GetMatrixAllocPolicy();
+    if (p.Pages == MatrixPages::Default && p.Placement == MatrixPlacement::FirstTouch) {
+        return ::operator new(bytes);
+    }
+
+    void* addr = nullptr;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t len = RoundUp(bytes, page);
+    if (p.Pages == MatrixPages::Huge1G) {
+        addr = MapHugetlb(RoundUp(bytes, PAGE_1G), PAGE_1G);
+        if (addr != nullptr) {
+            page = PAGE_1G;
+            len = RoundUp(bytes, PAGE_1G);
+        }
+    }
+    if (addr == nullptr && (p.Pages == MatrixPages::Huge1G || p.Pages == MatrixPages::Huge2M)) {
+        addr = MapHugetlb(RoundUp(bytes, PAGE_2M), PAGE_2M);
+        if (addr != nullptr) {
+            page = PAGE_2M;
+            len = RoundUp(bytes, PAGE_2M);
+        }
+    }
+    if (addr == nullptr && p.Pages != MatrixPages::Default) {
+        len = RoundUp(bytes, PAGE_2M);
+        addr = MapTransparent(len);
+        page = PAGE_2M;
+    }
+    if (addr == nullptr && p.Pages == MatrixPages::Default) {
+        void* m = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        addr = (m == MAP_FAILED) ? nullptr : m;
+    }
+    if (addr == nullptr) {
+        throw std::bad_alloc();
+    }
+
+    PlaceMapping(addr, len, p);
+    if (p.Placement == MatrixPlacement::ParallelFirstTouch) {
+        TouchInParallel(addr, len, page);
+    }
+
+    std::lock_guard<std::mutex> lock(mappings_mu);
+    mappings[reinterpret_cast<uintptr_t>(addr)] = len;
+    return addr;
+}
+
+void MatrixDeallocate(void* p, size_t bytes) noexcept {
+    if (bytes >= MATRIX_LARGE_BYTES) {
+        size_t len = 0;
+        {
+            std::lock_guard<std::mutex> lock(mappings_mu);
+            auto it = mappings.find(reinterpret_cast<uintptr_t>(p));
+            if (it != mappings.end()) {
+                len = it->second;
+                mappings.erase(it);
+            }
+        }
+        if (len > 0) {
+            munmap(p, len);
+            return;
+        }
+    }
+    ::operator delete(p);
+}
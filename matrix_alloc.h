@@ -0,0 +1,114 @@
+#ifndef MATRIX_ALLOC_H
+#define MATRIX_ALLOC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <string>
+#include <vector>
+
+// Where the backing memory of large matrices (the DB, A, the hint) comes
+// from. Answers stream the whole DB once per query, so with 4 KB pages a
+// big DB spends a noticeable share of each pass on TLB misses, and on a
+// multi-socket box half of it may sit on the wrong node.
+
+// Page size used for large matrices.
+enum class MatrixPages {
+    // Whatever operator new returns.
+    Default,
+    // Transparent huge pages: a 2 MB aligned mapping advised with
+    // MADV_HUGEPAGE. Needs no setup, but the kernel may decline.
+    Transparent,
+    // Pages from the hugetlbfs pool (vm.nr_hugepages, or the 1 GB pool
+    // reserved at boot). Falls back to the next smaller size, and finally
+    // to Transparent, when the pool is empty.
+    Huge2M,
+    Huge1G,
+};
+
+// NUMA placement of large matrices.
+enum class MatrixPlacement {
+    // Pages land on the node of the thread that first writes them, which
+    // for a freshly built matrix is the thread that constructed it.
+    FirstTouch,
+    // The new mapping is touched by one thread per CPU, pinned in the
+    // same order and split into the same contiguous slices as the workers
+    // of an AnswerPool, so each worker's rows start out on its own node
+    // and AnswerPool::Bind has nothing left to migrate.
+    ParallelFirstTouch,
+    // Pages are spread round-robin over all nodes (MPOL_INTERLEAVE), for
+    // data that every thread reads, such as A.
+    Interleave,
+    // All pages on MatrixAllocPolicy::Node (MPOL_BIND).
+    Bind,
+};
+
+struct MatrixAllocPolicy {
+    MatrixPages Pages;
+    MatrixPlacement Placement;
+    int Node;
+
+    MatrixAllocPolicy(MatrixPages pages = MatrixPages::Default,
+                      MatrixPlacement placement = MatrixPlacement::FirstTouch, int node = 0)
+        : Pages(pages), Placement(placement), Node(node) {}
+};
+
+// Only allocations of at least this many bytes follow the policy; smaller
+// ones always come from operator new.
+const size_t MATRIX_LARGE_BYTES = size_t(1) << 21;
+
+// Sets the policy for large matrices allocated from now on; existing
+// matrices keep their memory. The default policy leaves everything to
+// operator new. Safe to call at any time.
+void SetMatrixAllocPolicy(const MatrixAllocPolicy& policy);
+MatrixAllocPolicy GetMatrixAllocPolicy();
+
+// Parses "pages[,placement[,node]]", e.g. "2m,interleave" or "thp,bind,1",
+// with pages one of default/thp/2m/1g and placement one of first-touch/
+// parallel/interleave/bind. Throws on anything else.
+MatrixAllocPolicy ParseMatrixAllocPolicy(const std::string& spec);
+
+// Human-readable form of policy, in the syntax ParseMatrixAllocPolicy reads.
+std::string MatrixAllocPolicyName(const MatrixAllocPolicy& policy);
+
+// Allocates bytes of matrix storage under the current policy; throws
+// std::bad_alloc on failure. Memory from MatrixAllocate must be freed
+// with MatrixDeallocate and the same size, whatever the policy is by then.
+void* MatrixAllocate(size_t bytes);
+void MatrixDeallocate(void* p, size_t bytes) noexcept;
+
+// Stateless allocator that routes MatrixOf storage through MatrixAllocate.
+template <typename T>
+struct MatrixAllocator {
+    typedef T value_type;
+
+    MatrixAllocator() noexcept {}
+    template <typename U>
+    MatrixAllocator(const MatrixAllocator<U>&) noexcept {}
+
+    T* allocate(size_t n) {
+        if (n > SIZE_MAX / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+        return static_cast<T*>(MatrixAllocate(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, size_t n) noexcept {
+        MatrixDeallocate(p, n * sizeof(T));
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const MatrixAllocator<T>&, const MatrixAllocator<U>&) {
+    return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const MatrixAllocator<T>&, const MatrixAllocator<U>&) {
+    return false;
+}
+
+template <typename T>
+using MatrixStorage = std::vector<T, MatrixAllocator<T>>;
+
+#endif // MATRIX_ALLOC_H
@@ -0,0 +1,25 @@
+#ifndef PACKING_H
+#define PACKING_H
+
+#include <stddef.h>
+
+// Every (basis, compression) shape the params table can produce with
+// log(q) = 32: p in (512, 1024] packs 3 10-bit digits per word, p in
+// (256, 512] packs 3 9-bit digits, and p <= 256 packs 4 8-bit digits.
+// Each shape gets its own compile-time specialized packed kernels in
+// pir.c and pir_simd.c. The original hard-coded 10x3 shape comes first.
+#define PACKED_SHAPES(X) \
+  X(10, 3)               \
+  X(9, 3)                \
+  X(8, 4)
+
+#define PACKED_SHAPE_MATCHES(B, C) \
+  if (basis == (B) && compression == (C)) return 1;
+
+static inline int packedShapeSupported(size_t basis, size_t compression)
+{
+  PACKED_SHAPES(PACKED_SHAPE_MATCHES)
+  return 0;
+}
+
+#endif // PACKING_H
@@ -1,98 +1,174 @@
-#include <cmath>    
-#include <string> 
-#include <sstream>  
+#include "params.h"
+#include "packing.h"
+
+#include <cmath>
+#include <string>
+#include <sstream>
+#include <stdexcept>
+#include <memory>
 #include <iostream>
-#include<iostream>
-
-std::string lwe_params;
-
-// Equivalent C++ struct (or class) for the Params struct in Go
-class Params {
-public:
-    uint64_t N;     // LWE secret dimension
-    double Sigma;   // LWE error distribution stddev
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+// The contents of params.csv.
+std::string lwe_params = R"(log(n),log(m),log(q),sigma,log(p_simple),p_simple,p_double
+10,13,32,6.400000,9,991,929
+10,14,32,6.400000,9,833,781
+10,15,32,6.400000,9,701,657
+10,16,32,6.400000,9,589,552
+10,17,32,6.400000,8,495,464
+10,18,32,6.400000,8,416,390
+10,19,32,6.400000,8,350,328
+10,20,32,6.400000,8,294,276
+10,21,32,6.400000,7,247,231
+)";
+
+// Exact log2 of n, or -1 if n is not a power of two.
+static int ExactLog2(uint64_t n) {
+    if (n == 0 || (n & (n - 1)) != 0) {
+        return -1;
+    }
+    int log = 0;
+    while ((uint64_t(1) << log) < n) {
+        log++;
+    }
+    return log;
+}
 
-    uint64_t L;     // DB height
-    uint64_t M;     // DB width
+ParamsTable::ParamsTable(const std::string& csv) {
+    std::istringstream iss(csv);
+    std::string line;
+    std::getline(iss, line); // Skip the header
 
-    uint64_t Logq;  // (logarithm of) ciphertext modulus
-    uint64_t P;     // plaintext modulus
+    while (std::getline(iss, line)) {
+        std::istringstream lineStream(line);
+        std::string item;
+        std::vector<std::string> lineItems;
 
-    // Constructor for initializing the Params
-    Params(){}
-    Params(uint64_t n, double sigma, uint64_t l, uint64_t m, uint64_t logq, uint64_t p)
-        : N(n), Sigma(sigma), L(l), M(m), Logq(logq), P(p) {}
+        while (std::getline(lineStream, item, ',')) {
+            lineItems.push_back(item);
+        }
+        if (lineItems.size() < 7) {
+            continue;
+        }
 
-    // Converted methods from Go
-    uint64_t Delta() const {
-        return (1ULL << Logq) / P;
+        LWEParamsEntry e;
+        e.LogN = std::stoull(lineItems[0]);
+        e.LogM = std::stoull(lineItems[1]);
+        e.LogQ = std::stoull(lineItems[2]);
+        e.Sigma = std::stod(lineItems[3]);
+        e.PSimple = std::stoull(lineItems[5]);
+        e.PDouble = std::stoull(lineItems[6]);
+        // Keep the first row for a key, as the linear scan used to.
+        rows.emplace(std::make_tuple(e.LogN, e.LogQ, e.LogM), e);
     }
+}
 
-    uint64_t delta() const {
-        return static_cast<uint64_t>(std::ceil(static_cast<double>(Logq) / std::log2(static_cast<double>(P))));
+const LWEParamsEntry* ParamsTable::Find(uint64_t n, uint64_t logq, uint64_t num_samples) const {
+    int logn = ExactLog2(n);
+    if (logn < 0) {
+        return nullptr;
     }
-
-    uint64_t Round(uint64_t x) const {
-        uint64_t DeltaVal = Delta();
-        uint64_t v = (x + DeltaVal / 2) / DeltaVal;
-        return v % P;
+    uint64_t logm = 0;
+    while ((uint64_t(1) << logm) < num_samples) {
+        logm++;
     }
+    auto it = rows.lower_bound(std::make_tuple(uint64_t(logn), logq, logm));
+    if (it == rows.end() || it->second.LogN != uint64_t(logn) || it->second.LogQ != logq) {
+        return nullptr;
+    }
+    return &it->second;
+}
+
+std::vector<const LWEParamsEntry*> ParamsTable::Rows(uint64_t n, uint64_t logq) const {
+    std::vector<const LWEParamsEntry*> out;
+    int logn = ExactLog2(n);
+    if (logn < 0) {
+        return out;
+    }
+    auto it = rows.lower_bound(std::make_tuple(uint64_t(logn), logq, uint64_t(0)));
+    for (; it != rows.end() && it->second.LogN == uint64_t(logn) && it->second.LogQ == logq; ++it) {
+        out.push_back(&it->second);
+    }
+    return out;
+}
+
+std::shared_ptr<const ParamsTable> LWEParamsTable() {
+    static std::mutex mu;
+    static std::string parsed_from;
+    static std::shared_ptr<const ParamsTable> table;
+    std::lock_guard<std::mutex> lock(mu);
+    if (!table || parsed_from != lwe_params) {
+        table = std::make_shared<const ParamsTable>(lwe_params);
+        parsed_from = lwe_params;
+    }
+    return table;
+}
 
-    void PickParams(bool doublepir, const std::initializer_list<uint64_t>& samples) {
-        if (N == 0 || Logq == 0) {
-            throw std::runtime_error("Need to specify n and q!");
-        }
-
-        uint64_t num_samples = 0;
-        for (auto ns : samples) {
-            if (ns > num_samples) {
-                num_samples = ns;
-            }
-        }
+Params::Params() {}
 
-        std::istringstream iss(lwe_params);
-        std::string line;
-        std::getline(iss, line); // Skip the first line assuming it's a header or similar
+Params::Params(uint64_t n, double sigma, uint64_t l, uint64_t m, uint64_t logq, uint64_t p)
+    : N(n), Sigma(sigma), L(l), M(m), Logq(logq), P(p) {}
 
-        while (std::getline(iss, line)) {
-            std::istringstream lineStream(line);
-            std::string item;
-            std::vector<std::string> lineItems;
+uint64_t Params::Delta() const {
+    return (1ULL << Logq) / P;
+}
 
-            while (std::getline(lineStream, item, ',')) {
-                lineItems.push_back(item);
-            }
+uint64_t Params::delta() const {
+    return static_cast<uint64_t>(std::ceil(static_cast<double>(Logq) / std::log2(static_cast<double>(P))));
+}
 
-            uint64_t logn = std::stoull(lineItems[0]);
-            uint64_t logm = std::stoull(lineItems[1]);
-            uint64_t logq = std::stoull(lineItems[2]);
+uint64_t Params::Round(uint64_t x) const {
+    uint64_t DeltaVal = Delta();
+    uint64_t v = (x + DeltaVal / 2) / DeltaVal;
+    return v % P;
+}
 
-            if ((N == static_cast<uint64_t>(std::pow(2, logn))) &&
-                (num_samples <= static_cast<uint64_t>(std::pow(2, logm))) &&
-                (Logq == logq)) {
-                Sigma = std::stod(lineItems[3]);
+void Params::PickParams(bool doublepir, const std::initializer_list<uint64_t>& samples) {
+    if (N == 0 || Logq == 0) {
+        throw std::runtime_error("Need to specify n and q!");
+    }
 
-                uint64_t mod = std::stoull(lineItems[doublepir ? 6 : 5]);
-                P = mod;
+    uint64_t num_samples = 0;
+    for (auto ns : samples) {
+        if (ns > num_samples) {
+            num_samples = ns;
+        }
+    }
 
-                if (Sigma == 0.0 || P == 0) {
-                    throw std::runtime_error("Params invalid!");
-                }
+    const LWEParamsEntry* row = LWEParamsTable()->Find(N, Logq, num_samples);
+    if (row != nullptr) {
+        Sigma = row->Sigma;
+        P = doublepir ? row->PDouble : row->PSimple;
 
-                return; // Found and set parameters
-            }
+        if (Sigma == 0.0 || P == 0) {
+            throw std::runtime_error("Params invalid!");
         }
 
-        std::cerr << "Searched for " << N << ", " << L << "-by-" << M << ", " << Logq << ",\n";
-        throw std::runtime_error("No suitable params known!");
+        return; // Found and set parameters
     }
 
-    void PrintParams() const {
-        int dbSize = static_cast<int>(std::log2(L) + std::log2(M));
-        std::cout << "Working with: n=" << N 
-                  << "; db size=2^" << dbSize 
-                  << " (l=" << L << ", m=" << M << "); logq=" << Logq 
-                  << "; p=" << P << "; sigma=" << Sigma << std::endl;
+    std::cerr << "Searched for " << N << ", " << L << "-by-" << M << ", " << Logq << ",\n";
+    throw std::runtime_error("No suitable params known!");
+}
+
+void Params::PrintParams() const {
+    int dbSize = static_cast<int>(std::log2(L) + std::log2(M));
+    std::cout << "Working with: n=" << N 
+              << "; db size=2^" << dbSize 
+              << " (l=" << L << ", m=" << M << "); logq=" << Logq 
+              << "; p=" << P << "; sigma=" << Sigma << std::endl;
+}
+
+std::vector<uint64_t> CandidateModuli(uint64_t max_p) {
+    std::vector<uint64_t> moduli = {max_p};
+#define ADD_SHAPE_MODULUS(B, C)                   \
+    if ((uint64_t(1) << (B)) < max_p) {           \
+        moduli.push_back(uint64_t(1) << (B));     \
     }
-};
-
+    PACKED_SHAPES(ADD_SHAPE_MODULUS)
+#undef ADD_SHAPE_MODULUS
+    return moduli;
+}
@@ -9,8 +9,11 @@
 #include <vector>
 #include <stdexcept>
 #include <initializer_list>
+#include <map>
+#include <memory>
+#include <tuple>
 
-extern std::string lwe_params; // Assuming lwe_params is defined elsewhere
+extern std::string lwe_params; // The LWE params table, in the format of params.csv
 
 class Params {
 public:
@@ -35,4 +38,65 @@ public:
     void PrintParams() const;
 };
 
+// One row of the params table: with secret dimension 2^LogN, modulus
+// 2^LogQ and at most 2^LogM LWE samples, Sigma is the error stddev and
+// PSimple / PDouble the largest plaintext moduli for which SimplePIR /
+// DoublePIR still decrypt correctly.
+struct LWEParamsEntry {
+    uint64_t LogN;
+    uint64_t LogM;
+    uint64_t LogQ;
+    double Sigma;
+    uint64_t PSimple;
+    uint64_t PDouble;
+};
+
+// The params table (lwe_params, in the format of params.csv), parsed once
+// and indexed by (log n, log m, log q).
+class ParamsTable {
+public:
+    explicit ParamsTable(const std::string& csv);
+
+    // The row for dimension n and modulus 2^logq with the fewest samples
+    // that still allows num_samples, or nullptr if there is none. This is
+    // the row Params::PickParams uses.
+    const LWEParamsEntry* Find(uint64_t n, uint64_t logq, uint64_t num_samples) const;
+
+    // Every row for dimension n and modulus 2^logq, by increasing LogM.
+    std::vector<const LWEParamsEntry*> Rows(uint64_t n, uint64_t logq) const;
+
+private:
+    // Keyed by (log n, log q, log m), so that the rows for one (n, q) are
+    // adjacent and ordered by the number of samples they allow.
+    std::map<std::tuple<uint64_t, uint64_t, uint64_t>, LWEParamsEntry> rows;
+};
+
+// The table for the current contents of lwe_params. Parsed on first use
+// and again only if lwe_params has changed since; tables returned earlier
+// stay valid.
+std::shared_ptr<const ParamsTable> LWEParamsTable();
+
+// What the solver in SimplePIR::PickParams optimizes for.
+enum class ParamsObjective {
+    // Fewest bytes of (squished) DB scanned per query.
+    MaxThroughput,
+    // Smallest hint, i.e. offline download.
+    MinOfflineDownload,
+    // Least query upload plus answer download.
+    MinOnlineComm,
+};
+
+// Per-query costs of a parameter choice, in bytes.
+struct ParamsCost {
+    double ScanBytes;
+    double HintBytes;
+    double UploadBytes;
+    double DownloadBytes;
+};
+
+// Plaintext moduli worth trying for a params table row whose largest is
+// max_p: max_p itself, then the largest p of every packed shape (see
+// packing.h) below it, which may pack more digits per word.
+std::vector<uint64_t> CandidateModuli(uint64_t max_p);
+
 #endif // PARAMS_H
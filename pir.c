@@ -1,47 +1,177 @@
 
 #include "pir.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
 
-// Hard-coded, to allow for compiler optimizations:
-#define COMPRESSION 3
-#define BASIS       10
-#define BASIS2      BASIS*2
-#define MASK        (1<<BASIS)-1
+// Cache-blocking parameters for matMul: a BLOCK_K-by-BLOCK_J panel of b
+// stays resident in L2 while BLOCK_I rows of a stream over it.
+#define BLOCK_I 64
+#define BLOCK_K 256
+#define BLOCK_J 512
+
+// Computes one (i, k, j) tile of out += a*b, four rows of a at a time so
+// that each loaded row of b is reused from registers across four outputs.
+// Arithmetic wraps mod 2^32, so no reduction is needed.
+static void matMulTile(Elem *out, const Elem *a, const Elem *b,
+    size_t aCols, size_t bCols,
+    size_t i0, size_t i1, size_t k0, size_t k1, size_t j0, size_t j1)
+{
+  size_t i = i0;
+  for (; i + 4 <= i1; i += 4) {
+    Elem *o0 = out + bCols*(i+0);
+    Elem *o1 = out + bCols*(i+1);
+    Elem *o2 = out + bCols*(i+2);
+    Elem *o3 = out + bCols*(i+3);
+    for (size_t k = k0; k < k1; k++) {
+      const Elem a0 = a[aCols*(i+0) + k];
+      const Elem a1 = a[aCols*(i+1) + k];
+      const Elem a2 = a[aCols*(i+2) + k];
+      const Elem a3 = a[aCols*(i+3) + k];
+      const Elem *bk = b + bCols*k;
+      for (size_t j = j0; j < j1; j++) {
+        o0[j] += a0*bk[j];
+        o1[j] += a1*bk[j];
+        o2[j] += a2*bk[j];
+        o3[j] += a3*bk[j];
+      }
+    }
+  }
+  for (; i < i1; i++) {
+    Elem *o = out + bCols*i;
+    for (size_t k = k0; k < k1; k++) {
+      const Elem av = a[aCols*i + k];
+      const Elem *bk = b + bCols*k;
+      for (size_t j = j0; j < j1; j++) {
+        o[j] += av*bk[j];
+      }
+    }
+  }
+}
 
 void matMul(Elem *out, const Elem *a, const Elem *b,
     size_t aRows, size_t aCols, size_t bCols)
 {
-  for (size_t i = 0; i < aRows; i++) {
-    for (size_t k = 0; k < aCols; k++) {
-      for (size_t j = 0; j < bCols; j++) {
-        out[bCols*i + j] += a[aCols*i + k]*b[bCols*k + j];
+  for (size_t j0 = 0; j0 < bCols; j0 += BLOCK_J) {
+    size_t j1 = (j0 + BLOCK_J < bCols) ? j0 + BLOCK_J : bCols;
+    for (size_t k0 = 0; k0 < aCols; k0 += BLOCK_K) {
+      size_t k1 = (k0 + BLOCK_K < aCols) ? k0 + BLOCK_K : aCols;
+      for (size_t i0 = 0; i0 < aRows; i0 += BLOCK_I) {
+        size_t i1 = (i0 + BLOCK_I < aRows) ? i0 + BLOCK_I : aRows;
+        matMulTile(out, a, b, aCols, bCols, i0, i1, k0, k1, j0, j1);
       }
     }
   }
 }
 
-void matMulTransposedPacked(Elem *out, const Elem *a, const Elem *b,
-    size_t aRows, size_t aCols, size_t bRows, size_t bCols)
+struct matMulJob {
+  Elem *out;
+  const Elem *a;
+  const Elem *b;
+  size_t aRows, aCols, bCols;
+};
+
+static void *matMulWorker(void *arg)
+{
+  struct matMulJob *job = (struct matMulJob *) arg;
+  matMul(job->out, job->a, job->b, job->aRows, job->aCols, job->bCols);
+  return NULL;
+}
+
+void matMulParallel(Elem *out, const Elem *a, const Elem *b,
+    size_t aRows, size_t aCols, size_t bCols, size_t nThreads)
+{
+  if (nThreads == 0) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    nThreads = (n > 0) ? (size_t) n : 1;
+  }
+  // Give every thread at least one full row block, so that the split
+  // never costs more in b-panel reloads than it gains in parallelism.
+  size_t maxThreads = (aRows + BLOCK_I - 1) / BLOCK_I;
+  if (nThreads > maxThreads) {
+    nThreads = maxThreads;
+  }
+  if (nThreads <= 1) {
+    matMul(out, a, b, aRows, aCols, bCols);
+    return;
+  }
+
+  pthread_t threads[nThreads];
+  struct matMulJob jobs[nThreads];
+  int started[nThreads];
+  size_t rowsPer = (aRows + nThreads - 1) / nThreads;
+
+  for (size_t t = 0; t < nThreads; t++) {
+    size_t start = t*rowsPer;
+    started[t] = 0;
+    if (start >= aRows) {
+      continue;
+    }
+    size_t rows = (start + rowsPer < aRows) ? rowsPer : aRows - start;
+    jobs[t].out = out + bCols*start;
+    jobs[t].a = a + aCols*start;
+    jobs[t].b = b;
+    jobs[t].aRows = rows;
+    jobs[t].aCols = aCols;
+    jobs[t].bCols = bCols;
+    if (pthread_create(&threads[t], NULL, matMulWorker, &jobs[t]) == 0) {
+      started[t] = 1;
+    } else {
+      // Fall back to doing this slice on the calling thread.
+      matMulWorker(&jobs[t]);
+    }
+  }
+  for (size_t t = 0; t < nThreads; t++) {
+    if (started[t]) {
+      pthread_join(threads[t], NULL);
+    }
+  }
+}
+
+// The packed kernels below are written once, generically in (basis,
+// compression), and forced inline into one wrapper per shape listed in
+// PACKED_SHAPES. Since both arguments are then compile-time constants, each
+// wrapper gets fully unrolled digit loops and immediate shifts, just like
+// the original hard-coded 10-bit, 3-digit kernels.
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+
+// matMulTransposedPacked takes its long-row loop when
+// aRows*100 > aCols*transposedCrossover. Defaults to the square case.
+static size_t transposedCrossover = 100;
+
+void setMatMulTransposedPackedCrossover(size_t percent)
+{
+  transposedCrossover = percent;
+}
+
+size_t matMulTransposedPackedCrossover(void)
+{
+  return transposedCrossover;
+}
+
+ALWAYS_INLINE void matMulTransposedPackedGeneric(Elem *out, const Elem *a,
+    const Elem *b, size_t aRows, size_t aCols, size_t bRows, size_t bCols,
+    const unsigned basis, const unsigned compression)
 {
+  const Elem mask = (((Elem) 1) << basis) - 1;
   Elem val, tmp, db;
   Elem tmp2, tmp3, tmp4, tmp5, tmp6, tmp7, tmp8;
-  Elem db2, db3, db4, db5, db6, db7, db8;
-  Elem val2, val3, val4, val5, vl6, val7, val8;
   size_t ind1, ind2;
 
-  if (aRows > aCols) { // when the database rows are long
+  // The short-row loop handles 8 rows of b at a time.
+  if (aRows*100 > aCols*transposedCrossover || bRows % 8 != 0) { // when the database rows are long
     ind1 = 0;
     for (size_t i = 0; i < aRows; i += 1) {
       for (size_t k = 0; k < aCols; k += 1) {
         db = a[ind1++];
-    	val = db & MASK;
-    	val2 = (db >> BASIS) & MASK;
-    	val3 = (db >> BASIS2) & MASK;
-        for (size_t j = 0; j < bRows; j += 1) {
-	  out[bRows*i+j] += val*b[k*COMPRESSION+j*bCols];
-	  out[bRows*i+j] += val2*b[k*COMPRESSION+j*bCols+1];
-	  out[bRows*i+j] += val3*b[k*COMPRESSION+j*bCols+2];
-	}
+        for (unsigned m = 0; m < compression; m++) {
+          val = (db >> (m*basis)) & mask;
+          for (size_t j = 0; j < bRows; j += 1) {
+            out[bRows*i+j] += val*b[k*compression+j*bCols+m];
+          }
+        }
       }
     }
   } else { // when the database rows are short
@@ -49,18 +179,18 @@ void matMulTransposedPacked(Elem *out, const Elem *a, const Elem *b,
       ind1 = 0;
       for (size_t i = 0; i < aRows; i += 1) {
         tmp = 0;
-	tmp2 = 0;
+        tmp2 = 0;
         tmp3 = 0;
-	tmp4 = 0;
-	tmp5 = 0;
-	tmp6 = 0;
-	tmp7 = 0;
-	tmp8 = 0;
+        tmp4 = 0;
+        tmp5 = 0;
+        tmp6 = 0;
+        tmp7 = 0;
+        tmp8 = 0;
         ind2 = 0;
         for (size_t k = 0; k < aCols; k += 1) {
           db = a[ind1++];
-          for (int m = 0; m < COMPRESSION; m++) {
-            val = (db >> (m*BASIS)) & MASK;
+          for (unsigned m = 0; m < compression; m++) {
+            val = (db >> (m*basis)) & mask;
             tmp += val*b[ind2+(j+0)*bCols];
             tmp2 += val*b[ind2+(j+1)*bCols];
             tmp3 += val*b[ind2+(j+2)*bCols];
@@ -85,29 +215,18 @@ void matMulTransposedPacked(Elem *out, const Elem *a, const Elem *b,
   }
 }
 
-void matMulVec(Elem *out, const Elem *a, const Elem *b,
-    size_t aRows, size_t aCols)
-{
-  Elem tmp;
-  for (size_t i = 0; i < aRows; i++) {
-    tmp = 0;
-    for (size_t j = 0; j < aCols; j++) {
-      tmp += a[aCols*i + j]*b[j];
-    }
-    out[i] = tmp;
-  }
-}
-
-void matMulVecPacked(Elem *out, const Elem *a, const Elem *b,
-    size_t aRows, size_t aCols)
+ALWAYS_INLINE void matMulVecPackedGeneric(Elem *out, const Elem *a,
+    const Elem *b, size_t aRows, size_t aCols, size_t aStride,
+    const unsigned basis, const unsigned compression)
 {
+  const Elem mask = (((Elem) 1) << basis) - 1;
   Elem db, db2, db3, db4, db5, db6, db7, db8;
-  Elem val, val2, val3, val4, val5, val6, val7, val8;
   Elem tmp, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7, tmp8;
+  unsigned shift;
   size_t index = 0;
   size_t index2;
 
-  for (size_t i = 0; i < aRows; i += 8) {
+  for (size_t i = 0; i + 8 <= aRows; i += 8) {
     tmp  = 0;
     tmp2 = 0;
     tmp3 = 0;
@@ -120,67 +239,26 @@ void matMulVecPacked(Elem *out, const Elem *a, const Elem *b,
     index2 = 0;
     for (size_t j = 0; j < aCols; j++) {
       db  = a[index];
-      db2 = a[index+1*aCols];
-      db3 = a[index+2*aCols];
-      db4 = a[index+3*aCols];
-      db5 = a[index+4*aCols];
-      db6 = a[index+5*aCols];
-      db7 = a[index+6*aCols];
-      db8 = a[index+7*aCols];
-
-      val  = db & MASK;
-      val2 = db2 & MASK;
-      val3 = db3 & MASK;
-      val4 = db4 & MASK;
-      val5 = db5 & MASK;
-      val6 = db6 & MASK;
-      val7 = db7 & MASK;
-      val8 = db8 & MASK;
-      tmp  += val*b[index2];
-      tmp2 += val2*b[index2];
-      tmp3 += val3*b[index2];
-      tmp4 += val4*b[index2];
-      tmp5 += val5*b[index2];
-      tmp6 += val6*b[index2];
-      tmp7 += val7*b[index2];
-      tmp8 += val8*b[index2];
-      index2 += 1;
-
-      val  = (db >> BASIS) & MASK;
-      val2 = (db2 >> BASIS) & MASK;
-      val3 = (db3 >> BASIS) & MASK;
-      val4 = (db4 >> BASIS) & MASK;
-      val5 = (db5 >> BASIS) & MASK;
-      val6 = (db6 >> BASIS) & MASK;
-      val7 = (db7 >> BASIS) & MASK;
-      val8 = (db8 >> BASIS) & MASK;
-      tmp  += val*b[index2];
-      tmp2 += val2*b[index2];
-      tmp3 += val3*b[index2];
-      tmp4 += val4*b[index2];
-      tmp5 += val5*b[index2];
-      tmp6 += val6*b[index2];
-      tmp7 += val7*b[index2];
-      tmp8 += val8*b[index2];
-      index2 += 1;
-
-      val  = (db >> BASIS2) & MASK;
-      val2 = (db2 >> BASIS2) & MASK;
-      val3 = (db3 >> BASIS2) & MASK;
-      val4 = (db4 >> BASIS2) & MASK;
-      val5 = (db5 >> BASIS2) & MASK;
-      val6 = (db6 >> BASIS2) & MASK;
-      val7 = (db7 >> BASIS2) & MASK;
-      val8 = (db8 >> BASIS2) & MASK;
-      tmp  += val*b[index2];
-      tmp2 += val2*b[index2];
-      tmp3 += val3*b[index2];
-      tmp4 += val4*b[index2];
-      tmp5 += val5*b[index2];
-      tmp6 += val6*b[index2];
-      tmp7 += val7*b[index2];
-      tmp8 += val8*b[index2];
-      index2 += 1;
+      db2 = a[index+1*aStride];
+      db3 = a[index+2*aStride];
+      db4 = a[index+3*aStride];
+      db5 = a[index+4*aStride];
+      db6 = a[index+5*aStride];
+      db7 = a[index+6*aStride];
+      db8 = a[index+7*aStride];
+
+      for (unsigned m = 0; m < compression; m++) {
+        shift = m*basis;
+        tmp  += ((db  >> shift) & mask)*b[index2];
+        tmp2 += ((db2 >> shift) & mask)*b[index2];
+        tmp3 += ((db3 >> shift) & mask)*b[index2];
+        tmp4 += ((db4 >> shift) & mask)*b[index2];
+        tmp5 += ((db5 >> shift) & mask)*b[index2];
+        tmp6 += ((db6 >> shift) & mask)*b[index2];
+        tmp7 += ((db7 >> shift) & mask)*b[index2];
+        tmp8 += ((db8 >> shift) & mask)*b[index2];
+        index2 += 1;
+      }
       index += 1;
     }
     out[i]   += tmp;
@@ -191,15 +269,309 @@ void matMulVecPacked(Elem *out, const Elem *a, const Elem *b,
     out[i+5] += tmp6;
     out[i+6] += tmp7;
     out[i+7] += tmp8;
-    index += aCols*7;
+    index += aStride*8 - aCols;
+  }
+
+  for (size_t i = aRows & ~(size_t) 7; i < aRows; i++) {
+    tmp = 0;
+    index2 = 0;
+    for (size_t j = 0; j < aCols; j++) {
+      db = a[aStride*i + j];
+      for (unsigned m = 0; m < compression; m++) {
+        tmp += ((db >> (m*basis)) & mask)*b[index2];
+        index2 += 1;
+      }
+    }
+    out[i] += tmp;
   }
 }
 
-void transpose(Elem *out, const Elem *in, size_t rows, size_t cols)
+// out (aRows x bCols) += a * b, where a is a packed DB slice and each column
+// of b ((aCols*compression) x bCols) is one query, so a single pass over the
+// DB answers bCols queries. The DB is walked in column blocks of
+// MAT_BLOCK_COLS words; within a block, groups of four rows are multiplied
+// against MAT_CHUNK queries at a time, so each DB tile is decoded from L1
+// once per chunk and each query row is loaded once per four DB rows.
+#define MAT_BLOCK_COLS 512
+#define MAT_CHUNK      16
+
+ALWAYS_INLINE void matMulMatPackedGeneric(Elem *out, const Elem *a,
+    const Elem *b, size_t aRows, size_t aCols, size_t aStride, size_t bCols,
+    const unsigned basis, const unsigned compression)
 {
+  const Elem mask = (((Elem) 1) << basis) - 1;
+  Elem acc[4][MAT_CHUNK];
+  Elem db[4];
+
+  for (size_t j0 = 0; j0 < aCols; j0 += MAT_BLOCK_COLS) {
+    size_t j1 = (j0 + MAT_BLOCK_COLS < aCols) ? j0 + MAT_BLOCK_COLS : aCols;
+    for (size_t i = 0; i < aRows; i += 4) {
+      size_t rows = (aRows - i < 4) ? aRows - i : 4;
+      for (size_t q0 = 0; q0 < bCols; q0 += MAT_CHUNK) {
+        size_t qn = (bCols - q0 < MAT_CHUNK) ? bCols - q0 : MAT_CHUNK;
+        memset(acc, 0, sizeof(acc));
+        for (size_t j = j0; j < j1; j++) {
+          for (size_t r = 0; r < rows; r++) {
+            db[r] = a[aStride*(i+r) + j];
+          }
+          for (unsigned m = 0; m < compression; m++) {
+            const Elem *bq = b + (j*compression + m)*bCols + q0;
+            for (size_t r = 0; r < rows; r++) {
+              Elem val = (db[r] >> (m*basis)) & mask;
+              for (size_t q = 0; q < qn; q++) {
+                acc[r][q] += val*bq[q];
+              }
+            }
+          }
+        }
+        for (size_t r = 0; r < rows; r++) {
+          for (size_t q = 0; q < qn; q++) {
+            out[(i+r)*bCols + q0 + q] += acc[r][q];
+          }
+        }
+      }
+    }
+  }
+}
+
+#define DEFINE_SCALAR_PACKED_KERNELS(B, C) \
+  void matMulTransposedPacked_##B##x##C(Elem *out, const Elem *a, \
+      const Elem *b, size_t aRows, size_t aCols, size_t bRows, size_t bCols) \
+  { \
+    matMulTransposedPackedGeneric(out, a, b, aRows, aCols, bRows, bCols, B, C); \
+  } \
+  void matMulVecPackedScalar_##B##x##C(Elem *out, const Elem *a, \
+      const Elem *b, size_t aRows, size_t aCols, size_t aStride) \
+  { \
+    matMulVecPackedGeneric(out, a, b, aRows, aCols, aStride, B, C); \
+  } \
+  void matMulMatPackedScalar_##B##x##C(Elem *out, const Elem *a, \
+      const Elem *b, size_t aRows, size_t aCols, size_t aStride, size_t bCols) \
+  { \
+    matMulMatPackedGeneric(out, a, b, aRows, aCols, aStride, bCols, B, C); \
+  }
+
+PACKED_SHAPES(DEFINE_SCALAR_PACKED_KERNELS)
+
+void matMulTransposedPacked(Elem *out, const Elem *a, const Elem *b,
+    size_t aRows, size_t aCols, size_t bRows, size_t bCols)
+{
+  matMulTransposedPacked_10x3(out, a, b, aRows, aCols, bRows, bCols);
+}
+
+void matMulVec(Elem *out, const Elem *a, const Elem *b,
+    size_t aRows, size_t aCols)
+{
+  Elem tmp;
+  for (size_t i = 0; i < aRows; i++) {
+    tmp = 0;
+    for (size_t j = 0; j < aCols; j++) {
+      tmp += a[aCols*i + j]*b[j];
+    }
+    out[i] = tmp;
+  }
+}
+
+// Rows of A expanded per pass; the scratch is SEEDED_ROWS * aCols entries.
+#define SEEDED_ROWS 8
+
+int matMulVecSeeded(Elem *out, const PrgKey *key, unsigned logq,
+    const Elem *b, const Elem *e, size_t firstRow, size_t aRows, size_t aCols)
+{
+  Elem *rows = (Elem *) malloc(sizeof(Elem) * SEEDED_ROWS * aCols);
+  if (rows == NULL) {
+    return -1;
+  }
+  for (size_t i = 0; i < aRows; i += SEEDED_ROWS) {
+    size_t n = (aRows - i < SEEDED_ROWS) ? aRows - i : SEEDED_ROWS;
+    for (size_t r = 0; r < n; r++) {
+      prgMatrixRow(key, firstRow + i + r, aCols, logq, rows + r*aCols);
+    }
+    matMulVec(out + i, rows, b, n, aCols);
+    if (e != NULL) {
+      for (size_t r = 0; r < n; r++) {
+        out[i+r] += e[i+r];
+      }
+    }
+  }
+  free(rows);
+  return 0;
+}
+
+void matMulVecPackedScalar(Elem *out, const Elem *a, const Elem *b,
+    size_t aRows, size_t aCols)
+{
+  matMulVecPackedScalar_10x3(out, a, b, aRows, aCols, aCols);
+}
+
+void transpose8x8Scalar(Elem *out, size_t outStride, const Elem *in,
+    size_t inStride)
+{
+  for (size_t i = 0; i < 8; i++) {
+    for (size_t j = 0; j < 8; j++) {
+      out[j*outStride+i] = in[i*inStride+j];
+    }
+  }
+}
+
+// Transposes are cache-oblivious: the larger dimension is halved (on a
+// multiple of 8) until a block fits in TRANSPOSE_LEAF x TRANSPOSE_LEAF, so
+// both the reads and the strided writes of every leaf stay within a few
+// pages at every level of the memory hierarchy, without tuning for any one
+// cache size. Leaves are transposed 8x8 at a time in registers.
+#define TRANSPOSE_LEAF 64
+
+static void transposeLeaf(Elem *out, size_t outStride, const Elem *in,
+    size_t inStride, size_t rows, size_t cols)
+{
+  size_t rows8 = rows & ~(size_t) 7;
+  size_t cols8 = cols & ~(size_t) 7;
+  for (size_t i = 0; i < rows8; i += 8) {
+    for (size_t j = 0; j < cols8; j += 8) {
+      transpose8x8(out + j*outStride + i, outStride, in + i*inStride + j, inStride);
+    }
+  }
   for (size_t i = 0; i < rows; i++) {
-    for (size_t j = 0; j < cols; j++) {
-      out[j*rows+i] = in[i*cols+j];
+    for (size_t j = (i < rows8) ? cols8 : 0; j < cols; j++) {
+      out[j*outStride+i] = in[i*inStride+j];
+    }
+  }
+}
+
+static void transposeBlock(Elem *out, size_t outStride, const Elem *in,
+    size_t inStride, size_t rows, size_t cols)
+{
+  if (rows <= TRANSPOSE_LEAF && cols <= TRANSPOSE_LEAF) {
+    transposeLeaf(out, outStride, in, inStride, rows, cols);
+  } else if (rows >= cols) {
+    size_t h = (rows / 2) & ~(size_t) 7;
+    transposeBlock(out, outStride, in, inStride, h, cols);
+    transposeBlock(out + h, outStride, in + h*inStride, inStride, rows - h, cols);
+  } else {
+    size_t h = (cols / 2) & ~(size_t) 7;
+    transposeBlock(out, outStride, in, inStride, rows, h);
+    transposeBlock(out + h*outStride, outStride, in + h, inStride, rows, cols - h);
+  }
+}
+
+void transpose(Elem *out, const Elem *in, size_t rows, size_t cols)
+{
+  transposeBlock(out, rows, in, cols, rows, cols);
+}
+
+// Swaps the n-by-n block at (i, j) with the transpose of the one at (j, i),
+// both inside a square matrix with row stride `stride`; i == j transposes
+// the diagonal block onto itself. tmp holds n*n elements.
+static void swapTransposed(Elem *m, size_t stride, size_t i, size_t j,
+    size_t n, Elem *tmp)
+{
+  Elem *a = m + i*stride + j;
+  Elem *b = m + j*stride + i;
+  transposeBlock(tmp, n, a, stride, n, n);
+  if (i != j) {
+    transposeBlock(a, stride, b, stride, n, n);
+  }
+  for (size_t r = 0; r < n; r++) {
+    memcpy(b + r*stride, tmp + r*n, n*sizeof(Elem));
+  }
+}
+
+// In-place transpose of an n-by-n matrix with row stride `stride`, one
+// TRANSPOSE_LEAF-sized block pair at a time.
+static void transposeSquareInPlace(Elem *m, size_t n, size_t stride, Elem *tmp)
+{
+  const size_t t = TRANSPOSE_LEAF;
+  size_t full = n - n % t;
+  for (size_t i = 0; i < full; i += t) {
+    for (size_t j = i; j < full; j += t) {
+      swapTransposed(m, stride, i, j, t, tmp);
+    }
+  }
+  for (size_t i = 0; i < n; i++) {
+    for (size_t j = (i < full) ? full : i + 1; j < n; j++) {
+      Elem x = m[i*stride+j];
+      m[i*stride+j] = m[j*stride+i];
+      m[j*stride+i] = x;
+    }
+  }
+}
+
+// Transposes a rows-by-cols matrix whose entries are runs of `unit`
+// consecutive elements, in place, by following the cycles of the
+// permutation p -> p*rows mod (rows*cols - 1). Whole units are moved with
+// memcpy through tmp (unit elements), and a bitmap of rows*cols bits marks
+// the units already placed. Returns -1 if the bitmap cannot be allocated.
+static int transposeUnits(Elem *m, size_t rows, size_t cols, size_t unit,
+    Elem *tmp)
+{
+  size_t n = rows*cols;
+  if (rows <= 1 || cols <= 1) {
+    return 0;
+  }
+  unsigned char *done = (unsigned char *) calloc((n + 7) / 8, 1);
+  if (done == NULL) {
+    return -1;
+  }
+  const size_t bytes = unit*sizeof(Elem);
+  for (size_t start = 1; start + 1 < n; start++) {
+    if (done[start / 8] & (1 << (start % 8))) {
+      continue;
+    }
+    // Walk the cycle backwards, pulling each unit from its source.
+    memcpy(tmp, m + start*unit, bytes);
+    size_t dst = start;
+    for (;;) {
+      done[dst / 8] |= 1 << (dst % 8);
+      size_t src = (dst % rows)*cols + dst / rows;
+      if (src == start) {
+        break;
+      }
+      memcpy(m + dst*unit, m + src*unit, bytes);
+      dst = src;
+    }
+    memcpy(m + dst*unit, tmp, bytes);
+  }
+  free(done);
+  return 0;
+}
+
+// A tall matrix (rows = k*cols) is k stacked squares: each square is
+// transposed in place and then whole rows of the result are interleaved.
+// A wide one (cols = k*rows) does the same in reverse. Any other shape
+// falls back to element-wise cycle following. Extra memory is at most a
+// few tiles plus a bitmap of one bit per moved unit.
+int transposeInPlace(Elem *m, size_t rows, size_t cols)
+{
+  if (rows <= 1 || cols <= 1) {
+    return 0;
+  }
+  size_t sq = (rows < cols) ? rows : cols;
+  size_t tmpLen = TRANSPOSE_LEAF*TRANSPOSE_LEAF;
+  if (tmpLen < sq) {
+    tmpLen = sq;
+  }
+  Elem *tmp = (Elem *) malloc(tmpLen*sizeof(Elem));
+  if (tmp == NULL) {
+    return -1;
+  }
+
+  int err = 0;
+  if (rows % cols == 0) {
+    size_t k = rows / cols;
+    for (size_t b = 0; b < k; b++) {
+      transposeSquareInPlace(m + b*cols*cols, cols, cols, tmp);
+    }
+    // Row r of square b must move to row r, unit b of the result.
+    err = transposeUnits(m, k, cols, cols, tmp);
+  } else if (cols % rows == 0) {
+    size_t k = cols / rows;
+    err = transposeUnits(m, rows, k, rows, tmp);
+    for (size_t b = 0; b < k; b++) {
+      transposeSquareInPlace(m + b*rows*rows, rows, rows, tmp);
     }
+  } else {
+    err = transposeUnits(m, rows, cols, 1, tmp);
   }
+  free(tmp);
+  return err;
 }
@@ -1,18 +1,129 @@
+#ifndef PIR_H
+#define PIR_H
+
 #include <stdint.h>
 #include <stddef.h>
+#include "packing.h"
+#include "prg.h"
 
 typedef uint32_t Elem;
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 void transpose(Elem *out, const Elem *in, size_t rows, size_t cols);
 
+// Transposes a rows-by-cols matrix in place, without a second copy of it.
+// Returns 0 on success and -1 if scratch space could not be allocated.
+int transposeInPlace(Elem *m, size_t rows, size_t cols);
+
+// Writes the transpose of the 8x8 block at in (row stride inStride) to out
+// (row stride outStride). Dispatched like matMulVecPacked.
+void transpose8x8(Elem *out, size_t outStride, const Elem *in,
+    size_t inStride);
+
+void transpose8x8Scalar(Elem *out, size_t outStride, const Elem *in,
+    size_t inStride);
+
 void matMul(Elem *out, const Elem *a, const Elem *b,
     size_t aRows, size_t aCols, size_t bCols);
 
+// Splits the rows of a across nThreads workers (0 = one per online core).
+void matMulParallel(Elem *out, const Elem *a, const Elem *b,
+    size_t aRows, size_t aCols, size_t bCols, size_t nThreads);
+
 void matMulTransposedPacked(Elem *out, const Elem *a, const Elem *b,
     size_t aRows, size_t aCols, size_t bRows, size_t bCols);
 
+// The packed transposed products use their long-row loop when
+// aRows*100 > aCols*percent (or when bRows is not a multiple of 8), and
+// their short-row loop otherwise. The default is 100, i.e. aRows > aCols.
+void setMatMulTransposedPackedCrossover(size_t percent);
+size_t matMulTransposedPackedCrossover(void);
+
 void matMulVec(Elem *out, const Elem *a, const Elem *b,
     size_t aRows, size_t aCols);
 
+// out = A*b + e for rows [firstRow, firstRow + aRows) of the matrix with
+// aCols columns that prgMatrixRow expands from key (entries mod 2^logq). A is never materialized: rows are
+// generated a few at a time and consumed at once, so memory stays O(aCols).
+// e may be NULL. Returns -1 if the row scratch cannot be allocated.
+int matMulVecSeeded(Elem *out, const PrgKey *key, unsigned logq,
+    const Elem *b, const Elem *e, size_t firstRow, size_t aRows, size_t aCols);
+
+// Dispatches to the widest variant below that the host CPU supports;
+// the choice is made once, from cpuid, when the library is loaded.
 void matMulVecPacked(Elem *out, const Elem *a, const Elem *b,
     size_t aRows, size_t aCols);
+
+// Name of the variant matMulVecPacked dispatches to ("avx512", "avx2",
+// "sse4.2" or "scalar").
+const char *matMulVecPackedVariant(void);
+
+// Writes the names of up to max variants the host supports to names,
+// widest first, and returns how many there are.
+size_t packedKernelVariants(const char **names, size_t max);
+
+// Points every shape in the dispatch table at the named variant instead
+// of the widest one. Returns -1, and changes nothing, if the host does not
+// support it. Not safe while other threads are running packed kernels.
+int selectPackedKernelVariant(const char *name);
+
+void matMulVecPackedScalar(Elem *out, const Elem *a, const Elem *b,
+    size_t aRows, size_t aCols);
+
+void matMulVecPackedSSE42(Elem *out, const Elem *a, const Elem *b,
+    size_t aRows, size_t aCols);
+
+void matMulVecPackedAVX2(Elem *out, const Elem *a, const Elem *b,
+    size_t aRows, size_t aCols);
+
+void matMulVecPackedAVX512(Elem *out, const Elem *a, const Elem *b,
+    size_t aRows, size_t aCols);
+
+#define DECLARE_PACKED_KERNELS(B, C)                                      \
+  void matMulTransposedPacked_##B##x##C(Elem *out, const Elem *a,         \
+      const Elem *b, size_t aRows, size_t aCols, size_t bRows, size_t bCols); \
+  void matMulVecPackedScalar_##B##x##C(Elem *out, const Elem *a,          \
+      const Elem *b, size_t aRows, size_t aCols, size_t aStride);         \
+  void matMulMatPackedScalar_##B##x##C(Elem *out, const Elem *a,          \
+      const Elem *b, size_t aRows, size_t aCols, size_t aStride, size_t bCols);
+
+PACKED_SHAPES(DECLARE_PACKED_KERNELS)
+
+// The table kernels take the distance between consecutive rows of a
+// (aStride >= aCols), so they can run directly on a row/column slice of a
+// larger squished DB without copying it out first.
+typedef void (*matMulVecPackedFn)(Elem *out, const Elem *a, const Elem *b,
+    size_t aRows, size_t aCols, size_t aStride);
+
+// Multi-query product: b holds one query per column, (aCols*compression)
+// rows by bCols, and out (aRows by bCols, row-major) accumulates a*b. All
+// bCols queries are answered in a single pass over a.
+typedef void (*matMulMatPackedFn)(Elem *out, const Elem *a, const Elem *b,
+    size_t aRows, size_t aCols, size_t aStride, size_t bCols);
+
+typedef void (*matMulTransposedPackedFn)(Elem *out, const Elem *a,
+    const Elem *b, size_t aRows, size_t aCols, size_t bRows, size_t bCols);
+
+// One row of the packed-kernel dispatch table. matMulVecPacked and
+// matMulMatPacked already point at the widest SIMD variants the host
+// supports for this shape.
+typedef struct {
+  size_t basis;
+  size_t compression;
+  matMulVecPackedFn matMulVecPacked;
+  matMulMatPackedFn matMulMatPacked;
+  matMulTransposedPackedFn matMulTransposedPacked;
+} PackedKernels;
+
+// Returns the kernels specialized for (basis, compression), or NULL if
+// that shape is not in PACKED_SHAPES.
+const PackedKernels *packedKernels(size_t basis, size_t compression);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PIR_H
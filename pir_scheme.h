@@ -0,0 +1,77 @@
+#ifndef PIR_SCHEME_H
+#define PIR_SCHEME_H
+
+#include <cstdint>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "database.h"
+#include "params.h"
+#include "utils.h"
+
+class HintCache;
+
+// Defines the interface for PIR with preprocessing schemes, implemented by
+// SimplePIR (simple_pir.h) and DoublePIR (double_pir.h).
+class PIR {
+public:
+    virtual ~PIR() = default;
+
+    virtual std::string Name() const = 0;
+
+    virtual Params PickParams(uint64_t N, uint64_t d, uint64_t n, uint64_t logq) = 0;
+    virtual Params PickParamsGivenDimensions(uint64_t l, uint64_t m, uint64_t n, uint64_t logq) = 0;
+
+    virtual void GetBW(const DBinfo& info, const Params& p) = 0;
+
+    virtual State Init(const DBinfo& info, const Params& p) = 0;
+    virtual std::pair<State, CompressedState> InitCompressed(const DBinfo& info, const Params& p) = 0;
+    virtual std::pair<State, CompressedState> InitCompressedSeeded(const DBinfo& info, const Params& p,
+                                                                   PRGKey* seed) = 0;
+    virtual State DecompressState(const DBinfo& info, const Params& p, const CompressedState& comp) = 0;
+
+    virtual std::pair<State, Msg> Setup(Database* DB, const State& shared, const Params& p) = 0;
+    virtual std::pair<State, double> FakeSetup(Database* DB, const Params& p) = 0;
+
+    virtual std::pair<State, Msg> Query(uint64_t i, const State& shared, const Params& p, const DBinfo& info) = 0;
+    // As Query, for a client that holds only the seed of the shared state.
+    virtual std::pair<State, Msg> QueryCompressed(uint64_t i, const CompressedState& comp, const Params& p,
+                                                  const DBinfo& info) = 0;
+
+    virtual Msg Answer(Database* DB, const std::vector<Msg>& query, const State& server, const State& shared,
+                       const Params& p) = 0;
+
+    virtual uint64_t Recover(uint64_t i, uint64_t batch_index, const Msg& offline, const Msg& query,
+                             const Msg& answer, const State& shared, const State& client, const Params& p,
+                             const DBinfo& info) = 0;
+
+    virtual void Reset(Database* DB, const Params& p) = 0;
+};
+
+// Run PIR's online phase, with a random preprocessing (to skip the offline
+// phase). Gives accurate bandwidth and online time measurements. Returns
+// the rate (MB/s), and the total, offline and online communication (KB).
+std::tuple<double, double, double, double> RunFakePIR(PIR& pi, Database* DB, Params& p,
+                                                      const std::vector<uint64_t>& i);
+
+// Setup, or with a cache, the hint stored for this DB and seed plus the
+// server-side preprocessing only (FakeSetup), which is cheap next to
+// computing the hint.
+std::pair<State, Msg> SetupWithCache(PIR& pi, Database* DB, const State& shared, Params& p, HintCache* cache,
+                                     PRGKey* seed);
+
+// Run full PIR scheme (offline + online phases), checking every recovered
+// record against the DB. With a cache, A comes from the cache's seed and
+// the hint is reused across runs. Returns the rate (MB/s) and the total
+// communication (KB).
+std::tuple<double, double> RunPIR(PIR& pi, Database* DB, Params& p, const std::vector<uint64_t>& i,
+                                  HintCache* cache = nullptr);
+
+// As RunPIR, but the client gets only the seed of the shared state and
+// builds its queries with QueryCompressed.
+std::tuple<double, double> RunPIRCompressed(PIR& pi, Database* DB, Params& p, const std::vector<uint64_t>& i,
+                                            HintCache* cache = nullptr);
+
+#endif // PIR_SCHEME_H
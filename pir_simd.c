@@ -0,0 +1,745 @@
+#include "pir.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <immintrin.h>
+
+// Vectorized variants of matMulVecPacked. Each one is compiled for its own
+// instruction set through target attributes, so a single binary carries all
+// of them and the dispatch table picks one at load time from cpuid.
+//
+// The scalar kernel walks 8 rows at a time and multiplies one digit per
+// instruction. Here we instead vectorize along a row: W packed words are
+// loaded at once, their digits are unpacked with shifts and masks, and each
+// digit lane is multiplied by the matching query entry. To make the query
+// loads contiguous, b is first split into one plane per digit (plane m holds
+// b[j*compression+m]); this costs O(aCols) per call, and the planes live in
+// a per-thread scratch buffer so the call does not allocate. All arithmetic
+// wraps mod 2^32, as in the scalar kernel.
+//
+// Like the scalar kernels in pir.c, every variant is written once over
+// (basis, compression) and instantiated for each shape in PACKED_SHAPES.
+
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+#define MAX_COMPRESSION 4
+
+// Query planes for the kernels below. Each thread keeps one buffer, grown
+// to the largest split it has needed and freed when the thread exits, so
+// answer workers split every query without touching the allocator.
+typedef struct {
+  size_t len;
+  Elem data[];
+} Scratch;
+
+static pthread_key_t scratchKey;
+static pthread_once_t scratchOnce = PTHREAD_ONCE_INIT;
+
+static void makeScratchKey(void)
+{
+  pthread_key_create(&scratchKey, free);
+}
+
+// Returns this thread's scratch buffer, with room for at least n entries,
+// or NULL if it cannot be grown. Its contents are not preserved.
+static Elem *scratchBuffer(size_t n)
+{
+  pthread_once(&scratchOnce, makeScratchKey);
+  Scratch *s = (Scratch *) pthread_getspecific(scratchKey);
+  if (s == NULL || s->len < n) {
+    free(s);
+    s = (Scratch *) malloc(sizeof(Scratch) + n*sizeof(Elem));
+    if (s != NULL) {
+      s->len = n;
+    }
+    pthread_setspecific(scratchKey, s);
+    if (s == NULL) {
+      return NULL;
+    }
+  }
+  return s->data;
+}
+
+static Elem *splitQuery(const Elem *b, size_t aCols, unsigned compression)
+{
+  Elem *planes = scratchBuffer(compression * aCols);
+  if (planes == NULL) {
+    return NULL;
+  }
+  for (size_t j = 0; j < aCols; j++) {
+    for (unsigned m = 0; m < compression; m++) {
+      planes[m*aCols + j] = b[j*compression + m];
+    }
+  }
+  return planes;
+}
+
+ALWAYS_INLINE Elem rowTail(const Elem *row, const Elem *b, size_t from,
+    size_t aCols, const unsigned basis, const unsigned compression)
+{
+  const Elem mask = (((Elem) 1) << basis) - 1;
+  Elem tmp = 0;
+  for (size_t j = from; j < aCols; j++) {
+    Elem db = row[j];
+    for (unsigned m = 0; m < compression; m++) {
+      tmp += ((db >> (m*basis)) & mask)*b[j*compression+m];
+    }
+  }
+  return tmp;
+}
+
+__attribute__((target("sse4.2")))
+ALWAYS_INLINE void matMulVecPackedSSE42Generic(Elem *out, const Elem *a,
+    const Elem *b, size_t aRows, size_t aCols, size_t aStride,
+    const unsigned basis, const unsigned compression)
+{
+  Elem *planes = splitQuery(b, aCols, compression);
+  if (planes == NULL) {
+    for (size_t i = 0; i < aRows; i++) {
+      out[i] += rowTail(a + aStride*i, b, 0, aCols, basis, compression);
+    }
+    return;
+  }
+  const __m128i mask = _mm_set1_epi32((((Elem) 1) << basis) - 1);
+  size_t vecCols = aCols & ~(size_t) 3;
+
+  for (size_t i = 0; i < aRows; i++) {
+    const Elem *row = a + aStride*i;
+    __m128i acc = _mm_setzero_si128();
+    for (size_t j = 0; j < vecCols; j += 4) {
+      __m128i db = _mm_loadu_si128((const __m128i *) (row + j));
+      for (unsigned m = 0; m < compression; m++) {
+        __m128i v = _mm_and_si128(_mm_srli_epi32(db, m*basis), mask);
+        __m128i q = _mm_loadu_si128((const __m128i *) (planes + m*aCols + j));
+        acc = _mm_add_epi32(acc, _mm_mullo_epi32(v, q));
+      }
+    }
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0x4E));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0xB1));
+    out[i] += (Elem) _mm_cvtsi128_si32(acc) +
+      rowTail(row, b, vecCols, aCols, basis, compression);
+  }
+}
+
+__attribute__((target("avx2")))
+ALWAYS_INLINE Elem hsum256(__m256i v)
+{
+  __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v),
+      _mm256_extracti128_si256(v, 1));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4E));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xB1));
+  return (Elem) _mm_cvtsi128_si32(s);
+}
+
+__attribute__((target("avx2")))
+ALWAYS_INLINE __m256i madd256(__m256i acc, __m256i db, __m256i mask,
+    const __m256i *q, const unsigned basis, const unsigned compression)
+{
+  for (unsigned m = 0; m < compression; m++) {
+    __m256i v = _mm256_and_si256(_mm256_srli_epi32(db, m*basis), mask);
+    acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(v, q[m]));
+  }
+  return acc;
+}
+
+__attribute__((target("avx2")))
+ALWAYS_INLINE void matMulVecPackedAVX2Generic(Elem *out, const Elem *a,
+    const Elem *b, size_t aRows, size_t aCols, size_t aStride,
+    const unsigned basis, const unsigned compression)
+{
+  Elem *planes = splitQuery(b, aCols, compression);
+  if (planes == NULL) {
+    for (size_t i = 0; i < aRows; i++) {
+      out[i] += rowTail(a + aStride*i, b, 0, aCols, basis, compression);
+    }
+    return;
+  }
+  const __m256i mask = _mm256_set1_epi32((((Elem) 1) << basis) - 1);
+  size_t vecCols = aCols & ~(size_t) 7;
+  __m256i q[MAX_COMPRESSION];
+  size_t i = 0;
+
+  // Four rows per pass, so that each query load is reused four times.
+  for (; i + 4 <= aRows; i += 4) {
+    const Elem *r0 = a + aStride*(i+0);
+    const Elem *r1 = a + aStride*(i+1);
+    const Elem *r2 = a + aStride*(i+2);
+    const Elem *r3 = a + aStride*(i+3);
+    __m256i acc0 = _mm256_setzero_si256();
+    __m256i acc1 = _mm256_setzero_si256();
+    __m256i acc2 = _mm256_setzero_si256();
+    __m256i acc3 = _mm256_setzero_si256();
+    for (size_t j = 0; j < vecCols; j += 8) {
+      for (unsigned m = 0; m < compression; m++) {
+        q[m] = _mm256_loadu_si256((const __m256i *) (planes + m*aCols + j));
+      }
+      acc0 = madd256(acc0, _mm256_loadu_si256((const __m256i *) (r0 + j)),
+          mask, q, basis, compression);
+      acc1 = madd256(acc1, _mm256_loadu_si256((const __m256i *) (r1 + j)),
+          mask, q, basis, compression);
+      acc2 = madd256(acc2, _mm256_loadu_si256((const __m256i *) (r2 + j)),
+          mask, q, basis, compression);
+      acc3 = madd256(acc3, _mm256_loadu_si256((const __m256i *) (r3 + j)),
+          mask, q, basis, compression);
+    }
+    out[i]   += hsum256(acc0) + rowTail(r0, b, vecCols, aCols, basis, compression);
+    out[i+1] += hsum256(acc1) + rowTail(r1, b, vecCols, aCols, basis, compression);
+    out[i+2] += hsum256(acc2) + rowTail(r2, b, vecCols, aCols, basis, compression);
+    out[i+3] += hsum256(acc3) + rowTail(r3, b, vecCols, aCols, basis, compression);
+  }
+  for (; i < aRows; i++) {
+    const Elem *row = a + aStride*i;
+    __m256i acc = _mm256_setzero_si256();
+    for (size_t j = 0; j < vecCols; j += 8) {
+      for (unsigned m = 0; m < compression; m++) {
+        q[m] = _mm256_loadu_si256((const __m256i *) (planes + m*aCols + j));
+      }
+      acc = madd256(acc, _mm256_loadu_si256((const __m256i *) (row + j)),
+          mask, q, basis, compression);
+    }
+    out[i] += hsum256(acc) + rowTail(row, b, vecCols, aCols, basis, compression);
+  }
+}
+
+// Sums the lanes with wrapping 32-bit adds; _mm512_reduce_add_epi32 adds
+// them as signed ints, which overflows.
+__attribute__((target("avx512f")))
+ALWAYS_INLINE Elem hsum512(__m512i v)
+{
+  __m256i s = _mm256_add_epi32(_mm512_castsi512_si256(v),
+      _mm512_extracti64x4_epi64(v, 1));
+  __m128i t = _mm_add_epi32(_mm256_castsi256_si128(s),
+      _mm256_extracti128_si256(s, 1));
+  t = _mm_add_epi32(t, _mm_shuffle_epi32(t, 0x4E));
+  t = _mm_add_epi32(t, _mm_shuffle_epi32(t, 0xB1));
+  return (Elem) _mm_cvtsi128_si32(t);
+}
+
+__attribute__((target("avx512f")))
+ALWAYS_INLINE __m512i madd512(__m512i acc, __m512i db, __m512i mask,
+    const __m512i *q, const unsigned basis, const unsigned compression)
+{
+  for (unsigned m = 0; m < compression; m++) {
+    __m512i v = _mm512_and_si512(_mm512_srli_epi32(db, m*basis), mask);
+    acc = _mm512_add_epi32(acc, _mm512_mullo_epi32(v, q[m]));
+  }
+  return acc;
+}
+
+__attribute__((target("avx512f")))
+ALWAYS_INLINE void matMulVecPackedAVX512Generic(Elem *out, const Elem *a,
+    const Elem *b, size_t aRows, size_t aCols, size_t aStride,
+    const unsigned basis, const unsigned compression)
+{
+  Elem *planes = splitQuery(b, aCols, compression);
+  if (planes == NULL) {
+    for (size_t i = 0; i < aRows; i++) {
+      out[i] += rowTail(a + aStride*i, b, 0, aCols, basis, compression);
+    }
+    return;
+  }
+  const __m512i mask = _mm512_set1_epi32((((Elem) 1) << basis) - 1);
+  size_t vecCols = aCols & ~(size_t) 15;
+  __m512i q[MAX_COMPRESSION];
+  size_t i = 0;
+
+  for (; i + 4 <= aRows; i += 4) {
+    const Elem *r0 = a + aStride*(i+0);
+    const Elem *r1 = a + aStride*(i+1);
+    const Elem *r2 = a + aStride*(i+2);
+    const Elem *r3 = a + aStride*(i+3);
+    __m512i acc0 = _mm512_setzero_si512();
+    __m512i acc1 = _mm512_setzero_si512();
+    __m512i acc2 = _mm512_setzero_si512();
+    __m512i acc3 = _mm512_setzero_si512();
+    for (size_t j = 0; j < vecCols; j += 16) {
+      for (unsigned m = 0; m < compression; m++) {
+        q[m] = _mm512_loadu_si512((const void *) (planes + m*aCols + j));
+      }
+      acc0 = madd512(acc0, _mm512_loadu_si512((const void *) (r0 + j)),
+          mask, q, basis, compression);
+      acc1 = madd512(acc1, _mm512_loadu_si512((const void *) (r1 + j)),
+          mask, q, basis, compression);
+      acc2 = madd512(acc2, _mm512_loadu_si512((const void *) (r2 + j)),
+          mask, q, basis, compression);
+      acc3 = madd512(acc3, _mm512_loadu_si512((const void *) (r3 + j)),
+          mask, q, basis, compression);
+    }
+    out[i]   += hsum512(acc0) +
+      rowTail(r0, b, vecCols, aCols, basis, compression);
+    out[i+1] += hsum512(acc1) +
+      rowTail(r1, b, vecCols, aCols, basis, compression);
+    out[i+2] += hsum512(acc2) +
+      rowTail(r2, b, vecCols, aCols, basis, compression);
+    out[i+3] += hsum512(acc3) +
+      rowTail(r3, b, vecCols, aCols, basis, compression);
+  }
+  for (; i < aRows; i++) {
+    const Elem *row = a + aStride*i;
+    __m512i acc = _mm512_setzero_si512();
+    for (size_t j = 0; j < vecCols; j += 16) {
+      for (unsigned m = 0; m < compression; m++) {
+        q[m] = _mm512_loadu_si512((const void *) (planes + m*aCols + j));
+      }
+      acc = madd512(acc, _mm512_loadu_si512((const void *) (row + j)),
+          mask, q, basis, compression);
+    }
+    out[i] += hsum512(acc) +
+      rowTail(row, b, vecCols, aCols, basis, compression);
+  }
+}
+
+// Multi-query variants of matMulMatPacked (see pir.h). These vectorize
+// along a row, like the kernels above, so every lane is busy for any number
+// of queries: the k queries are split into k*compression digit planes
+// (padded with zeros to a whole number of vectors), and each decoded DB
+// digit vector is multiplied against the matching plane of `qn` queries at
+// once. The DB is walked in MAT_BLOCK_COLS-wide column blocks, so a block's
+// query planes stay in L2 and each `rows`-row DB tile is reused from L1 for
+// every chunk of queries. matTile* is always inlined with constant `rows`
+// and `qn`, so its accumulators stay in registers.
+#define MAT_BLOCK_COLS 256
+#define MAT_PAD        16
+
+// GCC does not always peel these short constant-trip loops at -O2, and
+// the accumulator arrays only stay in registers if it does.
+#define UNROLL _Pragma("GCC unroll 16")
+
+static Elem *splitQueries(const Elem *b, size_t aCols, size_t bCols,
+    unsigned compression, size_t pStride)
+{
+  Elem *planes = scratchBuffer(bCols * compression * pStride);
+  if (planes == NULL) {
+    return NULL;
+  }
+  for (size_t p = 0; p < bCols * compression; p++) {
+    memset(planes + p*pStride + aCols, 0, (pStride - aCols) * sizeof(Elem));
+  }
+  for (size_t j = 0; j < aCols; j++) {
+    for (unsigned m = 0; m < compression; m++) {
+      const Elem *row = b + (j*compression + m)*bCols;
+      for (size_t q = 0; q < bCols; q++) {
+        planes[(q*compression + m)*pStride + j] = row[q];
+      }
+    }
+  }
+  return planes;
+}
+
+__attribute__((target("avx2")))
+ALWAYS_INLINE void matTileAVX2(Elem *out, const Elem *a, const Elem *planes,
+    size_t aStride, size_t pStride, size_t bCols, size_t j0, size_t j1,
+    const unsigned rows, const unsigned qn,
+    const unsigned basis, const unsigned compression)
+{
+  const __m256i mask = _mm256_set1_epi32((((Elem) 1) << basis) - 1);
+  const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256i acc[4][4];
+  __m256i db[4];
+  __m256i v[4];
+
+  UNROLL
+  for (unsigned r = 0; r < rows; r++) {
+    UNROLL
+    for (unsigned q = 0; q < qn; q++) {
+      acc[r][q] = _mm256_setzero_si256();
+    }
+  }
+  for (size_t j = j0; j < j1; j += 8) {
+    __m256i lanes = _mm256_cmpgt_epi32(_mm256_set1_epi32((int) (j1 - j)), lane);
+    UNROLL
+    for (unsigned r = 0; r < rows; r++) {
+      db[r] = _mm256_maskload_epi32((const int *) (a + aStride*r + j), lanes);
+    }
+    UNROLL
+    for (unsigned m = 0; m < compression; m++) {
+      UNROLL
+      for (unsigned r = 0; r < rows; r++) {
+        v[r] = _mm256_and_si256(_mm256_srli_epi32(db[r], m*basis), mask);
+      }
+      UNROLL
+      for (unsigned q = 0; q < qn; q++) {
+        __m256i p = _mm256_loadu_si256((const __m256i *)
+            (planes + (q*compression + m)*pStride + j));
+        UNROLL
+        for (unsigned r = 0; r < rows; r++) {
+          acc[r][q] = _mm256_add_epi32(acc[r][q], _mm256_mullo_epi32(v[r], p));
+        }
+      }
+    }
+  }
+  UNROLL
+  for (unsigned r = 0; r < rows; r++) {
+    UNROLL
+    for (unsigned q = 0; q < qn; q++) {
+      out[r*bCols + q] += hsum256(acc[r][q]);
+    }
+  }
+}
+
+__attribute__((target("avx512f")))
+ALWAYS_INLINE void matTileAVX512(Elem *out, const Elem *a, const Elem *planes,
+    size_t aStride, size_t pStride, size_t bCols, size_t j0, size_t j1,
+    const unsigned rows, const unsigned qn,
+    const unsigned basis, const unsigned compression)
+{
+  const __m512i mask = _mm512_set1_epi32((((Elem) 1) << basis) - 1);
+  __m512i acc[4][4];
+  __m512i db[4];
+  __m512i v[4];
+
+  UNROLL
+  for (unsigned r = 0; r < rows; r++) {
+    UNROLL
+    for (unsigned q = 0; q < qn; q++) {
+      acc[r][q] = _mm512_setzero_si512();
+    }
+  }
+  for (size_t j = j0; j < j1; j += 16) {
+    __mmask16 lanes = (j1 - j >= 16) ? 0xFFFF :
+      (__mmask16) ((1u << (j1 - j)) - 1);
+    UNROLL
+    for (unsigned r = 0; r < rows; r++) {
+      db[r] = _mm512_maskz_loadu_epi32(lanes, a + aStride*r + j);
+    }
+    UNROLL
+    for (unsigned m = 0; m < compression; m++) {
+      UNROLL
+      for (unsigned r = 0; r < rows; r++) {
+        v[r] = _mm512_and_si512(_mm512_srli_epi32(db[r], m*basis), mask);
+      }
+      UNROLL
+      for (unsigned q = 0; q < qn; q++) {
+        __m512i p = _mm512_loadu_si512((const void *)
+            (planes + (q*compression + m)*pStride + j));
+        UNROLL
+        for (unsigned r = 0; r < rows; r++) {
+          acc[r][q] = _mm512_add_epi32(acc[r][q], _mm512_mullo_epi32(v[r], p));
+        }
+      }
+    }
+  }
+  UNROLL
+  for (unsigned r = 0; r < rows; r++) {
+    UNROLL
+    for (unsigned q = 0; q < qn; q++) {
+      out[r*bCols + q] += hsum512(acc[r][q]);
+    }
+  }
+}
+
+// AVX2 has only 16 vector registers, so it takes 2 rows by 4 queries per
+// tile; AVX-512 takes 4 by 4.
+__attribute__((target("avx2")))
+ALWAYS_INLINE void matMulMatPackedAVX2Generic(Elem *out, const Elem *a,
+    const Elem *b, size_t aRows, size_t aCols, size_t aStride, size_t bCols,
+    matMulMatPackedFn fallback, const unsigned basis, const unsigned compression)
+{
+  const unsigned R = 2;
+  size_t pStride = (aCols + MAT_PAD - 1) & ~(size_t) (MAT_PAD - 1);
+  Elem *planes = splitQueries(b, aCols, bCols, compression, pStride);
+  if (planes == NULL) {
+    fallback(out, a, b, aRows, aCols, aStride, bCols);
+    return;
+  }
+
+  for (size_t j0 = 0; j0 < aCols; j0 += MAT_BLOCK_COLS) {
+    size_t j1 = (j0 + MAT_BLOCK_COLS < aCols) ? j0 + MAT_BLOCK_COLS : aCols;
+    for (size_t i = 0; i < aRows; i += R) {
+      const Elem *rows = a + i*aStride;
+      Elem *o = out + i*bCols;
+      size_t q = 0;
+      if (i + R <= aRows) {
+        for (; q + 4 <= bCols; q += 4) {
+          matTileAVX2(o + q, rows, planes + q*compression*pStride, aStride,
+              pStride, bCols, j0, j1, R, 4, basis, compression);
+        }
+        for (; q < bCols; q++) {
+          matTileAVX2(o + q, rows, planes + q*compression*pStride, aStride,
+              pStride, bCols, j0, j1, R, 1, basis, compression);
+        }
+      } else {
+        for (size_t r = i; r < aRows; r++) {
+          for (q = 0; q < bCols; q++) {
+            matTileAVX2(out + r*bCols + q, a + r*aStride,
+                planes + q*compression*pStride, aStride, pStride, bCols,
+                j0, j1, 1, 1, basis, compression);
+          }
+        }
+      }
+    }
+  }
+}
+
+__attribute__((target("avx512f")))
+ALWAYS_INLINE void matMulMatPackedAVX512Generic(Elem *out, const Elem *a,
+    const Elem *b, size_t aRows, size_t aCols, size_t aStride, size_t bCols,
+    matMulMatPackedFn fallback, const unsigned basis, const unsigned compression)
+{
+  const unsigned R = 4;
+  size_t pStride = (aCols + MAT_PAD - 1) & ~(size_t) (MAT_PAD - 1);
+  Elem *planes = splitQueries(b, aCols, bCols, compression, pStride);
+  if (planes == NULL) {
+    fallback(out, a, b, aRows, aCols, aStride, bCols);
+    return;
+  }
+
+  for (size_t j0 = 0; j0 < aCols; j0 += MAT_BLOCK_COLS) {
+    size_t j1 = (j0 + MAT_BLOCK_COLS < aCols) ? j0 + MAT_BLOCK_COLS : aCols;
+    for (size_t i = 0; i < aRows; i += R) {
+      const Elem *rows = a + i*aStride;
+      Elem *o = out + i*bCols;
+      size_t q = 0;
+      if (i + R <= aRows) {
+        for (; q + 4 <= bCols; q += 4) {
+          matTileAVX512(o + q, rows, planes + q*compression*pStride, aStride,
+              pStride, bCols, j0, j1, R, 4, basis, compression);
+        }
+        for (; q < bCols; q++) {
+          matTileAVX512(o + q, rows, planes + q*compression*pStride, aStride,
+              pStride, bCols, j0, j1, R, 1, basis, compression);
+        }
+      } else {
+        for (size_t r = i; r < aRows; r++) {
+          for (q = 0; q < bCols; q++) {
+            matTileAVX512(out + r*bCols + q, a + r*aStride,
+                planes + q*compression*pStride, aStride, pStride, bCols,
+                j0, j1, 1, 1, basis, compression);
+          }
+        }
+      }
+    }
+  }
+}
+
+#define DEFINE_SIMD_PACKED_KERNELS(B, C)                                  \
+  __attribute__((target("sse4.2")))                                       \
+  static void matMulVecPackedSSE42_##B##x##C(Elem *out, const Elem *a,    \
+      const Elem *b, size_t aRows, size_t aCols, size_t aStride)          \
+  {                                                                       \
+    matMulVecPackedSSE42Generic(out, a, b, aRows, aCols, aStride, B, C);  \
+  }                                                                       \
+  __attribute__((target("avx2")))                                         \
+  static void matMulVecPackedAVX2_##B##x##C(Elem *out, const Elem *a,     \
+      const Elem *b, size_t aRows, size_t aCols, size_t aStride)          \
+  {                                                                       \
+    matMulVecPackedAVX2Generic(out, a, b, aRows, aCols, aStride, B, C);   \
+  }                                                                       \
+  __attribute__((target("avx512f")))                                      \
+  static void matMulVecPackedAVX512_##B##x##C(Elem *out, const Elem *a,   \
+      const Elem *b, size_t aRows, size_t aCols, size_t aStride)          \
+  {                                                                       \
+    matMulVecPackedAVX512Generic(out, a, b, aRows, aCols, aStride, B, C); \
+  }                                                                       \
+  __attribute__((target("avx2")))                                         \
+  static void matMulMatPackedAVX2_##B##x##C(Elem *out, const Elem *a,     \
+      const Elem *b, size_t aRows, size_t aCols, size_t aStride,          \
+      size_t bCols)                                                       \
+  {                                                                       \
+    matMulMatPackedAVX2Generic(out, a, b, aRows, aCols, aStride, bCols,   \
+        matMulMatPackedScalar_##B##x##C, B, C);                           \
+  }                                                                       \
+  __attribute__((target("avx512f")))                                      \
+  static void matMulMatPackedAVX512_##B##x##C(Elem *out, const Elem *a,   \
+      const Elem *b, size_t aRows, size_t aCols, size_t aStride,          \
+      size_t bCols)                                                       \
+  {                                                                       \
+    matMulMatPackedAVX512Generic(out, a, b, aRows, aCols, aStride, bCols, \
+        matMulMatPackedScalar_##B##x##C, B, C);                           \
+  }
+
+PACKED_SHAPES(DEFINE_SIMD_PACKED_KERNELS)
+
+void matMulVecPackedSSE42(Elem *out, const Elem *a, const Elem *b,
+    size_t aRows, size_t aCols)
+{
+  matMulVecPackedSSE42_10x3(out, a, b, aRows, aCols, aCols);
+}
+
+void matMulVecPackedAVX2(Elem *out, const Elem *a, const Elem *b,
+    size_t aRows, size_t aCols)
+{
+  matMulVecPackedAVX2_10x3(out, a, b, aRows, aCols, aCols);
+}
+
+void matMulVecPackedAVX512(Elem *out, const Elem *a, const Elem *b,
+    size_t aRows, size_t aCols)
+{
+  matMulVecPackedAVX512_10x3(out, a, b, aRows, aCols, aCols);
+}
+
+// In-register 8x8 transpose: three rounds of 32-, 64- and 128-bit
+// interleaves, the standard unpack/shuffle/permute network.
+__attribute__((target("avx2")))
+static void transpose8x8AVX2(Elem *out, size_t outStride, const Elem *in,
+    size_t inStride)
+{
+  __m256i r0 = _mm256_loadu_si256((const __m256i *) (in + 0*inStride));
+  __m256i r1 = _mm256_loadu_si256((const __m256i *) (in + 1*inStride));
+  __m256i r2 = _mm256_loadu_si256((const __m256i *) (in + 2*inStride));
+  __m256i r3 = _mm256_loadu_si256((const __m256i *) (in + 3*inStride));
+  __m256i r4 = _mm256_loadu_si256((const __m256i *) (in + 4*inStride));
+  __m256i r5 = _mm256_loadu_si256((const __m256i *) (in + 5*inStride));
+  __m256i r6 = _mm256_loadu_si256((const __m256i *) (in + 6*inStride));
+  __m256i r7 = _mm256_loadu_si256((const __m256i *) (in + 7*inStride));
+
+  __m256i t0 = _mm256_unpacklo_epi32(r0, r1);
+  __m256i t1 = _mm256_unpackhi_epi32(r0, r1);
+  __m256i t2 = _mm256_unpacklo_epi32(r2, r3);
+  __m256i t3 = _mm256_unpackhi_epi32(r2, r3);
+  __m256i t4 = _mm256_unpacklo_epi32(r4, r5);
+  __m256i t5 = _mm256_unpackhi_epi32(r4, r5);
+  __m256i t6 = _mm256_unpacklo_epi32(r6, r7);
+  __m256i t7 = _mm256_unpackhi_epi32(r6, r7);
+
+  r0 = _mm256_unpacklo_epi64(t0, t2);
+  r1 = _mm256_unpackhi_epi64(t0, t2);
+  r2 = _mm256_unpacklo_epi64(t1, t3);
+  r3 = _mm256_unpackhi_epi64(t1, t3);
+  r4 = _mm256_unpacklo_epi64(t4, t6);
+  r5 = _mm256_unpackhi_epi64(t4, t6);
+  r6 = _mm256_unpacklo_epi64(t5, t7);
+  r7 = _mm256_unpackhi_epi64(t5, t7);
+
+  _mm256_storeu_si256((__m256i *) (out + 0*outStride), _mm256_permute2x128_si256(r0, r4, 0x20));
+  _mm256_storeu_si256((__m256i *) (out + 1*outStride), _mm256_permute2x128_si256(r1, r5, 0x20));
+  _mm256_storeu_si256((__m256i *) (out + 2*outStride), _mm256_permute2x128_si256(r2, r6, 0x20));
+  _mm256_storeu_si256((__m256i *) (out + 3*outStride), _mm256_permute2x128_si256(r3, r7, 0x20));
+  _mm256_storeu_si256((__m256i *) (out + 4*outStride), _mm256_permute2x128_si256(r0, r4, 0x31));
+  _mm256_storeu_si256((__m256i *) (out + 5*outStride), _mm256_permute2x128_si256(r1, r5, 0x31));
+  _mm256_storeu_si256((__m256i *) (out + 6*outStride), _mm256_permute2x128_si256(r2, r6, 0x31));
+  _mm256_storeu_si256((__m256i *) (out + 7*outStride), _mm256_permute2x128_si256(r3, r7, 0x31));
+}
+
+static void (*transpose8x8Fn)(Elem *, size_t, const Elem *, size_t) =
+  transpose8x8Scalar;
+
+// The dispatch table, one entry per shape. Entries start out pointing at
+// the scalar kernels and are upgraded by pickPackedKernels.
+#define PACKED_TABLE_ENTRY(B, C) \
+  { B, C, matMulVecPackedScalar_##B##x##C, matMulMatPackedScalar_##B##x##C, \
+    matMulTransposedPacked_##B##x##C },
+
+static PackedKernels packedTable[] = {
+  PACKED_SHAPES(PACKED_TABLE_ENTRY)
+};
+
+static const size_t packedTableLen = sizeof(packedTable) / sizeof(packedTable[0]);
+
+static const char *matMulVecPackedName = "scalar";
+
+#define PICK_AVX512(B, C) \
+  lookupPackedKernels(B, C)->matMulVecPacked = matMulVecPackedAVX512_##B##x##C; \
+  lookupPackedKernels(B, C)->matMulMatPacked = matMulMatPackedAVX512_##B##x##C;
+#define PICK_AVX2(B, C) \
+  lookupPackedKernels(B, C)->matMulVecPacked = matMulVecPackedAVX2_##B##x##C; \
+  lookupPackedKernels(B, C)->matMulMatPacked = matMulMatPackedAVX2_##B##x##C;
+#define PICK_SSE42(B, C) \
+  lookupPackedKernels(B, C)->matMulVecPacked = matMulVecPackedSSE42_##B##x##C;
+
+static PackedKernels *lookupPackedKernels(size_t basis, size_t compression)
+{
+  for (size_t i = 0; i < packedTableLen; i++) {
+    if (packedTable[i].basis == basis &&
+        packedTable[i].compression == compression) {
+      return &packedTable[i];
+    }
+  }
+  return NULL;
+}
+
+#define PICK_SCALAR(B, C) \
+  lookupPackedKernels(B, C)->matMulVecPacked = matMulVecPackedScalar_##B##x##C; \
+  lookupPackedKernels(B, C)->matMulMatPacked = matMulMatPackedScalar_##B##x##C;
+
+// Every variant, widest first.
+static const char *const packedVariantNames[] = {"avx512", "avx2", "sse4.2", "scalar"};
+static const size_t numPackedVariants = sizeof(packedVariantNames) / sizeof(packedVariantNames[0]);
+
+static int hostSupportsVariant(size_t v)
+{
+  switch (v) {
+  case 0: return __builtin_cpu_supports("avx512f");
+  case 1: return __builtin_cpu_supports("avx2");
+  case 2: return __builtin_cpu_supports("sse4.2");
+  default: return 1;
+  }
+}
+
+// Starts from the scalar kernels, since SSE4.2 has no matMulMatPacked.
+static void applyPackedVariant(size_t v)
+{
+  PACKED_SHAPES(PICK_SCALAR)
+  switch (v) {
+  case 0: PACKED_SHAPES(PICK_AVX512) break;
+  case 1: PACKED_SHAPES(PICK_AVX2) break;
+  case 2: PACKED_SHAPES(PICK_SSE42) break;
+  default: break;
+  }
+  matMulVecPackedName = packedVariantNames[v];
+}
+
+__attribute__((constructor))
+static void pickPackedKernels(void)
+{
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    transpose8x8Fn = transpose8x8AVX2;
+  }
+  for (size_t v = 0; v < numPackedVariants; v++) {
+    if (hostSupportsVariant(v)) {
+      applyPackedVariant(v);
+      return;
+    }
+  }
+}
+
+size_t packedKernelVariants(const char **names, size_t max)
+{
+  size_t n = 0;
+  for (size_t v = 0; v < numPackedVariants; v++) {
+    if (hostSupportsVariant(v)) {
+      if (n < max) {
+        names[n] = packedVariantNames[v];
+      }
+      n++;
+    }
+  }
+  return n;
+}
+
+int selectPackedKernelVariant(const char *name)
+{
+  for (size_t v = 0; v < numPackedVariants; v++) {
+    if (strcmp(name, packedVariantNames[v]) == 0) {
+      if (!hostSupportsVariant(v)) {
+        return -1;
+      }
+      applyPackedVariant(v);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+const PackedKernels *packedKernels(size_t basis, size_t compression)
+{
+  return lookupPackedKernels(basis, compression);
+}
+
+// PACKED_SHAPES lists the original hard-coded 10-bit, 3-digit shape first.
+void matMulVecPacked(Elem *out, const Elem *a, const Elem *b,
+    size_t aRows, size_t aCols)
+{
+  packedTable[0].matMulVecPacked(out, a, b, aRows, aCols, aCols);
+}
+
+void transpose8x8(Elem *out, size_t outStride, const Elem *in,
+    size_t inStride)
+{
+  transpose8x8Fn(out, outStride, in, inStride);
+}
+
+const char *matMulVecPackedVariant(void)
+{
+  return matMulVecPackedName;
+}
@@ -1,40 +1,50 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <iostream>
 #include <vector>
 #include <cmath>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <numeric>
+#include <random>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "answer_pool.h"
+#include "autotune.h"
+#include "batch_pir.h"
+#include "coalescer.h"
+#include "db_file.h"
+#include "database.h"
+#include "db_ingest.h"
+#include "double_pir.h"
+#include "epoch.h"
+#include "hint_cache.h"
+#include "matrix.h"
+#include "matrix_alloc.h"
+#include "params.h"
+#include "pir.h"
+#include "pir_scheme.h"
+#include "shard.h"
+#include "simple_pir.h"
+#include "utils.h"
 
 constexpr uint64_t LOGQ = 32;
 constexpr uint64_t SEC_PARAM = 1 << 10;
 
-struct Params {
-    // Parameters struct definition
-};
-
-struct Database {
-    // Database struct definition
-};
-
-class SimplePIR {
-public:
-    Params PickParams(uint64_t N, uint64_t d, uint64_t secParam, uint64_t logQ) {
-        // Parameter picking logic here...
-    }
-
-    Database MakeDB(uint64_t N, uint64_t d, Params* p, std::vector<uint64_t>& vals) {
-        // Database creation logic here...
-    }
-    
-    Database ConcatDBs(std::vector<Database*>& DBs, Params* p) {
-        // Database concatenation logic here...
-    }
-    
-    void GetBW(DatabaseInfo info, Params p) {
-        // BW calculation logic here...
-    }
-};
-
 void TestDBMediumEntries() {
     uint64_t N = 4;
     uint64_t d = 9;
@@ -42,17 +52,18 @@ void TestDBMediumEntries() {
     Params p = pir.PickParams(N, d, SEC_PARAM, LOGQ);
 
     std::vector<uint64_t> vals = {1, 2, 3, 4};
-    Database DB = pir.MakeDB(N, d, &p, vals);
+    Database* DB = MakeDB(N, d, &p, vals);
 
-    if (DB.Info.Packing != 1 || DB.Info.Ne != 1) {
+    if (DB->Info.Packing != 1 || DB->Info.Ne != 1) {
         throw std::runtime_error("Should not happen.");
     }
 
     for (uint64_t i = 0; i < N; i++) {
-        if (DB.GetElem(i) != (i + 1)) {
+        if (DB->GetElem(i) != (i + 1)) {
             throw std::runtime_error("Failure");
         }
     }
+    delete DB;
 }
 
 void TestDBSmallEntries() {
@@ -62,17 +73,18 @@ void TestDBSmallEntries() {
     Params p = pir.PickParams(N, d, SEC_PARAM, LOGQ);
 
     std::vector<uint64_t> vals = {1, 2, 3, 4};
-    Database DB = pir.MakeDB(N, d, &p, vals);
+    Database* DB = MakeDB(N, d, &p, vals);
 
-    if (DB.Info.Packing <= 1 || DB.Info.Ne != 1) {
+    if (DB->Info.Packing <= 1 || DB->Info.Ne != 1) {
         throw std::runtime_error("Should not happen.");
     }
 
     for (uint64_t i = 0; i < N; i++) {
-        if (DB.GetElem(i) != (i + 1)) {
+        if (DB->GetElem(i) != (i + 1)) {
             throw std::runtime_error("Failure");
         }
     }
+    delete DB;
 }
 
 void TestDBLargeEntries() {
@@ -82,17 +94,18 @@ void TestDBLargeEntries() {
     Params p = pir.PickParams(N, d, SEC_PARAM, LOGQ);
 
     std::vector<uint64_t> vals = {1, 2, 3, 4};
-    Database DB = pir.MakeDB(N, d, &p, vals);
+    Database* DB = MakeDB(N, d, &p, vals);
 
-    if (DB.Info.Packing != 0 || DB.Info.Ne <= 1) {
+    if (DB->Info.Packing != 0 || DB->Info.Ne <= 1) {
         throw std::runtime_error("Should not happen.");
     }
 
     for (uint64_t i = 0; i < N; i++) {
-        if (DB.GetElem(i) != (i + 1)) {
+        if (DB->GetElem(i) != (i + 1)) {
             throw std::runtime_error("Failure");
         }
     }
+    delete DB;
 }
 
 void TestDBInterleaving() {
@@ -107,25 +120,27 @@ void TestDBInterleaving() {
     for (uint64_t n = 0; n < numBytes; ++n) {
         std::vector<uint64_t> val(N);
         for (uint64_t i = 0; i < N; ++i) {
-            const char* str = "string " + std::to_string(i);
-            if (std::strlen(str) > n) {
+            std::string str = "string " + std::to_string(i);
+            if (str.size() > n) {
                 val[i] = static_cast<uint64_t>(str[n]);
             } else {
                 val[i] = 0;
             }
         }
-        DBs[n] = new Database(pir.MakeDB(N, d, &p, val));
+        DBs[n] = MakeDB(N, d, &p, val);
     }
 
-    Database D = pir.ConcatDBs(DBs, &p);
+    Database* D = pir.ConcatDBs(DBs, &p);
 
     for (uint64_t i = 0; i < N; ++i) {
         std::string val;
         for (uint64_t n = 0; n < numBytes; ++n) {
-            val += static_cast<char>(D.GetElem(i + N * n));
+            val += static_cast<char>(D->GetElem(i + N * n));
         }
-        std::cout << "Got '" << val << "' instead of 'string " << i << "'" << std::endl;
+        // Records shorter than numBytes are padded with zero bytes.
+        val = val.substr(0, val.find('\0'));
         if (val != "string " + std::to_string(i)) {
+            std::cout << "Got '" << val << "' instead of 'string " << i << "'" << std::endl;
             throw std::runtime_error("Failure");
         }
     }
@@ -134,6 +149,7 @@ void TestDBInterleaving() {
     for (auto db : DBs) {
         delete db;
     }
+    delete D;
 }
 
 void TestSimplePirBW() {
@@ -145,7 +161,7 @@ void TestSimplePirBW() {
     if (log_N_env != nullptr) {
         int log_N = std::atoi(log_N_env);
         if (log_N != 0) {
-            N = 1 << log_N;
+            N = uint64_t(1) << log_N;
         }
     }
     if (D_env != nullptr) {
@@ -157,13 +173,14 @@ void TestSimplePirBW() {
 
     SimplePIR pir;
     Params p = pir.PickParams(N, d, SEC_PARAM, LOGQ);
-    Database DB = pir.SetupDB(N, d, &p);
+    Database* DB = SetupDB(N, d, &p);
 
     std::cout << "Executing with entries consisting of " << d << " (>= 1) bits; p is " << p.P
-              << "; packing factor is " << DB.Info.Packing << "; number of DB elems per entry is "
-              << DB.Info.Ne << "." << std::endl;
+              << "; packing factor is " << DB->Info.Packing << "; number of DB elems per entry is "
+              << DB->Info.Ne << "." << std::endl;
 
-    pir.GetBW(DB.Info, p);
+    pir.GetBW(DB->Info, p);
+    delete DB;
 }
 
 void TestDoublePirBW() {
@@ -175,7 +192,7 @@ void TestDoublePirBW() {
     if (log_N_env != nullptr) {
         int log_N = std::atoi(log_N_env);
         if (log_N != 0) {
-            N = 1 << log_N;
+            N = uint64_t(1) << log_N;
         }
     }
     if (D_env != nullptr) {
@@ -187,13 +204,25 @@ void TestDoublePirBW() {
 
     DoublePIR pir;
     Params p = pir.PickParams(N, d, SEC_PARAM, LOGQ);
-    Database DB = pir.SetupDB(N, d, &p);
+    Database* DB = SetupDB(N, d, &p);
 
     std::cout << "Executing with entries consisting of " << d << " (>= 1) bits; p is " << p.P
-              << "; packing factor is " << DB.Info.Packing << "; number of DB elems per entry is "
-              << DB.Info.Ne << "." << std::endl;
+              << "; packing factor is " << DB->Info.Packing << "; number of DB elems per entry is "
+              << DB->Info.Ne << "." << std::endl;
 
-    pir.GetBW(DB.Info, p);
+    pir.GetBW(DB->Info, p);
+    delete DB;
+}
+
+void TestDoublePir() {
+    uint64_t N = 1 << 28;
+    uint64_t d = 3;
+    DoublePIR pir;
+    Params p = pir.PickParams(N, d, SEC_PARAM, LOGQ);
+
+    Database* DB = MakeRandomDB(N, d, &p);
+    RunPIR(pir, DB, p, {0});
+    delete DB;
 }
 
 void TestSimplePir() {
@@ -202,8 +231,9 @@ void TestSimplePir() {
     SimplePIR pir;
     Params p = pir.PickParams(N, d, SEC_PARAM, LOGQ);
 
-    Database DB = pir.MakeRandomDB(N, d, &p);
-    pir.RunPIR(&DB, p, {262144});
+    Database* DB = MakeRandomDB(N, d, &p);
+    RunPIR(pir, DB, p, {262144});
+    delete DB;
 }
 
 void TestSimplePirCompressed() {
@@ -212,8 +242,9 @@ void TestSimplePirCompressed() {
     SimplePIR pir;
     Params p = pir.PickParams(N, d, SEC_PARAM, LOGQ);
 
-    Database DB = pir.MakeRandomDB(N, d, &p);
-    pir.RunPIR(&DB, p, {262144});
+    Database* DB = MakeRandomDB(N, d, &p);
+    RunPIRCompressed(pir, DB, p, {262144});
+    delete DB;
 }
 
 void TestSimplePirLongRow() {
@@ -222,8 +253,9 @@ void TestSimplePirLongRow() {
     SimplePIR pir;
     Params p = pir.PickParams(N, d, SEC_PARAM, LOGQ);
 
-    Database DB = pir.MakeRandomDB(N, d, &p);
-    pir.RunPIR(&DB, p, {1});
+    Database* DB = MakeRandomDB(N, d, &p);
+    RunPIR(pir, DB, p, {1});
+    delete DB;
 }
 
 void TestSimplePirLongRowCompressed() {
@@ -232,8 +264,9 @@ void TestSimplePirLongRowCompressed() {
     SimplePIR pir;
     Params p = pir.PickParams(N, d, SEC_PARAM, LOGQ);
 
-    Database DB = pir.MakeRandomDB(N, d, &p);
-    pir.RunPIR(&DB, p, {1});
+    Database* DB = MakeRandomDB(N, d, &p);
+    RunPIRCompressed(pir, DB, p, {1});
+    delete DB;
 }
 
 void TestSimplePirBigDB() {
@@ -242,8 +275,9 @@ void TestSimplePirBigDB() {
     SimplePIR pir;
     Params p = pir.PickParams(N, d, SEC_PARAM, LOGQ);
 
-    Database DB = pir.MakeRandomDB(N, d, &p);
-    pir.RunPIR(&DB, p, {0});
+    Database* DB = MakeRandomDB(N, d, &p);
+    RunPIR(pir, DB, p, {0});
+    delete DB;
 }
 
 void TestSimplePirBigDBCompressed() {
@@ -252,8 +286,9 @@ void TestSimplePirBigDBCompressed() {
     SimplePIR pir;
     Params p = pir.PickParams(N, d, SEC_PARAM, LOGQ);
 
-    Database DB = pir.MakeRandomDB(N, d, &p);
-    pir.RunPIR(&DB, p, {0});
+    Database* DB = MakeRandomDB(N, d, &p);
+    RunPIRCompressed(pir, DB, p, {0});
+    delete DB;
 }
 
 void TestSimplePirBatch() {
@@ -262,8 +297,9 @@ void TestSimplePirBatch() {
     SimplePIR pir;
     Params p = pir.PickParams(N, d, SEC_PARAM, LOGQ);
 
-    Database DB = pir.MakeRandomDB(N, d, &p);
-    pir.RunPIR(&DB, p, {0, 0, 0, 0});
+    Database* DB = MakeRandomDB(N, d, &p);
+    RunPIR(pir, DB, p, {0, 0, 0, 0});
+    delete DB;
 }
 
 void TestSimplePirBatchCompressed() {
@@ -272,8 +308,9 @@ void TestSimplePirBatchCompressed() {
     SimplePIR pir;
     Params p = pir.PickParams(N, d, SEC_PARAM, LOGQ);
 
-    Database DB = pir.MakeRandomDB(N, d, &p);
-    pir.RunPIR(&DB, p, {0, 0, 0, 0});
+    Database* DB = MakeRandomDB(N, d, &p);
+    RunPIRCompressed(pir, DB, p, {0, 0, 0, 0});
+    delete DB;
 }
 
 void TestSimplePirLongRowBatch() {
@@ -282,31 +319,1202 @@ void TestSimplePirLongRowBatch() {
     SimplePIR pir;
     Params p = pir.PickParams(N, d, SEC_PARAM, LOGQ);
 
-    Database DB = pir.MakeRandomDB(N, d, &p);
-    pir.RunPIR(&DB, p, {0, 0, 0, 0});
+    Database* DB = MakeRandomDB(N, d, &p);
+    RunPIR(pir, DB, p, {0, 0, 0, 0});
+    delete DB;
 }
 
-void TestSimplePirLongRowBatch() {
+void TestSimplePirLongRowBatchCompressed() {
     uint64_t N = 1 << 20;
     uint64_t d = 32;
     SimplePIR pir;
     Params p = pir.PickParams(N, d, SEC_PARAM, LOGQ);
 
-    Database DB = pir.MakeRandomDB(N, d, &p);
-    pir.RunPIR(&DB, p, {0, 0, 0, 0});
+    Database* DB = MakeRandomDB(N, d, &p);
+    RunPIRCompressed(pir, DB, p, {0, 0, 0, 0});
+    delete DB;
 }
 
-void TestSimplePirLongRowBatchCompressed() {
-    uint64_t N = 1 << 20;
+// The blocked, threaded GEMM against a schoolbook product, on shapes that
+// are not multiples of the block sizes and tall enough to be split across
+// threads.
+void TestMatrixMulOddShapes() {
+    uint64_t shapes[][3] = {{1, 1, 1}, {3, 1, 7}, {67, 300, 515}, {301, 517, 1037}, {640, 257, 3}};
+    for (auto& shape : shapes) {
+        uint64_t rows = shape[0], inner = shape[1], cols = shape[2];
+        Matrix a = MatrixRand(rows, inner, LOGQ, 0);
+        Matrix b = MatrixRand(inner, cols, LOGQ, 0);
+
+        Matrix want(rows, cols);
+        for (uint64_t i = 0; i < rows; i++) {
+            for (uint64_t k = 0; k < inner; k++) {
+                uint32_t x = a.Data[i * inner + k];
+                for (uint64_t j = 0; j < cols; j++) {
+                    want.Data[i * cols + j] += x * b.Data[k * cols + j];
+                }
+            }
+        }
+
+        Matrix got = Matrix::MatrixMul(a, b);
+        Matrix into(rows, cols);
+        matMul(into, a, b);
+        if (got.Rows != rows || got.Cols != cols || got.Data != want.Data || into.Data != want.Data) {
+            std::cout << "MatrixMul of " << rows << "-by-" << inner << " and " << inner << "-by-" << cols
+                      << " differs from the naive product" << std::endl;
+            throw std::runtime_error("Failure");
+        }
+    }
+}
+
+// Every packed kernel variant the host supports, for every shape in
+// PACKED_SHAPES, against the scalar kernel of that shape: on row counts
+// that are not multiples of the SIMD row blocks, widths that leave a
+// partial vector, and row strides wider than the rows.
+void TestPackedKernelVariants() {
+#define PACKED_SHAPE_SCALAR(B, C) {B, C, matMulVecPackedScalar_##B##x##C},
+    struct {
+        size_t basis;
+        size_t compression;
+        matMulVecPackedFn scalar;
+    } shapes[] = {PACKED_SHAPES(PACKED_SHAPE_SCALAR)};
+#undef PACKED_SHAPE_SCALAR
+    uint64_t sizes[][3] = {{1, 1, 1}, {7, 5, 5}, {33, 67, 70}, {131, 259, 259}, {64, 128, 131}, {9, 300, 333}};
+
+    const char* names[8];
+    size_t num_variants = packedKernelVariants(names, 8);
+    std::string old = matMulVecPackedVariant();
+    std::mt19937_64 rng(20);
+    for (size_t v = 0; v < num_variants; v++) {
+        if (selectPackedKernelVariant(names[v]) != 0) {
+            throw std::runtime_error("Failure");
+        }
+        for (auto& shape : shapes) {
+            const PackedKernels* kernels = packedKernels(shape.basis, shape.compression);
+            uint32_t mask = static_cast<uint32_t>((uint64_t(1) << (shape.basis * shape.compression)) - 1);
+            for (auto& size : sizes) {
+                uint64_t rows = size[0], cols = size[1], stride = size[2];
+                std::vector<uint32_t> a(rows * stride), b(cols * shape.compression), want(rows), got(rows);
+                for (auto& x : a) {
+                    x = static_cast<uint32_t>(rng()) & mask;
+                }
+                for (auto& x : b) {
+                    x = static_cast<uint32_t>(rng());
+                }
+                shape.scalar(want.data(), a.data(), b.data(), rows, cols, stride);
+                kernels->matMulVecPacked(got.data(), a.data(), b.data(), rows, cols, stride);
+                if (got != want) {
+                    std::cout << names[v] << " kernel for " << shape.basis << "x" << shape.compression << " on "
+                              << rows << "-by-" << cols << " (stride " << stride << ") differs from scalar"
+                              << std::endl;
+                    throw std::runtime_error("Failure");
+                }
+            }
+        }
+    }
+    selectPackedKernelVariant(old.c_str());
+
+    // The fixed 10x3 entry points, each only where the host can run it.
+    const std::vector<std::pair<std::string, void (*)(Elem*, const Elem*, const Elem*, size_t, size_t)>> fixed = {
+        {"sse4.2", matMulVecPackedSSE42}, {"avx2", matMulVecPackedAVX2}, {"avx512", matMulVecPackedAVX512}};
+    const char** supported = names + std::min<size_t>(num_variants, 8);
+    for (const auto& [name, kernel] : fixed) {
+        if (std::find(names, supported, name) == supported) {
+            continue;
+        }
+        for (auto& size : sizes) {
+            uint64_t rows = size[0], cols = size[1];
+            std::vector<uint32_t> a(rows * cols), b(cols * 3), want(rows), got(rows);
+            for (auto& x : a) {
+                x = static_cast<uint32_t>(rng()) & ((1u << 30) - 1);
+            }
+            for (auto& x : b) {
+                x = static_cast<uint32_t>(rng());
+            }
+            matMulVecPackedScalar(want.data(), a.data(), b.data(), rows, cols);
+            kernel(got.data(), a.data(), b.data(), rows, cols);
+            if (got != want) {
+                std::cout << "matMulVecPacked " << name << " on " << rows << "-by-" << cols << " differs from scalar"
+                          << std::endl;
+                throw std::runtime_error("Failure");
+            }
+        }
+    }
+}
+
+// Views must point into the matrix they select from without copying,
+// read the same entries through any stride, and copy out (Concat, or the
+// Matrix constructor) row by row; packed products over a row slice must
+// match the same rows of the product over the whole matrix.
+void TestMatrixView() {
+    Matrix m = MatrixRand(9, 7, LOGQ, 0);
+    MatrixView rows = m.SelectRows(2, 5);
+    MatrixView block = rows.SelectCols(1, 4);
+    if (rows.Data != m.Data.data() + 2 * 7 || rows.Rows != 5 || rows.Cols != 7 || !rows.Contiguous() ||
+        block.Data != rows.Data + 1 || block.Stride != 7 || block.Contiguous()) {
+        std::cout << "Views do not point into the matrix" << std::endl;
+        throw std::runtime_error("Failure");
+    }
+    Matrix copy(block);
+    for (uint64_t i = 0; i < 5; i++) {
+        for (uint64_t j = 0; j < 4; j++) {
+            if (block.Get(i, j) != m.Get(i + 2, j + 1) || copy.Get(i, j) != m.Get(i + 2, j + 1)) {
+                std::cout << "View or its copy differs from the matrix at " << i << ", " << j << std::endl;
+                throw std::runtime_error("Failure");
+            }
+        }
+    }
+
+    Matrix joined(0, 0);
+    joined.Concat(m.SelectRows(0, 4));
+    joined.Concat(m.SelectRows(4, 5));
+    if (joined.Rows != 9 || joined.Cols != 7 || joined.Data != m.Data) {
+        std::cout << "Concatenated views differ from the matrix" << std::endl;
+        throw std::runtime_error("Failure");
+    }
+
+    auto throws = [](const std::function<void()>& fn) {
+        try {
+            fn();
+        } catch (const std::runtime_error&) {
+            return true;
+        }
+        return false;
+    };
+    if (!throws([&] { joined.Concat(block); }) || !throws([&] { m.SelectRows(5, 5); })) {
+        std::cout << "Mismatched Concat or out-of-range SelectRows did not throw" << std::endl;
+        throw std::runtime_error("Failure");
+    }
+
+    Matrix db = MatrixRand(12, 5, 0, 1 << 30);
+    Matrix q = MatrixRand(15, 1, LOGQ, 0);
+    Matrix full = MatrixMulVecPacked(db, q, 10, 3);
+    Matrix part = MatrixMulVecPacked(db.SelectRows(3, 6), q, 10, 3);
+    if (!std::equal(part.Data.begin(), part.Data.end(), full.Data.begin() + 3)) {
+        std::cout << "Packed product over a row slice differs from the full product" << std::endl;
+        throw std::runtime_error("Failure");
+    }
+}
+
+// The pool's row ranges must tile any height, with empty ranges past the
+// last row, and SimplePIR answers split across several workers (more than
+// this host may have CPUs) must equal answers from a single worker, for
+// batches whose boundaries fall inside a worker's range.
+void TestAnswerPoolSplit() {
+    AnswerPool one(1);
+    AnswerPool three(3);
+    AnswerPool four(4);
+    std::vector<std::pair<AnswerPool*, uint64_t>> pools = {{&one, 1}, {&three, 3}, {&four, 4}};
+    for (auto [pool, workers] : pools) {
+        if (pool->NumWorkers() != workers) {
+            std::cout << "Pool started " << pool->NumWorkers() << " workers" << std::endl;
+            throw std::runtime_error("Failure");
+        }
+        for (uint64_t rows : {0, 1, 2, 5, 13, 100}) {
+            uint64_t next = 0;
+            for (uint64_t w = 0; w < pool->NumWorkers(); w++) {
+                RowRange r = pool->Rows(w, rows);
+                if (r.Start != next || r.End < r.Start || r.End > rows) {
+                    std::cout << "Worker " << w << " of " << pool->NumWorkers() << " got rows [" << r.Start
+                              << ", " << r.End << ") of " << rows << std::endl;
+                    throw std::runtime_error("Failure");
+                }
+                next = r.End;
+            }
+            if (next != rows) {
+                std::cout << "Workers cover " << next << " of " << rows << " rows" << std::endl;
+                throw std::runtime_error("Failure");
+            }
+        }
+        std::vector<std::atomic<int>> calls(pool->NumWorkers());
+        pool->Run([&](uint64_t w) { calls[w]++; });
+        if (std::any_of(calls.begin(), calls.end(), [](const std::atomic<int>& c) { return c != 1; })) {
+            std::cout << "Run did not call every worker once" << std::endl;
+            throw std::runtime_error("Failure");
+        }
+    }
+
+    uint64_t N = 1 << 16;
+    uint64_t d = 8;
+    SimplePIR single(&one);
+    Params p = single.PickParams(N, d, SEC_PARAM, LOGQ);
+    Database* DB = MakeRandomDB(N, d, &p);
+    State shared = single.Init(DB->Info, p);
+    auto [server, offline] = single.Setup(DB, shared, p);
+
+    std::vector<Msg> queries;
+    std::vector<State> clients;
+    for (uint64_t i = 0; i < 3; i++) {
+        auto [client, query] = single.Query(i * 7919 % N, shared, p, DB->Info);
+        clients.push_back(client);
+        queries.push_back(query);
+    }
+    Msg want = single.Answer(DB, queries, server, shared, p);
+    std::vector<Msg> want_many = single.AnswerMany(DB, queries);
+    for (AnswerPool* pool : {&three, &four}) {
+        SimplePIR split(pool);
+        Msg got = split.Answer(DB, queries, server, shared, p);
+        std::vector<Msg> got_many = split.AnswerMany(DB, queries);
+        if (got.data[0]->Data != want.data[0]->Data) {
+            std::cout << "Answer split over " << pool->NumWorkers() << " workers differs" << std::endl;
+            throw std::runtime_error("Failure");
+        }
+        for (uint64_t k = 0; k < queries.size(); k++) {
+            if (got_many[k].data[0]->Data != want_many[k].data[0]->Data) {
+                std::cout << "AnswerMany split over " << pool->NumWorkers() << " workers differs for query " << k
+                          << std::endl;
+                throw std::runtime_error("Failure");
+            }
+            delete got_many[k].data[0];
+        }
+        delete got.data[0];
+    }
+    for (uint64_t k = 0; k < queries.size(); k++) {
+        single.ReleaseQuery(clients[k], queries[k]);
+        delete want_many[k].data[0];
+    }
+    delete want.data[0];
+    delete offline.data[0];
+    delete shared.data[0];
+    delete DB;
+
+    SimplePIR split(&four);
+    p = split.PickParams(N, d, SEC_PARAM, LOGQ);
+    DB = MakeRandomDB(N, d, &p);
+    RunPIR(split, DB, p, {0, 4099, 8191});
+    delete DB;
+}
+
+// Each variant's multi-query kernel, for every shape and every k up to 64
+// queries and a DB wider than one column block, must give column c of
+// its product equal to the scalar single-query kernel on query c alone.
+void TestPackedMatMulQueries() {
+#define PACKED_SHAPE_SCALAR(B, C) {B, C, matMulVecPackedScalar_##B##x##C},
+    struct {
+        size_t basis;
+        size_t compression;
+        matMulVecPackedFn scalar;
+    } shapes[] = {PACKED_SHAPES(PACKED_SHAPE_SCALAR)};
+#undef PACKED_SHAPE_SCALAR
+    uint64_t rows = 37, cols = 300, stride = 301;
+
+    const char* names[8];
+    size_t num_variants = packedKernelVariants(names, 8);
+    std::string old = matMulVecPackedVariant();
+    std::mt19937_64 rng(21);
+    for (size_t v = 0; v < num_variants; v++) {
+        if (selectPackedKernelVariant(names[v]) != 0) {
+            throw std::runtime_error("Failure");
+        }
+        for (auto& shape : shapes) {
+            const PackedKernels* kernels = packedKernels(shape.basis, shape.compression);
+            uint32_t mask = static_cast<uint32_t>((uint64_t(1) << (shape.basis * shape.compression)) - 1);
+            std::vector<uint32_t> a(rows * stride);
+            for (auto& x : a) {
+                x = static_cast<uint32_t>(rng()) & mask;
+            }
+            uint64_t len = cols * shape.compression;
+            for (uint64_t k = 1; k <= 64; k++) {
+                std::vector<uint32_t> b(len * k), got(rows * k);
+                for (auto& x : b) {
+                    x = static_cast<uint32_t>(rng());
+                }
+                kernels->matMulMatPacked(got.data(), a.data(), b.data(), rows, cols, stride, k);
+                for (uint64_t c = 0; c < k; c++) {
+                    std::vector<uint32_t> query(len), want(rows);
+                    for (uint64_t j = 0; j < len; j++) {
+                        query[j] = b[j * k + c];
+                    }
+                    shape.scalar(want.data(), a.data(), query.data(), rows, cols, stride);
+                    for (uint64_t r = 0; r < rows; r++) {
+                        if (got[r * k + c] != want[r]) {
+                            std::cout << names[v] << " multi-query kernel for " << shape.basis << "x"
+                                      << shape.compression << " with " << k << " queries differs at row " << r
+                                      << ", query " << c << std::endl;
+                            throw std::runtime_error("Failure");
+                        }
+                    }
+                }
+            }
+        }
+    }
+    selectPackedKernelVariant(old.c_str());
+}
+
+// In-place transposes of non-square matrices, covering each way
+// transposeInPlace splits them: into square blocks stacked vertically
+// (rows a multiple of cols), side by side (cols a multiple of rows), or
+// neither, with sizes around the recursion's leaf size.
+void TestTransposeNonSquare() {
+    uint64_t shapes[][2] = {{96, 24}, {24, 96}, {100, 3}, {3, 100}, {37, 53}, {53, 37},
+                            {65, 130}, {1, 9}, {9, 1}, {257, 33}};
+    for (auto& shape : shapes) {
+        uint64_t rows = shape[0], cols = shape[1];
+        Matrix m = MatrixRand(rows, cols, LOGQ, 0);
+        Matrix orig = m;
+
+        m.Transpose();
+        bool ok = (m.Rows == cols && m.Cols == rows);
+        for (uint64_t i = 0; ok && i < rows; i++) {
+            for (uint64_t j = 0; j < cols; j++) {
+                if (m.Get(j, i) != orig.Get(i, j)) {
+                    ok = false;
+                    break;
+                }
+            }
+        }
+        m.Transpose();
+        if (!ok || m.Rows != rows || m.Cols != cols || m.Data != orig.Data) {
+            std::cout << "Transpose of " << rows << "-by-" << cols << " is wrong" << std::endl;
+            throw std::runtime_error("Failure");
+        }
+    }
+}
+
+// N random records of d bits.
+static std::vector<uint64_t> RandomRecords(uint64_t N, uint64_t d, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::vector<uint64_t> vals(N);
+    for (auto& v : vals) {
+        v = (d >= 64) ? rng() : rng() % (uint64_t(1) << d);
+    }
+    return vals;
+}
+
+// Fetches record i through Query, Answer and Recover, handing the client's
+// buffers back to its MatrixPool afterwards.
+static uint64_t Retrieve(SimplePIR& pir, Database* DB, uint64_t i, const State& shared,
+                         const Msg& offline, const Params& p) {
+    auto [client, query] = pir.Query(i, shared, p, DB->Info);
+    Msg answer = pir.Answer(DB, {query}, MakeState({}), shared, p);
+    uint64_t val = pir.Recover(i, 0, offline, query, answer, shared, client, p, DB->Info);
+    delete answer.data[0];
+    pir.ReleaseQuery(client, query);
+    return val;
+}
+
+void TestMatrixPoolReuse() {
+    MatrixPool& pool = MatrixPool::Local();
+    Matrix m = pool.Get(5, 7);
+    std::fill(m.Data.begin(), m.Data.end(), 0xdeadbeef);
+    const uint32_t* buf = m.Data.data();
+    uint64_t cached = pool.CachedBytes();
+    pool.Put(m);
+    if (pool.CachedBytes() != cached + 64 * sizeof(uint32_t)) {
+        throw std::runtime_error("Failure");
+    }
+
+    // 54 entries fall in the same 64-entry class as the 35 above.
+    Matrix n = pool.Get(6, 9);
+    if (n.Data.data() != buf || n.Rows != 6 || n.Cols != 9 || n.Data.size() != 54 ||
+        std::any_of(n.Data.begin(), n.Data.end(), [](uint32_t x) { return x != 0; })) {
+        std::cout << "Pooled matrix was not reused as a zeroed 6-by-9 matrix" << std::endl;
+        throw std::runtime_error("Failure");
+    }
+    pool.Put(n);
+
+    // Query and Recover draw their buffers from the pool, so repeated
+    // retrievals must not see each other's leftovers.
+    uint64_t N = 1 << 16;
+    uint64_t d = 8;
+    SimplePIR pir;
+    Params p = pir.PickParams(N, d, SEC_PARAM, LOGQ);
+    std::vector<uint64_t> vals = RandomRecords(N, d, 1);
+    Database* DB = MakeDB(N, d, &p, vals);
+    State shared = pir.Init(DB->Info, p);
+    auto [server, offline] = pir.Setup(DB, shared, p);
+    for (uint64_t i : {uint64_t(0), uint64_t(1), N / 2, N - 1, uint64_t(1)}) {
+        if (Retrieve(pir, DB, i, shared, offline, p) != vals[i]) {
+            std::cout << "Recovered the wrong value for record " << i << std::endl;
+            throw std::runtime_error("Failure");
+        }
+    }
+    delete DB;
+}
+
+// A compressed client, holding only the seed of A, must build queries of
+// the same form as Query does from A itself (A * secret + small noise +
+// Delta at the queried column), and the server must answer both alike.
+void TestSimplePirCompressedQuery() {
+    uint64_t N = 1 << 16;
+    uint64_t d = 8;
+    SimplePIR pir;
+    Params p = pir.PickParams(N, d, SEC_PARAM, LOGQ);
+    std::vector<uint64_t> vals = RandomRecords(N, d, 2);
+    Database* DB = MakeDB(N, d, &p, vals);
+
+    PRGKey seed = RandomPRGKey();
+    auto [shared, comp] = pir.InitCompressedSeeded(DB->Info, p, &seed);
+    State expanded = pir.DecompressState(DB->Info, p, comp);
+    Matrix& A = *shared.data[0];
+    if (expanded.data[0]->Data != A.Data) {
+        std::cout << "DecompressState expanded a different A" << std::endl;
+        throw std::runtime_error("Failure");
+    }
+    auto [server, offline] = pir.Setup(DB, shared, p);
+
+    for (uint64_t i : {uint64_t(0), uint64_t(12345), N - 1}) {
+        auto [client, query] = pir.QueryCompressed(i, comp, p, DB->Info);
+        Matrix As = Matrix::MatrixMul(A, *client.data[0]);
+        for (uint64_t j = 0; j < p.M; j++) {
+            uint32_t noise = query.data[0]->Data[j] - As.Data[j];
+            if (j == i % p.M) {
+                noise -= static_cast<uint32_t>(p.Delta());
+            }
+            if (std::abs(static_cast<int32_t>(noise)) > (1 << 10)) {
+                std::cout << "Compressed query is not A * secret + noise at " << j << std::endl;
+                throw std::runtime_error("Failure");
+            }
+        }
+        Msg answer = pir.Answer(DB, {query}, server, shared, p);
+        uint64_t got = pir.Recover(i, 0, offline, query, answer, shared, client, p, DB->Info);
+        delete answer.data[0];
+        pir.ReleaseQuery(client, query);
+
+        if (got != vals[i] || Retrieve(pir, DB, i, shared, offline, p) != got) {
+            std::cout << "Compressed and uncompressed queries for " << i << " disagree" << std::endl;
+            throw std::runtime_error("Failure");
+        }
+    }
+    delete DB;
+}
+
+// A squished DB written by SaveSquishedDB and mapped back must answer
+// like the original, and Setup on it must give the same hint.
+void TestSquishedDBFile() {
+    uint64_t N = 1 << 16;
+    uint64_t d = 32;
+    SimplePIR pir;
+    Params p = pir.PickParams(N, d, SEC_PARAM, LOGQ);
+    std::vector<uint64_t> vals = RandomRecords(N, d, 3);
+    Database* DB = MakeDB(N, d, &p, vals);
+    State shared = pir.Init(DB->Info, p);
+    auto [server, offline] = pir.Setup(DB, shared, p);
+
+    std::string path = (std::filesystem::temp_directory_path() / "simple_pir_test.db").string();
+    SaveSquishedDB(DB, path);
+    Database* loaded = LoadSquishedDB(path);
+    std::remove(path.c_str());
+
+    auto [loaded_server, loaded_offline] = pir.Setup(loaded, shared, p);
+    if (loaded_offline.data[0]->Data != offline.data[0]->Data) {
+        std::cout << "Setup on the loaded DB gave a different hint" << std::endl;
+        throw std::runtime_error("Failure");
+    }
+    for (uint64_t i : {uint64_t(0), uint64_t(777), N - 1}) {
+        if (Retrieve(pir, loaded, i, shared, offline, p) != vals[i]) {
+            std::cout << "Recovered the wrong value for record " << i << " from the loaded DB" << std::endl;
+            throw std::runtime_error("Failure");
+        }
+    }
+    delete loaded;
+    delete DB;
+}
+
+// IngestDB must build exactly the squished DB that MakeDB followed by
+// Setup leaves behind, whatever the number of workers.
+void TestIngestDB() {
+    uint64_t N = 1 << 16;
+    SimplePIR pir;
+    for (uint64_t d : {8, 32}) {
+        Params p = pir.PickParams(N, d, SEC_PARAM, LOGQ);
+        std::vector<uint64_t> vals = RandomRecords(N, d, 4);
+        Database* DB = MakeDB(N, d, &p, vals);
+        State shared = pir.Init(DB->Info, p);
+        auto [server, offline] = pir.Setup(DB, shared, p);
+        Matrix want(DB->View());
+
+        for (uint64_t threads : {1, 3}) {
+            VectorRecordReader in(vals);
+            Database* ingested = IngestDB(in, N, d, &p, threads);
+            if (!ingested->Squished || ingested->Info.Basis != DB->Info.Basis ||
+                ingested->Info.Squishing != DB->Info.Squishing || ingested->Info.Cols != DB->Info.Cols ||
+                Matrix(ingested->View()).Data != want.Data) {
+                std::cout << "IngestDB with " << threads << " threads differs from MakeDB for d = " << d << std::endl;
+                throw std::runtime_error("Failure");
+            }
+            if (Retrieve(pir, ingested, N / 3, shared, offline, p) != vals[N / 3]) {
+                throw std::runtime_error("Failure");
+            }
+            delete ingested;
+        }
+        delete DB;
+    }
+}
+
+// Records rewritten with Update after Setup must be recovered with their
+// new values once the client applies UpdateHint's patch, and the patched
+// hint must equal the one a fresh Setup computes.
+void TestSimplePirUpdate() {
+    uint64_t N = 1 << 16;
+    SimplePIR pir;
+    for (uint64_t d : {8, 32}) {
+        Params p = pir.PickParams(N, d, SEC_PARAM, LOGQ);
+        std::vector<uint64_t> vals = RandomRecords(N, d, 5);
+        Database* DB = MakeDB(N, d, &p, vals);
+        State shared = pir.Init(DB->Info, p);
+        auto [server, offline] = pir.Setup(DB, shared, p);
+
+        std::vector<uint64_t> updated = {7, 8, N / 2, N - 1};
+        std::vector<DBEntryDelta> changes;
+        for (uint64_t i : updated) {
+            vals[i] = (vals[i] + 1 + i) % (uint64_t(1) << d);
+            std::vector<DBEntryDelta> c = DB->Update(i, vals[i]);
+            changes.insert(changes.end(), c.begin(), c.end());
+        }
+        pir.ApplyHintDelta(offline, pir.UpdateHint(changes, shared));
+
+        for (uint64_t i : {uint64_t(6), uint64_t(7), uint64_t(8), N / 2, N - 1}) {
+            if (Retrieve(pir, DB, i, shared, offline, p) != vals[i]) {
+                std::cout << "Recovered the wrong value for record " << i << " after Update" << std::endl;
+                throw std::runtime_error("Failure");
+            }
+        }
+
+        pir.Reset(DB, p);
+        auto [fresh_server, fresh] = pir.Setup(DB, shared, p);
+        if (fresh.data[0]->Data != offline.data[0]->Data) {
+            std::cout << "Patched hint differs from a fresh Setup for d = " << d << std::endl;
+            throw std::runtime_error("Failure");
+        }
+        delete DB;
+    }
+}
+
+// Records added with Append after Setup, filling up the last row block
+// and spilling into new ones, must be recovered once the client applies
+// the patch and the new hint rows.
+void TestSimplePirAppend() {
+    uint64_t N = (1 << 16) - 100;
+    SimplePIR pir;
+    for (uint64_t d : {8, 32}) {
+        Params p = pir.PickParams(N, d, SEC_PARAM, LOGQ);
+        std::vector<uint64_t> vals = RandomRecords(N, d, 6);
+        Database* DB = MakeDB(N, d, &p, vals);
+        State shared = pir.Init(DB->Info, p);
+        auto [server, offline] = pir.Setup(DB, shared, p);
+
+        std::vector<uint64_t> extra = RandomRecords(p.M + 300, d, 7);
+        auto [patch, rows] = pir.Append(DB, extra, shared, p);
+        pir.ApplyHintDelta(offline, patch);
+        pir.ExtendHint(offline, rows);
+        vals.insert(vals.end(), extra.begin(), extra.end());
+
+        for (uint64_t i : {uint64_t(0), N - 1, N, N + 99, N + 100, uint64_t(vals.size() - 1)}) {
+            if (Retrieve(pir, DB, i, shared, offline, p) != vals[i]) {
+                std::cout << "Recovered the wrong value for record " << i << " after Append" << std::endl;
+                throw std::runtime_error("Failure");
+            }
+        }
+        delete DB;
+    }
+}
+
+// Writes staged in the overlay must be answered right away, and still
+// after Compact has folded them into the squished matrix.
+void TestSimplePirStage() {
+    uint64_t N = 1 << 16;
+    SimplePIR pir;
+    for (uint64_t d : {8, 32}) {
+        Params p = pir.PickParams(N, d, SEC_PARAM, LOGQ);
+        std::vector<uint64_t> vals = RandomRecords(N, d, 8);
+        Database* DB = MakeDB(N, d, &p, vals);
+        State shared = pir.Init(DB->Info, p);
+        auto [server, offline] = pir.Setup(DB, shared, p);
+
+        // Record 3 is staged twice; only its last value counts.
+        std::vector<uint64_t> staged = {3, 3, 1000, N - 2};
+        std::vector<DBEntryDelta> changes;
+        for (uint64_t k = 0; k < staged.size(); k++) {
+            uint64_t i = staged[k];
+            vals[i] = (vals[i] + 17 * (k + 1)) % (uint64_t(1) << d);
+            std::vector<DBEntryDelta> c = DB->Stage(i, vals[i]);
+            changes.insert(changes.end(), c.begin(), c.end());
+        }
+        pir.ApplyHintDelta(offline, pir.UpdateHint(changes, shared));
+        if (DB->Overlay.empty()) {
+            throw std::runtime_error("Failure");
+        }
+
+        for (int pass = 0; pass < 2; pass++) {
+            for (uint64_t i : {uint64_t(2), uint64_t(3), uint64_t(1000), N - 2}) {
+                if (Retrieve(pir, DB, i, shared, offline, p) != vals[i]) {
+                    std::cout << "Recovered the wrong value for staged record " << i
+                              << (pass == 0 ? " before" : " after") << " Compact" << std::endl;
+                    throw std::runtime_error("Failure");
+                }
+            }
+            DB->Compact();
+            if (!DB->Overlay.empty()) {
+                std::cout << "Compact left writes in the overlay" << std::endl;
+                throw std::runtime_error("Failure");
+            }
+        }
+        delete DB;
+    }
+}
+
+// An epoch held by a reader must stay usable after a rebuild publishes
+// the next one, and go away once the reader lets go.
+void TestSimplePirEpochSwap() {
+    uint64_t N = 1 << 16;
+    uint64_t d = 8;
+    SimplePIR pir;
+    Params p = pir.PickParams(N, d, SEC_PARAM, LOGQ);
+    std::vector<uint64_t> old_vals = RandomRecords(N, d, 9);
+    std::vector<uint64_t> new_vals = RandomRecords(N, d, 10);
+    Database* first = MakeDB(N, d, &p, old_vals);
+    State shared = pir.Init(first->Info, p);
+
+    EpochManager epochs;
+    epochs.Publish(first, pir.Setup(first, shared, p).second);
+    std::shared_ptr<const Epoch> held = epochs.Current();
+    std::weak_ptr<const Epoch> watch = held;
+
+    uint64_t id = epochs.Rebuild([&] {
+        Database* DB = MakeDB(N, d, &p, new_vals);
+        return std::make_pair(DB, pir.Setup(DB, shared, p).second);
+    }).get();
+    if (id != 2 || epochs.Current()->Id != 2) {
+        throw std::runtime_error("Failure");
+    }
+
+    uint64_t i = 4242;
+    if (Retrieve(pir, held->DB, i, shared, held->Hint, p) != old_vals[i]) {
+        std::cout << "Held epoch no longer answers with the old DB" << std::endl;
+        throw std::runtime_error("Failure");
+    }
+    auto [client, query] = pir.Query(i, shared, p, first->Info);
+    auto [answered, answer] = pir.Answer(epochs, {query}, MakeState({}), shared, p);
+    std::shared_ptr<const Epoch> current = epochs.Current();
+    if (answered != 2 ||
+        pir.Recover(i, 0, current->Hint, query, answer, shared, client, p, current->DB->Info) != new_vals[i]) {
+        std::cout << "Answer did not use the newly published epoch" << std::endl;
+        throw std::runtime_error("Failure");
+    }
+    delete answer.data[0];
+    pir.ReleaseQuery(client, query);
+
+    held.reset();
+    if (!watch.expired()) {
+        std::cout << "Old epoch outlived its last reader" << std::endl;
+        throw std::runtime_error("Failure");
+    }
+}
+
+// Answers from worker processes, each serving a block of rows, must
+// stack up to exactly the single-server answer.
+void TestShardedServer() {
+    uint64_t N = 1 << 16;
     uint64_t d = 32;
     SimplePIR pir;
     Params p = pir.PickParams(N, d, SEC_PARAM, LOGQ);
+    std::vector<uint64_t> vals = RandomRecords(N, d, 11);
+    Database* DB = MakeDB(N, d, &p, vals);
+    State shared = pir.Init(DB->Info, p);
+    auto [server, offline] = pir.Setup(DB, shared, p);
+
+    for (uint64_t num_shards : {1, 3}) {
+        ShardedServer shards(DB, num_shards);
+        for (uint64_t i : {uint64_t(0), N / 2 + 1, N - 1}) {
+            auto [client, query] = pir.Query(i, shared, p, DB->Info);
+            Msg single = pir.Answer(DB, {query}, server, shared, p);
+            Msg sharded = pir.Answer(shards, query);
+            if (sharded.data[0]->Data != single.data[0]->Data ||
+                pir.Recover(i, 0, offline, query, sharded, shared, client, p, DB->Info) != vals[i]) {
+                std::cout << "Answer from " << num_shards << " shards differs for record " << i << std::endl;
+                throw std::runtime_error("Failure");
+            }
+            delete single.data[0];
+            delete sharded.data[0];
+            pir.ReleaseQuery(client, query);
+        }
+    }
+    delete DB;
+}
+
+// Whether the shared memory segment name still exists.
+static bool SharedSegmentExists(const std::string& name) {
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd >= 0) {
+        close(fd);
+    }
+    return fd >= 0;
+}
+
+// A DB published in shared memory must answer like the original from
+// every attached process, and its segment must be unlinked when the last
+// one detaches.
+void TestSharedDB() {
+    uint64_t N = 1 << 16;
+    uint64_t d = 8;
+    SimplePIR pir;
+    Params p = pir.PickParams(N, d, SEC_PARAM, LOGQ);
+    std::vector<uint64_t> vals = RandomRecords(N, d, 12);
+    Database* DB = MakeDB(N, d, &p, vals);
+    State shared = pir.Init(DB->Info, p);
+    auto [server, offline] = pir.Setup(DB, shared, p);
+
+    std::string name = "/simple_pir_test." + std::to_string(getpid());
+    MatrixView owner_hint(nullptr, 0, 0, 0);
+    Database* owner = CreateSharedDB(DB, *offline.data[0], name, &owner_hint);
+    MatrixView hint(nullptr, 0, 0, 0);
+    Database* attached = AttachSharedDB(name, &hint);
+    if (Matrix(hint).Data != offline.data[0]->Data || Matrix(attached->View()).Data != Matrix(DB->View()).Data) {
+        std::cout << "Attached DB or hint differs from the published one" << std::endl;
+        throw std::runtime_error("Failure");
+    }
+    for (uint64_t i : {uint64_t(5), N - 5}) {
+        if (Retrieve(pir, attached, i, shared, offline, p) != vals[i]) {
+            std::cout << "Recovered the wrong value for record " << i << " from shared memory" << std::endl;
+            throw std::runtime_error("Failure");
+        }
+    }
 
-    Database DB = pir.MakeRandomDB(N, d, &p);
-    pir.RunPIRCompressed(&DB, p, {0, 0, 0, 0});
+    delete owner;
+    if (!SharedSegmentExists(name)) {
+        std::cout << "Segment unlinked while still attached" << std::endl;
+        throw std::runtime_error("Failure");
+    }
+    delete attached;
+    if (SharedSegmentExists(name)) {
+        std::cout << "Segment outlived its last user" << std::endl;
+        throw std::runtime_error("Failure");
+    }
+    delete DB;
+}
+
+// The hint cache must miss before the first Setup, hand back the stored
+// hint for an identical DB, and miss again once a record changes.
+void TestHintCache() {
+    uint64_t N = 1 << 16;
+    uint64_t d = 8;
+    SimplePIR pir;
+    Params p = pir.PickParams(N, d, SEC_PARAM, LOGQ);
+    std::vector<uint64_t> vals = RandomRecords(N, d, 13);
+    std::filesystem::path dir = std::filesystem::temp_directory_path() /
+                                ("simple_pir_test_hints." + std::to_string(getpid()));
+
+    HintCache cache(dir.string());
+    PRGKey seed, again;
+    cache.Seed(seed.data());
+    HintCache(dir.string()).Seed(again.data());
+    if (seed != again) {
+        std::cout << "Cache did not keep its seed" << std::endl;
+        throw std::runtime_error("Failure");
+    }
+
+    Database* DB = MakeDB(N, d, &p, vals);
+    State shared = pir.InitCompressedSeeded(DB->Info, p, &seed).first;
+    HintDigest key = DigestHintInputs(DB, seed.data(), p, pir.Name());
+    Msg hint;
+    if (cache.Load(key, hint)) {
+        std::cout << "Empty cache returned a hint" << std::endl;
+        throw std::runtime_error("Failure");
+    }
+    auto [server, offline] = pir.Setup(DB, shared, p);
+    cache.Store(key, offline);
+
+    Database* same = MakeDB(N, d, &p, vals);
+    HintDigest same_key = DigestHintInputs(same, seed.data(), p, pir.Name());
+    if (!cache.Load(same_key, hint) || hint.data[0]->Data != offline.data[0]->Data) {
+        std::cout << "Cache missed the hint of an identical DB" << std::endl;
+        throw std::runtime_error("Failure");
+    }
+    pir.FakeSetup(same, p);
+    if (Retrieve(pir, same, 99, shared, hint, p) != vals[99]) {
+        std::cout << "Recovered the wrong value with the cached hint" << std::endl;
+        throw std::runtime_error("Failure");
+    }
+
+    vals[99] ^= 1;
+    Database* changed = MakeDB(N, d, &p, vals);
+    Msg stale;
+    if (cache.Load(DigestHintInputs(changed, seed.data(), p, pir.Name()), stale)) {
+        std::cout << "Cache returned a hint for a changed DB" << std::endl;
+        throw std::runtime_error("Failure");
+    }
+
+    // A corrupt entry, with a huge matrix count or matrix size in its
+    // header, is a miss rather than an allocation of that size.
+    std::string entry = (dir / (key.Hex() + ".hint")).string();
+    std::vector<std::pair<uint64_t, uint64_t>> fields = {{12, 0xFFFFFFFF}, {32, uint64_t(1) << 40}};
+    for (auto [offset, huge] : fields) {
+        uint64_t width = (offset == 12) ? 4 : 8;
+        uint64_t saved = 0;
+        std::fstream f(entry, std::ios::in | std::ios::out | std::ios::binary);
+        f.seekg(offset);
+        f.read(reinterpret_cast<char*>(&saved), width);
+        f.seekp(offset);
+        f.write(reinterpret_cast<const char*>(&huge), width);
+        f.flush();
+        Msg corrupt;
+        if (cache.Load(key, corrupt)) {
+            std::cout << "Cache loaded an entry with a corrupt header at byte " << offset << std::endl;
+            throw std::runtime_error("Failure");
+        }
+        f.seekp(offset);
+        f.write(reinterpret_cast<const char*>(&saved), width);
+    }
+    for (const auto& file : std::filesystem::directory_iterator(dir)) {
+        if (file.path().extension() == ".tmp") {
+            std::cout << "Cache left " << file.path() << " behind" << std::endl;
+            throw std::runtime_error("Failure");
+        }
+    }
+
+    std::filesystem::remove_all(dir);
+    delete changed;
+    delete same;
+    delete DB;
+}
+
+// Large matrices must come out zeroed, correctly sized and usable under
+// every allocation policy, whether or not the pages it asks for are
+// available, and policy names must parse back to the same policy.
+void TestMatrixAllocPolicies() {
+    MatrixAllocPolicy old = GetMatrixAllocPolicy();
+    std::stringstream ss("default;thp;2m;1g;thp,parallel;thp,interleave;2m,bind,0;default,first-touch");
+    std::string spec;
+    while (std::getline(ss, spec, ';')) {
+        MatrixAllocPolicy policy = ParseMatrixAllocPolicy(spec);
+        MatrixAllocPolicy parsed = ParseMatrixAllocPolicy(MatrixAllocPolicyName(policy));
+        if (parsed.Pages != policy.Pages || parsed.Placement != policy.Placement || parsed.Node != policy.Node) {
+            std::cout << "Policy " << spec << " does not survive its name" << std::endl;
+            throw std::runtime_error("Failure");
+        }
+        SetMatrixAllocPolicy(policy);
+
+        // 4 MB, well above MATRIX_LARGE_BYTES.
+        Matrix a(1000, 1000);
+        bool ok = a.Data.size() == 1000 * 1000 &&
+                  std::all_of(a.Data.begin(), a.Data.end(), [](uint32_t x) { return x == 0; });
+        for (uint64_t i = 0; i < a.Data.size(); i++) {
+            a.Data[i] = static_cast<uint32_t>(i * 2654435761u);
+        }
+        Matrix b = a;
+        a.Transpose();
+        a.Transpose();
+        if (!ok || a.Data != b.Data) {
+            std::cout << "Matrix allocated under " << MatrixAllocPolicyName(policy) << " is broken" << std::endl;
+            throw std::runtime_error("Failure");
+        }
+    }
+    SetMatrixAllocPolicy(old);
+
+    for (const char* bad : {"", "4k", "thp,everywhere", "thp,bind,x"}) {
+        try {
+            ParseMatrixAllocPolicy(bad);
+        } catch (const std::exception&) {
+            continue;
+        }
+        std::cout << "Accepted bad policy \"" << bad << "\"" << std::endl;
+        throw std::runtime_error("Failure");
+    }
+}
+
+// The indexed table must hand PickParams the row with the fewest samples
+// that still covers M, and each objective must pick params no worse on
+// that objective than the other objectives' picks, all of which recover.
+void TestPickParamsObjectives() {
+    uint64_t N = 1 << 16;
+    uint64_t d = 8;
+    std::shared_ptr<const ParamsTable> table = LWEParamsTable();
+    std::vector<const LWEParamsEntry*> rows = table->Rows(SEC_PARAM, LOGQ);
+    for (uint64_t k = 1; k < rows.size(); k++) {
+        if (rows[k - 1]->LogM >= rows[k]->LogM) {
+            std::cout << "Params table rows are out of order" << std::endl;
+            throw std::runtime_error("Failure");
+        }
+    }
+    if (rows.empty() || table->Find(SEC_PARAM, LOGQ, (uint64_t(1) << rows.back()->LogM) + 1) != nullptr) {
+        std::cout << "Params table found a row past its largest" << std::endl;
+        throw std::runtime_error("Failure");
+    }
+
+    SimplePIR pir;
+    std::vector<ParamsObjective> objectives = {ParamsObjective::MaxThroughput, ParamsObjective::MinOfflineDownload,
+                                               ParamsObjective::MinOnlineComm};
+    std::vector<ParamsCost> costs;
+    std::vector<uint64_t> vals = RandomRecords(N, d, 14);
+    for (ParamsObjective objective : objectives) {
+        Params p = pir.PickParams(N, d, SEC_PARAM, LOGQ, objective);
+        const LWEParamsEntry* row = table->Find(SEC_PARAM, LOGQ, p.M);
+        auto at = std::find(rows.begin(), rows.end(), row);
+        if (at == rows.end() || row->Sigma != p.Sigma || (uint64_t(1) << row->LogM) < p.M ||
+            (at != rows.begin() && (uint64_t(1) << (*(at - 1))->LogM) >= p.M)) {
+            std::cout << "Picked params disagree with the table" << std::endl;
+            throw std::runtime_error("Failure");
+        }
+        costs.push_back(SimplePIR::Cost(p));
+
+        Database* DB = MakeDB(N, d, &p, vals);
+        State shared = pir.Init(DB->Info, p);
+        auto [server, offline] = pir.Setup(DB, shared, p);
+        if (Retrieve(pir, DB, N - 1, shared, offline, p) != vals[N - 1]) {
+            std::cout << "Recovered the wrong value under picked params" << std::endl;
+            throw std::runtime_error("Failure");
+        }
+        delete DB;
+    }
+
+    auto online = [](const ParamsCost& c) { return c.UploadBytes + c.DownloadBytes; };
+    for (const ParamsCost& c : costs) {
+        if (costs[0].ScanBytes > c.ScanBytes || costs[1].HintBytes > c.HintBytes || online(costs[2]) > online(c)) {
+            std::cout << "An objective picked params beaten on that objective" << std::endl;
+            throw std::runtime_error("Failure");
+        }
+    }
+}
+
+// The first LoadOrAutotune in an empty directory measures and stores a
+// tuning, the second loads the same one back, and applying it selects its
+// kernel variant and crossover and makes its best aspect cost 1.
+void TestAutotuneStoredResult() {
+    std::filesystem::path dir = std::filesystem::temp_directory_path() /
+                                ("simple_pir_test_tune." + std::to_string(getpid()));
+    std::string old_variant = matMulVecPackedVariant();
+    size_t old_crossover = matMulTransposedPackedCrossover();
+
+    TuneResult measured = LoadOrAutotune(dir.string());
+    TuneResult loaded = LoadOrAutotune(dir.string());
+    bool same = loaded.Cpu == measured.Cpu && loaded.Variant == measured.Variant &&
+                loaded.TransposedCrossover == measured.TransposedCrossover &&
+                loaded.AspectLog2 == measured.AspectLog2 && loaded.AspectCost.size() == measured.AspectCost.size();
+    for (uint64_t k = 0; same && k < loaded.AspectCost.size(); k++) {
+        same = std::abs(loaded.AspectCost[k] - measured.AspectCost[k]) <= 1e-4 * measured.AspectCost[k];
+    }
+    if (!same) {
+        std::cout << "Stored tuning did not load back" << std::endl;
+        throw std::runtime_error("Failure");
+    }
+    if (loaded.Variant != matMulVecPackedVariant() || loaded.TransposedCrossover != matMulTransposedPackedCrossover() ||
+        TunedAspect() != loaded.BestAspect() || std::abs(ScanCostFactor(TunedAspect()) - 1.0) > 1e-4) {
+        std::cout << "Tuning was not applied" << std::endl;
+        throw std::runtime_error("Failure");
+    }
+
+    // Back to the untuned dispatch and a flat scan cost.
+    TuneResult untuned;
+    untuned.Cpu = loaded.Cpu;
+    untuned.Variant = old_variant;
+    untuned.TransposedCrossover = old_crossover;
+    ApplyTuning(untuned);
+    if (ScanCostFactor(16.0) != 1.0 || TunedAspect() != 1.0) {
+        std::cout << "Tuning without aspect costs is not flat" << std::endl;
+        throw std::runtime_error("Failure");
+    }
+    std::filesystem::remove_all(dir);
+}
+
+// DoublePIR must recover packed records and records spread over several
+// DB rows, with a hint whose size depends only on the LWE params and X.
+void TestDoublePirRecover() {
+    uint64_t N = 1 << 16;
+    DoublePIR pir;
+    for (uint64_t d : {3, 32}) {
+        Params p = pir.PickParams(N, d, SEC_PARAM, LOGQ);
+        std::vector<uint64_t> vals = RandomRecords(N, d, 15);
+        Database* DB = MakeDB(N, d, &p, vals);
+        State shared = pir.Init(DB->Info, p);
+        auto [server, offline] = pir.Setup(DB, shared, p);
+        const Matrix& H2 = *offline.data[0];
+        if (H2.Rows != p.N * p.delta() * DB->Info.X || H2.Cols != p.N) {
+            std::cout << "DoublePIR hint is " << H2.Rows << "-by-" << H2.Cols << std::endl;
+            throw std::runtime_error("Failure");
+        }
+
+        for (uint64_t i : {uint64_t(0), N / 3, N - 1}) {
+            auto [client, query] = pir.Query(i, shared, p, DB->Info);
+            Msg answer = pir.Answer(DB, {query}, server, shared, p);
+            uint64_t val = pir.Recover(i, 0, offline, query, answer, shared, client, p, DB->Info);
+            for (Matrix* m : answer.data) {
+                delete m;
+            }
+            pir.ReleaseQuery(client, query);
+            if (val != vals[i]) {
+                std::cout << "DoublePIR recovered " << val << " for record " << i << " of " << d
+                          << " bits, expected " << vals[i] << std::endl;
+                throw std::runtime_error("Failure");
+            }
+        }
+        delete DB;
+    }
+}
+
+// Every copy of a record must sit where the client's hashes say, a full
+// batch with repeated indices must get distinct buckets, and one pass
+// over the replicated DB must recover every index that was placed.
+void TestSimplePirCuckooBatch() {
+    uint64_t N = 1 << 14;
+    uint64_t k = 32;
+    CuckooBatch batch(N, k, 17);
+    std::vector<uint64_t> vals = RandomRecords(N, 8, 16);
+
+    std::vector<uint64_t> replicated = batch.Replicate(vals, batch.BucketRecords());
+    for (uint64_t i = 0; i < N; i += 97) {
+        for (int h = 0; h < CuckooBatch::NUM_HASHES; h++) {
+            uint64_t at = batch.Bucket(i, h) * batch.BucketRecords() + batch.Slot(i, h);
+            if (batch.Bucket(i, h) >= batch.NumBuckets() || batch.Slot(i, h) >= batch.BucketRecords() ||
+                replicated[at] != vals[i]) {
+                std::cout << "Copy " << h << " of record " << i << " is not where it hashes to" << std::endl;
+                throw std::runtime_error("Failure");
+            }
+        }
+    }
+
+    std::mt19937_64 rng(18);
+    std::vector<uint64_t> indices(k);
+    for (auto& i : indices) {
+        i = rng() % N;
+    }
+    indices[k - 1] = indices[0];
+
+    // d = 2 packs several records into each Z_p element.
+    for (uint64_t d : {8, 2}) {
+        vals = RandomRecords(N, d, 16);
+        SimplePIR pir;
+        Params p = pir.PickBatchParams(batch, d, SEC_PARAM, LOGQ);
+        Database* DB = pir.MakeBatchDB(batch, d, p, vals);
+        State shared = pir.Init(DB->Info, p);
+        auto [server, offline] = pir.Setup(DB, shared, p);
+        BatchQuery q = pir.QueryBatch(indices, batch, shared, p, DB->Info);
+        if (q.Assignment.BucketOf[k - 1] != q.Assignment.BucketOf[0]) {
+            std::cout << "Repeated index got its own bucket" << std::endl;
+            throw std::runtime_error("Failure");
+        }
+        std::vector<bool> used(batch.NumBuckets(), false);
+        for (uint64_t pos = 0; pos < k; pos++) {
+            uint64_t b = q.Assignment.BucketOf[pos];
+            if (b == CuckooBatch::NONE) {
+                continue;
+            }
+            if (indices[q.Assignment.ForBucket[b]] != indices[pos] || (q.Assignment.ForBucket[b] == pos && used[b])) {
+                std::cout << "Two indices share bucket " << b << std::endl;
+                throw std::runtime_error("Failure");
+            }
+            used[b] = true;
+        }
+
+        Msg answer = pir.Answer(DB, q.Queries, server, shared, p);
+        std::vector<uint64_t> got = pir.RecoverBatch(indices, q, batch, offline, answer, shared, p, DB->Info);
+        for (uint64_t pos = 0; pos < k; pos++) {
+            if (q.Assignment.BucketOf[pos] != CuckooBatch::NONE && got[pos] != vals[indices[pos]]) {
+                std::cout << "Batch recovered the wrong value for " << d << "-bit record " << indices[pos]
+                          << std::endl;
+                throw std::runtime_error("Failure");
+            }
+        }
+        delete answer.data[0];
+        for (uint64_t b = 0; b < batch.NumBuckets(); b++) {
+            pir.ReleaseQuery(q.Client[b], q.Queries[b]);
+        }
+        delete DB;
+    }
+}
+
+// Coalesced answers must equal answers given one at a time; full batches
+// must go out without waiting for the deadline, a short batch must go out
+// at it, and an exception from the pass must reach every query in it.
+void TestQueryCoalescer() {
+    uint64_t N = 1 << 16;
+    uint64_t d = 8;
+    SimplePIR pir;
+    Params p = pir.PickParams(N, d, SEC_PARAM, LOGQ);
+    std::vector<uint64_t> vals = RandomRecords(N, d, 19);
+    Database* DB = MakeDB(N, d, &p, vals);
+    State shared = pir.Init(DB->Info, p);
+    auto [server, offline] = pir.Setup(DB, shared, p);
+
+    std::vector<State> clients;
+    std::vector<Msg> queries;
+    for (uint64_t i = 0; i < 16; i++) {
+        auto [client, query] = pir.Query(i * 4099 % N, shared, p, DB->Info);
+        clients.push_back(client);
+        queries.push_back(query);
+    }
+
+    {
+        QueryCoalescer coalescer([&](const std::vector<Msg>& qs) { return pir.AnswerMany(DB, qs); }, 8,
+                                 std::chrono::seconds(10));
+        std::vector<std::future<Msg>> answers;
+        for (const Msg& query : queries) {
+            answers.push_back(coalescer.Submit(query));
+        }
+        for (uint64_t k = 0; k < queries.size(); k++) {
+            Msg coalesced = answers[k].get();
+            Msg single = pir.Answer(DB, {queries[k]}, server, shared, p);
+            if (coalesced.data[0]->Data != single.data[0]->Data) {
+                std::cout << "Coalesced answer differs for query " << k << std::endl;
+                throw std::runtime_error("Failure");
+            }
+            delete coalesced.data[0];
+            delete single.data[0];
+        }
+        CoalescerStats stats = coalescer.Stats();
+        if (stats.Queries != 16 || stats.Passes != 2 || stats.FullPasses != 2 || stats.BatchSize.Count() != 2 ||
+            stats.QueueDelayUs.Count() != 16) {
+            std::cout << "Full batches were not answered in full passes" << std::endl;
+            throw std::runtime_error("Failure");
+        }
+    }
+
+    {
+        QueryCoalescer coalescer([&](const std::vector<Msg>& qs) { return pir.AnswerMany(DB, qs); }, 8,
+                                 std::chrono::milliseconds(50));
+        std::vector<std::future<Msg>> answers;
+        for (uint64_t k = 0; k < 3; k++) {
+            answers.push_back(coalescer.Submit(queries[k]));
+        }
+        for (uint64_t k = 0; k < 3; k++) {
+            Msg answer = answers[k].get();
+            uint64_t i = k * 4099 % N;
+            if (pir.Recover(i, 0, offline, queries[k], answer, shared, clients[k], p, DB->Info) != vals[i]) {
+                std::cout << "Recovered the wrong value from a coalesced answer" << std::endl;
+                throw std::runtime_error("Failure");
+            }
+            delete answer.data[0];
+        }
+        CoalescerStats stats = coalescer.Stats();
+        if (stats.Queries != 3 || stats.FullPasses != 0 || stats.DeadlinePasses != stats.Passes) {
+            std::cout << "Short batch was not flushed at its deadline" << std::endl;
+            throw std::runtime_error("Failure");
+        }
+    }
+
+    {
+        QueryCoalescer coalescer(
+            [](const std::vector<Msg>&) -> std::vector<Msg> { throw std::runtime_error("pass failed"); }, 2,
+            std::chrono::seconds(10));
+        std::future<Msg> a = coalescer.Submit(queries[0]);
+        std::future<Msg> b = coalescer.Submit(queries[1]);
+        for (std::future<Msg>* f : {&a, &b}) {
+            try {
+                f->get();
+            } catch (const std::runtime_error&) {
+                continue;
+            }
+            std::cout << "A failed pass returned an answer" << std::endl;
+            throw std::runtime_error("Failure");
+        }
+    }
+
+    for (uint64_t k = 0; k < queries.size(); k++) {
+        pir.ReleaseQuery(clients[k], queries[k]);
+    }
+    delete DB;
+}
+
+// With TUNE_DIR set, applies the host tuning stored there (measuring it
+// first if this CPU model has none yet) before params are picked.
+static void TuneFromEnv() {
+    char* dir = std::getenv("TUNE_DIR");
+    if (dir != nullptr && dir[0] != '\0') {
+        LoadOrAutotune(dir);
+    }
 }
 
 void BenchmarkSimplePirSingle() {
+    TuneFromEnv();
     uint64_t N = 1 << 20;
     uint64_t d = 2048;
 
@@ -315,7 +1523,7 @@ void BenchmarkSimplePirSingle() {
     if (log_N_env != nullptr) {
         int log_N = std::atoi(log_N_env);
         if (log_N != 0) {
-            N = 1 << log_N;
+            N = uint64_t(1) << log_N;
         }
     }
     if (D_env != nullptr) {
@@ -333,15 +1541,15 @@ void BenchmarkSimplePirSingle() {
         throw std::runtime_error("Index out of dimensions");
     }
 
-    Database DB = pir.MakeRandomDB(N, d, &p);
-    std::vector<float64_t> tputs;
+    Database* DB = MakeRandomDB(N, d, &p);
+    std::vector<double> tputs;
     for (int j = 0; j < 5; j++) {
-        auto [tput, _, _, _] = pir.RunFakePIR(&DB, p, {i});
-        tputs.push_back(tput);
+        tputs.push_back(std::get<0>(RunFakePIR(pir, DB, p, {i})));
     }
+    delete DB;
 
     // Calculate average throughput
-    float64_t avg_tput = 0.0;
+    double avg_tput = 0.0;
     for (auto tput : tputs) {
         avg_tput += tput;
     }
@@ -351,6 +1559,53 @@ void BenchmarkSimplePirSingle() {
     std::cout << "Avg SimplePIR throughput, except for first run: " << avg_tput << " MB/s" << std::endl;
 }
 
+// Compares answer throughput (the printRate MB/s) across page sizes and
+// NUMA placements of the DB and A. Set ALLOC_POLICIES to a ';'-separated
+// list of ParseMatrixAllocPolicy specs to try others.
+void BenchmarkSimplePirAllocPolicy() {
+    uint64_t N = 1 << 20;
+    uint64_t d = 2048;
+
+    char* log_N_env = std::getenv("LOG_N");
+    if (log_N_env != nullptr && std::atoi(log_N_env) != 0) {
+        N = uint64_t(1) << std::atoi(log_N_env);
+    }
+    char* D_env = std::getenv("D");
+    if (D_env != nullptr && std::atoi(D_env) != 0) {
+        d = std::atoi(D_env);
+    }
+
+    std::string specs = "default;thp;2m;1g;thp,parallel;thp,interleave";
+    char* policies_env = std::getenv("ALLOC_POLICIES");
+    if (policies_env != nullptr) {
+        specs = policies_env;
+    }
+
+    SimplePIR pir;
+    Params p = pir.PickParams(N, d, SEC_PARAM, LOGQ);
+    MatrixAllocPolicy old = GetMatrixAllocPolicy();
+
+    std::stringstream ss(specs);
+    std::string spec;
+    while (std::getline(ss, spec, ';')) {
+        MatrixAllocPolicy policy = ParseMatrixAllocPolicy(spec);
+        SetMatrixAllocPolicy(policy);
+
+        // Built after setting the policy, so the DB (and, inside
+        // RunFakePIR, A) is allocated under it.
+        Database* DB = MakeRandomDB(N, d, &p);
+        std::vector<double> tputs;
+        for (int j = 0; j < 5; j++) {
+            tputs.push_back(std::get<0>(RunFakePIR(pir, DB, p, {0})));
+        }
+        delete DB;
+        double avg_tput = std::accumulate(tputs.begin(), tputs.end(), 0.0) / tputs.size();
+        std::cout << "Avg SimplePIR throughput (" << MatrixAllocPolicyName(policy) << "): "
+                  << avg_tput << " MB/s" << std::endl;
+    }
+    SetMatrixAllocPolicy(old);
+}
+
 void BenchmarkSimplePirVaryingDB() {
     std::ofstream flog("simple-comm.log", std::ios::app);
     if (!flog.is_open()) {
@@ -359,11 +1614,12 @@ void BenchmarkSimplePirVaryingDB() {
 
     flog << "N,d,tput,tput_stddev,offline_comm,online_comm" << std::endl;
 
+    TuneFromEnv();
     SimplePIR pir;
     int total_sz = 33;
 
     for (uint64_t d = 1; d <= 32768; d *= 2) {
-        uint64_t N = (1 << total_sz) / d;
+        uint64_t N = (uint64_t(1) << total_sz) / d;
         Params p = pir.PickParams(N, d, SEC_PARAM, LOGQ);
 
         uint64_t i = 0; // index to query
@@ -371,38 +1627,39 @@ void BenchmarkSimplePirVaryingDB() {
             throw std::runtime_error("Index out of dimensions");
         }
 
-        Database DB = pir.MakeRandomDB(N, d, &p);
-        std::vector<float64_t> tputs;
-        std::vector<float64_t> offline_cs;
-        std::vector<float64_t> online_cs;
+        Database* DB = MakeRandomDB(N, d, &p);
+        std::vector<double> tputs;
+        std::vector<double> offline_cs;
+        std::vector<double> online_cs;
 
         for (int j = 0; j < 5; j++) {
-            auto [tput, _, offline_c, online_c] = pir.RunFakePIR(&DB, p, {i});
+            auto [tput, _, offline_c, online_c] = RunFakePIR(pir, DB, p, {i});
             tputs.push_back(tput);
             offline_cs.push_back(offline_c);
             online_cs.push_back(online_c);
         }
 
         // Calculate average throughput
-        float64_t avg_tput = 0.0;
+        double avg_tput = 0.0;
         for (auto tput : tputs) {
             avg_tput += tput;
         }
         avg_tput /= tputs.size();
 
         // Calculate standard deviation of throughput
-        float64_t tput_stddev = 0.0;
+        double tput_stddev = 0.0;
         for (auto tput : tputs) {
             tput_stddev += (tput - avg_tput) * (tput - avg_tput);
         }
         tput_stddev = std::sqrt(tput_stddev / tputs.size());
 
         // Calculate average offline and online communication
-        float64_t avg_offline_c = std::accumulate(offline_cs.begin(), offline_cs.end(), 0.0) / offline_cs.size();
-        float64_t avg_online_c = std::accumulate(online_cs.begin(), online_cs.end(), 0.0) / online_cs.size();
+        double avg_offline_c = std::accumulate(offline_cs.begin(), offline_cs.end(), 0.0) / offline_cs.size();
+        double avg_online_c = std::accumulate(online_cs.begin(), online_cs.end(), 0.0) / online_cs.size();
 
         // Write results to log file
         flog << N << "," << d << "," << avg_tput << "," << tput_stddev << "," << avg_offline_c << "," << avg_online_c << std::endl;
+        delete DB;
     }
 }
 
@@ -417,7 +1674,7 @@ void BenchmarkSimplePirBatchLarge() {
         throw std::runtime_error("Error creating log file");
     }
 
-    uint64_t N = 1 << 33;
+    uint64_t N = uint64_t(1) << 33;
     uint64_t d = 1;
 
     SimplePIR pir;
@@ -428,18 +1685,17 @@ void BenchmarkSimplePirBatchLarge() {
         throw std::runtime_error("Index out of dimensions");
     }
 
-    Database DB = pir.MakeRandomDB(N, d, &p);
+    Database* DB = MakeRandomDB(N, d, &p);
 
     flog << "Batch_sz,Good_tput,Good_std_dev,Num_successful_queries,Tput" << std::endl;
 
     for (int trial = 0; trial <= 10; trial += 1) {
         int batch_sz = (1 << trial);
         std::vector<uint64_t> query(batch_sz, i);
-        std::vector<float64_t> tputs;
+        std::vector<double> tputs;
 
         for (int iter = 0; iter < 5; iter++) {
-            auto [tput, _, _, _] = pir.RunFakePIR(&DB, p, query);
-            tputs.push_back(tput);
+            tputs.push_back(std::get<0>(RunFakePIR(pir, DB, p, query)));
         }
 
         double expected_num_empty_buckets = pow(double(batch_sz - 1) / double(batch_sz), double(batch_sz)) * double(batch_sz);
@@ -454,5 +1710,280 @@ void BenchmarkSimplePirBatchLarge() {
             << expected_num_successful_queries << ","
             << (std::accumulate(tputs.begin(), tputs.end(), 0.0) / tputs.size()) << std::endl;
     }
+    delete DB;
+}
+
+// Batch PIR through cuckoo-hashed buckets (batch_pir.h): every index of
+// the batch is retrieved in one pass over NUM_HASHES copies of the DB.
+// Tput is N * d bits times the number of indices retrieved, per second of
+// Answer, so it compares directly with BenchmarkSimplePirSingle.
+void BenchmarkSimplePirCuckooBatch() {
+    uint64_t N = 1 << 24;
+    uint64_t d = 1;
+
+    char* log_N_env = std::getenv("LOG_N");
+    if (log_N_env != nullptr && std::atoi(log_N_env) != 0) {
+        N = uint64_t(1) << std::atoi(log_N_env);
+    }
+    char* D_env = std::getenv("D");
+    if (D_env != nullptr && std::atoi(D_env) != 0) {
+        d = std::atoi(D_env);
+    }
+
+    std::ofstream flog("simple-cuckoo-batch.log");
+    if (!flog.is_open()) {
+        throw std::runtime_error("Error creating log file");
+    }
+    flog << "Batch_sz,Tput,Tput_std_dev,Num_successful_queries" << std::endl;
+
+    std::mt19937_64 rng(1);
+    std::vector<uint64_t> vals(N);
+    for (auto& v : vals) {
+        v = rng() % (uint64_t(1) << d);
+    }
+
+    SimplePIR pir;
+    for (int trial = 0; trial <= 10; trial += 1) {
+        uint64_t batch_sz = uint64_t(1) << trial;
+        CuckooBatch batch(N, batch_sz, rng());
+        Params p = pir.PickBatchParams(batch, d, SEC_PARAM, LOGQ);
+        Database* DB = pir.MakeBatchDB(batch, d, p, vals);
+        State shared = pir.Init(DB->Info, p);
+        auto [server, _] = pir.FakeSetup(DB, p);
+
+        std::vector<double> tputs;
+        uint64_t successes = 0;
+        for (int iter = 0; iter < 5; iter++) {
+            std::vector<uint64_t> indices(batch_sz);
+            for (auto& i : indices) {
+                i = rng() % N;
+            }
+            BatchQuery q = pir.QueryBatch(indices, batch, shared, p, DB->Info);
+            auto start = std::chrono::steady_clock::now();
+            Msg answer = pir.Answer(DB, q.Queries, server, shared, p);
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            uint64_t placed = std::count_if(q.Assignment.BucketOf.begin(), q.Assignment.BucketOf.end(),
+                                            [](uint64_t b) { return b != CuckooBatch::NONE; });
+            successes += placed;
+            tputs.push_back(double(N) * d / (8.0 * 1024.0 * 1024.0) * placed / elapsed);
+        }
+
+        double avg_tput = std::accumulate(tputs.begin(), tputs.end(), 0.0) / tputs.size();
+        double dev = std::sqrt(std::accumulate(tputs.begin(), tputs.end(), 0.0,
+                            [avg_tput](double acc, double val) { return acc + (val - avg_tput) * (val - avg_tput); }) / tputs.size());
+        flog << batch_sz << ","
+            << avg_tput << ","
+            << dev << ","
+            << double(successes) / tputs.size() << std::endl;
+        delete DB;
+    }
+}
+
+// Many clients sending single queries at once, answered through a
+// QueryCoalescer, for a few batch limits. Prints QPS and the queueing
+// delay and batch size histograms. CLIENTS and MAX_DELAY_US override the
+// number of client threads and the flush deadline.
+void BenchmarkSimplePirCoalesced() {
+    uint64_t N = 1 << 20;
+    uint64_t d = 2048;
+    uint64_t clients = 256;
+    uint64_t max_delay_us = 2000;
+
+    char* log_N_env = std::getenv("LOG_N");
+    if (log_N_env != nullptr && std::atoi(log_N_env) != 0) {
+        N = uint64_t(1) << std::atoi(log_N_env);
+    }
+    char* D_env = std::getenv("D");
+    if (D_env != nullptr && std::atoi(D_env) != 0) {
+        d = std::atoi(D_env);
+    }
+    char* clients_env = std::getenv("CLIENTS");
+    if (clients_env != nullptr && std::atoi(clients_env) != 0) {
+        clients = std::atoi(clients_env);
+    }
+    char* delay_env = std::getenv("MAX_DELAY_US");
+    if (delay_env != nullptr && std::atoi(delay_env) != 0) {
+        max_delay_us = std::atoi(delay_env);
+    }
+
+    SimplePIR pir;
+    Params p = pir.PickParams(N, d, SEC_PARAM, LOGQ);
+    Database* DB = MakeRandomDB(N, d, &p);
+    State shared = pir.Init(DB->Info, p);
+    auto [server, _] = pir.FakeSetup(DB, p);
+
+    for (uint64_t max_batch : {1, 8, 32, 128}) {
+        QueryCoalescer coalescer(
+            [&](const std::vector<Msg>& queries) { return pir.AnswerMany(DB, queries); },
+            max_batch, std::chrono::microseconds(max_delay_us));
+
+        std::atomic<uint64_t> done(0);
+        auto start = std::chrono::steady_clock::now();
+        auto end = start + std::chrono::seconds(5);
+        std::vector<std::thread> threads;
+        for (uint64_t c = 0; c < clients; c++) {
+            threads.emplace_back([&, c] {
+                while (std::chrono::steady_clock::now() < end) {
+                    auto [client, query] = pir.Query(c % (p.L * p.M), shared, p, DB->Info);
+                    Msg answer = pir.Answer(coalescer, query);
+                    delete answer.data[0];
+                    pir.ReleaseQuery(client, query);
+                    done++;
+                }
+            });
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        CoalescerStats stats = coalescer.Stats();
+        std::cout << "Max batch " << max_batch << ", " << clients << " clients: " << done / elapsed << " QPS, "
+                  << stats.Passes << " passes (" << stats.FullPasses << " full), p50/p99 queueing delay "
+                  << stats.QueueDelayUs.Quantile(0.5) << "/" << stats.QueueDelayUs.Quantile(0.99) << " us" << std::endl;
+        std::cout << "\tQueueing delay:" << std::endl;
+        stats.QueueDelayUs.Print(std::cout, "us");
+        std::cout << "\tBatch size:" << std::endl;
+        stats.BatchSize.Print(std::cout, "queries");
+    }
+    delete DB;
 }
 
+// Setup time on an in-memory DB, whose hint is one threaded GEMM, against
+// Setup on the same DB saved and mapped back, whose hint is unpacked and
+// multiplied by the answer pool's workers (HintRows). The two should be
+// close at any core count; LOG_N and D override the DB size.
+void BenchmarkSimplePirSetupMapped() {
+    uint64_t N = 1 << 22;
+    uint64_t d = 8;
+    char* log_N_env = std::getenv("LOG_N");
+    char* D_env = std::getenv("D");
+    if (log_N_env != nullptr && std::atoi(log_N_env) != 0) {
+        N = uint64_t(1) << std::atoi(log_N_env);
+    }
+    if (D_env != nullptr && std::atoi(D_env) != 0) {
+        d = std::atoi(D_env);
+    }
+
+    SimplePIR pir;
+    Params p = pir.PickParams(N, d, SEC_PARAM, LOGQ);
+    Database* DB = MakeRandomDB(N, d, &p);
+    State shared = pir.Init(DB->Info, p);
+
+    auto start = std::chrono::steady_clock::now();
+    auto [server, offline] = pir.Setup(DB, shared, p);
+    double in_memory = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::string path = (std::filesystem::temp_directory_path() / "simple_pir_bench.db").string();
+    SaveSquishedDB(DB, path);
+    Database* loaded = LoadSquishedDB(path);
+    std::remove(path.c_str());
+
+    start = std::chrono::steady_clock::now();
+    auto [loaded_server, loaded_offline] = pir.Setup(loaded, shared, p);
+    double mapped = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (loaded_offline.data[0]->Data != offline.data[0]->Data) {
+        throw std::runtime_error("Setup on the mapped DB gave a different hint");
+    }
+
+    std::cout << "Setup on " << DefaultAnswerPool().NumWorkers() << " workers: in memory " << in_memory
+              << "s, mapped " << mapped << "s (" << mapped / in_memory << "x)" << std::endl;
+    delete offline.data[0];
+    delete loaded_offline.data[0];
+    delete shared.data[0];
+    delete loaded;
+    delete DB;
+}
+
+// Tests run by default, in this order, and by name from ctest (see
+// CMakeLists.txt). Benchmarks run only when named.
+static const std::vector<std::pair<std::string, void (*)()>> TESTS = {
+    {"TestDBMediumEntries", TestDBMediumEntries},
+    {"TestDBSmallEntries", TestDBSmallEntries},
+    {"TestDBLargeEntries", TestDBLargeEntries},
+    {"TestDBInterleaving", TestDBInterleaving},
+    {"TestSimplePirBW", TestSimplePirBW},
+    {"TestDoublePirBW", TestDoublePirBW},
+    {"TestDoublePir", TestDoublePir},
+    {"TestSimplePir", TestSimplePir},
+    {"TestSimplePirCompressed", TestSimplePirCompressed},
+    {"TestSimplePirLongRow", TestSimplePirLongRow},
+    {"TestSimplePirLongRowCompressed", TestSimplePirLongRowCompressed},
+    {"TestSimplePirBigDB", TestSimplePirBigDB},
+    {"TestSimplePirBigDBCompressed", TestSimplePirBigDBCompressed},
+    {"TestSimplePirBatch", TestSimplePirBatch},
+    {"TestSimplePirBatchCompressed", TestSimplePirBatchCompressed},
+    {"TestSimplePirLongRowBatch", TestSimplePirLongRowBatch},
+    {"TestSimplePirLongRowBatchCompressed", TestSimplePirLongRowBatchCompressed},
+    {"TestMatrixMulOddShapes", TestMatrixMulOddShapes},
+    {"TestPackedKernelVariants", TestPackedKernelVariants},
+    {"TestMatrixView", TestMatrixView},
+    {"TestAnswerPoolSplit", TestAnswerPoolSplit},
+    {"TestPackedMatMulQueries", TestPackedMatMulQueries},
+    {"TestTransposeNonSquare", TestTransposeNonSquare},
+    {"TestMatrixPoolReuse", TestMatrixPoolReuse},
+    {"TestSimplePirCompressedQuery", TestSimplePirCompressedQuery},
+    {"TestSquishedDBFile", TestSquishedDBFile},
+    {"TestIngestDB", TestIngestDB},
+    {"TestSimplePirUpdate", TestSimplePirUpdate},
+    {"TestSimplePirAppend", TestSimplePirAppend},
+    {"TestSimplePirStage", TestSimplePirStage},
+    {"TestSimplePirEpochSwap", TestSimplePirEpochSwap},
+    {"TestShardedServer", TestShardedServer},
+    {"TestSharedDB", TestSharedDB},
+    {"TestHintCache", TestHintCache},
+    {"TestMatrixAllocPolicies", TestMatrixAllocPolicies},
+    {"TestPickParamsObjectives", TestPickParamsObjectives},
+    {"TestAutotuneStoredResult", TestAutotuneStoredResult},
+    {"TestDoublePirRecover", TestDoublePirRecover},
+    {"TestSimplePirCuckooBatch", TestSimplePirCuckooBatch},
+    {"TestQueryCoalescer", TestQueryCoalescer},
+};
+
+static const std::vector<std::pair<std::string, void (*)()>> BENCHMARKS = {
+    {"BenchmarkSimplePirSingle", BenchmarkSimplePirSingle},
+    {"BenchmarkSimplePirAllocPolicy", BenchmarkSimplePirAllocPolicy},
+    {"BenchmarkSimplePirVaryingDB", BenchmarkSimplePirVaryingDB},
+    {"BenchmarkSimplePirBatchLarge", BenchmarkSimplePirBatchLarge},
+    {"BenchmarkSimplePirCuckooBatch", BenchmarkSimplePirCuckooBatch},
+    {"BenchmarkSimplePirCoalesced", BenchmarkSimplePirCoalesced},
+    {"BenchmarkSimplePirSetupMapped", BenchmarkSimplePirSetupMapped},
+};
+
+// Runs the tests and benchmarks named on the command line, or every test
+// if none is. Exits non-zero if any of them throws.
+int main(int argc, char** argv) {
+    std::vector<std::pair<std::string, void (*)()>> run;
+    if (argc == 1) {
+        run = TESTS;
+    }
+    for (int k = 1; k < argc; k++) {
+        auto named = [&](const std::pair<std::string, void (*)()>& t) { return t.first == argv[k]; };
+        auto t = std::find_if(TESTS.begin(), TESTS.end(), named);
+        if (t == TESTS.end()) {
+            t = std::find_if(BENCHMARKS.begin(), BENCHMARKS.end(), named);
+            if (t == BENCHMARKS.end()) {
+                std::cerr << "No test or benchmark named " << argv[k] << std::endl;
+                return 2;
+            }
+        }
+        run.push_back(*t);
+    }
+
+    int failed = 0;
+    for (const auto& [name, fn] : run) {
+        std::cout << "=== RUN   " << name << std::endl;
+        auto start = std::chrono::steady_clock::now();
+        std::string error;
+        try {
+            fn();
+        } catch (const std::exception& e) {
+            error = e.what();
+        }
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << (error.empty() ? "--- PASS: " : "--- FAIL: ") << name << " (" << elapsed << "s)"
+                  << (error.empty() ? "" : ": " + error) << std::endl;
+        failed += !error.empty();
+    }
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,170 @@
+#include "prg.h"
+#include <string.h>
+#include <immintrin.h>
+
+static const uint8_t sbox[256] = {
+  0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+  0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+  0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+  0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+  0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+  0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+  0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+  0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+  0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+  0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+  0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+  0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+  0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+  0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+  0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+  0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+static uint8_t xtime(uint8_t x)
+{
+  return (uint8_t) ((x << 1) ^ ((x >> 7) * 0x1b));
+}
+
+// FIPS-197 key expansion; the AES-NI and table paths share the schedule.
+void prgInit(PrgKey *key, const uint8_t seed[PRG_SEED_BYTES])
+{
+  uint8_t *w = &key->roundKeys[0][0];
+  uint8_t rcon = 1;
+  memcpy(w, seed, 16);
+  for (size_t i = 16; i < 176; i += 4) {
+    uint8_t t[4] = { w[i-4], w[i-3], w[i-2], w[i-1] };
+    if (i % 16 == 0) {
+      uint8_t t0 = t[0];
+      t[0] = sbox[t[1]] ^ rcon;
+      t[1] = sbox[t[2]];
+      t[2] = sbox[t[3]];
+      t[3] = sbox[t0];
+      rcon = xtime(rcon);
+    }
+    for (size_t j = 0; j < 4; j++) {
+      w[i+j] = w[i+j-16] ^ t[j];
+    }
+  }
+}
+
+static void counterBlock(uint64_t block, uint8_t out[16])
+{
+  memset(out, 0, 16);
+  for (size_t b = 0; b < 8; b++) {
+    out[b] = (uint8_t) (block >> (8*b));
+  }
+}
+
+static void encryptTable(const PrgKey *key, uint8_t s[16])
+{
+  for (size_t j = 0; j < 16; j++) {
+    s[j] ^= key->roundKeys[0][j];
+  }
+  for (size_t round = 1; round <= 10; round++) {
+    uint8_t t[16];
+    // SubBytes and ShiftRows; the state is column-major.
+    for (size_t c = 0; c < 4; c++) {
+      for (size_t r = 0; r < 4; r++) {
+        t[4*c + r] = sbox[s[4*((c + r) % 4) + r]];
+      }
+    }
+    if (round < 10) {
+      for (size_t c = 0; c < 4; c++) {
+        uint8_t *col = t + 4*c;
+        uint8_t all = col[0] ^ col[1] ^ col[2] ^ col[3];
+        uint8_t c0 = col[0];
+        col[0] ^= all ^ xtime(col[0] ^ col[1]);
+        col[1] ^= all ^ xtime(col[1] ^ col[2]);
+        col[2] ^= all ^ xtime(col[2] ^ col[3]);
+        col[3] ^= all ^ xtime(col[3] ^ c0);
+      }
+    }
+    for (size_t j = 0; j < 16; j++) {
+      s[j] = t[j] ^ key->roundKeys[round][j];
+    }
+  }
+}
+
+static void prgBlocksTable(const PrgKey *key, uint64_t block, uint32_t *out,
+    size_t nBlocks)
+{
+  for (size_t b = 0; b < nBlocks; b++) {
+    uint8_t s[16];
+    counterBlock(block + b, s);
+    encryptTable(key, s);
+    memcpy(out + 4*b, s, 16);
+  }
+}
+
+// Eight independent counters per pass keep the AES unit's pipeline full.
+__attribute__((target("aes,sse4.2")))
+static void prgBlocksAESNI(const PrgKey *key, uint64_t block, uint32_t *out,
+    size_t nBlocks)
+{
+  __m128i rk[11];
+  for (size_t r = 0; r < 11; r++) {
+    rk[r] = _mm_loadu_si128((const __m128i *) key->roundKeys[r]);
+  }
+  size_t b = 0;
+  for (; b + 8 <= nBlocks; b += 8) {
+    __m128i s[8];
+    for (size_t l = 0; l < 8; l++) {
+      s[l] = _mm_xor_si128(_mm_set_epi64x(0, (long long) (block + b + l)), rk[0]);
+    }
+    for (size_t r = 1; r < 10; r++) {
+      for (size_t l = 0; l < 8; l++) {
+        s[l] = _mm_aesenc_si128(s[l], rk[r]);
+      }
+    }
+    for (size_t l = 0; l < 8; l++) {
+      _mm_storeu_si128((__m128i *) (out + 4*(b + l)), _mm_aesenclast_si128(s[l], rk[10]));
+    }
+  }
+  for (; b < nBlocks; b++) {
+    __m128i s = _mm_xor_si128(_mm_set_epi64x(0, (long long) (block + b)), rk[0]);
+    for (size_t r = 1; r < 10; r++) {
+      s = _mm_aesenc_si128(s, rk[r]);
+    }
+    _mm_storeu_si128((__m128i *) (out + 4*b), _mm_aesenclast_si128(s, rk[10]));
+  }
+}
+
+static void (*prgBlocksFn)(const PrgKey *, uint64_t, uint32_t *, size_t) =
+  prgBlocksTable;
+
+__attribute__((constructor))
+static void pickPrg(void)
+{
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("aes") && __builtin_cpu_supports("sse4.2")) {
+    prgBlocksFn = prgBlocksAESNI;
+  }
+}
+
+void prgBlocks(const PrgKey *key, uint64_t block, uint32_t *out,
+    size_t nBlocks)
+{
+  prgBlocksFn(key, block, out, nBlocks);
+}
+
+void prgMatrixRow(const PrgKey *key, size_t i, size_t cols, unsigned logq,
+    uint32_t *out)
+{
+  const uint32_t mask = (logq >= 32) ? ~(uint32_t) 0 : (((uint32_t) 1) << logq) - 1;
+  size_t blocksPerRow = (cols + 3) / 4;
+  size_t full = cols / 4;
+  uint64_t first = (uint64_t) i * blocksPerRow;
+
+  prgBlocks(key, first, out, full);
+  if (full < blocksPerRow) {
+    uint32_t tail[4];
+    prgBlocks(key, first + full, tail, 1);
+    memcpy(out + 4*full, tail, (cols - 4*full) * sizeof(uint32_t));
+  }
+  if (mask != ~(uint32_t) 0) {
+    for (size_t j = 0; j < cols; j++) {
+      out[j] &= mask;
+    }
+  }
+}
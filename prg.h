@@ -0,0 +1,38 @@
+#ifndef PRG_H
+#define PRG_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// AES-128 in counter mode, for expanding public matrices (the LWE matrix
+// A) from a 16-byte seed. Entry (i, j) of a rows-by-cols matrix is word
+// j % 4 of the keystream block i * ceil(cols / 4) + j / 4, so any row can
+// be generated on its own, in any order, without the rest of the matrix.
+// Uses AES-NI when the CPU has it and a table-based AES otherwise; A is
+// public, so the table version's timing leaks nothing.
+#define PRG_SEED_BYTES 16
+
+typedef struct {
+  uint8_t roundKeys[11][16];
+} PrgKey;
+
+void prgInit(PrgKey *key, const uint8_t seed[PRG_SEED_BYTES]);
+
+// Writes keystream blocks [block, block + nBlocks) to out, 4 words each.
+void prgBlocks(const PrgKey *key, uint64_t block, uint32_t *out,
+    size_t nBlocks);
+
+// Writes row i of the matrix described above, with every entry reduced
+// mod 2^logq (logq <= 32).
+void prgMatrixRow(const PrgKey *key, size_t i, size_t cols, unsigned logq,
+    uint32_t *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PRG_H
@@ -6,11 +6,14 @@
 #include <mutex>
 #include <cstdint>
 #include <algorithm>
+#include <cstring>
+
+#include "utils.h"
 
 constexpr size_t aesBlockSize = 16;
 constexpr size_t bufSize = 8192;
 
-using PRGKey = std::array<uint8_t, aesBlockSize>;
+static_assert(aesBlockSize == PRG_SEED_BYTES, "PRGKey must be one AES block");
 
 class PRGReader {
 private:
@@ -22,7 +25,7 @@ private:
 
 public:
     PRGReader(const PRGKey& key) : Key(key), rng(std::random_device{}()), dist(0, UINT64_MAX) {
-        iv.fill(0);
+        iv.assign(aesBlockSize, 0);
     }
 
     uint64_t RandInt(uint64_t mod) {
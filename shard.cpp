@@ -0,0 +1,272 @@
+#include "shard.h"
+#include "database.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Framing: every message is a ShardHeader followed by Rows * Cols
+// little-endian 32-bit words. Requests carry the query (Rows = length,
+// Cols = number of queries); a request with Op == SHARD_OP_QUIT stops
+// the worker. Replies carry the shard's part of the answer, or, when
+// Status is nonzero, an error message of Rows bytes.
+struct ShardHeader {
+    uint32_t Op;
+    uint32_t Status;
+    uint64_t Rows;
+    uint64_t Cols;
+};
+
+static const uint32_t SHARD_OP_ANSWER = 1;
+static const uint32_t SHARD_OP_QUIT = 2;
+
+static bool WriteAll(int fd, const void* buf, size_t len) {
+    const char* p = static_cast<const char*>(buf);
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool ReadAll(int fd, void* buf, size_t len) {
+    char* p = static_cast<char*>(buf);
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Serves requests on fd from the rows db of the squished DB until the
+// server says to quit or goes away. Runs in the forked worker, which has
+// only this thread: the parent's AnswerPool threads did not survive the
+// fork, so the worker starts its own on the CPUs it was pinned to.
+static void ServeShard(int fd, const MatrixView& db, uint64_t basis, uint64_t compression) {
+    AnswerPool pool;
+    for (;;) {
+        ShardHeader h;
+        if (!ReadAll(fd, &h, sizeof(h)) || h.Op != SHARD_OP_ANSWER) {
+            return;
+        }
+        Matrix q(h.Rows, h.Cols);
+        if (!ReadAll(fd, q.Data.data(), q.Data.size() * sizeof(uint32_t))) {
+            return;
+        }
+
+        ShardHeader reply = {SHARD_OP_ANSWER, 0, db.Rows, h.Cols};
+        Matrix ans(db.Rows, h.Cols);
+        std::string err;
+        try {
+            pool.Run([&](uint64_t w) {
+                RowRange mine = pool.Rows(w, db.Rows);
+                if (mine.Start >= mine.End) {
+                    return;
+                }
+                MatrixView out = ans.SelectRows(mine.Start, mine.End - mine.Start);
+                MatrixView a = db.SelectRows(mine.Start, mine.End - mine.Start);
+                if (q.Cols == 1) {
+                    MatrixMulVecPackedInto(out, a, q, basis, compression);
+                } else {
+                    MatrixMulMatPackedInto(out, a, q, basis, compression);
+                }
+            });
+        } catch (const std::exception& e) {
+            err = e.what();
+            reply.Status = 1;
+            reply.Rows = err.size();
+            reply.Cols = 0;
+        }
+
+        bool ok = WriteAll(fd, &reply, sizeof(reply));
+        if (reply.Status == 0) {
+            ok = ok && WriteAll(fd, ans.Data.data(), ans.Data.size() * sizeof(uint32_t));
+        } else {
+            ok = ok && WriteAll(fd, err.data(), err.size());
+        }
+        if (!ok) {
+            return;
+        }
+    }
+}
+
+// Splits the CPUs this process may use into num_shards contiguous slices;
+// shards share CPUs round-robin when there are fewer CPUs than shards.
+static std::vector<cpu_set_t> SplitCpus(uint64_t num_shards) {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    std::vector<int> cpus;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int c = 0; c < CPU_SETSIZE; c++) {
+            if (CPU_ISSET(c, &allowed)) {
+                cpus.push_back(c);
+            }
+        }
+    }
+    if (cpus.empty()) {
+        cpus.push_back(0);
+    }
+
+    std::vector<cpu_set_t> out(num_shards);
+    uint64_t n = cpus.size();
+    for (uint64_t s = 0; s < num_shards; s++) {
+        CPU_ZERO(&out[s]);
+        uint64_t lo = s * n / num_shards;
+        uint64_t hi = (s + 1) * n / num_shards;
+        if (hi <= lo) {
+            hi = lo + 1;
+        }
+        for (uint64_t c = lo; c < hi; c++) {
+            CPU_SET(cpus[c % n], &out[s]);
+        }
+    }
+    return out;
+}
+
+ShardedServer::ShardedServer(Database* DB, uint64_t num_shards) {
+    if (!DB->Squished) {
+        throw std::runtime_error("DB must be squished before sharding");
+    }
+    if (!DB->Overlay.empty()) {
+        throw std::runtime_error("DB has staged writes; Compact it before sharding");
+    }
+    MatrixView db = DB->View();
+    uint64_t block = (DB->Info.Packing > 0) ? 1 : DB->Info.Ne;
+    uint64_t blocks = db.Rows / block;
+    if (num_shards == 0 || num_shards > blocks) {
+        throw std::runtime_error("Bad number of shards");
+    }
+
+    for (uint64_t s = 0; s < num_shards; s++) {
+        rows.push_back(RowRange{s * blocks / num_shards * block, (s + 1) * blocks / num_shards * block});
+    }
+    rows.back().End = db.Rows;
+
+    std::vector<cpu_set_t> cpus = SplitCpus(num_shards);
+    for (uint64_t s = 0; s < num_shards; s++) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) {
+            Shutdown();
+            throw std::runtime_error("Error creating shard socket");
+        }
+        // Otherwise pending stdio output would be written again by the
+        // worker.
+        fflush(nullptr);
+        std::cout.flush();
+        pid_t pid = fork();
+        if (pid < 0) {
+            close(sv[0]);
+            close(sv[1]);
+            Shutdown();
+            throw std::runtime_error("Error forking shard worker");
+        }
+        if (pid == 0) {
+            // Keep only this shard's socket, so that each worker sees EOF
+            // as soon as the server closes its end.
+            for (int fd : socks) {
+                close(fd);
+            }
+            close(sv[0]);
+            sched_setaffinity(0, sizeof(cpus[s]), &cpus[s]);
+            ServeShard(sv[1], db.SelectRows(rows[s].Start, rows[s].End - rows[s].Start),
+                       DB->Info.Basis, DB->Info.Squishing);
+            // Skip the parent's static destructors, which would wait for
+            // threads that exist only in the parent.
+            _exit(0);
+        }
+        close(sv[1]);
+        socks.push_back(sv[0]);
+        pids.push_back(pid);
+    }
+}
+
+ShardedServer::~ShardedServer() {
+    Shutdown();
+}
+
+void ShardedServer::Shutdown() {
+    ShardHeader quit = {SHARD_OP_QUIT, 0, 0, 0};
+    for (int fd : socks) {
+        WriteAll(fd, &quit, sizeof(quit));
+        close(fd);
+    }
+    for (pid_t pid : pids) {
+        while (waitpid(pid, nullptr, 0) < 0 && errno == EINTR) {
+        }
+    }
+    socks.clear();
+    pids.clear();
+}
+
+uint64_t ShardedServer::NumShards() const {
+    return rows.size();
+}
+
+RowRange ShardedServer::ShardRows(uint64_t s) const {
+    return rows[s];
+}
+
+Matrix ShardedServer::Answer(const Matrix& q) {
+    std::lock_guard<std::mutex> lock(mu);
+    ShardHeader h = {SHARD_OP_ANSWER, 0, q.Rows, q.Cols};
+    for (int fd : socks) {
+        if (!WriteAll(fd, &h, sizeof(h)) ||
+            !WriteAll(fd, q.Data.data(), q.Data.size() * sizeof(uint32_t))) {
+            throw std::runtime_error("Shard worker is gone");
+        }
+    }
+
+    // Gather every reply, even after a failure, so the sockets stay in
+    // step for the next call.
+    Matrix ans(rows.back().End, q.Cols);
+    bool failed = false;
+    std::string err;
+    for (uint64_t s = 0; s < socks.size(); s++) {
+        ShardHeader reply;
+        if (!ReadAll(socks[s], &reply, sizeof(reply))) {
+            throw std::runtime_error("Shard worker is gone");
+        }
+        if (reply.Status != 0) {
+            std::string msg(reply.Rows, '\0');
+            if (!ReadAll(socks[s], &msg[0], msg.size())) {
+                throw std::runtime_error("Shard worker is gone");
+            }
+            failed = true;
+            err = msg;
+            continue;
+        }
+        uint64_t n = rows[s].End - rows[s].Start;
+        if (reply.Rows != n || reply.Cols != q.Cols) {
+            throw std::runtime_error("Bad reply from shard worker");
+        }
+        if (!ReadAll(socks[s], &ans.Data[rows[s].Start * q.Cols], n * q.Cols * sizeof(uint32_t))) {
+            throw std::runtime_error("Shard worker is gone");
+        }
+    }
+    if (failed) {
+        throw std::runtime_error("Shard worker failed: " + err);
+    }
+    return ans;
+}
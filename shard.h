@@ -0,0 +1,61 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "answer_pool.h"
+#include "matrix.h"
+
+class Database;
+
+// Serves one squished DB from several local worker processes. Worker s
+// owns a contiguous block of DB rows (a whole number of Ne-row record
+// blocks) and answers for those rows only, on its own slice of the CPUs
+// with its own AnswerPool. Every shard multiplies by the same query, so
+// one A and one query serve them all, and the answer and the hint are
+// just the shards' parts stacked in row order.
+//
+// Workers talk to the server over Unix stream sockets with length-framed
+// messages, so any other stream (e.g. TCP to another box) can stand in
+// for one. They are forked from the calling process and answer from a
+// copy-on-write snapshot of the DB (or its file mapping, which they
+// share), so construct the server after the last write to the DB. Only
+// the forking thread survives in a worker: threads already running in
+// the parent, such as the DefaultAnswerPool that Setup starts, are left
+// behind, and each worker builds its own pool. Nothing a worker needs
+// may be held locked by another thread at the time of the fork.
+class ShardedServer {
+public:
+    // DB must be squished and have no staged writes.
+    ShardedServer(Database* DB, uint64_t num_shards);
+    ~ShardedServer();
+
+    ShardedServer(const ShardedServer&) = delete;
+    ShardedServer& operator=(const ShardedServer&) = delete;
+
+    uint64_t NumShards() const;
+
+    // DB rows served by shard s.
+    RowRange ShardRows(uint64_t s) const;
+
+    // DB * q, with q a column vector (one query) or matrix (one query per
+    // column), padded as SimplePIR::Query pads it. Sends q to every shard
+    // before reading any answer, so the shards compute in parallel.
+    // Concurrent calls are serialized.
+    Matrix Answer(const Matrix& q);
+
+private:
+    // Stops and reaps the workers started so far.
+    void Shutdown();
+
+    std::vector<RowRange> rows;
+    std::vector<int> socks;
+    std::vector<pid_t> pids;
+    std::mutex mu;
+};
+
+#endif // SHARD_H
@@ -1,213 +1,521 @@
+#include "simple_pir.h"
 #include "pir.h"
-#include  "params.h"
+#include "params.h"
 #include "database.h"
+#include "answer_pool.h"
+#include "epoch.h"
+#include "shard.h"
+#include "autotune.h"
+#include "packing.h"
+#include "batch_pir.h"
+#include "coalescer.h"
+#include "utils.h"
 #include <iostream>
 #include <string>
 #include <cstdint>
 #include <vector>
 #include <stdexcept>
 #include <utility>
-
-
-class SimplePIR {
-public:
-    std::string Name() const {
-        return "SimplePIR";
-    }
-
-    Params PickParams(uint64_t N, uint64_t d, uint64_t n, uint64_t logq) {
-        Params good_p;
-        bool found = false;
-
-        // Iteratively refine p and DB dimensions until tight values are found
-        for (uint64_t mod_p = 2; ; mod_p++) {
-            uint64_t l, m;
-            std::tie(l, m) = ApproxSquareDatabaseDims(N, d, mod_p);
-
-            Params p;
-            p.N = n;
-            p.Logq = logq;
-            p.L = l;
-            p.M = m;
-            p.PickParams(false, m);
-
-            if (p.P < mod_p) {
-                if (!found) {
-                    throw std::runtime_error("Error; should not happen");
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <random>
+#include <tuple>
+
+SimplePIR::SimplePIR(AnswerPool* pool) : pool(pool) {}
+
+std::string SimplePIR::Name() const {
+    return "SimplePIR";
+}
+
+Params SimplePIR::PickParams(uint64_t N, uint64_t d, uint64_t n, uint64_t logq) {
+    return PickParams(N, d, n, logq, ParamsObjective::MaxThroughput);
+}
+
+Params SimplePIR::PickParams(uint64_t N, uint64_t d, uint64_t n, uint64_t logq, ParamsObjective objective) {
+    std::shared_ptr<const ParamsTable> table = LWEParamsTable();
+    Params best;
+    ParamsCost best_cost{};
+    bool found = false;
+
+    for (const LWEParamsEntry* row : table->Rows(n, logq)) {
+        uint64_t max_m = uint64_t(1) << row->LogM;
+        for (uint64_t mod_p : CandidateModuli(row->PSimple)) {
+            for (int shape = 0; shape < 3; shape++) {
+                uint64_t l, m;
+                if (shape == 0) {
+                    std::tie(l, m) = ApproxSquareDatabaseDims(N, d, mod_p);
+                } else if (shape == 1) {
+                    std::tie(l, m) = ApproxDatabaseDims(N, d, mod_p, max_m);
+                } else {
+                    std::tie(l, m) = ApproxDatabaseDimsWithAspect(N, d, mod_p, TunedAspect());
+                }
+                if (m > max_m) {
+                    continue;
+                }
+                // Sigma of the row Params::PickParams would use for m.
+                const LWEParamsEntry* used = table->Find(n, logq, m);
+                Params p(n, used->Sigma, l, m, logq, mod_p);
+                ParamsCost c = Cost(p);
+                if (!found || Cheaper(c, best_cost, objective)) {
+                    best = p;
+                    best_cost = c;
+                    found = true;
                 }
-                good_p.PrintParams();
-                return good_p;
             }
-
-            good_p = p;
-            found = true;
         }
-
-        // Unreachable in theory; included to avoid compiler warnings.
-        throw std::runtime_error("Cannot be reached");
     }
 
-    Params PickParamsGivenDimensions(uint64_t l, uint64_t m, uint64_t n, uint64_t logq) {
-        Params p;
-        p.N = n;
-        p.Logq = logq;
-        p.L = l;
-        p.M = m;
-        p.PickParams(false, m);
-        return p;
+    if (!found) {
+        std::cerr << "Searched for " << n << ", " << N << " records of " << d << " bits, " << logq << ",\n";
+        throw std::runtime_error("No suitable params known!");
     }
-
-    Database* ConcatDBs(const std::vector<Database*>& DBs, Params* p) {
-        if (DBs.empty()) {
-            throw std::runtime_error("Should not happen");
+    best.PrintParams();
+    return best;
+}
+
+ParamsCost SimplePIR::Cost(const Params& p) {
+    uint64_t compression = 1;
+    for (uint64_t basis = static_cast<uint64_t>(std::ceil(std::log2(static_cast<double>(p.P))));
+         basis <= p.Logq; basis++) {
+        if (packedShapeSupported(basis, p.Logq / basis)) {
+            compression = p.Logq / basis;
+            break;
         }
-
-        if (DBs[0]->Info.Num != p->L * p->M) {
-            throw std::runtime_error("Not yet implemented");
+    }
+    double elem_bytes = static_cast<double>(p.Logq) / 8.0;
+    double words = static_cast<double>(p.L) * static_cast<double>((p.M + compression - 1) / compression);
+    words *= ScanCostFactor(static_cast<double>(p.M) / static_cast<double>(p.L));
+    return ParamsCost{words * elem_bytes, static_cast<double>(p.L * p.N) * elem_bytes,
+                      static_cast<double>(p.M) * elem_bytes, static_cast<double>(p.L) * elem_bytes};
+}
+
+Params SimplePIR::PickParamsGivenDimensions(uint64_t l, uint64_t m, uint64_t n, uint64_t logq) {
+    Params p;
+    p.N = n;
+    p.Logq = logq;
+    p.L = l;
+    p.M = m;
+    p.PickParams(false, {m});
+    return p;
+}
+
+Params SimplePIR::PickBatchParams(const CuckooBatch& batch, uint64_t d, uint64_t n, uint64_t logq) {
+    Params p = PickParams(batch.BucketRecords(), d, n, logq);
+    p.L *= batch.NumBuckets();
+    return p;
+}
+
+uint64_t SimplePIR::BatchStride(const CuckooBatch& batch, uint64_t d, const Params& p) {
+    auto [_, ne, packing] = Num_DB_entries(batch.BucketRecords(), d, p.P);
+    return p.L / batch.NumBuckets() / ne * p.M * std::max<uint64_t>(packing, 1);
+}
+
+Database* SimplePIR::MakeBatchDB(const CuckooBatch& batch, uint64_t d, const Params& p, const std::vector<uint64_t>& vals) {
+    uint64_t stride = BatchStride(batch, d, p);
+    return MakeDB(batch.NumBuckets() * stride, d, &p, batch.Replicate(vals, stride));
+}
+
+BatchQuery SimplePIR::QueryBatch(const std::vector<uint64_t>& indices, const CuckooBatch& batch, const State& shared,
+                                 const Params& p, const DBinfo& info) {
+    thread_local std::mt19937_64 rng(std::random_device{}());
+    uint64_t stride = BatchStride(batch, info.Row_length, p);
+    BatchQuery q;
+    q.Assignment = batch.Assign(indices, rng);
+    for (uint64_t b = 0; b < batch.NumBuckets(); b++) {
+        auto [client, query] = Query(b * stride + q.Assignment.Slot[b], shared, p, info);
+        q.Client.push_back(client);
+        q.Queries.push_back(query);
+    }
+    return q;
+}
+
+std::vector<uint64_t> SimplePIR::RecoverBatch(const std::vector<uint64_t>& indices, const BatchQuery& q, const CuckooBatch& batch,
+                                              const Msg& offline, const Msg& answer, const State& shared, const Params& p,
+                                              const DBinfo& info) {
+    uint64_t stride = BatchStride(batch, info.Row_length, p);
+    std::vector<uint64_t> vals(indices.size(), 0);
+    for (uint64_t pos = 0; pos < indices.size(); pos++) {
+        uint64_t b = q.Assignment.BucketOf[pos];
+        if (b != CuckooBatch::NONE) {
+            vals[pos] = Recover(b * stride + q.Assignment.Slot[b], b, offline, q.Queries[b], answer, shared,
+                                q.Client[b], p, info);
         }
+    }
+    return vals;
+}
 
-        auto rows = DBs[0]->Data.Rows; // Assuming Data has a Rows member; adjust as needed
-        for (size_t j = 1; j < DBs.size(); ++j) {
-            if (DBs[j]->Data.Rows != rows) {
-                throw std::runtime_error("Bad input");
-            }
-        }
+Database* SimplePIR::ConcatDBs(const std::vector<Database*>& DBs, Params* p) {
+    if (DBs.empty()) {
+        throw std::runtime_error("Should not happen");
+    }
 
-        Database* D = new Database();
-        D->Data = Matrix(0, 0); // Initialize Data to a zero-sized Matrix
-        D->Info = DBs[0]->Info;
-        D->Info.Num *= DBs.size();
-        p->L *= DBs.size();
+    if (DBs[0]->Info.Num != p->L * p->M) {
+        throw std::runtime_error("Not yet implemented");
+    }
 
-        for (const auto& db : DBs) {
-            D->Data.Concat(db->SelectRows(0, rows));
+    auto rows = DBs[0]->Data->Rows;
+    for (size_t j = 1; j < DBs.size(); ++j) {
+        if (DBs[j]->Data->Rows != rows) {
+            throw std::runtime_error("Bad input");
         }
-
-        return D;
     }
 
-    void GetBW(const DBinfo& info, const Params& p) {
-        double offlineDownload = static_cast<double>(p.L * p.N * p.Logq) / (8.0 * 1024.0);
-        std::cout << "\t\tOffline download: " << static_cast<uint64_t>(offlineDownload) << " KB\n";
+    Database* D = new Database();
+    D->Data = new Matrix(0, 0);
+    D->Info = DBs[0]->Info;
+    D->Info.Num *= DBs.size();
+    p->L *= DBs.size();
 
-        double onlineUpload = static_cast<double>(p.M * p.Logq) / (8.0 * 1024.0);
-        std::cout << "\t\tOnline upload: " << static_cast<uint64_t>(onlineUpload) << " KB\n";
-
-        double onlineDownload = static_cast<double>(p.L * p.Logq) / (8.0 * 1024.0);
-        std::cout << "\t\tOnline download: " << static_cast<uint64_t>(onlineDownload) << " KB\n";
+    // Size the result once, then append each input through a view.
+    D->Data->Data.reserve(rows * DBs[0]->Data->Cols * DBs.size());
+    for (const auto& db : DBs) {
+        D->Data->Concat(db->Data->SelectRows(0, rows));
     }
 
-    State Init(const DBinfo& info, const Params& p) {
-        Matrix A = MatrixRand(p.M, p.N, p.Logq, 0);
-        return MakeState(A);
+    return D;
+}
+
+void SimplePIR::GetBW(const DBinfo&, const Params& p) {
+    double offlineDownload = static_cast<double>(p.L * p.N * p.Logq) / (8.0 * 1024.0);
+    std::cout << "\t\tOffline download: " << static_cast<uint64_t>(offlineDownload) << " KB\n";
+
+    double onlineUpload = static_cast<double>(p.M * p.Logq) / (8.0 * 1024.0);
+    std::cout << "\t\tOnline upload: " << static_cast<uint64_t>(onlineUpload) << " KB\n";
+
+    double onlineDownload = static_cast<double>(p.L * p.Logq) / (8.0 * 1024.0);
+    std::cout << "\t\tOnline download: " << static_cast<uint64_t>(onlineDownload) << " KB\n";
+}
+
+State SimplePIR::Init(const DBinfo&, const Params& p) {
+    Matrix* A = new Matrix(MatrixRand(p.M, p.N, p.Logq, 0));
+    return MakeState({A});
+}
+
+std::pair<State, CompressedState> SimplePIR::InitCompressed(const DBinfo& info, const Params& p) {
+    PRGKey* seed = new PRGKey(RandomPRGKey());
+    return InitCompressedSeeded(info, p, seed);
+}
+
+std::pair<State, CompressedState> SimplePIR::InitCompressedSeeded(const DBinfo&, const Params& p, PRGKey* seed) {
+    Matrix* A = new Matrix(MatrixFromSeed(seed->data(), p.M, p.N, p.Logq));
+    return {MakeState({A}), MakeCompressedState(seed)};
+}
+
+State SimplePIR::DecompressState(const DBinfo&, const Params& p, const CompressedState& comp) {
+    Matrix* A = new Matrix(MatrixFromSeed(comp.seed->data(), p.M, p.N, p.Logq));
+    return MakeState({A});
+}
+
+std::pair<State, Msg> SimplePIR::Setup(Database* DB, const State& shared, const Params& p) {
+    Matrix& A = *shared.data[0];
+    if (DB->Squished) {
+        // Built pre-squished, by LoadSquishedDB or IngestDB.
+        Matrix* H = new Matrix(HintRows(DB, A, 0, DB->View().Rows, Pool()));
+        Pool().Bind(DB->View());
+        return {MakeState({}), MakeMsg({H})};
     }
+    Matrix* H = new Matrix(Matrix::MatrixMul(*DB->Data, A));
 
-    std::pair<State, CompressedState> InitCompressed(const DBinfo& info, const Params& p) {
-        PRGKey* seed = RandomPRGKey();
-        return InitCompressedSeeded(info, p, seed);
-    }
+    DB->Data->Add(p.P / 2);
+    DB->Squish();
+    Pool().Bind(DB->View());
 
-    std::pair<State, CompressedState> InitCompressedSeeded(const DBinfo& info, const Params& p, PRGKey* seed) {
-        BufPRG bufPrgReader = NewBufPRG(NewPRG(seed));
-        return {Init(info, p), MakeCompressedState(seed)};
-    }
-
-    State DecompressState(const DBinfo& info, const Params& p, const CompressedState& comp) {
-        BufPRG bufPrgReader = NewBufPRG(NewPRG(comp.Seed));
-        return Init(info, p);
-    }
+    return {MakeState({}), MakeMsg({H})};
+}
 
-    std::pair<State, Msg> Setup(Database* DB, const State& shared, const Params& p) {
-        Matrix A = shared.Data; // Assuming State.Data is a Matrix
-        Matrix H = MatrixMul(DB->Data, A);
+std::pair<State, double> SimplePIR::FakeSetup(Database* DB, const Params& p) {
+    double offlineDownload = static_cast<double>(p.L * p.N * p.Logq) / (8.0 * 1024.0);
+    std::cout << "\t\tOffline download: " << static_cast<uint64_t>(offlineDownload) << " KB\n";
 
-        DB->Data.Add(p.P / 2);
+    if (!DB->Squished) {
+        DB->Data->Add(p.P / 2);
         DB->Squish();
-
-        return {MakeState(), MakeMsg(H)};
     }
+    Pool().Bind(DB->View());
 
-    std::pair<State, double> FakeSetup(Database* DB, const Params& p) {
-        double offlineDownload = static_cast<double>(p.L * p.N * p.Logq) / (8.0 * 1024.0);
-        std::cout << "\t\tOffline download: " << static_cast<uint64_t>(offlineDownload) << " KB\n";
+    return {MakeState({}), offlineDownload};
+}
 
-        DB->Data.Add(p.P / 2);
-        DB->Squish();
+HintDelta SimplePIR::UpdateHint(std::vector<DBEntryDelta> changes, const State& shared) {
+    Matrix& A = *shared.data[0];
+    std::sort(changes.begin(), changes.end(),
+              [](const DBEntryDelta& a, const DBEntryDelta& b) { return a.Row < b.Row; });
 
-        return {MakeState(), offlineDownload};
+    HintDelta d;
+    for (const DBEntryDelta& c : changes) {
+        if (d.Rows.empty() || d.Rows.back() != c.Row) {
+            d.Rows.push_back(c.Row);
+        }
     }
+    d.Vals = Matrix(d.Rows.size(), A.Cols);
+    uint64_t k = 0;
+    for (const DBEntryDelta& c : changes) {
+        if (d.Rows[k] != c.Row) {
+            k++;
+        }
+        uint32_t* out = &d.Vals.Data[k * A.Cols];
+        const uint32_t* a = &A.Data[c.Col * A.Cols];
+        uint32_t delta = static_cast<uint32_t>(c.Delta);
+        for (uint64_t j = 0; j < A.Cols; j++) {
+            out[j] += delta * a[j];
+        }
+    }
+    return d;
+}
 
-    std::pair<State, Msg> Query(uint64_t i, const State& shared, const Params& p, const DBinfo& info) {
-        Matrix A = shared.Data; // Assuming the first matrix in shared data
-        Matrix secret = MatrixRand(p.N, 1, p.Logq, 0);
-        Matrix err = MatrixGaussian(p.M, 1);
-        Matrix query = MatrixMul(A, secret);
-        query.MatrixAdd(err);
-        // Assuming query.Data is directly accessible and modifiable
-        // Adjust based on your actual data structure and operations
-        query.Data[i % p.M] += p.Delta(); // Adjust for actual matrix element access
-
-        if (p.M % info.Squishing != 0) {
-            query.AppendZeros(info.Squishing - (p.M % info.Squishing));
+void SimplePIR::ApplyHintDelta(Msg& offline, const HintDelta& d) {
+    Matrix& H = *offline.data[0];
+    if (!d.Rows.empty() && d.Vals.Cols != H.Cols) {
+        throw std::runtime_error("Hint delta does not match hint");
+    }
+    for (uint64_t k = 0; k < d.Rows.size(); k++) {
+        if (d.Rows[k] >= H.Rows) {
+            throw std::runtime_error("Hint delta does not match hint");
         }
+        uint32_t* h = &H.Data[d.Rows[k] * H.Cols];
+        const uint32_t* v = &d.Vals.Data[k * H.Cols];
+        for (uint64_t j = 0; j < H.Cols; j++) {
+            h[j] += v[j];
+        }
+    }
+}
+
+std::pair<HintDelta, Msg> SimplePIR::Append(Database* DB, const std::vector<uint64_t>& vals, const State& shared, Params& p) {
+    Matrix& A = *shared.data[0];
+    uint64_t oldRows = DB->View().Rows;
+    HintDelta patch = UpdateHint(DB->Append(vals), shared);
+    uint64_t rows = DB->View().Rows;
+    p.L = rows;
+    Pool().Bind(DB->View());
+    Matrix* H = new Matrix(HintRows(DB, A, oldRows, rows - oldRows, Pool()));
+    return {std::move(patch), MakeMsg({H})};
+}
+
+void SimplePIR::ExtendHint(Msg& offline, const Msg& rows) {
+    offline.data[0]->Concat(*rows.data[0]);
+}
+
+std::pair<State, Msg> SimplePIR::Query(uint64_t i, const State& shared, const Params& p, const DBinfo& info) {
+    MatrixPool& pool = MatrixPool::Local();
+    Matrix& A = *shared.data[0];
+    uint64_t pad = (p.M % info.Squishing != 0) ? info.Squishing - (p.M % info.Squishing) : 0;
+
+    Matrix* secret = new Matrix(pool.Get(p.N, 1));
+    MatrixRandInto(*secret, p.Logq, 0);
+    Matrix err = pool.Get(p.M, 1);
+    MatrixGaussianInto(err);
+    Matrix* query = new Matrix(pool.Get(p.M, 1, p.M + pad));
+    Matrix::MatrixMulInto(*query, A, *secret);
+    query->MatrixAdd(err);
+    pool.Put(err);
+    query->Data[(i / std::max<uint64_t>(info.Packing, 1)) % p.M] += p.Delta();
+
+    if (pad != 0) {
+        query->AppendZeros(pad);
+    }
+
+    return {MakeState({secret}), MakeMsg({query})};
+}
 
-        return {MakeState(secret), MakeMsg(query)};
+std::pair<State, Msg> SimplePIR::QueryCompressed(uint64_t i, const CompressedState& comp, const Params& p, const DBinfo& info) {
+    MatrixPool& pool = MatrixPool::Local();
+    uint64_t pad = (p.M % info.Squishing != 0) ? info.Squishing - (p.M % info.Squishing) : 0;
+
+    Matrix* secret = new Matrix(pool.Get(p.N, 1));
+    MatrixRandInto(*secret, p.Logq, 0);
+    Matrix err = pool.Get(p.M, 1);
+    MatrixGaussianInto(err);
+    Matrix* query = new Matrix(pool.Get(p.M, 1, p.M + pad));
+    MatrixMulVecSeededInto(*query, comp.seed->data(), p.N, p.Logq, *secret, &err);
+    pool.Put(err);
+    query->Data[(i / std::max<uint64_t>(info.Packing, 1)) % p.M] += p.Delta();
+
+    if (pad != 0) {
+        query->AppendZeros(pad);
     }
 
-    Msg Answer(Database* DB, const std::vector<Msg>& query, const State& server, const State& shared, const Params& p) {
-        Matrix ans; // Assume default initialization creates an empty matrix
-        uint64_t num_queries = query.size(); 
-        uint64_t batch_sz = DB->Data.Rows() / num_queries; 
+    return {MakeState({secret}), MakeMsg({query})};
+}
 
+void SimplePIR::ReleaseQuery(State& client, Msg& query) {
+    MatrixPool& pool = MatrixPool::Local();
+    for (Matrix* m : client.data) {
+        pool.Put(*m);
+        delete m;
+    }
+    for (Matrix* m : query.data) {
+        pool.Put(*m);
+        delete m;
+    }
+    client.data.clear();
+    query.data.clear();
+}
+
+Msg SimplePIR::Answer(Database* DB, const std::vector<Msg>& query, const State&, const State&, const Params&) {
+    auto guard = DB->ReadLock();
+    MatrixView db = DB->View();
+    uint64_t num_queries = query.size(); 
+    uint64_t batch_sz = db.Rows / num_queries; 
+
+    // Each batch reads a row slice of the squished DB in place and
+    // writes its answer straight into the matching slice of ans. The
+    // pool's workers each handle the part of every batch that falls in
+    // their own (NUMA-local) row range, so their writes are disjoint.
+    Matrix* ans = new Matrix(db.Rows, 1);
+    AnswerPool& pool = Pool();
+
+    pool.Run([&](uint64_t w) {
+        RowRange mine = pool.Rows(w, db.Rows);
         uint64_t last = 0;
-
-        for (size_t batch = 0; batch < query.size(); ++batch) {
-            if (batch == num_queries - 1) {
-                batch_sz = DB->Data.Rows() - last;
+        for (size_t batch = 0; batch < num_queries; ++batch) {
+            uint64_t sz = (batch == num_queries - 1) ? db.Rows - last : batch_sz;
+            uint64_t start = std::max(last, mine.Start);
+            uint64_t end = std::min(last + sz, mine.End);
+            if (start < end) {
+                MatrixMulVecPackedInto(ans->SelectRows(start, end - start),
+                                       db.SelectRows(start, end - start),
+                                       *query[batch].data[0],
+                                       DB->Info.Basis,
+                                       DB->Info.Squishing);
             }
-            Matrix a = MatrixMulVecPacked(DB->Data.SelectRows(last, batch_sz),
-                                          query[batch].Data,
-                                          DB->Info.Basis,
-                                          DB->Info.Squishing);
-            ans.Concat(a);
-            last += batch_sz;
+            last += sz;
         }
+    });
 
-        return MakeMsg(ans);
+    // Staged writes: O(1) per overlay entry, against the query of the
+    // batch its row falls in.
+    for (const DBEntryDelta& d : DB->Overlay) {
+        uint64_t batch = (batch_sz == 0) ? num_queries - 1 : std::min(d.Row / batch_sz, num_queries - 1);
+        ans->Data[d.Row] += static_cast<uint32_t>(d.Delta) * query[batch].data[0]->Data[d.Col];
     }
 
-    uint64_t Recover(uint64_t i, uint64_t batch_index, const Msg& offline, const Msg& query, const Msg& answer,
-                     const State& shared, const State& client, const Params& p, const DBinfo& info) {
-        Matrix secret = client.Data; // Assuming the first matrix in client data
-        Matrix H = offline.Data; // Assuming the first matrix in offline data
-        Matrix ans = answer.Data; // Assuming the first matrix in answer data
+    return MakeMsg({ans});
+}
 
-        uint64_t ratio = p.P / 2;
-        uint64_t offset = 0;
-        for (uint64_t j = 0; j < p.M; ++j) {
-            offset += ratio * query.Data.Get(j, 0);
-        }
-        offset %= static_cast<uint64_t>(std::pow(2, p.Logq));
-        offset = static_cast<uint64_t>(std::pow(2, p.Logq)) - offset;
+std::pair<uint64_t, Msg> SimplePIR::Answer(EpochManager& epochs, const std::vector<Msg>& query, const State& server, const State& shared, const Params& p) {
+    std::shared_ptr<const Epoch> epoch = epochs.Current();
+    if (!epoch) {
+        throw std::runtime_error("No epoch published");
+    }
+    return {epoch->Id, Answer(epoch->DB, query, server, shared, p)};
+}
 
-        uint64_t row = i / p.M;
-        Matrix interm = MatrixMul(H, secret);
-        ans.MatrixSub(interm);
+Msg SimplePIR::Answer(ShardedServer& shards, const Msg& query) {
+    return MakeMsg({new Matrix(shards.Answer(*query.data[0]))});
+}
 
-        std::vector<uint64_t> vals;
-        for (uint64_t j = row * info.Ne; j < (row + 1) * info.Ne; ++j) {
-            uint64_t noised = static_cast<uint64_t>(ans.Get(j, 0)) + offset;
-            uint64_t denoised = p.Round(noised);
-            vals.push_back(denoised);
-            // Optional: Print reconstruction info here
+Msg SimplePIR::Answer(QueryCoalescer& coalescer, const Msg& query) {
+    return coalescer.Submit(query).get();
+}
+
+std::vector<Msg> SimplePIR::AnswerMany(Database* DB, const std::vector<Msg>& queries) {
+    if (queries.empty()) {
+        throw std::runtime_error("No queries to answer");
+    }
+    uint64_t k = queries.size();
+    uint64_t len = queries[0].data[0]->Rows;
+    Matrix q(len, k);
+    for (uint64_t c = 0; c < k; c++) {
+        const Matrix& qc = *queries[c].data[0];
+        if (qc.Rows != len || qc.Cols != 1) {
+            throw std::runtime_error("Queries must be vectors of the same length");
+        }
+        for (uint64_t j = 0; j < len; j++) {
+            q.Data[j * k + c] = qc.Data[j];
+        }
+    }
+
+    auto guard = DB->ReadLock();
+    MatrixView db = DB->View();
+    Matrix all(db.Rows, k);
+    AnswerPool& pool = Pool();
+    pool.Run([&](uint64_t w) {
+        RowRange mine = pool.Rows(w, db.Rows);
+        if (mine.Start < mine.End) {
+            MatrixMulMatPackedInto(all.SelectRows(mine.Start, mine.End - mine.Start),
+                                   db.SelectRows(mine.Start, mine.End - mine.Start),
+                                   q,
+                                   DB->Info.Basis,
+                                   DB->Info.Squishing);
+        }
+    });
+    for (const DBEntryDelta& d : DB->Overlay) {
+        uint32_t delta = static_cast<uint32_t>(d.Delta);
+        for (uint64_t c = 0; c < k; c++) {
+            all.Data[d.Row * k + c] += delta * q.Data[d.Col * k + c];
         }
-        ans.MatrixAdd(interm);
+    }
 
-        return ReconstructElem(vals, i, info);
+    std::vector<Msg> answers;
+    answers.reserve(k);
+    for (uint64_t c = 0; c < k; c++) {
+        Matrix* ans = new Matrix(all.Rows, 1);
+        for (uint64_t i = 0; i < all.Rows; i++) {
+            ans->Data[i] = all.Data[i * k + c];
+        }
+        answers.push_back(MakeMsg({ans}));
+    }
+    return answers;
+}
+
+uint64_t SimplePIR::Recover(uint64_t i, uint64_t, const Msg& offline, const Msg& query, const Msg& answer,
+                            const State&, const State& client, const Params& p, const DBinfo& info) {
+    Matrix& secret = *client.data[0];
+    Matrix& H = *offline.data[0];
+    Matrix& ans = *answer.data[0];
+
+    uint64_t ratio = p.P / 2;
+    uint64_t offset = 0;
+    for (uint64_t j = 0; j < p.M; ++j) {
+        offset += ratio * query.data[0]->Get(j, 0);
+    }
+    offset %= static_cast<uint64_t>(std::pow(2, p.Logq));
+    offset = static_cast<uint64_t>(std::pow(2, p.Logq)) - offset;
+
+    uint64_t row = i / std::max<uint64_t>(info.Packing, 1) / p.M;
+    MatrixPool& pool = MatrixPool::Local();
+    Matrix interm = pool.Get(H.Rows, 1);
+    Matrix::MatrixMulInto(interm, H, secret);
+    ans.MatrixSub(interm);
+
+    std::vector<uint64_t> vals;
+    vals.reserve(info.Ne);
+    for (uint64_t j = row * info.Ne; j < (row + 1) * info.Ne; ++j) {
+        uint64_t noised = static_cast<uint64_t>(ans.Get(j, 0)) + offset;
+        uint64_t denoised = p.Round(noised);
+        vals.push_back(denoised);
+        // Optional: Print reconstruction info here
     }
+    ans.MatrixAdd(interm);
+    pool.Put(interm);
 
-    void Reset(Database* DB, const Params& p) {
-        DB->Unsquish();
-        DB->Data.Sub(p.P / 2);
+    return ReconstructElem(vals, i, info);
+}
+
+void SimplePIR::Reset(Database* DB, const Params& p) {
+    if (DB->Mapped) {
+        return; // Mapped DBs are read-only and stay squished.
     }
-};
\ No newline at end of file
+    DB->Unsquish();
+    DB->Data->Sub(p.P / 2);
+}
+
+bool SimplePIR::Cheaper(const ParamsCost& a, const ParamsCost& b, ParamsObjective objective) {
+    auto key = [objective](const ParamsCost& c) {
+        double online = c.UploadBytes + c.DownloadBytes;
+        switch (objective) {
+        case ParamsObjective::MinOfflineDownload:
+            return std::make_tuple(c.HintBytes, c.ScanBytes, online);
+        case ParamsObjective::MinOnlineComm:
+            return std::make_tuple(online, c.ScanBytes, c.HintBytes);
+        default:
+            return std::make_tuple(c.ScanBytes, online, c.HintBytes);
+        }
+    };
+    return key(a) < key(b);
+}
+
+AnswerPool& SimplePIR::Pool() {
+    return pool ? *pool : DefaultAnswerPool();
+}
@@ -0,0 +1,183 @@
+#ifndef SIMPLE_PIR_H
+#define SIMPLE_PIR_H
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "batch_pir.h"
+#include "database.h"
+#include "matrix.h"
+#include "params.h"
+#include "pir_scheme.h"
+#include "utils.h"
+
+class AnswerPool;
+class EpochManager;
+class QueryCoalescer;
+class ShardedServer;
+
+// Sparse patch to the offline hint H = DB * A after Database::Update:
+// row Rows[k] of H grows by row k of Vals. Only the rows holding changed
+// digits are sent, Ne or fewer per updated record.
+struct HintDelta {
+    std::vector<uint64_t> Rows;
+    Matrix Vals;
+
+    HintDelta() : Vals(0, 0) {}
+};
+
+// Client side of a cuckoo batch: where each requested index went, and the
+// secret and query of every bucket, in bucket order.
+struct BatchQuery {
+    CuckooBatch::Assignment Assignment;
+    std::vector<State> Client;
+    std::vector<Msg> Queries;
+};
+
+class SimplePIR : public PIR {
+public:
+    // Setup binds, and Answer and AnswerMany split their passes over, the
+    // workers of pool; nullptr means DefaultAnswerPool().
+    explicit SimplePIR(AnswerPool* pool = nullptr);
+
+    std::string Name() const override;
+
+    Params PickParams(uint64_t N, uint64_t d, uint64_t n, uint64_t logq) override;
+
+    // Chooses p and the DB dimensions for N records of d bits by scoring
+    // every candidate with Cost. Candidates come from each row of the
+    // params table: its largest p, and the largest p of every packed shape
+    // below that (a 9-bit p packs only 3 digits per word where an 8-bit p
+    // packs 4, so the smaller p can scan fewer bytes), each with square
+    // dimensions, with the widest M the row allows and with the aspect
+    // the autotuner found fastest. Only the rows for (n, logq) are
+    // visited, so this takes microseconds.
+    Params PickParams(uint64_t N, uint64_t d, uint64_t n, uint64_t logq, ParamsObjective objective);
+
+    // Per-query costs of p: the server scans the squished DB (L rows of
+    // M / compression words, weighted by how fast this host scans that
+    // shape; see ScanCostFactor), the client downloads the L-by-N hint
+    // once, uploads M elements of Z_q and downloads L.
+    static ParamsCost Cost(const Params& p);
+
+    Params PickParamsGivenDimensions(uint64_t l, uint64_t m, uint64_t n, uint64_t logq) override;
+
+    // Params for the replicated DB of batch: each bucket is sized like a
+    // DB of batch.BucketRecords() records, and the buckets are stacked, so
+    // only L (and with it the hint) grows with the number of buckets. The
+    // query length, and so the LWE params, are those of a single bucket.
+    Params PickBatchParams(const CuckooBatch& batch, uint64_t d, uint64_t n, uint64_t logq);
+
+    // Records from the start of one bucket to the next in the DB that
+    // MakeBatchDB builds: a whole number of row blocks, so that Answer,
+    // given one query per bucket, gives each query exactly its bucket.
+    uint64_t BatchStride(const CuckooBatch& batch, uint64_t d, const Params& p);
+
+    // The DB of N = batch.NumRecords() records vals, replicated into the
+    // buckets of batch.
+    Database* MakeBatchDB(const CuckooBatch& batch, uint64_t d, const Params& p, const std::vector<uint64_t>& vals);
+
+    // Queries for up to batch.MaxBatch() indices at once: one per bucket,
+    // to be answered together by Answer in one pass. Buckets that serve no
+    // index get a query for a random slot, so the server cannot tell which
+    // ones are real.
+    BatchQuery QueryBatch(const std::vector<uint64_t>& indices, const CuckooBatch& batch, const State& shared,
+                          const Params& p, const DBinfo& info);
+
+    // The record at each position of indices, from the answer to
+    // q.Queries. Positions whose Assignment.BucketOf is NONE were not
+    // retrieved and come back as 0.
+    std::vector<uint64_t> RecoverBatch(const std::vector<uint64_t>& indices, const BatchQuery& q, const CuckooBatch& batch,
+                                       const Msg& offline, const Msg& answer, const State& shared, const Params& p,
+                                       const DBinfo& info);
+
+    Database* ConcatDBs(const std::vector<Database*>& DBs, Params* p);
+
+    void GetBW(const DBinfo& info, const Params& p) override;
+
+    State Init(const DBinfo& info, const Params& p) override;
+
+    std::pair<State, CompressedState> InitCompressed(const DBinfo& info, const Params& p) override;
+
+    // A is expanded from the seed with the counter-mode PRG in prg.h, so
+    // clients holding only the seed can regenerate any row of it.
+    std::pair<State, CompressedState> InitCompressedSeeded(const DBinfo& info, const Params& p, PRGKey* seed) override;
+
+    State DecompressState(const DBinfo& info, const Params& p, const CompressedState& comp) override;
+
+    std::pair<State, Msg> Setup(Database* DB, const State& shared, const Params& p) override;
+
+    std::pair<State, double> FakeSetup(Database* DB, const Params& p) override;
+
+    // The change to H caused by DB entries changing as in changes: entry
+    // (r, c) growing by d adds d times row c of A to row r of H. Deltas to
+    // the same row are merged.
+    HintDelta UpdateHint(std::vector<DBEntryDelta> changes, const State& shared);
+
+    // Applies a patch from UpdateHint to a client's copy of the hint.
+    void ApplyHintDelta(Msg& offline, const HintDelta& d);
+
+    // Grows the DB by vals (see Database::Append) without re-running
+    // Setup. Returns the patch for hint rows that already existed and the
+    // hint rows for the new row blocks, which clients add with
+    // ApplyHintDelta and ExtendHint. p.L grows to the new DB height.
+    std::pair<HintDelta, Msg> Append(Database* DB, const std::vector<uint64_t>& vals, const State& shared, Params& p);
+
+    // Adds the hint rows returned by Append to a client's hint.
+    void ExtendHint(Msg& offline, const Msg& rows);
+
+    // Record i lives in DB element i / Packing, as in DoublePIR. All
+    // buffers come from this thread's MatrixPool: err goes straight back,
+    // and secret and query are returned to it by ReleaseQuery once the
+    // client has recovered its answer.
+    std::pair<State, Msg> Query(uint64_t i, const State& shared, const Params& p, const DBinfo& info) override;
+
+    // Query for clients that hold only the seed of A: A*secret + err is
+    // computed in one pass with A expanded from the seed a few rows at a
+    // time, so client memory is O(N + M) rather than O(M * N).
+    std::pair<State, Msg> QueryCompressed(uint64_t i, const CompressedState& comp, const Params& p, const DBinfo& info) override;
+
+    // Hands the buffers of a finished query back to this thread's pool.
+    void ReleaseQuery(State& client, Msg& query);
+
+    Msg Answer(Database* DB, const std::vector<Msg>& query, const State& server, const State& shared, const Params& p) override;
+
+    // Answers from whichever epoch is current when the call starts, and
+    // returns that epoch's id so the client recovers with the matching
+    // hint. The epoch stays alive until the answer is done, even if a
+    // rebuild publishes a newer one meanwhile.
+    std::pair<uint64_t, Msg> Answer(EpochManager& epochs, const std::vector<Msg>& query, const State& server, const State& shared, const Params& p);
+
+    // Answer for a DB served by worker processes (see shard.h): the query
+    // goes to every shard and their answers are stacked in row order.
+    Msg Answer(ShardedServer& shards, const Msg& query);
+
+    // Answer for one client's query, coalesced with whatever other clients
+    // sent around the same time into one AnswerMany pass (see
+    // coalescer.h). Blocks until that pass is done.
+    Msg Answer(QueryCoalescer& coalescer, const Msg& query);
+
+    // Answers k independent queries against the whole DB in a single pass
+    // over it: the queries become the columns of one matrix and go through
+    // the packed multi-query kernel. Returns one answer per query, each the
+    // same as Answer would give for that query alone.
+    std::vector<Msg> AnswerMany(Database* DB, const std::vector<Msg>& queries);
+
+    uint64_t Recover(uint64_t i, uint64_t batch_index, const Msg& offline, const Msg& query, const Msg& answer,
+                     const State& shared, const State& client, const Params& p, const DBinfo& info) override;
+
+    void Reset(Database* DB, const Params& p) override;
+
+private:
+    // Whether a beats b for objective; ties on the objective go to the
+    // other costs, scan bytes first.
+    static bool Cheaper(const ParamsCost& a, const ParamsCost& b, ParamsObjective objective);
+
+    AnswerPool& Pool();
+
+    AnswerPool* pool;
+};
+
+#endif // SIMPLE_PIR_H
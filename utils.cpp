@@ -1,42 +1,21 @@
-#include<bits/stdc++.h>
-using namespace std;
-//Include header files for Matrix and PRGKey
+#include "utils.h"
+#include "matrix.h"
 
-class State {
-public:
-    vector<Matrix*> data;
-};
-
-class CompressedState {
-public:
-    PRGKey* seed;
-};
-
-class Msg {
-public:
-    vector<Matrix*> data;
-    
-    uint64_t Size() {
-        uint64_t sz = 0;
-        for (auto d : data) {
-            sz += d->Size();
-        }
-        return sz;
+uint64_t Msg::Size() {
+    uint64_t sz = 0;
+    for (auto d : data) {
+        sz += d->Size();
     }
-};
+    return sz;
+}
 
-class MsgSlice {
-public:
-    std::vector<Msg> data;
-    
-    uint64_t Size() {
-        uint64_t sz = 0;
-        for (auto d : data) {
-            sz += d.Size();
-        }
-        return sz;
+uint64_t MsgSlice::Size() {
+    uint64_t sz = 0;
+    for (auto d : data) {
+        sz += d.Size();
     }
-};
+    return sz;
+}
 
 State MakeState(vector<Matrix*> elems) {
     State st;
@@ -94,7 +73,7 @@ tuple<uint64_t, uint64_t, uint64_t> Num_DB_entries(uint64_t N, uint64_t row_leng
     if (row_length <= log2(p)) {
         uint64_t logp = log2(p);
         uint64_t entries_per_elem = logp / row_length;
-        uint64_t db_entries = ceil(N / entries_per_elem);
+        uint64_t db_entries = (N + entries_per_elem - 1) / entries_per_elem;
         if (db_entries == 0 || db_entries > N) {
             std::cout << "Num entries is " << db_entries << "; N is " << N << std::endl;
             throw std::runtime_error("Should not happen");
@@ -2,10 +2,13 @@
 #define UTILS_H
 
 #include<bits/stdc++.h>
+#include "prg.h"
 using namespace std;
 
-class Matrix; // Assuming the Matrix class is defined in a separate file or later in the source file.
-class PRGKey; // Assuming the PRGKey class is defined in a separate file or later in the source file.
+template <typename T> class MatrixOf; // Defined in matrix.h.
+typedef MatrixOf<uint32_t> Matrix;
+// Seed of a PRG (see prg.h), e.g. the one the LWE matrix A is expanded from.
+typedef std::array<uint8_t, PRG_SEED_BYTES> PRGKey;
 
 class State {
 public:
@@ -35,6 +38,8 @@ State MakeState(vector<Matrix*> elems);
 
 CompressedState MakeCompressedState(PRGKey* elem);
 
+PRGKey RandomPRGKey();
+
 Msg MakeMsg(vector<Matrix*> elems);
 
 MsgSlice MakeMsgSlice(vector<Msg> elems);